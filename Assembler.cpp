@@ -7,12 +7,28 @@
 #include <IterableUtil.h>
 #include <StringBuilder.h>
 #include <Tuple.h>
-#include <ctype.h>
-#include <locale.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <stdlib.h>
 
 namespace nvm
 {
+    static String to_string(const StringView& view)
+    {
+        return String(view.non_null_terminated_buffer(), view.byte_size());
+    }
+    
+    static bool is_hex_literal(const StringView& literal)
+    {
+        return literal.byte_size() > 1 && (literal.non_null_terminated_buffer()[1] == 'x' || literal.non_null_terminated_buffer()[1] == 'X');
+    }
+    
     ResultOrError<Tuple<Register, Register, bool, Variant<Register, u64>>, Error>
     read_reg_reg_regimm(Vector<const Token>::BidIt &token_iterator, const Vector<const Token>::BidIt &end,
                         const StringView &instruction_literal)
@@ -21,37 +37,37 @@ namespace nvm
         if (token_iterator->type != TokenType::RegisterKeyword)
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 1); expected register identifier").to_string())};
         }
-        Register op1 = find(register_literals, token_iterator->data->to_view(),
+        Register op1 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
         if (token_iterator->type != TokenType::RegisterKeyword)
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 2); expected register identifier").to_string())};
         }
-        Register op2 = find(register_literals, token_iterator->data->to_view(),
+        Register op2 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
         if (token_iterator->type == TokenType::RegisterKeyword)
         {
-            Register op3 = find(register_literals, token_iterator->data->to_view(),
+            Register op3 = find(register_literals, token_iterator->data,
                                 [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                                 { return p.get<StringView>() == s; })
                     ->get<Register>();
@@ -60,19 +76,19 @@ namespace nvm
         {
             char *invalid_char;
             i64 op3;
-            if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                op3 = strtol(token_iterator->data->null_terminated_characters(), &invalid_char, 16);
+            if (is_hex_literal(token_iterator->data))
+                op3 = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char, 16);
             else
-                op3 = strtol(token_iterator->data->null_terminated_characters(), &invalid_char, 10);
+                op3 = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char, 10);
             if ((op3 & 0xFFFFF00000000000) != 0 || errno == ERANGE)
             {
-                return Error{token_iterator->position_in_source, new String("overflow in register immediate operand")};
+                return Error{token_iterator->position_in_source, String("overflow in register immediate operand")};
             }
             return make_tuple<Register, Register, bool, Variant<Register, u64>>(op1, op2, false, (u64) op3);
         } else
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 3); expected register identifier or numeric literal").to_string())};
         }
@@ -86,61 +102,61 @@ namespace nvm
         if (token_iterator->type != TokenType::RegisterKeyword)
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 1); expected register identifier").to_string())};
         }
-        Register op1 = find(register_literals, token_iterator->data->to_view(),
+        Register op1 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
         if (token_iterator->type != TokenType::RegisterKeyword)
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 2); expected register identifier").to_string())};
         }
-        Register op2 = find(register_literals, token_iterator->data->to_view(),
+        Register op2 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         return make_tuple<Register, Register>(op1, op2);
     }
     
-    ResultOrError<Tuple<int, Variant<Register, u64, String>, Register, Instruction, Register>, Error>
+    ResultOrError<Tuple<int, Variant<Register, u64, StringView>, Register, Instruction, Register>, Error>
     read_regimm_reg_ins_reg(Vector<const Token>::BidIt &token_iterator, const Vector<const Token>::BidIt &end,
                             const StringView &instruction_literal)
     {
         errno = 0;
         Register op1reg;
         u64 op1num;
-        String op1tag;
+        StringView op1tag;
         bool has_op1reg = false;
         bool has_op1num = false;
         if (token_iterator->type == TokenType::RegisterKeyword)
         {
             has_op1reg = true;
             has_op1num = false;
-            op1reg = find(register_literals, token_iterator->data->to_view(),
+            op1reg = find(register_literals, token_iterator->data,
                           [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                           { return p.get<StringView>() == s; })
                     ->get<Register>();
         } else if (token_iterator->type == TokenType::NumericLiteral)
         {
             char *invalid_char;
-            if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                op1num = strtol(token_iterator->data->null_terminated_characters(), &invalid_char, 16);
+            if (is_hex_literal(token_iterator->data))
+                op1num = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char, 16);
             else
-                op1num = strtol(token_iterator->data->null_terminated_characters(), &invalid_char, 10);
+                op1num = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char, 10);
             if ((op1num & 0xFFFFF00000000000) != 0 || errno == ERANGE)
             {
-                return Error{token_iterator->position_in_source, new String("overflow in register immediate operand")};
+                return Error{token_iterator->position_in_source, String("overflow in register immediate operand")};
             }
             has_op1reg = false;
             has_op1num = true;
@@ -148,83 +164,82 @@ namespace nvm
         {
             has_op1reg = false;
             has_op1num = false;
-            op1tag = *token_iterator->data;
+            op1tag = token_iterator->data;
         } else
         {
             return Error{
-                    token_iterator->position_in_source, new String(
+                    token_iterator->position_in_source, String(
                             StringBuilder().append("invalid token in ").append(instruction_literal).append(
                                     " instruction (operand 1); expected register identifier, tag or numeric literal").to_string())};
         }
-        Variant<Register, u64, String> op1 = has_op1reg ? Variant<Register, u64, String>(op1reg) : has_op1num
-                                                                                                   ? Variant<Register, u64, String>(
+        Variant<Register, u64, StringView> op1 = has_op1reg ? Variant<Register, u64, StringView>(op1reg) : has_op1num
+                                                                                                   ? Variant<Register, u64, StringView>(
                         op1num)
-                                                                                                   : Variant<Register, u64, String>(
+                                                                                                   : Variant<Register, u64, StringView>(
                         op1tag);
-        if (++token_iterator == end)
-            return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
-        if (token_iterator->type != TokenType::OtherKeyword)
+        auto condition = token_iterator;
+        if (++condition == end || condition->type != TokenType::OtherKeyword)
         {
-            //assume this is an unconditional jmp
-            return make_tuple<int, Variant<Register, u64, String>, Register, Instruction, Register>(
+            //assume this is an unconditional jmp, which ends at its target
+            return make_tuple<int, Variant<Register, u64, StringView>, Register, Instruction, Register>(
                     has_op1reg ? 0 : has_op1num ? 1
                                                 : 2,
                     op1, Register::r0, Instruction::Je, Register::r0);
         }
+        token_iterator = condition;
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
-        Register op2 = find(register_literals, token_iterator->data->to_view(),
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
+        Register op2 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
         Instruction ins;
         if (token_iterator->type != TokenType::OtherKeyword)
         {
             return Error{
                     token_iterator->position_in_source,
-                    new String("unexpected keyword found while parsing a jmp-type instruction")};
+                    String("unexpected keyword found while parsing a jmp-type instruction")};
         } else
         {
-            if (token_iterator->data->to_view() == "<"_sv)
+            if (token_iterator->data == "<"_sv)
             {
                 ins = Instruction::Jl;
-            } else if (token_iterator->data->to_view() == ">"_sv)
+            } else if (token_iterator->data == ">"_sv)
             {
                 ins = Instruction::Jg;
-            } else if (token_iterator->data->to_view() == "=="_sv)
+            } else if (token_iterator->data == "=="_sv)
             {
                 ins = Instruction::Je;
-            } else if (token_iterator->data->to_view() == "!="_sv)
+            } else if (token_iterator->data == "!="_sv)
             {
                 ins = Instruction::Jne;
             } else
             {
                 return Error{
                         token_iterator->position_in_source,
-                        new String("unexpected keyword found while parsing a jmp-type instruction")};
+                        String("unexpected keyword found while parsing a jmp-type instruction")};
             }
         }
         if (++token_iterator == end)
             return Error{
-                    (token_iterator--)->position_in_source,
-                    new String("unexpected end of token stream in the middle of parsing an instruction")};
-        Register op3 = find(register_literals, token_iterator->data->to_view(),
+                    (--token_iterator)->position_in_source,
+                    String("unexpected end of token stream in the middle of parsing an instruction")};
+        Register op3 = find(register_literals, token_iterator->data,
                             [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                             { return p.get<StringView>() == s; })
                 ->get<Register>();
         auto next = token_iterator;
         if (++next != end)
         {
-            if (next->type == TokenType::OtherKeyword && next->data->to_view() == "unsigned")
+            if (next->type == TokenType::OtherKeyword && next->data == "unsigned")
             {
+                token_iterator = next;
                 if (ins == Instruction::Jg)
                     ins = Instruction::Jgu;
                 else if (ins == Instruction::Jl)
@@ -232,11 +247,11 @@ namespace nvm
                 else
                     return Error{
                             token_iterator->position_in_source,
-                            new String("unsigned keyword can only be used with '<' and '>' jmp types")
+                            String("unsigned keyword can only be used with '<' and '>' jmp types")
                     };
             }
         }
-        return make_tuple<int, Variant<Register, u64, String>, Register, Instruction, Register>(
+        return make_tuple<int, Variant<Register, u64, StringView>, Register, Instruction, Register>(
                 has_op1reg ? 0 : has_op1num ? 1
                                             : 2,
                 op1, op2, ins, op3);
@@ -256,16 +271,16 @@ namespace nvm
                          if (op3_is_register)
                              return Object{
                                      ObjectType::Instruction,
-                                     new InstructionData{
-                                             Instruction::Add, op1, op2, make_tuple(0, Variant<Register, String, u64>(
+                                     InstructionData{
+                                             Instruction::Add, op1, op2, make_tuple(0, Variant<Register, StringView, u64>(
                                                      op3.get<Register>())), 0}
                              };
                          else
                              return Object{
                                      ObjectType::Instruction,
-                                     new InstructionData{
+                                     InstructionData{
                                              Instruction::Add, op1, op2,
-                                             make_tuple(2, Variant<Register, String, u64>(op3.get<u64>())), 2}
+                                             make_tuple(2, Variant<Register, StringView, u64>(op3.get<u64>())), 2}
                              };
                      }},
                     {
@@ -281,18 +296,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Sub, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Sub, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -309,18 +324,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Mul, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Mul, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -337,18 +352,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Div, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Div, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -363,9 +378,9 @@ namespace nvm
                                 
                                 auto[op1, op2] = result_or_error.result();
                                 return Object{
-                                        ObjectType::Instruction, new InstructionData{
+                                        ObjectType::Instruction, InstructionData{
                                                 Instruction::Neg, op1, op2,
-                                                make_tuple(2, Variant<Register, String, u64>(0ul)), 0}
+                                                make_tuple(2, Variant<Register, StringView, u64>(0ul)), 0}
                                 };
                             }},
                     {
@@ -379,9 +394,9 @@ namespace nvm
                                 
                                 auto[op1, op2] = result_or_error.result();
                                 return Object{
-                                        ObjectType::Instruction, new InstructionData{
+                                        ObjectType::Instruction, InstructionData{
                                                 Instruction::Neg, op1, op2,
-                                                make_tuple(0, Variant<Register, String, u64>(0ul)), 0}
+                                                make_tuple(0, Variant<Register, StringView, u64>(0ul)), 0}
                                 };
                             }},
                     {
@@ -397,18 +412,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Shl, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Shl, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -425,18 +440,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Shr, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Shr, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -453,18 +468,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Sra, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Sra, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -481,18 +496,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::And, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::And, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 2}
                                     };
                             }},
@@ -509,18 +524,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Or, op1, op2, make_tuple(0,
-                                                                                          Variant<Register, String, u64>(
+                                                                                          Variant<Register, StringView, u64>(
                                                                                                   op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Or, op1, op2, make_tuple(2,
-                                                                                          Variant<Register, String, u64>(
+                                                                                          Variant<Register, StringView, u64>(
                                                                                                   op3.get<u64>())), 2}
                                     };
                             }},
@@ -537,18 +552,18 @@ namespace nvm
                                 if (op3_is_register)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Xor, op1, op2, make_tuple(0,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<Register>())),
                                                     0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     Instruction::Xor, op1, op2, make_tuple(2,
-                                                                                           Variant<Register, String, u64>(
+                                                                                           Variant<Register, StringView, u64>(
                                                                                                    op3.get<u64>())), 0}
                                     };
                             }},
@@ -562,38 +577,38 @@ namespace nvm
                                 if (token_iterator->type == TokenType::NumericLiteral)
                                 {
                                     char *invalid_char;
-                                    if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(), &invalid_char,
+                                    if (is_hex_literal(token_iterator->data))
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char,
                                                      16);
                                     else
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(), &invalid_char,
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(), &invalid_char,
                                                      10);
                                     if ((op1 & 0xFFFFF00000000000) != 0 || errno == ERANGE)
                                     {
                                         return Error{
                                                 token_iterator->position_in_source,
-                                                new String("overflow in register immediate operand")
+                                                String("overflow in register immediate operand")
                                         };
                                     }
                                 } else
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token found while parsing a instruction: expected numeric literal (64/32/16/8)")
                                     };
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source, new String(
+                                            (--token_iterator)->position_in_source, String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
                                 Register op2reg;
                                 u64 op2num;
-                                String op2tag;
+                                StringView op2tag;
                                 bool has_op2reg = false;
                                 bool has_op2num = false;
                                 if (token_iterator->type == TokenType::RegisterKeyword)
                                 {
                                     has_op2reg = true;
-                                    op2reg = find(register_literals, token_iterator->data->to_view(),
+                                    op2reg = find(register_literals, token_iterator->data,
                                                   [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                                                   { return p.get<StringView>() == s; })
                                             ->get<Register>();
@@ -601,61 +616,61 @@ namespace nvm
                                 {
                                     has_op2num = true;
                                     char *invalid_char;
-                                    if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                                        op2num = strtol(token_iterator->data->null_terminated_characters(),
+                                    if (is_hex_literal(token_iterator->data))
+                                        op2num = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                         &invalid_char, 16);
                                     else
-                                        op2num = strtol(token_iterator->data->null_terminated_characters(),
+                                        op2num = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                         &invalid_char, 10);
                                     if (op1 != 64 && op1 != 32 && op1 != 16 && op1 != 8)
                                         return Error{
-                                                token_iterator->position_in_source, new String(
+                                                token_iterator->position_in_source, String(
                                                         "load/store instructions can only move 64/32/16/8 bits at a time")
                                         };
                                 } else if (token_iterator->type == TokenType::Tag)
                                 {
-                                    op2tag = *token_iterator->data;
+                                    op2tag = token_iterator->data;
                                 } else
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "invalid token in load instruction (operand 2); expected register identifier or numeric literal")
                                     };
                                 }
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source, new String(
+                                            (--token_iterator)->position_in_source, String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
                                 if (token_iterator->type != TokenType::OtherKeyword &&
-                                    token_iterator->data->to_view() != "to")
+                                    token_iterator->data != "to")
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("unexpected keyword found while parsing a load instruction")
+                                            String("unexpected keyword found while parsing a load instruction")
                                     };
                                 }
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source, new String(
+                                            (--token_iterator)->position_in_source, String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
-                                Register op3 = find(register_literals, token_iterator->data->to_view(),
+                                Register op3 = find(register_literals, token_iterator->data,
                                                     [](const Pair<StringView, Register> &p, const StringView &s) -> bool
                                                     { return p.get<StringView>() == s; })
                                         ->get<Register>();
                                 return Object{
-                                        ObjectType::Instruction, new InstructionData{
+                                        ObjectType::Instruction, InstructionData{
                                                 .instruction = Instruction::Load, .op1 = op3, .op3 = has_op2reg
                                                                                                      ? make_tuple(0,
-                                                                                                                  Variant<Register, String, u64>(
+                                                                                                                  Variant<Register, StringView, u64>(
                                                                                                                           op2reg))
                                                                                                      : has_op2num
                                                                                                        ? make_tuple(2,
-                                                                                                                    Variant<Register, String, u64>(
+                                                                                                                    Variant<Register, StringView, u64>(
                                                                                                                             op2num))
                                                                                                        : make_tuple(1,
-                                                                                                                    Variant<Register, String, u64>(
+                                                                                                                    Variant<Register, StringView, u64>(
                                                                                                                             op2tag)),
                                                 .misc = op1}
                                 };
@@ -670,65 +685,65 @@ namespace nvm
                                 if (token_iterator->type == TokenType::NumericLiteral)
                                 {
                                     char *invalid_char;
-                                    if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(),
+                                    if (is_hex_literal(token_iterator->data))
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                      &invalid_char, 16);
                                     else
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(),
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                      &invalid_char, 10);
                                     if (op1 != 64 && op1 != 32 && op1 != 16 && op1 != 8)
                                         return Error{
                                                 token_iterator->position_in_source,
-                                                new String(
+                                                String(
                                                         "load/store instructions can only move 64/32/16/8 bits at a time")
                                         };
                                 } else
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token found while parsing a instruction: expected numeric literal (64/32/16/8)")
                                     };
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source,
-                                            new String(
+                                            (--token_iterator)->position_in_source,
+                                            String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
-                                Register op2 = find(register_literals, token_iterator->data->to_view(),
+                                Register op2 = find(register_literals, token_iterator->data,
                                                     [](const Pair<StringView, Register> &p,
                                                        const StringView &s) -> bool
                                                     { return p.get<StringView>() == s; })
                                         ->get<Register>();
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source,
-                                            new String(
+                                            (--token_iterator)->position_in_source,
+                                            String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
                                 if (token_iterator->type != TokenType::OtherKeyword &&
-                                    token_iterator->data->to_view() != "in")
+                                    token_iterator->data != "in")
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String(
+                                            String(
                                                     "unexpected keyword found while parsing a store instruction")
                                     };
                                 }
                                 if (++token_iterator == end)
                                     return Error{
-                                            (token_iterator--)->position_in_source,
-                                            new String(
+                                            (--token_iterator)->position_in_source,
+                                            String(
                                                     "unexpected end of token stream in the middle of parsing an instruction")
                                     };
                                 
                                 Register op3reg;
                                 u64 op3num;
-                                String op3tag;
+                                StringView op3tag;
                                 bool has_op3reg = false;
                                 bool has_op3num = false;
                                 if (token_iterator->type == TokenType::RegisterKeyword)
                                 {
                                     has_op3reg = true;
-                                    op3reg = find(register_literals, token_iterator->data->to_view(),
+                                    op3reg = find(register_literals, token_iterator->data,
                                                   [](const Pair<StringView, Register> &p,
                                                      const StringView &s) -> bool
                                                   { return p.get<StringView>() == s; })
@@ -737,47 +752,41 @@ namespace nvm
                                 {
                                     has_op3num = true;
                                     char *invalid_char;
-                                    if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                                        op3num = strtol(token_iterator->data->null_terminated_characters(),
+                                    if (is_hex_literal(token_iterator->data))
+                                        op3num = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                         &invalid_char, 16);
                                     else
-                                        op3num = strtol(token_iterator->data->null_terminated_characters(),
+                                        op3num = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                         &invalid_char, 10);
                                     if ((op3num & 0xFFFFF00000000000) != 0 || errno == ERANGE)
                                     {
                                         return Error{
                                                 token_iterator->position_in_source,
-                                                new String("overflow in register immediate operand")
+                                                String("overflow in register immediate operand")
                                         };
                                     }
                                 } else if (token_iterator->type == TokenType::Tag)
                                 {
-                                    op3tag = *token_iterator->data;
+                                    op3tag = token_iterator->data;
                                 } else
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "invalid token in load instruction (operand 2); expected register identifier or numeric literal")
                                     };
                                 }
-                                if (++token_iterator == end)
-                                    return Error{
-                                            (token_iterator--)->position_in_source,
-                                            new String(
-                                                    "unexpected end of token stream in the middle of parsing an instruction")
-                                    };
                                 return Object{
-                                        ObjectType::Instruction, new InstructionData{
+                                        ObjectType::Instruction, InstructionData{
                                                 .instruction = Instruction::Store, .op1 = op2, .op3 = has_op3reg
                                                                                                       ? make_tuple(0,
-                                                                                                                   Variant<Register, String, u64>(
+                                                                                                                   Variant<Register, StringView, u64>(
                                                                                                                            op3reg))
                                                                                                       : has_op3num
                                                                                                         ? make_tuple(2,
-                                                                                                                     Variant<Register, String, u64>(
+                                                                                                                     Variant<Register, StringView, u64>(
                                                                                                                              op3num))
                                                                                                         : make_tuple(1,
-                                                                                                                     Variant<Register, String, u64>(
+                                                                                                                     Variant<Register, StringView, u64>(
                                                                                                                              op3tag)),
                                                 .misc = op1}
                                 };
@@ -794,30 +803,30 @@ namespace nvm
                                 {
                                     i64 op1;
                                     char *invalid_char;
-                                    if (token_iterator->data->contains("x") || token_iterator->data->contains("X"))
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(),
+                                    if (is_hex_literal(token_iterator->data))
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                      &invalid_char, 16);
                                     else
-                                        op1 = strtol(token_iterator->data->null_terminated_characters(),
+                                        op1 = strtol(token_iterator->data.non_null_terminated_buffer(),
                                                      &invalid_char, 10);
                                     if ((op1 & 0xFFFFF00000000000) != 0 || errno == ERANGE)
                                     {
                                         return Error{
                                                 token_iterator->position_in_source,
-                                                new String("overflow in register immediate operand")
+                                                String("overflow in register immediate operand")
                                         };
                                     }
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
+                                            InstructionData{
                                                     .instruction = Instruction::Int, .op3 = make_tuple(2,
-                                                                                                       Variant<Register, String, u64>(
+                                                                                                       Variant<Register, StringView, u64>(
                                                                                                                (u64) op1))}
                                     };
                                 } else
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "invalid token in load instruction (operand 2); expected register identifier or numeric literal")
                                     };
                                 }
@@ -835,23 +844,23 @@ namespace nvm
                                 if (op1_selector == 0)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
-                                                    ins, op2, op3, make_tuple(0, Variant<Register, String, u64>(
+                                            InstructionData{
+                                                    ins, op2, op3, make_tuple(0, Variant<Register, StringView, u64>(
                                                             op1.get<Register>())), 0}
                                     };
                                 else if (op1_selector == 1)
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
-                                                    ins, op2, op3, make_tuple(2, Variant<Register, String, u64>(
+                                            InstructionData{
+                                                    ins, op2, op3, make_tuple(2, Variant<Register, StringView, u64>(
                                                             op1.get<u64>())), 0}
                                     };
                                 else
                                     return Object{
                                             ObjectType::Instruction,
-                                            new InstructionData{
-                                                    ins, op2, op3, make_tuple(1, Variant<Register, String, u64>(
-                                                            op1.get<String>())), 0}
+                                            InstructionData{
+                                                    ins, op2, op3, make_tuple(1, Variant<Register, StringView, u64>(
+                                                            op1.get<StringView>())), 0}
                                     };
                             }}}
     };
@@ -866,25 +875,25 @@ namespace nvm
                          if (token_iterator->type != TokenType::NumericLiteral)
                          {
                              return Error{
-                                     token_iterator->position_in_source, new String(
+                                     token_iterator->position_in_source, String(
                                              "unexpected token while parsing .i8 directive; expected numeric literal")};
                          }
                          char *invalid_char;
                          i64 value;
-                         if ((*token_iterator).data->contains("x") || (*token_iterator).data->contains("X"))
-                             value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char, 16);
+                         if (is_hex_literal((*token_iterator).data))
+                             value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char, 16);
                          else
-                             value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char, 10);
-                         if (invalid_char == (*token_iterator).data->null_terminated_characters())
+                             value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char, 10);
+                         if (invalid_char == (*token_iterator).data.non_null_terminated_buffer())
                          {
                              return Error{
-                                     token_iterator->position_in_source, new String("couldn't parse numeric token")};
+                                     token_iterator->position_in_source, String("couldn't parse numeric token")};
                          }
                          if ((value & 0xFFFFFFFFFFFFFF00) != 0 || errno == ERANGE)
                          {
                              return Error{
                                      token_iterator->position_in_source,
-                                     new String("overflow in i8 directive literal")};
+                                     String("overflow in i8 directive literal")};
                          }
                          auto next = token_iterator;
                          next++;
@@ -892,7 +901,7 @@ namespace nvm
                              more = true;
                          else
                              more = false;
-                         return Object{ObjectType::AssemblerDirective, new DirectiveData{Directive::i8, (u64) value}};
+                         return Object{ObjectType::AssemblerDirective, DirectiveData{Directive::i8, (u64) value}};
                      }},
                     {
                             ".i16",
@@ -903,28 +912,28 @@ namespace nvm
                                 if (token_iterator->type != TokenType::NumericLiteral)
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token while parsing .i16 directive; expected numeric literal")};
                                 }
                                 char *invalid_char;
                                 i64 value;
-                                if ((*token_iterator).data->contains("x") || (*token_iterator).data->contains("X"))
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                if (is_hex_literal((*token_iterator).data))
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    16);
                                 else
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    10);
-                                if (invalid_char == (*token_iterator).data->null_terminated_characters())
+                                if (invalid_char == (*token_iterator).data.non_null_terminated_buffer())
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("couldn't parse numeric token")};
+                                            String("couldn't parse numeric token")};
                                 }
                                 if ((value & 0xFFFFFFFFFFFF0000) != 0 || errno == ERANGE)
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("overflow in i16 directive literal")};
+                                            String("overflow in i16 directive literal")};
                                 }
                                 auto next = token_iterator;
                                 next++;
@@ -933,7 +942,7 @@ namespace nvm
                                 else
                                     more = false;
                                 return Object{
-                                        ObjectType::AssemblerDirective, new DirectiveData{Directive::i16, (u64) value}};
+                                        ObjectType::AssemblerDirective, DirectiveData{Directive::i16, (u64) value}};
                             }},
                     {
                             ".i32",
@@ -944,28 +953,28 @@ namespace nvm
                                 if (token_iterator->type != TokenType::NumericLiteral)
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token while parsing .i32 directive; expected numeric literal")};
                                 }
                                 char *invalid_char;
                                 i64 value;
-                                if ((*token_iterator).data->contains("x") || (*token_iterator).data->contains("X"))
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                if (is_hex_literal((*token_iterator).data))
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    16);
                                 else
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    10);
-                                if (invalid_char == (*token_iterator).data->null_terminated_characters())
+                                if (invalid_char == (*token_iterator).data.non_null_terminated_buffer())
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("couldn't parse numeric token")};
+                                            String("couldn't parse numeric token")};
                                 }
                                 if ((value & 0xFFFFFFFF00000000) != 0 || errno == ERANGE)
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("overflow in i32 directive literal")};
+                                            String("overflow in i32 directive literal")};
                                 }
                                 auto next = token_iterator;
                                 next++;
@@ -974,7 +983,7 @@ namespace nvm
                                 else
                                     more = false;
                                 return Object{
-                                        ObjectType::AssemblerDirective, new DirectiveData{Directive::i32, (u64) value}};
+                                        ObjectType::AssemblerDirective, DirectiveData{Directive::i32, (u64) value}};
                             }},
                     {
                             ".i64",
@@ -985,28 +994,28 @@ namespace nvm
                                 if (token_iterator->type != TokenType::NumericLiteral)
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token while parsing .i64 directive; expected numeric literal")};
                                 }
                                 char *invalid_char;
                                 i64 value;
-                                if ((*token_iterator).data->contains("x") || (*token_iterator).data->contains("X"))
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                if (is_hex_literal((*token_iterator).data))
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    16);
                                 else
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    10);
-                                if (invalid_char == (*token_iterator).data->null_terminated_characters())
+                                if (invalid_char == (*token_iterator).data.non_null_terminated_buffer())
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("couldn't parse numeric token")};
+                                            String("couldn't parse numeric token")};
                                 }
                                 if ((value & 0xFFFFFFFF00000000) != 0 || errno == ERANGE)
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("overflow in i64 directive literal")};
+                                            String("overflow in i64 directive literal")};
                                 }
                                 auto next = token_iterator;
                                 next++;
@@ -1015,7 +1024,7 @@ namespace nvm
                                 else
                                     more = false;
                                 return Object{
-                                        ObjectType::AssemblerDirective, new DirectiveData{Directive::i64, (u64) value}};
+                                        ObjectType::AssemblerDirective, DirectiveData{Directive::i64, (u64) value}};
                             }},
                     {
                             ".addr",
@@ -1026,28 +1035,28 @@ namespace nvm
                                 if (token_iterator->type != TokenType::NumericLiteral)
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token while parsing .addr directive; expected numeric literal")};
                                 }
                                 char *invalid_char;
                                 i64 value;
-                                if ((*token_iterator).data->contains("x") || (*token_iterator).data->contains("X"))
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                if (is_hex_literal((*token_iterator).data))
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    16);
                                 else
-                                    value = strtol((*token_iterator).data->null_terminated_characters(), &invalid_char,
+                                    value = strtol((*token_iterator).data.non_null_terminated_buffer(), &invalid_char,
                                                    10);
-                                if (invalid_char == (*token_iterator).data->null_terminated_characters())
+                                if (invalid_char == (*token_iterator).data.non_null_terminated_buffer())
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("couldn't parse numeric token")};
+                                            String("couldn't parse numeric token")};
                                 }
                                 if ((value & 0xFFFFFFFF00000000) != 0 || errno == ERANGE)
                                 {
                                     return Error{
                                             token_iterator->position_in_source,
-                                            new String("overflow in addr directive literal")};
+                                            String("overflow in addr directive literal")};
                                 }
                                 auto next = token_iterator;
                                 next++;
@@ -1057,7 +1066,7 @@ namespace nvm
                                     more = false;
                                 return Object{
                                         ObjectType::AssemblerDirective,
-                                        new DirectiveData{Directive::addr, (u64) value}};
+                                        DirectiveData{Directive::addr, (u64) value}};
                             }},
                     {
                             ".string",
@@ -1068,7 +1077,7 @@ namespace nvm
                                 if (token_iterator->type != TokenType::StringLiteral)
                                 {
                                     return Error{
-                                            token_iterator->position_in_source, new String(
+                                            token_iterator->position_in_source, String(
                                                     "unexpected token while parsing .string directive; expected numeric literal")};
                                 }
                                 auto next = token_iterator;
@@ -1079,13 +1088,24 @@ namespace nvm
                                     more = false;
                                 return Object{
                                         ObjectType::AssemblerDirective,
-                                        new DirectiveData{Directive::addr, *token_iterator->data}};
+                                        DirectiveData{Directive::string, token_iterator->data}};
                             }}}
     };
     
+    //directives that only say what the bytes after them are, and take no value
+    struct SectionDirective
+    {
+        StringView directive;
+        SectionType type;
+    };
+    
+    constexpr Array<SectionDirective, 3> section_directives{
+            {{ ".text", SectionType::Text }, { ".rodata", SectionType::Rodata }, { ".data", SectionType::Data }}
+    };
+    
     Optional<Assembler> Assembler::create_from_file(const StringView &path)
     {
-        if (File::exists(path))
+        if (!File::exists(path))
             return {};
         auto buffer_or_error = File::read_all(path);
         if (buffer_or_error.has_error())
@@ -1094,130 +1114,326 @@ namespace nvm
     }
     
     Assembler::Assembler(Vector<u8> &&data) :
-            m_data(move(data)), m_source((const char *) m_data.data())
+            m_data(move(data))
     {
+        //tokens are views into the source, and numeric ones are handed to strtol, which needs a terminator to stop at
+        m_data.append(0);
+        m_source = StringView((const char *) m_data.data(), m_data.size() - 1);
     }
     
-    ResultOrError<Vector<Token>, Vector<Error>> Assembler::tokenize()
+    enum CharClass : u8
     {
-        Vector<Token> tokens;
-        Vector<Error> errors;
-        locale_t utf8_locale = newlocale(0, "en_US.UTF8", nullptr);
-        setlocale(LC_ALL, "en_US.UTF8");
+        IdentifierStart = 1,
+        IdentifierPart = 2,
+        Digit = 4,
+        HexDigit = 8,
+        Space = 16,
+        Operator = 32
+    };
+    
+    struct CharClasses
+    {
+        u8 classes[256];
+    };
+    
+    constexpr CharClasses make_char_classes()
+    {
+        CharClasses table {};
+        for (u32 c = 0; c < 256; c++)
+        {
+            u8 flags = 0;
+            //bytes of multibyte utf8 sequences are allowed in tags
+            if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80)
+                flags |= IdentifierStart | IdentifierPart;
+            if (c >= '0' && c <= '9')
+                flags |= IdentifierPart | Digit | HexDigit;
+            if ((c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F'))
+                flags |= HexDigit;
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
+                flags |= Space;
+            if (c == '=' || c == '!' || c == '<' || c == '>')
+                flags |= Operator;
+            table.classes[c] = flags;
+        }
+        return table;
+    }
+    
+    constexpr CharClasses char_classes = make_char_classes();
+    
+    struct Keyword
+    {
+        const char* literal;
+        u8 size;
+        TokenType type;
+    };
+    
+    //mirrors instruction_literals, register_literals, other_keyword_literals and assembler_directives
+    constexpr Keyword keywords[] {
+            { "add", 3, TokenType::InstructionKeyword }, { "sub", 3, TokenType::InstructionKeyword },
+            { "mul", 3, TokenType::InstructionKeyword }, { "div", 3, TokenType::InstructionKeyword },
+            { "neg", 3, TokenType::InstructionKeyword }, { "not", 3, TokenType::InstructionKeyword },
+            { "shl", 3, TokenType::InstructionKeyword }, { "shr", 3, TokenType::InstructionKeyword },
+            { "sra", 3, TokenType::InstructionKeyword }, { "and", 3, TokenType::InstructionKeyword },
+            { "or", 2, TokenType::InstructionKeyword }, { "xor", 3, TokenType::InstructionKeyword },
+            { "load", 4, TokenType::InstructionKeyword }, { "store", 5, TokenType::InstructionKeyword },
+            { "int", 3, TokenType::InstructionKeyword }, { "jmp", 3, TokenType::InstructionKeyword },
+            { "r0", 2, TokenType::RegisterKeyword }, { "r1", 2, TokenType::RegisterKeyword },
+            { "r2", 2, TokenType::RegisterKeyword }, { "r3", 2, TokenType::RegisterKeyword },
+            { "r4", 2, TokenType::RegisterKeyword }, { "r5", 2, TokenType::RegisterKeyword },
+            { "r6", 2, TokenType::RegisterKeyword }, { "r7", 2, TokenType::RegisterKeyword },
+            { "r8", 2, TokenType::RegisterKeyword }, { "sp", 2, TokenType::RegisterKeyword },
+            { "ip", 2, TokenType::RegisterKeyword },
+            { "to", 2, TokenType::OtherKeyword }, { "in", 2, TokenType::OtherKeyword },
+            { "if", 2, TokenType::OtherKeyword }, { "unsigned", 8, TokenType::OtherKeyword },
+            { "==", 2, TokenType::OtherKeyword }, { "!=", 2, TokenType::OtherKeyword },
+            { ">", 1, TokenType::OtherKeyword }, { "<", 1, TokenType::OtherKeyword },
+            { ".addr", 5, TokenType::AssemblerDirective }, { ".i8", 3, TokenType::AssemblerDirective },
+            { ".i16", 4, TokenType::AssemblerDirective }, { ".i32", 4, TokenType::AssemblerDirective },
+            { ".i64", 4, TokenType::AssemblerDirective }, { ".string", 7, TokenType::AssemblerDirective },
+            { ".text", 5, TokenType::AssemblerDirective }, { ".rodata", 7, TokenType::AssemblerDirective },
+            { ".data", 5, TokenType::AssemblerDirective }
+    };
+    constexpr u32 keyword_count = sizeof(keywords) / sizeof(Keyword);
+    constexpr u32 keyword_table_size = 128;
+    
+    constexpr u32 hash_keyword(const char* text, u64 size, u32 seed)
+    {
+        u32 hash = seed;
+        for (u64 i = 0; i < size; i++)
+            hash = (hash ^ (u8) text[i]) * 16777619u;
+        return (hash ^ (hash >> 16)) & (keyword_table_size - 1);
+    }
+    
+    struct KeywordTable
+    {
+        u32 seed;
+        //index into keywords, or -1
+        i8 slots[keyword_table_size];
+    };
+    
+    //searches for a seed under which no two keywords collide, so a lookup is one hash and one comparison
+    constexpr KeywordTable make_keyword_table()
+    {
+        for (u32 seed = 2166136261u;; seed++)
+        {
+            KeywordTable table { seed, {} };
+            for (u32 i = 0; i < keyword_table_size; i++)
+                table.slots[i] = -1;
+            bool collided = false;
+            for (u32 i = 0; i < keyword_count && !collided; i++)
+            {
+                u32 slot = hash_keyword(keywords[i].literal, keywords[i].size, seed);
+                collided = table.slots[slot] != -1;
+                table.slots[slot] = (i8) i;
+            }
+            if (!collided)
+                return table;
+        }
+    }
+    
+    constexpr KeywordTable keyword_table = make_keyword_table();
+    
+    static Optional<TokenType> classify_keyword(const char* text, u64 size)
+    {
+        i8 index = keyword_table.slots[hash_keyword(text, size, keyword_table.seed)];
+        if (index < 0 || keywords[index].size != size || __builtin_memcmp(keywords[index].literal, text, size) != 0)
+            return {};
+        return keywords[index].type;
+    }
+    
+    /*
+     * Single pass over the source. Line and column are tracked as the cursor moves instead of being recomputed from
+     * the start of the file for every token, and columns count utf8 codepoints from the last newline onwards.
+     * Tokens are pulled one at a time, so callers decide how many of them to keep around.
+     */
+    class Lexer
+    {
+    public:
+        explicit Lexer(const StringView& source) :
+                m_begin(source.non_null_terminated_buffer()), m_end(m_begin + source.byte_size()), m_counted_up_to(m_begin)
+        {
+        }
+        
+        //reports anything that doesn't lex on the way; returns false once the source is exhausted
+        bool next(Token& token, Vector<Error>& errors);
+        
+        size_t line() const
+        {
+            return m_line;
+        }
+        
+        bool hit_unterminated_string() const
+        {
+            return m_unterminated_string;
+        }
+    
+    private:
+        static bool is(char c, u8 char_class)
+        {
+            return (char_classes.classes[(u8) c] & char_class) != 0;
+        }
+        
+        void new_line(const char* newline)
+        {
+            m_line++;
+            m_column = 1;
+            m_counted_up_to = newline + 1;
+        }
+        
+        LinePos position_of(const char* where)
+        {
+            for (; m_counted_up_to < where; m_counted_up_to++)
+            {
+                if (((u8) *m_counted_up_to & 0xC0) != 0x80)
+                    m_column++;
+            }
+            return { m_line, m_column };
+        }
         
-        auto begin = m_source.begin();
-        auto end = m_source.end();
+        const char* m_begin;
+        const char* m_end;
+        size_t m_line { 1 };
+        size_t m_column { 1 };
+        const char* m_counted_up_to;
+        bool m_unterminated_string { false };
+    };
+    
+    bool Lexer::next(Token& token, Vector<Error>& errors)
+    {
+        const char*& begin = m_begin;
+        const char* const end = m_end;
         while (begin != end)
         {
-            Utf8Char c = *begin;
-            if (isspace_l(c, utf8_locale))
+            char c = *begin;
+            if (is(c, Space))
+            {
+                begin++;
+                continue;
+            }
+            if (c == '\n')
+            {
+                new_line(begin++);
+                continue;
+            }
+            if (c == ',')
             {
                 begin++;
                 continue;
             }
-            if (isalpha_l(c, utf8_locale))
+            if (c == '#')
             {
-                auto start = begin;
-                while (isalnum_l(*begin, utf8_locale))
+                while (begin != end && *begin != '\n')
                     begin++;
-                String string(start.ptr().data, begin.ptr().data - start.ptr().data);
-                LinePos lp = get_line_and_pos(m_source, begin);
-                if (*begin == ':')
-                {
-                    tokens.construct(lp, TokenType::TagDefinition, new String(string));
+                continue;
+            }
+            
+            const char* start = begin;
+            LinePos lp = position_of(start);
+            if (is(c, IdentifierStart))
+            {
+                while (begin != end && is(*begin, IdentifierPart))
                     begin++;
-                } else if (instruction_literals.contains(string, [](const Pair<StringView, Instruction> &a,
-                                                                    const StringView &b) -> bool
-                { return a.get<StringView>() == b; }))
-                {
-                    tokens.construct(lp, TokenType::InstructionKeyword, new String(string));
-                } else if (register_literals.contains(string, [](const Pair<StringView, Register> &a,
-                                                                 const StringView &b) -> bool
-                { return a.get<StringView>() == b; }))
-                {
-                    tokens.construct(lp, TokenType::RegisterKeyword, new String(string));
-                } else if (other_keyword_literals.contains(string))
-                {
-                    tokens.construct(lp, TokenType::OtherKeyword, new String(string));
-                } else
+                StringView word(start, begin - start);
+                if (begin != end && *begin == ':')
                 {
-                    tokens.construct(lp, TokenType::Tag, new String(string));
+                    begin++;
+                    token = Token{lp, TokenType::TagDefinition, word};
+                    return true;
                 }
-                continue;
+                auto keyword = classify_keyword(start, word.byte_size());
+                token = Token{lp, keyword.has_value() ? keyword.value() : TokenType::Tag, word};
+                return true;
             }
             
-            if (c == '"')
+            if (is(c, Digit))
             {
-                auto start = ++begin;
-                while (*begin != '"')
+                begin++;
+                if (c == '0' && begin != end && (*begin == 'x' || *begin == 'X'))
                 {
-                    if (*begin == '\\')
-                    {
+                    begin++;
+                    while (begin != end && is(*begin, HexDigit))
+                        begin++;
+                } else
+                {
+                    while (begin != end && is(*begin, Digit))
                         begin++;
+                }
+                if (begin != end && is(*begin, IdentifierPart))
+                {
+                    while (begin != end && is(*begin, IdentifierPart))
                         begin++;
-                    }
+                    errors.construct(lp, String(StringBuilder().append("malformed numeric literal ").append(StringView(start, begin - start)).to_string()));
+                    continue;
                 }
-                begin++;
-                String string(start.ptr().data, begin.ptr().data - start.ptr().data);
-                LinePos lp = get_line_and_pos(m_source, begin);
-                tokens.construct(lp, TokenType::StringLiteral, new String(string));
-                continue;
+                token = Token{lp, TokenType::NumericLiteral, StringView(start, begin - start)};
+                return true;
             }
             
-            if (isdigit_l(c, utf8_locale))
+            if (c == '"')
             {
-                auto start = begin;
-                while (isdigit_l(*begin, utf8_locale))
+                begin++;
+                while (begin != end && *begin != '"')
+                {
+                    if (*begin == '\n')
+                        new_line(begin);
+                    else if (*begin == '\\' && begin + 1 != end)
+                        begin++;
                     begin++;
-                String string(start.ptr().data, begin.ptr().data - start.ptr().data);
-                LinePos lp = get_line_and_pos(m_source, begin);
-                tokens.construct(lp, TokenType::NumericLiteral, new String(string));
-                continue;
-            }
-            
-            if (c == '#')
-            {
-                while (*begin++ != '\n');
-                continue;
+                }
+                if (begin == end)
+                {
+                    errors.construct(lp, String("unterminated string literal"));
+                    m_unterminated_string = true;
+                    continue;
+                }
+                begin++;
+                token = Token{lp, TokenType::StringLiteral, StringView(start + 1, begin - start - 2)};
+                return true;
             }
             
             if (c == '.')
             {
-                auto start = begin++;
-                while (isalnum_l(*begin, utf8_locale))
+                begin++;
+                while (begin != end && is(*begin, IdentifierPart))
                     begin++;
-                String string(start.ptr().data, begin.ptr().data - start.ptr().data);
-                LinePos lp = get_line_and_pos(m_source, begin);
-                if (assembler_directives.select([](const Pair<StringView, Directive> &d)
-                                                { return d.template get<0>(); })
-                        .contains(string))
-                {
-                    tokens.construct(lp, TokenType::AssemblerDirective, new String(string));
-                } else
+                auto keyword = classify_keyword(start, begin - start);
+                if (keyword.has_value() && keyword.value() == TokenType::AssemblerDirective)
                 {
-                    errors.construct(lp, new String(string));
+                    token = Token{lp, TokenType::AssemblerDirective, StringView(start, begin - start)};
+                    return true;
                 }
+                errors.construct(lp, String(StringBuilder().append("unknown directive ").append(StringView(start, begin - start)).to_string()));
                 continue;
             }
             
-            if (c == ',')
+            if (is(c, Operator))
             {
-                begin++;
+                while (begin != end && is(*begin, Operator))
+                    begin++;
+                auto keyword = classify_keyword(start, begin - start);
+                if (keyword.has_value())
+                {
+                    token = Token{lp, keyword.value(), StringView(start, begin - start)};
+                    return true;
+                }
+                errors.construct(lp, String(StringBuilder().append("unknown operator ").append(StringView(start, begin - start)).to_string()));
                 continue;
             }
             
-            //generic keywords
-            auto start = begin;
-            while (!isalpha_l(*begin, utf8_locale))
-                begin++;
-            begin--;
-            String string(start.ptr().data, begin.ptr().data - start.ptr().data);
-            LinePos lp = get_line_and_pos(m_source, begin);
-            if (other_keyword_literals.contains(string))
-                tokens.construct(lp, TokenType::OtherKeyword, new String(string));
-            else
-                errors.construct(lp, new String(string));
+            begin++;
+            errors.construct(lp, String(StringBuilder().append("unexpected character ").append(StringView(start, 1)).to_string()));
         }
+        return false;
+    }
+    
+    ResultOrError<Vector<Token>, Vector<Error>> Assembler::tokenize()
+    {
+        Vector<Token> tokens;
+        Vector<Error> errors;
+        Lexer lexer(m_source);
+        Token token;
+        while (lexer.next(token, errors))
+            tokens.append(token);
         
         if (errors.size() != 0)
             return errors;
@@ -1225,302 +1441,2305 @@ namespace nvm
             return tokens;
     }
     
-    ResultOrError<Vector<Object>, Vector<Error>> Assembler::parse(const Vector<Token> &tokens)
+    //statements start at one of these tokens, so a statement always ends right before the next one
+    static bool starts_statement(TokenType type)
     {
-        Vector<Error> errors;
-        Vector<Object> objects;
-        
-        auto begin = tokens.begin();
-        auto end = tokens.end();
-        
-        while (begin != end)
+        return type == TokenType::TagDefinition || type == TokenType::InstructionKeyword || type == TokenType::AssemblerDirective;
+    }
+    
+    static void parse_statement(Vector<const Token>::BidIt &begin, const Vector<const Token>::BidIt &end, Vector<Object> &objects,
+                                Vector<Error> &errors)
+    {
+        LinePos position = begin->position_in_source;
+        switch (begin->type)
         {
-            switch (begin->type)
+            case TokenType::TagDefinition:
+                objects.construct(ObjectType::Tag, begin++->data, position);
+                break;
+            case TokenType::InstructionKeyword:
             {
-                case TokenType::TagDefinition:
-                    objects.construct(ObjectType::Tag, begin++->data);
-                    break;
-                case TokenType::InstructionKeyword:
+                auto hit = find(instruction_parsers, begin++->data,
+                                [](const InstructionParser &a, const StringView &what) -> bool
+                                { return a.instruction_literal == what; });
+                if (begin == end)
+                {
+                    errors.construct(position, String("unexpected end of token stream in the middle of parsing an instruction"));
+                } else if (hit != instruction_parsers.end())
                 {
-                    auto hit = find(instruction_parsers, begin++->data->to_view(),
-                                    [](const InstructionParser &a, const StringView &what) -> bool
-                                    { return a.instruction_literal == what; });
-                    if (hit != instruction_parsers.end())
+                    auto object_or_error = hit->parse(begin, end);
+                    if (object_or_error.has_result())
                     {
-                        auto object_or_error = hit->parse(begin, end);
-                        if (object_or_error.has_result())
-                            objects.append(object_or_error.result());
-                        else
-                            errors.append(object_or_error.error());
-                        begin++;
+                        objects.append(object_or_error.result());
+                        objects[objects.size() - 1].position = position;
                     } else
-                    {
-                        errors.construct(begin++->position_in_source, new String("Unexpected tag reference"));
-                    }
+                        errors.append(object_or_error.error());
+                    begin++;
+                } else
+                {
+                    errors.construct(begin++->position_in_source, String("Unexpected tag reference"));
                 }
+            }
+                break;
+            case TokenType::Tag:
+                errors.construct(begin++->position_in_source, String("Unexpected tag reference"));
+                break;
+            case TokenType::AssemblerDirective:
+            {
+                auto section = find(section_directives, begin->data,
+                                    [](const SectionDirective &a, const StringView &b) -> bool
+                                    { return a.directive == b; });
+                if (section != section_directives.end())
+                {
+                    objects.construct(ObjectType::AssemblerDirective, DirectiveData{Directive::section, (u64) section->type}, position);
+                    begin++;
                     break;
-                case TokenType::Tag:
-                    errors.construct(begin++->position_in_source, new String("Unexpected tag reference"));
-                    break;
-                case TokenType::AssemblerDirective:
+                }
+                auto hit = find(directive_parsers, begin++->data,
+                                [](const DirectiveParser &a, const StringView &b) -> bool
+                                { return a.directive == b; });
+                if (hit != directive_parsers.end())
                 {
-                    auto hit = find(directive_parsers, begin++->data->to_view(),
-                                    [](const DirectiveParser &a, const StringView &b) -> bool
-                                    { return a.directive == b; });
-                    if (hit != directive_parsers.end())
+                    //directive parsers read one value each and leave the iterator on it
+                    bool more = begin != end;
+                    if (!more)
+                        errors.construct(position, String("directive is missing its value"));
+                    while (more)
                     {
-                        bool more;
-                        do
+                        more = false;
+                        auto object_or_error = hit->parse(begin, end, more);
+                        if (object_or_error.has_result())
                         {
-                            auto object_or_error = hit->parse(begin, end, more);
-                            if (object_or_error.has_result())
-                                objects.append(object_or_error.result());
-                            else
-                                errors.append(object_or_error.error());
-                        } while (more);
+                            objects.append(object_or_error.result());
+                            objects[objects.size() - 1].position = position;
+                        } else
+                            errors.append(object_or_error.error());
+                        begin++;
                     }
                 }
-                    break;
-                case TokenType::RegisterKeyword:
-                case TokenType::NumericLiteral:
-                case TokenType::StringLiteral:
-                case TokenType::OtherKeyword:
-                    errors.construct(begin++->position_in_source, new String("unexpected token found"));
-                    break;
             }
+                break;
+            case TokenType::RegisterKeyword:
+            case TokenType::NumericLiteral:
+            case TokenType::StringLiteral:
+            case TokenType::OtherKeyword:
+                errors.construct(begin++->position_in_source, String("unexpected token found"));
+                break;
         }
+    }
+    
+    ResultOrError<Vector<Object>, Vector<Error>> Assembler::parse(const Vector<Token> &tokens)
+    {
+        Vector<Error> errors;
+        Vector<Object> objects;
+        
+        auto begin = tokens.begin();
+        auto end = tokens.end();
+        while (begin != end)
+            parse_statement(begin, end, objects, errors);
         
         if (errors.size() > 0)
             return errors;
         return objects;
     }
     
-    struct TagIR
+    u64 make_instruction(bool wide, bool use_imm, Instruction instruction, Register a, Register b, Register c, u64 imm)
+    {
+        u64 ins = 0;
+        ins |= (u64) wide << 63;
+        ins |= (u64) !use_imm << 62;
+        ins |= (u64) get_instruction_opcode(instruction) << 56;
+        ins |= (u64) get_register_id(a) << 52;
+        ins |= (u64) get_register_id(b) << 48;
+        ins |= (u64) get_register_id(c) << 44;
+        if (use_imm)
+            ins |= wide ? imm & 0xFFFFFFFFFFF : (imm & 0xFFF) << 32;
+        return wide ? ins : ins >> 32;
+    }
+    
+    static bool is_wide(const InstructionData &data)
+    {
+        //load/store take the absolute address of a tag, which may not be known yet, so they always get the wide form
+        if (data.op3.get<int>() == 1)
+            return is_load_store(data.instruction);
+        return data.op3.get<int>() == 2 && data.op3.get<1>().get<u64>() >= 4096;
+    }
+    
+    //the address BytecodeEmitter::emit moves on to after emitting object at address
+    static u64 address_after(const Object &object, u64 address)
+    {
+        switch (object.type)
+        {
+            case ObjectType::AssemblerDirective:
+            {
+                const auto &directive = object.data.get<DirectiveData>();
+                switch (directive.directive)
+                {
+                    case Directive::addr:
+                        return directive.value.get<u64>();
+                    case Directive::i8:
+                        return address + 1;
+                    case Directive::i16:
+                        return address + 2;
+                    case Directive::i32:
+                        return address + 4;
+                    case Directive::i64:
+                        return address + 8;
+                    case Directive::string:
+                        return address + directive.value.get<StringView>().byte_size();
+                    case Directive::section:
+                        return address;
+                }
+            }
+                break;
+            case ObjectType::Tag:
+                break;
+            case ObjectType::Instruction:
+                address = (address + 3) & ~3ul;
+                return address + (is_wide(object.data.get<InstructionData>()) ? 8 : 4);
+        }
+        return address;
+    }
+    
+    //where something ended up: its offset in the payload, the address it runs at and the offset its .addr segment starts at
+    struct Placement
     {
-        String name;
-        u64 addr;
+        u64 offset;
+        u64 address;
+        u64 segment;
     };
     
-    struct InstructionIR
+    struct TagFixup
     {
+        LinePos position;
+        //of the instruction
+        Placement placement;
         u64 instruction;
-        Optional<String> maybe_tag;
+        StringView tag;
+        bool tag_is_absolute;
+        //see BytecodeEmitter
+        bool relocatable;
     };
     
-    enum class IRType
+    struct TagDefinition
     {
-        Tag,
-        Instruction,
-        RawByte
+        StringView name;
+        u32 hash;
+        Placement placement;
+        LinePos position;
+        bool relocatable;
     };
     
-    struct ObjectIR
+    //the source position of an instruction, kept for the debug table (see NVMDebugTable)
+    struct LineRecord
     {
-        explicit ObjectIR() : ir_type(IRType::RawByte), data((u8)0) {}
-        
-        explicit ObjectIR(u8 i) :
-                ir_type(IRType::RawByte), data(i)
+        Placement placement;
+        LinePos position;
+        bool relocatable;
+    };
+    
+    //where a .text, .rodata or .data directive was, kept for writing sectioned images (see Assembler::sections)
+    struct SectionRecord
+    {
+        Placement placement;
+        SectionType type;
+        bool relocatable;
+    };
+    
+    //what link() resolves to final addresses besides the tag references: the tag definitions that made it into the
+    //program, the positions of its instructions and its section directives
+    struct PlacedSymbols
+    {
+        struct Tag
         {
-        }
+            StringView name;
+            Placement placement;
+        };
         
-        explicit ObjectIR(const InstructionIR &i) :
-                ir_type(IRType::Instruction), data(i)
+        struct Section
         {
-        }
+            Placement placement;
+            SectionType type;
+        };
+        
+        Vector<Tag> tags;
+        Vector<Placement> lines;
+        Vector<LinePos> positions;
+        Vector<Section> sections;
+    };
+    
+    //where a piece of a program ended up, used to move the placements emitted for it to their place in the program
+    struct PieceOrigin
+    {
+        u64 offset;
+        u64 address_delta;
+        //the segment the piece starts in, which its relocatable placements belong to
+        u64 segment;
         
-        explicit ObjectIR(const TagIR &i) :
-                ir_type(IRType::Tag), data(i)
+        Placement place(const Placement &placement, bool relocatable) const
         {
+            if (relocatable)
+                return { placement.offset + offset, placement.address + address_delta, segment };
+            return { placement.offset + offset, placement.address, placement.segment + offset };
         }
-        
-        IRType ir_type {};
-        Variant<InstructionIR, TagIR, u8> data {(u8)0};
     };
     
-    u64 make_instruction(bool wide, bool use_imm, Instruction instruction, Register a, Register b, Register c, u64 imm)
+    static u32 hash_tag(const StringView &name)
     {
-        u64 ins = 0;
-        ins |= (u64) wide << 63;
-        ins |= (u64) !use_imm << 62;
-        ins |= (u64) get_instruction_opcode(instruction) << 56;
-        ins |= (u64) get_register_id(a) << 52;
-        ins |= (u64) get_register_id(b) << 48;
-        ins |= (u64) get_register_id(c) << 44;
-        ins |= use_imm ? imm & 0xFFFFFFFFFFF : 0;
-        return wide ? ins : ins >> 32;
+        u32 hash = 2166136261u;
+        for (size_t i = 0; i < name.byte_size(); i++)
+            hash = (hash ^ (u8) name.non_null_terminated_buffer()[i]) * 16777619u;
+        return hash;
     }
     
-    ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> Assembler::generate_bytecode(const Vector<Object> &objects)
+    static Error redefinition_error(const StringView &name, const LinePos &position)
     {
-        Vector<u8> bytecode;
-        Vector<ObjectIR> ir;
-        Vector<Error> errors;
+        return Error { position, String(StringBuilder("tag \"").append(name).append("\" is defined more than once").to_string()) };
+    }
+    
+    static Error undefined_tag_error(const StringView &name, const LinePos &position)
+    {
+        return Error { position, String(StringBuilder("undefined tag \"").append(name).append("\"").to_string()) };
+    }
+    
+    //bytes put together a block at a time, where a Vector would take them one append per byte. once growing fails,
+    //every append after it is dropped and failed() tells, so callers only have to check at the end
+    class ByteBuffer
+    {
+    public:
+        explicit ByteBuffer(u64 capacity = 0)
+        {
+            if (capacity != 0)
+                reserve(capacity);
+        }
         
-        u64 base_addr = 0;
-        u64 current_addr = base_addr;
+        ~ByteBuffer()
+        {
+            free(m_data);
+        }
         
-        Hashmap<String, u64> tagmap;
+        ByteBuffer(const ByteBuffer &) = delete;
+        ByteBuffer &operator=(const ByteBuffer &) = delete;
         
-        for (const auto &obj : objects)
+        void append(const void *data, u64 size)
         {
-            switch (obj.type)
-            {
-                case ObjectType::AssemblerDirective:
-                {
-                    u64 value;
-                    if (reinterpret_cast<DirectiveData *>(obj.data)->directive != Directive::string)
-                        value = reinterpret_cast<DirectiveData *>(obj.data)->value.get<u64>();
-                    
-                    switch (reinterpret_cast<DirectiveData *>(obj.data)->directive)
-                    {
-                        case Directive::addr:
-                            base_addr = value;
-                            current_addr = base_addr;
-                            break;
-                        case Directive::i8:
-                            ir.construct((u8) (value & 0xFF));
-                            current_addr += 1;
-                            break;
-                        case Directive::i16:
-                            ir.construct((u8) (value & 0xFF));
-                            ir.construct((u8) ((value & 0xFF00) >> 8));
-                            current_addr += 2;
-                            break;
-                        case Directive::i32:
-                            ir.construct((u8) value & 0xFF);
-                            ir.construct((u8) ((value & 0xFF00) >> 8));
-                            ir.construct((u8) ((value & 0xFF0000) >> 16));
-                            ir.construct((u8) ((value & 0xFF000000) >> 24));
-                            current_addr += 4;
-                            break;
-                        case Directive::i64:
-                            ir.construct((u8) value & 0xFF);
-                            ir.construct((u8) ((value & 0xFF00) >> 8));
-                            ir.construct((u8) ((value & 0xFF0000) >> 16));
-                            ir.construct((u8) ((value & 0xFF000000) >> 24));
-                            ir.construct((u8) ((value & 0xFF00000000) >> 32));
-                            ir.construct((u8) ((value & 0xFF0000000000) >> 40));
-                            ir.construct((u8) ((value & 0xFF000000000000) >> 48));
-                            ir.construct((u8) ((value & 0xFF00000000000000) >> 56));
-                            current_addr += 8;
-                            break;
-                        case Directive::string:
-                            for (size_t i = 0;
-                                 i < reinterpret_cast<DirectiveData *>(obj.data)->value.get<String>().byte_size(); i++)
-                            {
-                                ir.construct(
-                                        reinterpret_cast<DirectiveData *>(obj.data)->value.get<String>().null_terminated_characters()[i]);
-                                current_addr += 1;
-                            }
-                            break;
-                    }
-                }
+            u8 *at = size != 0 ? grow(size) : nullptr;
+            if (at != nullptr)
+                __builtin_memcpy(at, data, size);
+        }
+        
+        void append_zeros(u64 size)
+        {
+            u8 *at = size != 0 ? grow(size) : nullptr;
+            if (at != nullptr)
+                __builtin_memset(at, 0, size);
+        }
+        
+        bool failed() const
+        {
+            return m_failed;
+        }
+        
+        u8 *data() const
+        {
+            return m_data;
+        }
+        
+        u64 size() const
+        {
+            return m_size;
+        }
+        
+        Span<u8> span() const
+        {
+            return Span<u8>(m_data, m_size);
+        }
+    
+    private:
+        //the old buffer is kept when realloc fails, so what was appended so far stays readable
+        bool reserve(u64 capacity)
+        {
+            auto data = (u8 *) realloc(m_data, capacity);
+            if (data == nullptr)
+            {
+                m_failed = true;
+                return false;
+            }
+            m_data = data;
+            m_capacity = capacity;
+            return true;
+        }
+        
+        u8 *grow(u64 size)
+        {
+            if (m_failed)
+                return nullptr;
+            if (m_capacity - m_size < size && !reserve(m_size + size > m_capacity * 2 ? m_size + size : m_capacity * 2))
+                return nullptr;
+            u8 *at = m_data + m_size;
+            m_size += size;
+            return at;
+        }
+        
+        u8 *m_data { nullptr };
+        u64 m_size { 0 };
+        u64 m_capacity { 0 };
+        bool m_failed { false };
+    };
+    
+    //a tag reference and where its tag ended up, both as emitted, before any jump was widened
+    struct LinkFixup
+    {
+        TagFixup fixup;
+        Placement target;
+    };
+    
+    static bool fits_in_bits(i64 value, u32 bits)
+    {
+        return value >= -(1l << (bits - 1)) && value < (1l << (bits - 1));
+    }
+    
+    /*
+     * Puts together the final image out of a payload and every tag reference in it, sorted by offset.
+     * Jumps to tags are emitted in the short form, whatever the distance to their tag. Relaxation widens the ones whose
+     * tag turns out to be more than 12 bits of words away, which moves everything after them by a word and may push
+     * other jumps out of range in turn, so it repeats until nothing changes. Widening only ever makes distances longer,
+     * so this always ends, and with no more wide jumps than needed.
+     * A widened jump moves the offsets of everything past it, and the addresses of what follows it in its .addr segment.
+     * Immediate jump offsets are taken as written and never adjusted.
+     * Every call copies the whole payload and relaxes every jump again, however little of the program changed since the
+     * last one, but the copy only takes one memcpy per run of bytes between two tag references.
+     */
+    static RefPtr<Vector<u8>> link(const Span<u8> &payload, const Vector<LinkFixup> &fixups, const Placement &entry_point,
+                                   u64 base_address, const PlacedSymbols &symbols, Vector<ResolvedTag> &tags,
+                                   Vector<ResolvedLine> &lines, Vector<ResolvedSection> &sections, Vector<Error> &errors)
+    {
+        //index of the first fixup at or past offset; everything below counts widened jumps by fixup index
+        auto first_at = [&fixups](u64 offset) -> u64
+        {
+            u64 low = 0;
+            u64 high = fixups.size();
+            while (low < high)
+            {
+                u64 middle = (low + high) / 2;
+                if (fixups[middle].fixup.placement.offset < offset)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            return low;
+        };
+        Vector<u64> own_segment;
+        Vector<u64> target_end;
+        Vector<u64> target_segment;
+        Vector<u8> widened;
+        for (const auto &link_fixup : fixups)
+        {
+            own_segment.append(first_at(link_fixup.fixup.placement.segment));
+            target_end.append(first_at(link_fixup.target.offset));
+            target_segment.append(first_at(link_fixup.target.segment));
+            widened.append(0);
+        }
+        
+        //widened_before[i] is the number of widened jumps among the first i fixups
+        Vector<u64> widened_before;
+        auto address_of = [&](u64 i) -> u64
+        {
+            return fixups[i].fixup.placement.address + 4 * (widened_before[i] - widened_before[own_segment[i]]);
+        };
+        auto target_of = [&](u64 i) -> u64
+        {
+            return fixups[i].target.address + 4 * (widened_before[target_end[i]] - widened_before[target_segment[i]]);
+        };
+        bool changed = true;
+        while (changed)
+        {
+            widened_before.clear();
+            widened_before.append(0);
+            for (u64 i = 0; i < fixups.size(); i++)
+                widened_before.append(widened_before[i] + widened[i]);
+            changed = false;
+            for (u64 i = 0; i < fixups.size(); i++)
+            {
+                if (fixups[i].fixup.tag_is_absolute || widened[i])
+                    continue;
+                if (!fits_in_bits(((i64) target_of(i) - (i64) address_of(i)) / 4, 12))
+                {
+                    widened[i] = 1;
+                    changed = true;
+                }
+            }
+        }
+        
+        //filled once up front, so that the payload goes in one copy per run of it between two fixups
+        u64 image_size = sizeof(NVMBinaryHeader) + payload.size() + 4 * widened_before[fixups.size()];
+        RefPtr<Vector<u8>> image(new Vector<u8>(image_size));
+        for (u64 i = 0; i < image_size; i++)
+            image->append(0);
+        u8 *out = image->data() + sizeof(NVMBinaryHeader);
+        u64 cursor = 0;
+        auto copy_until = [&](u64 offset)
+        {
+            if (offset <= cursor)
+                return;
+            __builtin_memcpy(out, payload.data() + cursor, offset - cursor);
+            out += offset - cursor;
+        };
+        for (u64 i = 0; i < fixups.size(); i++)
+        {
+            const auto &fixup = fixups[i].fixup;
+            copy_until(fixup.placement.offset);
+            u64 instruction = fixup.instruction;
+            cursor = fixup.placement.offset + (instruction & (1ul << 63) ? 8 : 4);
+            if (widened[i])
+                instruction = (instruction << 32) | (1ul << 63);
+            
+            if (fixup.tag_is_absolute)
+            {
+                instruction |= target_of(i) & 0xFFFFFFFFFFF;
+            } else
+            {
+                i64 words = ((i64) target_of(i) - (i64) address_of(i)) / 4;
+                if (!fits_in_bits(words, 44))
+                    errors.construct(fixup.position, String(StringBuilder("jump is too far away from tag \"").append(fixup.tag).append("\"").to_string()));
+                instruction |= (u64) words & (instruction & (1ul << 63) ? 0xFFFFFFFFFFF : 0xFFF);
+            }
+            
+            //the word holding the wide bit goes first so the vm can tell the width from the first fetch
+            u32 words[2] { (u32) instruction, 0 };
+            if (instruction & (1ul << 63))
+            {
+                words[0] = instruction >> 32;
+                words[1] = (u32) instruction;
+            }
+            u64 width = instruction & (1ul << 63) ? 8 : 4;
+            __builtin_memcpy(out, words, width);
+            out += width;
+        }
+        copy_until(payload.size());
+        
+        //placements move by the jumps widened between the start of their segment and them
+        auto final_address = [&](const Placement &placement) -> u64
+        {
+            return placement.address + 4 * (widened_before[first_at(placement.offset)] - widened_before[first_at(placement.segment)]);
+        };
+        u64 entry_address = final_address(entry_point);
+        tags.clear();
+        for (const auto &tag : symbols.tags)
+            tags.append({ final_address(tag.placement), to_string(tag.name) });
+        heap_sort(tags.data(), tags.size(), [](const ResolvedTag &a, const ResolvedTag &b) { return a.address < b.address; });
+        //an instruction moves in the image by the jumps widened anywhere before it; its first word tells its width
+        lines.clear();
+        for (u64 i = 0; i < symbols.lines.size(); i++)
+        {
+            const auto &placement = symbols.lines[i];
+            u32 word;
+            __builtin_memcpy(&word, image->data() + sizeof(NVMBinaryHeader) + placement.offset + 4 * widened_before[first_at(placement.offset)], sizeof(u32));
+            lines.append({ final_address(placement), word & (1u << 31) ? 8u : 4u, symbols.positions[i] });
+        }
+        heap_sort(lines.data(), lines.size(), [](const ResolvedLine &a, const ResolvedLine &b) { return a.address < b.address; });
+        sections.clear();
+        for (const auto &section : symbols.sections)
+            sections.append({ final_address(section.placement), section.type });
+        heap_sort(sections.data(), sections.size(), [](const ResolvedSection &a, const ResolvedSection &b) { return a.address < b.address; });
+        if (errors.size() != 0)
+            return {};
+        finish_nvm_format(*image, base_address, entry_address);
+        return image;
+    }
+    
+    /*
+     * Turns objects into bytecode as they come. Tag references are emitted with an empty immediate and only resolved
+     * by finish(), once every tag is known, which links the whole program in one go. Jumps to tags start out short and
+     * are widened there if they need to be; every other width is fixed at emission.
+     * Pieces are emitters that hold part of a program. They don't even look up their own tags, and leave it to
+     * whoever split the program to resolve references and link. Until a piece hits an .addr directive, nothing in it
+     * depends on where it starts but for the alignment of that address, so what it emits up to there is relocatable:
+     * it may be moved by any multiple of 4, and belongs to whatever segment the piece starts in.
+     */
+    class BytecodeEmitter
+    {
+    public:
+        explicit BytecodeEmitter(bool is_piece = false) :
+                m_is_piece(is_piece)
+        {
+        }
+        
+        //only before anything was emitted
+        void start_at(u64 address)
+        {
+            m_current_address = address;
+        }
+        
+        void emit(const Object &object);
+        ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> finish(Vector<Error> &errors, Vector<ResolvedTag> &tags,
+                                                                Vector<ResolvedLine> &lines, Vector<ResolvedSection> &sections);
+        
+        const Vector<TagDefinition> &definitions() const
+        {
+            return m_definitions;
+        }
+        
+        const Vector<LineRecord> &lines() const
+        {
+            return m_lines;
+        }
+        
+        const Vector<SectionRecord> &sections() const
+        {
+            return m_sections;
+        }
+        
+        const Vector<TagFixup> &fixups() const
+        {
+            return m_fixups;
+        }
+        
+        const Vector<Error> &errors() const
+        {
+            return m_errors;
+        }
+        
+        const Vector<u8> &bytes() const
+        {
+            return m_bytes;
+        }
+        
+        u64 current_address() const
+        {
+            return m_current_address;
+        }
+        
+        bool is_relocatable() const
+        {
+            return m_relocatable;
+        }
+        
+        u64 segment() const
+        {
+            return m_segment;
+        }
+        
+        Optional<u64> base_address() const
+        {
+            if (m_has_base_address)
+                return m_base_address;
+            return {};
+        }
+    
+    private:
+        void emit_instruction(u64 instruction)
+        {
+            //the word holding the wide bit goes first so the vm can tell the width from the first fetch
+            if (instruction & (1ul << 63))
+                emit_word(instruction >> 32);
+            emit_word(instruction);
+        }
+        
+        void emit_word(u32 word)
+        {
+            m_bytes.append(word & 0xFF);
+            m_bytes.append((word >> 8) & 0xFF);
+            m_bytes.append((word >> 16) & 0xFF);
+            m_bytes.append((word >> 24) & 0xFF);
+            m_current_address += 4;
+        }
+        
+        void emit_byte(u8 byte)
+        {
+            m_bytes.append(byte);
+            m_current_address += 1;
+        }
+        
+        Placement here() const
+        {
+            return { m_bytes.size(), m_current_address, m_segment };
+        }
+        
+        void define_tag(const StringView &name, const LinePos &position);
+        
+        bool m_is_piece;
+        Vector<u8> m_bytes;
+        //index into m_definitions, for programs emitted whole
+        Hashmap<String, u64> m_tags;
+        Vector<TagDefinition> m_definitions;
+        Vector<TagFixup> m_fixups;
+        Vector<LineRecord> m_lines;
+        Vector<SectionRecord> m_sections;
+        Vector<Error> m_errors;
+        u64 m_base_address { 0 };
+        bool m_has_base_address { false };
+        bool m_relocatable { true };
+        u64 m_segment { 0 };
+        u64 m_current_address { 0 };
+    };
+    
+    void BytecodeEmitter::emit(const Object &object)
+    {
+        switch (object.type)
+        {
+            case ObjectType::AssemblerDirective:
+            {
+                const auto &directive = object.data.get<DirectiveData>();
+                if (directive.directive == Directive::string)
+                {
+                    const auto &string = directive.value.get<StringView>();
+                    for (size_t i = 0; i < string.byte_size(); i++)
+                        emit_byte(string.non_null_terminated_buffer()[i]);
                     break;
-                case ObjectType::Tag:
+                }
+                u64 value = directive.value.get<u64>();
+                u8 bytes = 0;
+                switch (directive.directive)
                 {
-                    tagmap.insert(*reinterpret_cast<String *>(obj.data), current_addr);
+                    case Directive::addr:
+                        m_base_address = value;
+                        m_has_base_address = true;
+                        m_relocatable = false;
+                        m_segment = m_bytes.size();
+                        m_current_address = value;
+                        break;
+                    case Directive::i8:
+                        bytes = 1;
+                        break;
+                    case Directive::i16:
+                        bytes = 2;
+                        break;
+                    case Directive::i32:
+                        bytes = 4;
+                        break;
+                    case Directive::i64:
+                        bytes = 8;
+                        break;
+                    case Directive::section:
+                        m_sections.append({ here(), (SectionType) value, m_relocatable });
+                        break;
+                    case Directive::string:
+                        break;
                 }
+                for (u8 i = 0; i < bytes; i++)
+                    emit_byte((value >> (i * 8)) & 0xFF);
+            }
+                break;
+            case ObjectType::Tag:
+                define_tag(object.data.get<StringView>(), object.position);
+                break;
+            case ObjectType::Instruction:
+            {
+                //the vm only executes 32 bit aligned instructions
+                while (m_current_address % 4 != 0)
+                    emit_byte(0);
+                const auto &data = object.data.get<InstructionData>();
+                Register op2 = is_load_store(data.instruction) ? (Register) get_width_id(data.misc) : data.op2;
+                bool wide = is_wide(data);
+                m_lines.append({ here(), object.position, m_relocatable });
+                
+                if (data.op3.get<int>() == 2)
+                {
+                    u64 imm = data.op3.get<1>().get<u64>();
+                    emit_instruction(make_instruction(wide, true, data.instruction, data.op1, op2, Register::r0, imm));
+                } else if (data.op3.get<int>() == 1)
+                {
+                    m_fixups.append({ object.position, here(), make_instruction(wide, true, data.instruction, data.op1, op2, Register::r0, 0),
+                                      data.op3.get<1>().get<StringView>(), wide, m_relocatable });
+                    emit_instruction(m_fixups[m_fixups.size() - 1].instruction);
+                } else
+                {
+                    emit_instruction(make_instruction(false, false, data.instruction, data.op1, op2,
+                                                      data.op3.get<1>().get<Register>(), 0));
+                }
+            }
+                break;
+        }
+    }
+    
+    void BytecodeEmitter::define_tag(const StringView &name, const LinePos &position)
+    {
+        if (!m_is_piece)
+        {
+            String key = to_string(name);
+            if (m_tags.get(key).has_value())
+            {
+                m_errors.append(redefinition_error(name, position));
+                return;
+            }
+            m_tags.insert(key, m_definitions.size());
+        }
+        m_definitions.construct(name, hash_tag(name), here(), position, m_relocatable);
+    }
+    
+    ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> BytecodeEmitter::finish(Vector<Error> &errors, Vector<ResolvedTag> &tags,
+                                                                              Vector<ResolvedLine> &lines,
+                                                                              Vector<ResolvedSection> &sections)
+    {
+        Vector<LinkFixup> fixups;
+        for (const auto &fixup : m_fixups)
+        {
+            auto target = m_tags.get(to_string(fixup.tag));
+            if (target.has_value())
+                fixups.append({ fixup, m_definitions[target.value()].placement });
+            else
+                m_errors.append(undefined_tag_error(fixup.tag, fixup.position));
+        }
+        auto entry_point = m_tags.get("start");
+        if (!entry_point.has_value())
+            m_errors.construct((LinePos){}, String("program doesn't contain entry point 'start'"));
+        
+        for (const auto &error : m_errors)
+            errors.append(error);
+        if (errors.size() != 0)
+            return errors;
+        //redefinitions never make it into m_definitions, or fail above
+        PlacedSymbols symbols;
+        for (const auto &definition : m_definitions)
+            symbols.tags.append({ definition.name, definition.placement });
+        for (const auto &line : m_lines)
+        {
+            symbols.lines.append(line.placement);
+            symbols.positions.append(line.position);
+        }
+        for (const auto &section : m_sections)
+            symbols.sections.append({ section.placement, section.type });
+        auto image = link(m_bytes.span(), fixups, m_definitions[entry_point.value()].placement, m_base_address, symbols, tags,
+                          lines, sections, errors);
+        if (errors.size() != 0)
+            return errors;
+        return image;
+    }
+    
+    ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> Assembler::generate_bytecode(const Vector<Object> &objects)
+    {
+        BytecodeEmitter emitter;
+        for (const auto &object : objects)
+            emitter.emit(object);
+        Vector<Error> errors;
+        return emitter.finish(errors, m_tags, m_lines, m_sections);
+    }
+    
+    /*
+     * The peephole optimizer works on extended basic blocks: runs of objects that are only entered at their first
+     * object, which start at tags and continue past conditional jumps. Within one, every register holds either a
+     * known constant or a value nothing else is known about but its number, and an instruction whose result is already
+     * in its destination is dropped. Liveness is then solved over the jumps between tags, to drop writes that are never
+     * read and to fuse a sub/xor whose only use is a comparison against r0 into the jump that makes it.
+     * Removing instructions moves code around, which is only safe as long as every code address the program uses comes
+     * from a tag. Programs that jump to registers or numeric offsets, or read ip, are left untouched.
+     */
+    constexpr u16 all_registers = ((1u << (get_register_id(Register::ip) + 1)) - 1) & ~1u;
+    
+    static u16 register_bit(Register r)
+    {
+        //writes to r0 are discarded and reads of it are always zero, so it is never live
+        return (1u << get_register_id(r)) & ~1u;
+    }
+    
+    static bool has_register_operand(const InstructionData &data)
+    {
+        return data.op3.get<int>() == 0;
+    }
+    
+    static bool has_immediate_operand(const InstructionData &data, u64 value)
+    {
+        return data.op3.get<int>() == 2 && data.op3.get<1>().get<u64>() == value;
+    }
+    
+    static bool is_unary(Instruction i)
+    {
+        return i == Instruction::Neg || i == Instruction::Not;
+    }
+    
+    static bool is_unconditional_jump(const InstructionData &data)
+    {
+        return data.instruction == Instruction::Jmp || (data.instruction == Instruction::Je && data.op1 == data.op2);
+    }
+    
+    static u16 registers_read(const InstructionData &data)
+    {
+        //interrupts take their argument in r1, see NVMInterruptTable.h
+        if (data.instruction == Instruction::Int)
+            return register_bit(Register::r1);
+        //neg and not don't have a third operand, whatever op3 holds
+        if (is_unary(data.instruction))
+            return register_bit(data.op2);
+        u16 read = has_register_operand(data) ? register_bit(data.op3.get<1>().get<Register>()) : 0;
+        if (is_logicarithmetic(data.instruction))
+            return read | register_bit(data.op2);
+        if (data.instruction == Instruction::Store)
+            return read | register_bit(data.op1);
+        if (is_jump(data.instruction))
+            return read | register_bit(data.op1) | register_bit(data.op2);
+        return read;
+    }
+    
+    static u16 registers_written(const InstructionData &data)
+    {
+        if (is_logicarithmetic(data.instruction) || data.instruction == Instruction::Load)
+            return register_bit(data.op1);
+        return 0;
+    }
+    
+    static u16 live_before(const InstructionData &data, u16 live_after)
+    {
+        //nothing runs after the terminate interrupt, which only hands r1 back
+        if (data.instruction == Instruction::Int && data.op3.get<1>().get<u64>() == 0xFF)
+            return register_bit(Register::r1);
+        return (live_after & ~registers_written(data)) | registers_read(data);
+    }
+    
+    //moves are instructions that copy a register or a constant: the ones with r0 or an identity as an operand
+    static bool is_move(const InstructionData &data)
+    {
+        auto identity = [&data]
+        { return has_immediate_operand(data, 0) || (has_register_operand(data) && data.op3.get<1>().get<Register>() == Register::r0); };
+        switch (data.instruction)
+        {
+            case Instruction::Add:
+            case Instruction::Or:
+            case Instruction::Xor:
+                return identity() || data.op2 == Register::r0;
+            case Instruction::Sub:
+            case Instruction::Shl:
+            case Instruction::Shr:
+            case Instruction::Sra:
+                return identity();
+            default:
+                return false;
+        }
+    }
+    
+    static bool reads_ip(const InstructionData &data)
+    {
+        //ip is never live, so check the operand fields directly
+        if (is_unary(data.instruction))
+            return data.op2 == Register::ip;
+        if (has_register_operand(data) && data.op3.get<1>().get<Register>() == Register::ip)
+            return true;
+        if (is_logicarithmetic(data.instruction))
+            return data.op2 == Register::ip;
+        if (data.instruction == Instruction::Store)
+            return data.op1 == Register::ip;
+        if (is_jump(data.instruction))
+            return data.op1 == Register::ip || data.op2 == Register::ip;
+        return false;
+    }
+    
+    /*
+     * Removing instructions moves everything after them, which only tag references follow. Jumps that don't go to a tag,
+     * anything that reads ip, and loads and stores at a fixed address anywhere from the lowest to the highest byte the
+     * program takes up would all end up somewhere else.
+     */
+    static bool has_untracked_code_addresses(const Vector<Object> &objects)
+    {
+        u64 low = ~0ul;
+        u64 high = 0;
+        u64 address = 0;
+        for (const auto &object : objects)
+        {
+            u64 next = address_after(object, address);
+            if (object.type == ObjectType::AssemblerDirective && object.data.get<DirectiveData>().directive == Directive::addr)
+            {
+                address = next;
+                continue;
+            }
+            //instructions are aligned first, which doesn't matter for the range
+            if (next > address)
+            {
+                low = address < low ? address : low;
+                high = next > high ? next : high;
+            }
+            address = next;
+        }
+        for (const auto &object : objects)
+        {
+            if (object.type != ObjectType::Instruction)
+                continue;
+            const auto &data = object.data.get<InstructionData>();
+            if ((is_jump(data.instruction) && data.op3.get<int>() != 1) || reads_ip(data))
+                return true;
+            if (is_load_store(data.instruction) && data.op3.get<int>() == 2 && data.op3.get<1>().get<u64>() >= low
+                && data.op3.get<1>().get<u64>() < high)
+                return true;
+        }
+        return false;
+    }
+    
+    //false when the instruction would trap instead
+    static bool evaluate(Instruction instruction, u64 lhs, u64 rhs, u64 &result)
+    {
+        switch (instruction)
+        {
+            case Instruction::Add:
+                result = lhs + rhs;
+                return true;
+            case Instruction::Sub:
+                result = lhs - rhs;
+                return true;
+            case Instruction::Mul:
+                result = lhs * rhs;
+                return true;
+            case Instruction::Div:
+                if (rhs == 0)
+                    return false;
+                result = rhs == (u64) -1 ? -lhs : (u64) ((i64) lhs / (i64) rhs);
+                return true;
+            case Instruction::Neg:
+                result = -lhs;
+                return true;
+            case Instruction::Not:
+                result = ~lhs;
+                return true;
+            case Instruction::Shl:
+                result = lhs << (rhs & 63);
+                return true;
+            case Instruction::Shr:
+                result = lhs >> (rhs & 63);
+                return true;
+            case Instruction::Sra:
+                result = (u64) ((i64) lhs >> (rhs & 63));
+                return true;
+            case Instruction::And:
+                result = lhs & rhs;
+                return true;
+            case Instruction::Or:
+                result = lhs | rhs;
+                return true;
+            case Instruction::Xor:
+                result = lhs ^ rhs;
+                return true;
+            default:
+                return false;
+        }
+    }
+    
+    static bool compare(Instruction instruction, u64 lhs, u64 rhs)
+    {
+        switch (instruction)
+        {
+            case Instruction::Jmp:
+                return true;
+            case Instruction::Je:
+                return lhs == rhs;
+            case Instruction::Jne:
+                return lhs != rhs;
+            case Instruction::Jg:
+                return (i64) lhs > (i64) rhs;
+            case Instruction::Jgu:
+                return lhs > rhs;
+            case Instruction::Jl:
+                return (i64) lhs < (i64) rhs;
+            case Instruction::Jlu:
+                return lhs < rhs;
+            default:
+                return false;
+        }
+    }
+    
+    class PeepholeOptimizer
+    {
+    public:
+        PeepholeOptimizer(Vector<Object> &objects, PeepholeStatistics &statistics) :
+                m_objects(objects), m_statistics(statistics)
+        {
+            for (size_t i = 0; i < objects.size(); i++)
+                m_removed.append(0);
+        }
+        
+        //true if anything changed
+        bool run()
+        {
+            bool changed = number_values();
+            changed |= remove_dead_writes();
+            if (changed)
+                compact();
+            return changed;
+        }
+    
+    private:
+        //a constant, or a number standing for whatever a register held
+        struct Value
+        {
+            bool is_constant;
+            u64 bits;
+            
+            bool operator==(const Value &other) const
+            {
+                return is_constant == other.is_constant && bits == other.bits;
+            }
+        };
+        
+        struct Block
+        {
+            size_t begin;
+            size_t end;
+            //the block a jump at its end goes to, if there is one and its tag is defined
+            Optional<size_t> target;
+            bool falls_through;
+            u16 live_in;
+        };
+        
+        Value unknown()
+        {
+            return { false, m_next_value++ };
+        }
+        
+        static Value constant(u64 value)
+        {
+            return { true, value };
+        }
+        
+        void forget_values()
+        {
+            m_values[0] = constant(0);
+            for (size_t i = 1; i < 16; i++)
+                m_values[i] = unknown();
+        }
+        
+        void set_value(Register r, const Value &value)
+        {
+            if (r != Register::r0)
+                m_values[get_register_id(r)] = value;
+        }
+        
+        Value operand_value(const InstructionData &data) const
+        {
+            if (has_register_operand(data))
+                return m_values[get_register_id(data.op3.get<1>().get<Register>())];
+            return constant(data.op3.get<1>().get<u64>());
+        }
+        
+        Value result_of(const InstructionData &data)
+        {
+            Value lhs = m_values[get_register_id(data.op2)];
+            Value rhs = is_unary(data.instruction) ? constant(0) : operand_value(data);
+            u64 result;
+            if (lhs.is_constant && rhs.is_constant && evaluate(data.instruction, lhs.bits, rhs.bits, result))
+                return constant(result);
+            switch (data.instruction)
+            {
+                case Instruction::Add:
+                case Instruction::Or:
+                case Instruction::Xor:
+                    if (lhs == constant(0))
+                        return rhs;
+                    [[fallthrough]];
+                case Instruction::Sub:
+                case Instruction::Shl:
+                case Instruction::Shr:
+                case Instruction::Sra:
+                    if (rhs == constant(0))
+                        return lhs;
+                    if ((data.instruction == Instruction::Sub || data.instruction == Instruction::Xor) && lhs == rhs)
+                        return constant(0);
+                    if (data.instruction == Instruction::Or && lhs == rhs)
+                        return lhs;
                     break;
-                case ObjectType::Instruction:
+                case Instruction::Mul:
+                    if (lhs == constant(0) || rhs == constant(0))
+                        return constant(0);
+                    if (rhs == constant(1))
+                        return lhs;
+                    if (lhs == constant(1))
+                        return rhs;
+                    break;
+                case Instruction::Div:
+                    if (rhs == constant(1))
+                        return lhs;
+                    break;
+                case Instruction::And:
+                    if (lhs == constant(0) || rhs == constant(0))
+                        return constant(0);
+                    if (lhs == rhs)
+                        return lhs;
+                    break;
+                default:
+                    break;
+            }
+            return unknown();
+        }
+        
+        //folds constants and drops instructions that leave every register as it was, one extended basic block at a time
+        bool number_values()
+        {
+            bool changed = false;
+            forget_values();
+            for (size_t i = 0; i < m_objects.size(); i++)
+            {
+                auto &object = m_objects[i];
+                if (object.type != ObjectType::Instruction)
+                {
+                    forget_values();
+                    continue;
+                }
+                auto &data = object.data.get<InstructionData>();
+                if (is_logicarithmetic(data.instruction))
+                {
+                    if (data.op1 == Register::r0 || data.op1 == Register::ip)
+                        continue;
+                    Value result = result_of(data);
+                    if (result == m_values[get_register_id(data.op1)])
+                    {
+                        m_removed[i] = 1;
+                        if (is_move(data))
+                            m_statistics.redundant_moves++;
+                        else
+                            m_statistics.folded_constants++;
+                        changed = true;
+                        continue;
+                    }
+                    bool is_constant_move = data.instruction == Instruction::Add && data.op2 == Register::r0 && data.op3.get<int>() == 2;
+                    if (result.is_constant && !is_constant_move && (result.bits < 4096 || (is_wide(data) && result.bits < (1ul << 44))))
+                    {
+                        data.instruction = Instruction::Add;
+                        data.op2 = Register::r0;
+                        data.op3 = make_tuple(2, Variant<Register, StringView, u64>(result.bits));
+                        m_statistics.rewritten_constants++;
+                        changed = true;
+                    }
+                    set_value(data.op1, result);
+                } else if (data.instruction == Instruction::Load)
+                {
+                    set_value(data.op1, unknown());
+                } else if (data.instruction == Instruction::Int)
+                {
+                    //interrupts only ever write their result to r1
+                    set_value(Register::r1, unknown());
+                } else if (is_jump(data.instruction) && !is_unconditional_jump(data))
+                {
+                    Value lhs = m_values[get_register_id(data.op1)];
+                    Value rhs = m_values[get_register_id(data.op2)];
+                    bool taken;
+                    if (lhs == rhs)
+                        taken = compare(data.instruction, 0, 0);
+                    else if (lhs.is_constant && rhs.is_constant)
+                        taken = compare(data.instruction, lhs.bits, rhs.bits);
+                    else
+                        continue;
+                    if (taken)
+                    {
+                        data.instruction = Instruction::Je;
+                        data.op1 = Register::r0;
+                        data.op2 = Register::r0;
+                        m_statistics.rewritten_constants++;
+                    } else
+                    {
+                        m_removed[i] = 1;
+                        m_statistics.folded_constants++;
+                    }
+                    changed = true;
+                }
+            }
+            return changed;
+        }
+        
+        void find_blocks()
+        {
+            m_blocks.clear();
+            Hashmap<String, size_t> block_of_tag;
+            Vector<size_t> last;
+            bool after_jump = true;
+            for (size_t i = 0; i < m_objects.size(); i++)
+            {
+                if (m_removed[i])
+                    continue;
+                const auto &object = m_objects[i];
+                if (after_jump || object.type == ObjectType::Tag)
+                {
+                    if (m_blocks.size() != 0)
+                        m_blocks[m_blocks.size() - 1].end = i;
+                    m_blocks.append({ i, m_objects.size(), {}, true, 0 });
+                    last.append(i);
+                }
+                last[last.size() - 1] = i;
+                //the first definition is the one generate_bytecode resolves to, the rest are errors anyway
+                if (object.type == ObjectType::Tag && !block_of_tag.get(to_string(object.data.get<StringView>())).has_value())
+                    block_of_tag.insert(to_string(object.data.get<StringView>()), m_blocks.size() - 1);
+                after_jump = object.type == ObjectType::Instruction && is_jump(object.data.get<InstructionData>().instruction);
+            }
+            for (size_t i = 0; i < m_blocks.size(); i++)
+            {
+                const auto &object = m_objects[last[i]];
+                if (object.type != ObjectType::Instruction || !is_jump(object.data.get<InstructionData>().instruction))
+                    continue;
+                const auto &data = object.data.get<InstructionData>();
+                m_blocks[i].target = block_of_tag.get(to_string(data.op3.get<1>().get<StringView>()));
+                m_blocks[i].falls_through = !is_unconditional_jump(data);
+            }
+        }
+        
+        u16 live_out(size_t block) const
+        {
+            const auto &info = m_blocks[block];
+            u16 live = 0;
+            //jumps to undefined tags fail to assemble anyway, so what they would need doesn't matter
+            if (info.target.has_value())
+                live |= m_blocks[info.target.value()].live_in;
+            if (info.falls_through)
+                live |= block + 1 < m_blocks.size() ? m_blocks[block + 1].live_in : all_registers;
+            return live;
+        }
+        
+        u16 live_in(size_t block) const
+        {
+            u16 live = live_out(block);
+            for (size_t i = m_blocks[block].end; i-- > m_blocks[block].begin;)
+            {
+                if (m_removed[i])
+                    continue;
+                const auto &object = m_objects[i];
+                //running into data, or past the end of a segment, could read anything
+                if (object.type == ObjectType::AssemblerDirective)
+                    live = all_registers;
+                else if (object.type == ObjectType::Instruction)
+                    live = live_before(object.data.get<InstructionData>(), live);
+            }
+            return live;
+        }
+        
+        static bool can_remove(const InstructionData &data)
+        {
+            if (data.op1 == Register::ip)
+                return false;
+            if (data.instruction == Instruction::Load)
+                return true;
+            //divisions by zero trap, which is as observable as it gets
+            if (data.instruction == Instruction::Div)
+                return data.op3.get<int>() == 2 && data.op3.get<1>().get<u64>() != 0;
+            return is_logicarithmetic(data.instruction);
+        }
+        
+        //index of the closest object before i that is still there, if it is an instruction
+        Optional<size_t> previous_instruction(size_t i, size_t begin) const
+        {
+            while (i-- > begin)
+            {
+                if (m_removed[i])
+                    continue;
+                if (m_objects[i].type == ObjectType::Instruction)
+                    return i;
+                return {};
+            }
+            return {};
+        }
+        
+        bool remove_dead_writes()
+        {
+            find_blocks();
+            for (bool changed = true; changed;)
+            {
+                changed = false;
+                for (size_t block = m_blocks.size(); block-- > 0;)
+                {
+                    u16 live = live_in(block);
+                    if (live != m_blocks[block].live_in)
+                    {
+                        m_blocks[block].live_in = live;
+                        changed = true;
+                    }
+                }
+            }
+            
+            bool changed = false;
+            for (size_t block = 0; block < m_blocks.size(); block++)
+            {
+                u16 live = live_out(block);
+                for (size_t i = m_blocks[block].end; i-- > m_blocks[block].begin;)
                 {
-                    bool wide = false;
-                    bool uses_imm = false;
-                    auto *data = reinterpret_cast<InstructionData *>(obj.data);
-                    
-                    if (data->op3.get<int>() == 2)
-                    {
-                        uses_imm = true;
-                        if (data->op3.get<1>().get<u64>() >= 4096)
-                            wide = true;
-                        ir.construct(InstructionIR{
-                                make_instruction(wide, uses_imm, data->instruction, data->op1, data->op2, Register::r0,
-                                                 0), {}});
-                    } else if (data->op3.get<int>() == 1)
+                    if (m_removed[i])
+                        continue;
+                    auto &object = m_objects[i];
+                    if (object.type == ObjectType::AssemblerDirective)
                     {
-                        uses_imm = true;
-                        ir.construct(InstructionIR{
-                                make_instruction(wide, uses_imm, data->instruction, data->op1, data->op2, Register::r0,
-                                                 0), data->op3.get<1>().get<String>()});
-                    } else if (data->op3.get<int>() == 0)
+                        live = all_registers;
+                        continue;
+                    }
+                    if (object.type != ObjectType::Instruction)
+                        continue;
+                    auto &data = object.data.get<InstructionData>();
+                    u16 written = registers_written(data);
+                    if (can_remove(data) && (written & live) == 0)
                     {
-                        uses_imm = false;
-                        wide = false;
-                        ir.construct(InstructionIR{
-                                make_instruction(wide, uses_imm, data->instruction, data->op1, data->op2,
-                                                 data->op3.get<1>().get<Register>(), 0), {}});
+                        m_removed[i] = 1;
+                        m_statistics.dead_writes++;
+                        changed = true;
+                        continue;
                     }
-                    current_addr += wide ? 8 : 4;
+                    if (fuse_comparison(i, m_blocks[block].begin, live))
+                        changed = true;
+                    live = live_before(data, live);
                 }
-                    break;
             }
+            return changed;
+        }
+        
+        //sub/xor t, a, b followed by a jump if t ==/!= r0 becomes a jump if a ==/!= b, as long as t isn't read afterwards
+        bool fuse_comparison(size_t jump, size_t begin, u16 live)
+        {
+            auto &data = m_objects[jump].data.get<InstructionData>();
+            if ((data.instruction != Instruction::Je && data.instruction != Instruction::Jne) || (data.op1 == Register::r0) == (data.op2 == Register::r0))
+                return false;
+            Register difference = data.op1 == Register::r0 ? data.op2 : data.op1;
+            if (register_bit(difference) & live)
+                return false;
+            auto previous = previous_instruction(jump, begin);
+            if (!previous.has_value())
+                return false;
+            const auto &comparison = m_objects[previous.value()].data.get<InstructionData>();
+            if ((comparison.instruction != Instruction::Sub && comparison.instruction != Instruction::Xor) || comparison.op1 != difference
+                || !has_register_operand(comparison))
+                return false;
+            data.op1 = comparison.op2;
+            data.op2 = comparison.op3.get<1>().get<Register>();
+            m_removed[previous.value()] = 1;
+            m_statistics.fused_jumps++;
+            return true;
+        }
+        
+        void compact()
+        {
+            Vector<Object> kept;
+            for (size_t i = 0; i < m_objects.size(); i++)
+            {
+                if (!m_removed[i])
+                    kept.append(move(m_objects[i]));
+            }
+            m_objects = move(kept);
+            m_removed.clear();
+            for (size_t i = 0; i < m_objects.size(); i++)
+                m_removed.append(0);
         }
         
-        current_addr = base_addr;
-        for (auto &obj : ir)
+        Vector<Object> &m_objects;
+        PeepholeStatistics &m_statistics;
+        Vector<u8> m_removed;
+        Vector<Block> m_blocks;
+        Value m_values[16];
+        u64 m_next_value { 0 };
+    };
+    
+    PeepholeStatistics Assembler::optimize(Vector<Object> &objects)
+    {
+        PeepholeStatistics statistics {};
+        if (has_untracked_code_addresses(objects))
+        {
+            statistics.skipped = true;
+            return statistics;
+        }
+        PeepholeOptimizer optimizer(objects, statistics);
+        //every round that changes anything removes or simplifies something, so this ends
+        while (optimizer.run())
+            ;
+        return statistics;
+    }
+    
+    //statements are parsed as soon as the lexer has moved past them, so only their own tokens are kept around
+    template<typename Callback>
+    static void parse_statements(Lexer &lexer, Vector<Object> &objects, Vector<Error> &errors, const Callback &parsed)
+    {
+        Vector<Token> statement;
+        Token token;
+        bool more = lexer.next(token, errors);
+        while (more)
+        {
+            statement.clear();
+            do
+            {
+                statement.append(token);
+                more = lexer.next(token, errors);
+            } while (more && !starts_statement(token.type));
+            
+            const auto &tokens = statement;
+            auto begin = tokens.begin();
+            auto end = tokens.end();
+            while (begin != end)
+                parse_statement(begin, end, objects, errors);
+            parsed();
+        }
+    }
+    
+    //tags defined by a program split into chunks, sharded by hash so that every thread can fill in a shard
+    struct TagShard
+    {
+        Hashmap<String, Placement> tags;
+        Vector<Error> errors;
+    };
+    
+    //a piece of a source assembled on its own thread
+    struct SourceChunk
+    {
+        StringView source;
+        Vector<Object> objects;
+        Vector<Error> errors;
+        size_t first_line { 1 };
+        size_t lines { 0 };
+        bool ends_in_string { false };
+        u64 address { 0 };
+        BytecodeEmitter emitter { true };
+        PieceOrigin origin { 0, 0, 0 };
+        Vector<LinkFixup> fixups;
+    };
+    
+    //lines opening with a tag definition or an .addr directive always start a statement, unless they sit in a string
+    static bool is_split_point(const char *line, const char *end)
+    {
+        while (line != end && (char_classes.classes[(u8) *line] & Space))
+            line++;
+        if (end - line > 5 && __builtin_memcmp(line, ".addr", 5) == 0)
+            return !(char_classes.classes[(u8) line[5]] & IdentifierPart);
+        if (line == end || !(char_classes.classes[(u8) *line] & IdentifierStart))
+            return false;
+        while (line != end && (char_classes.classes[(u8) *line] & IdentifierPart))
+            line++;
+        return line != end && *line == ':';
+    }
+    
+    static Vector<StringView> split_source(const StringView &source, u32 count)
+    {
+        const char *begin = source.non_null_terminated_buffer();
+        const char *end = begin + source.byte_size();
+        Vector<StringView> chunks;
+        const char *chunk_begin = begin;
+        for (u32 i = 1; i < count; i++)
+        {
+            const char *line = begin + source.byte_size() / count * i;
+            if (line < chunk_begin)
+                continue;
+            while ((line = (const char *) __builtin_memchr(line, '\n', end - line)) != nullptr)
+            {
+                if (is_split_point(++line, end))
+                    break;
+            }
+            if (line == nullptr)
+                break;
+            chunks.append(StringView(chunk_begin, line - chunk_begin));
+            chunk_begin = line;
+        }
+        chunks.append(StringView(chunk_begin, end - chunk_begin));
+        return chunks;
+    }
+    
+    //runs work(i) for every i below count, each on its own thread; the calling thread takes the first one, and any
+    //that couldn't get a thread of their own once the others are started
+    template<typename Work>
+    static void run_in_parallel(u64 count, const Work &work)
+    {
+        struct Job
         {
-            if (obj.ir_type == IRType::Instruction)
+            const Work *work;
+            u64 index;
+        };
+        Vector<Job> jobs;
+        for (u64 i = 0; i < count; i++)
+            jobs.append({ &work, i });
+        Vector<pthread_t> threads;
+        Vector<u64> inline_jobs;
+        for (u64 i = 1; i < count; i++)
+        {
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, [](void *job) -> void *
+            {
+                (*((Job *) job)->work)(((Job *) job)->index);
+                return nullptr;
+            }, &jobs[i]) == 0)
+                threads.append(thread);
+            else
+                inline_jobs.append(i);
+        }
+        work(0);
+        for (auto index : inline_jobs)
+            work(index);
+        for (auto thread : threads)
+            pthread_join(thread, nullptr);
+    }
+    
+    /*
+     * Lexes, parses and emits in one go. Only the tokens of the statement being parsed are kept, and objects go to the
+     * emitter as soon as their statement is parsed, so memory use follows the size of the output instead of the input.
+     *
+     * Large sources are split into chunks at lines that start with a tag definition or an .addr directive. Every chunk
+     * is lexed and parsed on its own thread, then laid out: instruction sizes don't depend on tag values, so chunk
+     * addresses only take a walk over the objects. The chunks are then emitted in parallel and their tags gathered into
+     * a table sharded by hash, one shard per thread, which every chunk then resolves its references against. Laying
+     * out the chunks, splicing them together and linking is left to a single thread.
+     * A split inside a multi-line string literal is noticed because the chunk before it ends in an unterminated
+     * string; the source is then assembled on a single thread instead.
+     */
+    ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> Assembler::assemble(u32 threads)
+    {
+        u64 chunk_count = m_source.byte_size() / min_chunk_size;
+        if (chunk_count > threads)
+            chunk_count = threads;
+        Vector<StringView> sources = split_source(m_source, chunk_count > 1 ? chunk_count : 1);
+        if (sources.size() > 1)
+        {
+            Vector<SourceChunk> chunks;
+            for (const auto &source : sources)
+            {
+                chunks.construct();
+                chunks[chunks.size() - 1].source = source;
+            }
+            
+            run_in_parallel(chunks.size(), [&chunks](u64 i)
+            {
+                auto &chunk = chunks[i];
+                Lexer lexer(chunk.source);
+                parse_statements(lexer, chunk.objects, chunk.errors, [] {});
+                chunk.lines = lexer.line() - 1;
+                chunk.ends_in_string = lexer.hit_unterminated_string();
+            });
+            
+            bool split_in_string = false;
+            u64 address = 0;
+            for (size_t i = 0; i < chunks.size(); i++)
+            {
+                auto &chunk = chunks[i];
+                split_in_string |= chunk.ends_in_string && i + 1 != chunks.size();
+                if (i != 0)
+                    chunk.first_line = chunks[i - 1].first_line + chunks[i - 1].lines;
+                chunk.address = address;
+                for (const auto &object : chunk.objects)
+                    address = address_after(object, address);
+            }
+            
+            if (!split_in_string)
             {
-                if (obj.data.get<InstructionIR>().maybe_tag.has_value())
+                run_in_parallel(chunks.size(), [&chunks](u64 i)
                 {
+                    auto &chunk = chunks[i];
+                    chunk.emitter.start_at(chunk.address);
+                    for (auto &object : chunk.objects)
                     {
-                        u64 resolved_tag = tagmap.get(obj.data.get<InstructionIR>().maybe_tag.value()).value();
-                        if ((((i64)resolved_tag - (i64)current_addr) / 4) < 2047 && (((i64)resolved_tag - (i64)current_addr) / 4) > -2048)
-                        {
-                            u64 long_offset = ((i64) resolved_tag - (i64) current_addr) / 4;
-                            u64 offset = (long_offset & 0xFFF) | ((long_offset & (1ul << 63)) >> 52);
-                            obj.data.get<InstructionIR>().instruction |= offset;
-                        } else
+                        object.position.line += chunk.first_line - 1;
+                        chunk.emitter.emit(object);
+                    }
+                    for (auto &error : chunk.errors)
+                        error.where.line += chunk.first_line - 1;
+                });
+                
+                u64 offset = 0;
+                u64 segment = 0;
+                u64 base_address = 0;
+                for (auto &chunk : chunks)
+                {
+                    chunk.origin = { offset, 0, segment };
+                    if (!chunk.emitter.is_relocatable())
+                        segment = offset + chunk.emitter.segment();
+                    if (chunk.emitter.base_address().has_value())
+                        base_address = chunk.emitter.base_address().value();
+                    offset += chunk.emitter.bytes().size();
+                }
+                
+                //shards take the chunks in order, so the first definition of a tag is the one that sticks
+                Vector<TagShard> shards;
+                for (size_t i = 0; i < chunks.size(); i++)
+                    shards.construct();
+                run_in_parallel(shards.size(), [&chunks, &shards](u64 i)
+                {
+                    auto &shard = shards[i];
+                    for (const auto &chunk : chunks)
+                    {
+                        for (const auto &definition : chunk.emitter.definitions())
                         {
-                            auto msg = StringBuilder("a jump cannot use a tag whose address is more than 4096 32 bit words away; use a register jump instead; error occured with tag \"").append(obj.data.get<InstructionIR>().maybe_tag.value()).append("\"").to_string();
-                            errors.construct((LinePos) {}, new String(msg));
+                            if (definition.hash % shards.size() != i)
+                                continue;
+                            String key = to_string(definition.name);
+                            if (shard.tags.get(key).has_value())
+                                shard.errors.append(redefinition_error(definition.name, definition.position));
+                            else
+                                shard.tags.insert(key, chunk.origin.place(definition.placement, definition.relocatable));
                         }
-                        obj.data.get<InstructionIR>().maybe_tag.clear();
                     }
+                });
+                
+                auto lookup = [&shards](const StringView &tag)
+                { return shards[hash_tag(tag) % shards.size()].tags.get(to_string(tag)); };
+                run_in_parallel(chunks.size(), [&chunks, &lookup](u64 i)
+                {
+                    auto &chunk = chunks[i];
+                    for (auto fixup : chunk.emitter.fixups())
+                    {
+                        auto target = lookup(fixup.tag);
+                        fixup.placement = chunk.origin.place(fixup.placement, fixup.relocatable);
+                        if (target.has_value())
+                            chunk.fixups.append({ fixup, target.value() });
+                        else
+                            chunk.errors.append(undefined_tag_error(fixup.tag, fixup.position));
+                    }
+                });
+                
+                Vector<Error> errors;
+                for (const auto &chunk : chunks)
+                {
+                    for (const auto &error : chunk.errors)
+                        errors.append(error);
+                }
+                for (const auto &shard : shards)
+                {
+                    for (const auto &error : shard.errors)
+                        errors.append(error);
+                }
+                auto entry_point = lookup("start"_sv);
+                if (!entry_point.has_value())
+                    errors.construct((LinePos){}, String("program doesn't contain entry point 'start'"));
+                if (errors.size() != 0)
+                    return errors;
+                
+                //offset ended up at the size of every chunk together
+                ByteBuffer payload(offset);
+                Vector<LinkFixup> fixups;
+                PlacedSymbols symbols;
+                for (const auto &chunk : chunks)
+                {
+                    payload.append(chunk.emitter.bytes().data(), chunk.emitter.bytes().size());
+                    for (const auto &fixup : chunk.fixups)
+                        fixups.append(fixup);
+                    for (const auto &definition : chunk.emitter.definitions())
+                        symbols.tags.append({ definition.name, chunk.origin.place(definition.placement, definition.relocatable) });
+                    for (const auto &line : chunk.emitter.lines())
+                    {
+                        symbols.lines.append(chunk.origin.place(line.placement, line.relocatable));
+                        symbols.positions.append(line.position);
+                    }
+                    for (const auto &section : chunk.emitter.sections())
+                        symbols.sections.append({ chunk.origin.place(section.placement, section.relocatable), section.type });
+                }
+                if (payload.failed())
+                {
+                    errors.construct((LinePos){}, String("out of memory"));
+                    return errors;
                 }
-                current_addr += (obj.data.get<InstructionIR>().instruction & (1ul<<63)) == 0 ? 4 : 8;
+                auto image = link(payload.span(), fixups, entry_point.value(), base_address, symbols, m_tags, m_lines,
+                                  m_sections, errors);
+                if (errors.size() != 0)
+                    return errors;
+                return image;
             }
         }
         
-        for(const auto& i : ir)
+        Vector<Error> errors;
+        Vector<Object> objects;
+        BytecodeEmitter emitter;
+        Lexer lexer(m_source);
+        parse_statements(lexer, objects, errors, [&]
+        {
+            for (const auto &object : objects)
+                emitter.emit(object);
+            objects.clear();
+        });
+        return emitter.finish(errors, m_tags, m_lines, m_sections);
+    }
+    
+    /*
+     * Incremental assembly keeps an object cache on disk. The source is cut into regions at lines that open with a tag
+     * definition or an .addr directive, picked by a hash of the line itself, so an edit only moves the boundaries next
+     * to it. Every region is cached as a relocatable piece: its bytes, the tags it defines, its tag references,
+     * already resolved when they refer to a tag of the same region, and where its instructions came from in the source.
+     * A region whose text and start alignment are in the cache is only relocated; the rest are lexed, parsed and
+     * emitted again. Linking then only has to look up the references that cross regions before relaxing jumps over the
+     * whole program.
+     * Only the front end is incremental: every build still links the whole program, so a warm build copies every
+     * region's bytes into the payload and link() copies the payload into the image and relaxes every jump again.
+     * Those are a few passes over the bytes and the fixups, so a build with every region cached stays O(program), it
+     * just no longer lexes, parses or emits any of it.
+     */
+    constexpr u32 object_cache_magic = 0x6302CAC4;
+    //bump whenever the encoding or the layout of the cache changes
+    constexpr u32 object_cache_version = 4;
+    constexpr u64 min_region_size = 4096;
+    //one split point in this many ends a region, once it is past min_region_size
+    constexpr u32 region_boundary_odds = 16;
+    
+    struct ObjectCacheHeader
+    {
+        u32 magic;
+        u32 version;
+        u64 region_count;
+    };
+    
+    constexpr u32 region_has_base_address = 1;
+    constexpr u32 region_end_is_relocatable = 2;
+    
+    //followed by the bytes, the definitions, the fixups, the instruction positions, the section directives and the tag
+    //names; records are padded to 8 bytes
+    struct CachedRegionHeader
+    {
+        u64 source_hash;
+        u64 source_size;
+        u64 record_size;
+        u64 bytes_size;
+        u64 end_address;
+        //where the last segment of the region starts, unless the region's end is relocatable
+        u64 end_segment;
+        u64 base_address;
+        u32 alignment;
+        u32 lines;
+        u32 definition_count;
+        u32 fixup_count;
+        u32 names_size;
+        u32 flags;
+        u32 instruction_count;
+        u32 section_count;
+    };
+    
+    struct CachedDefinition
+    {
+        Placement placement;
+        u32 name_offset;
+        u32 name_size;
+        u32 hash;
+        u32 relocatable;
+        u32 line;
+        u32 pos;
+    };
+    
+    constexpr u32 no_local_tag = 0xFFFFFFFF;
+    
+    struct CachedFixup
+    {
+        Placement placement;
+        u64 instruction;
+        u32 name_offset;
+        u32 name_size;
+        u32 line;
+        u32 pos;
+        u32 tag_is_absolute;
+        u32 relocatable;
+        //index of the definition of the tag in the same region, or no_local_tag
+        u32 local_tag;
+        u32 reserved;
+    };
+    
+    struct CachedInstruction
+    {
+        Placement placement;
+        u32 line;
+        u32 pos;
+        u32 relocatable;
+        u32 reserved;
+    };
+    
+    struct CachedSection
+    {
+        Placement placement;
+        u32 type;
+        u32 relocatable;
+    };
+    
+    static u64 hash_region(const StringView &region)
+    {
+        const char *data = region.non_null_terminated_buffer();
+        u64 size = region.byte_size();
+        u64 hash = size * 0x9E3779B97F4A7C15;
+        for (; size >= 8; data += 8, size -= 8)
+        {
+            u64 word;
+            __builtin_memcpy(&word, data, sizeof(u64));
+            hash = (hash ^ word) * 0xFF51AFD7ED558CCD;
+            hash ^= hash >> 32;
+        }
+        u64 tail = 0;
+        __builtin_memcpy(&tail, data, size);
+        hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53;
+        return hash ^ (hash >> 29);
+    }
+    
+    //the start of the line after the one at, following the lexer's rules for strings and comments: in_string tells
+    //whether a string literal is still open there
+    static const char *next_line(const char *at, const char *end, bool &in_string)
+    {
+        while (at != end)
         {
-            switch (i.ir_type)
+            char c = *at++;
+            if (in_string)
             {
-                case IRType::Instruction:
-                    if ((i.data.get<InstructionIR>().instruction & (1ul<<63)) == 0)
-                    {
-                        bytecode.append((u8) i.data.get<InstructionIR>().instruction & 0xFF);
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF00) >> 8));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF0000) >> 16));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF000000) >> 24));
-                    }
-                    else
-                    {
-                        bytecode.append((u8) i.data.get<InstructionIR>().instruction & 0xFF);
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF00) >> 8));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF0000) >> 16));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF000000) >> 24));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF00000000) >> 32));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF0000000000) >> 40));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF000000000000) >> 48));
-                        bytecode.append((u8) ((i.data.get<InstructionIR>().instruction & 0xFF00000000000000) >> 56));
-                    }
-                case IRType::RawByte:
-                    bytecode.append(i.data.get<u8>());
-                    break;
-                case IRType::Tag:
-                    break;
+                if (c == '"')
+                    in_string = false;
+                else if (c == '\\' && at != end)
+                    at++;
+            } else if (c == '"')
+            {
+                in_string = true;
+            } else if (c == '#')
+            {
+                at = (const char *) __builtin_memchr(at, '\n', end - at);
+                if (at == nullptr)
+                    return end;
+            }
+            if (c == '\n')
+                return at;
+        }
+        return end;
+    }
+    
+    //lines inside a multi-line string literal look like any other to is_split_point, so the scan keeps track of them
+    static Vector<StringView> split_regions(const StringView &source)
+    {
+        const char *begin = source.non_null_terminated_buffer();
+        const char *end = begin + source.byte_size();
+        Vector<StringView> regions;
+        const char *region_begin = begin;
+        bool in_string = false;
+        for (const char *line = begin; line != end;)
+        {
+            line = next_line(line, end, in_string);
+            if (in_string || line == end || (u64) (line - region_begin) <= min_region_size || !is_split_point(line, end))
+                continue;
+            const char *line_end = (const char *) __builtin_memchr(line, '\n', end - line);
+            StringView text(line, (line_end != nullptr ? line_end : end) - line);
+            if (hash_tag(text) % region_boundary_odds != 0)
+                continue;
+            regions.append(StringView(region_begin, line - region_begin));
+            region_begin = line;
+        }
+        regions.append(StringView(region_begin, end - region_begin));
+        return regions;
+    }
+    
+    //false if the record couldn't be put together for lack of memory
+    static bool append_cached_region(ByteBuffer &cache, const StringView &source, u64 source_hash, u32 alignment, u32 lines,
+                                     const BytecodeEmitter &piece)
+    {
+        ByteBuffer names;
+        Vector<CachedDefinition> definitions;
+        //the first definition of a tag is the one the whole program resolves to, any other one is an error anyway
+        Hashmap<String, u32> local_tags;
+        for (const auto &definition : piece.definitions())
+        {
+            String key = to_string(definition.name);
+            if (!local_tags.get(key).has_value())
+                local_tags.insert(key, definitions.size());
+            definitions.append({ definition.placement, (u32) names.size(), (u32) definition.name.byte_size(), definition.hash,
+                                 definition.relocatable, (u32) definition.position.line, (u32) definition.position.pos });
+            names.append(definition.name.non_null_terminated_buffer(), definition.name.byte_size());
+        }
+        Vector<CachedFixup> fixups;
+        for (const auto &fixup : piece.fixups())
+        {
+            auto local_tag = local_tags.get(to_string(fixup.tag));
+            fixups.append({ fixup.placement, fixup.instruction, (u32) names.size(), (u32) fixup.tag.byte_size(),
+                            (u32) fixup.position.line, (u32) fixup.position.pos, fixup.tag_is_absolute, fixup.relocatable,
+                            local_tag.has_value() ? local_tag.value() : no_local_tag, 0 });
+            names.append(fixup.tag.non_null_terminated_buffer(), fixup.tag.byte_size());
+        }
+        Vector<CachedInstruction> instructions;
+        for (const auto &line : piece.lines())
+            instructions.append({ line.placement, (u32) line.position.line, (u32) line.position.pos, line.relocatable, 0 });
+        Vector<CachedSection> sections;
+        for (const auto &section : piece.sections())
+            sections.append({ section.placement, (u32) section.type, section.relocatable });
+        
+        if (names.failed())
+            return false;
+        
+        const auto &bytes = piece.bytes();
+        u64 bytes_size = (bytes.size() + 7) & ~7ul;
+        u64 names_size = (names.size() + 7) & ~7ul;
+        CachedRegionHeader header { source_hash, source.byte_size(),
+                                    sizeof(CachedRegionHeader) + bytes_size + definitions.size() * sizeof(CachedDefinition)
+                                    + fixups.size() * sizeof(CachedFixup) + instructions.size() * sizeof(CachedInstruction)
+                                    + sections.size() * sizeof(CachedSection) + names_size,
+                                    bytes.size(), piece.current_address(), piece.segment(),
+                                    piece.base_address().has_value() ? piece.base_address().value() : 0,
+                                    alignment, lines, (u32) definitions.size(), (u32) fixups.size(), (u32) names.size(),
+                                    (piece.base_address().has_value() ? region_has_base_address : 0)
+                                    | (piece.is_relocatable() ? region_end_is_relocatable : 0),
+                                    (u32) instructions.size(), (u32) sections.size() };
+        cache.append(&header, sizeof(CachedRegionHeader));
+        cache.append(bytes.data(), bytes.size());
+        cache.append_zeros(bytes_size - bytes.size());
+        cache.append(definitions.data(), definitions.size() * sizeof(CachedDefinition));
+        cache.append(fixups.data(), fixups.size() * sizeof(CachedFixup));
+        cache.append(instructions.data(), instructions.size() * sizeof(CachedInstruction));
+        cache.append(sections.data(), sections.size() * sizeof(CachedSection));
+        cache.append(names.data(), names.size());
+        cache.append_zeros(names_size - names.size());
+        return !cache.failed();
+    }
+    
+    //a region placed in the program, read straight out of a cache buffer
+    struct PlacedRegion
+    {
+        const CachedRegionHeader *header;
+        const u8 *bytes;
+        const CachedDefinition *definitions;
+        const CachedFixup *fixups;
+        const CachedInstruction *instructions;
+        const CachedSection *sections;
+        const char *names;
+        PieceOrigin origin;
+        size_t first_line;
+        
+        static PlacedRegion at(const u8 *record, const PieceOrigin &origin, size_t first_line)
+        {
+            auto header = (const CachedRegionHeader *) record;
+            const u8 *bytes = record + sizeof(CachedRegionHeader);
+            auto definitions = (const CachedDefinition *) (bytes + ((header->bytes_size + 7) & ~7ul));
+            auto fixups = (const CachedFixup *) (definitions + header->definition_count);
+            auto instructions = (const CachedInstruction *) (fixups + header->fixup_count);
+            auto sections = (const CachedSection *) (instructions + header->instruction_count);
+            return { header, bytes, definitions, fixups, instructions, sections, (const char *) (sections + header->section_count),
+                     origin, first_line };
+        }
+        
+        Placement place(const CachedDefinition &definition) const
+        {
+            return origin.place(definition.placement, definition.relocatable);
+        }
+        
+        LinePos position(u32 line, u32 pos) const
+        {
+            return { line + first_line - 1, pos };
+        }
+        
+        StringView name(u32 offset, u32 size) const
+        {
+            return StringView(names + offset, size);
+        }
+    };
+    
+    //placements are offsets into the region's bytes; a fixup or an instruction needs its words to be in them
+    static bool placement_is_sound(const Placement &placement, u32 relocatable, u64 size, u64 bytes_size)
+    {
+        return placement.offset <= bytes_size && bytes_size - placement.offset >= size
+               && (relocatable || placement.segment <= placement.offset);
+    }
+    
+    //every index in a record stays inside it, so that a damaged or foreign cache is a miss instead of a crash
+    static bool region_is_sound(const PlacedRegion &region)
+    {
+        const auto &header = *region.header;
+        if (!(header.flags & region_end_is_relocatable) && header.end_segment > header.bytes_size)
+            return false;
+        auto name_is_sound = [&header](u32 offset, u32 size) { return (u64) offset + size <= header.names_size; };
+        for (u32 i = 0; i < header.definition_count; i++)
+        {
+            const auto &definition = region.definitions[i];
+            if (!name_is_sound(definition.name_offset, definition.name_size)
+                || !placement_is_sound(definition.placement, definition.relocatable, 0, header.bytes_size))
+                return false;
+        }
+        //link() patches fixups in one pass over the bytes, so they have to be in order and not overlap
+        u64 patched_up_to = 0;
+        for (u32 i = 0; i < header.fixup_count; i++)
+        {
+            const auto &fixup = region.fixups[i];
+            u64 size = fixup.instruction & (1ul << 63) ? 8 : 4;
+            if (!name_is_sound(fixup.name_offset, fixup.name_size)
+                || !placement_is_sound(fixup.placement, fixup.relocatable, size, header.bytes_size)
+                || fixup.placement.offset < patched_up_to
+                || (fixup.local_tag != no_local_tag && fixup.local_tag >= header.definition_count))
+                return false;
+            patched_up_to = fixup.placement.offset + size;
+        }
+        for (u32 i = 0; i < header.instruction_count; i++)
+        {
+            const auto &instruction = region.instructions[i];
+            if (!placement_is_sound(instruction.placement, instruction.relocatable, sizeof(u32), header.bytes_size))
+                return false;
+        }
+        for (u32 i = 0; i < header.section_count; i++)
+        {
+            const auto &section = region.sections[i];
+            if (section.type > (u32) SectionType::Bss
+                || !placement_is_sound(section.placement, section.relocatable, 0, header.bytes_size))
+                return false;
+        }
+        return true;
+    }
+    
+    //records of a cache file by the hash of their source, if the file is sound
+    static Hashmap<u64, u64> index_object_cache(const Vector<u8> &cache, u64 &region_count)
+    {
+        Hashmap<u64, u64> records;
+        region_count = 0;
+        ObjectCacheHeader header;
+        if (cache.size() < sizeof(ObjectCacheHeader))
+            return records;
+        __builtin_memcpy(&header, cache.data(), sizeof(ObjectCacheHeader));
+        if (header.magic != object_cache_magic || header.version != object_cache_version)
+            return records;
+        u64 offset = sizeof(ObjectCacheHeader);
+        for (u64 i = 0; i < header.region_count; i++)
+        {
+            if (cache.size() - offset < sizeof(CachedRegionHeader))
+                return Hashmap<u64, u64>();
+            auto region = (const CachedRegionHeader *) (cache.data() + offset);
+            u64 minimum = sizeof(CachedRegionHeader) + region->bytes_size + (u64) region->definition_count * sizeof(CachedDefinition)
+                          + (u64) region->fixup_count * sizeof(CachedFixup)
+                          + (u64) region->instruction_count * sizeof(CachedInstruction)
+                          + (u64) region->section_count * sizeof(CachedSection) + region->names_size;
+            if (region->record_size % 8 != 0 || region->record_size < minimum || cache.size() - offset < region->record_size
+                || !region_is_sound(PlacedRegion::at(cache.data() + offset, {}, 1)))
+                return Hashmap<u64, u64>();
+            records.insert(region->source_hash, offset);
+            offset += region->record_size;
+        }
+        region_count = header.region_count;
+        return records;
+    }
+    
+    //open addressing over the tags of every region, so that linking never has to copy a tag name
+    class TagIndex
+    {
+    public:
+        explicit TagIndex(u64 count)
+        {
+            while (m_mask + 1 < count * 2)
+                m_mask = m_mask * 2 + 1;
+            for (u64 i = 0; i <= m_mask; i++)
+                m_slots.append({ nullptr, nullptr });
+        }
+        
+        //false if the tag is already there
+        bool insert(const PlacedRegion &region, const CachedDefinition &definition)
+        {
+            StringView name = region.name(definition.name_offset, definition.name_size);
+            for (u64 slot = definition.hash & m_mask;; slot = (slot + 1) & m_mask)
+            {
+                auto &entry = m_slots[slot];
+                if (entry.definition == nullptr)
+                {
+                    entry = { &region, &definition };
+                    return true;
+                }
+                if (entry.definition->hash == definition.hash && entry.name() == name)
+                    return false;
+            }
+        }
+        
+        Optional<Placement> get(const StringView &name) const
+        {
+            u32 hash = hash_tag(name);
+            for (u64 slot = hash & m_mask;; slot = (slot + 1) & m_mask)
+            {
+                const auto &entry = m_slots[slot];
+                if (entry.definition == nullptr)
+                    return {};
+                if (entry.definition->hash == hash && entry.name() == name)
+                    return entry.region->place(*entry.definition);
+            }
+        }
+    
+    private:
+        struct Slot
+        {
+            const PlacedRegion *region;
+            const CachedDefinition *definition;
+            
+            StringView name() const
+            {
+                return region->name(definition->name_offset, definition->name_size);
+            }
+        };
+        
+        Vector<Slot> m_slots;
+        u64 m_mask { 15 };
+    };
+    
+    //the cache is written to a file of its own next to it and renamed over it, so a build that is interrupted, or
+    //another one writing the same cache at the same time, never leaves a torn file behind
+    static bool write_object_cache(const StringView &path, const Vector<Span<u8>> &records)
+    {
+        String target = to_string(path);
+        String pattern = StringBuilder().append(path).append(".XXXXXX").to_string();
+        u64 pattern_size = __builtin_strlen(pattern.null_terminated_characters()) + 1;
+        auto temporary = (char *) malloc(pattern_size);
+        if (temporary == nullptr)
+            return false;
+        __builtin_memcpy(temporary, pattern.null_terminated_characters(), pattern_size);
+        int fd = mkstemp(temporary);
+        if (fd < 0)
+        {
+            free(temporary);
+            return false;
+        }
+        //mkstemp only lets the owner read it, unlike every other file the assembler writes
+        fchmod(fd, 0644);
+        ObjectCacheHeader header { object_cache_magic, object_cache_version, records.size() };
+        bool ok = write(fd, &header, sizeof(ObjectCacheHeader)) == sizeof(ObjectCacheHeader);
+        for (u64 i = 0; ok && i < records.size(); i += IOV_MAX)
+        {
+            iovec parts[IOV_MAX];
+            u64 count = records.size() - i < IOV_MAX ? records.size() - i : IOV_MAX;
+            ssize_t expected = 0;
+            for (u64 j = 0; j < count; j++)
+            {
+                parts[j] = { records[i + j].data(), records[i + j].size() };
+                expected += records[i + j].size();
             }
+            ok = writev(fd, parts, count) == expected;
         }
+        close(fd);
+        if (ok)
+            ok = rename(temporary, target.null_terminated_characters()) == 0;
+        if (!ok)
+            unlink(temporary);
+        free(temporary);
+        return ok;
+    }
     
-        auto maybe_entry_point = tagmap.get("start");
-        if (!maybe_entry_point.has_value())
-            errors.construct((LinePos){}, new String("program doesn't contain entry point 'start'"));
+    ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> Assembler::assemble_incremental(const StringView &cache_path)
+    {
+        Vector<u8> old_cache;
+        if (File::exists(cache_path))
+        {
+            auto cache_or_error = File::read_all(cache_path);
+            if (cache_or_error.has_result())
+                old_cache = move(cache_or_error.result());
+        }
+        u64 cached_regions;
+        auto cached = index_object_cache(old_cache, cached_regions);
+        
+        struct RegionRecord
+        {
+            bool is_fresh;
+            u64 offset;
+            PieceOrigin origin;
+            size_t first_line;
+        };
+        Vector<RegionRecord> records;
+        ByteBuffer fresh;
+        Vector<Error> errors;
+        u64 address = 0;
+        u64 payload_offset = 0;
+        u64 segment = 0;
+        size_t first_line = 1;
+        u64 misses = 0;
+        for (const auto &source : split_regions(m_source))
+        {
+            u64 source_hash = hash_region(source);
+            u32 alignment = address % 4;
+            PieceOrigin origin { payload_offset, address - alignment, segment };
+            auto hit = cached.get(source_hash);
+            const CachedRegionHeader *header = nullptr;
+            if (hit.has_value())
+            {
+                header = (const CachedRegionHeader *) (old_cache.data() + hit.value());
+                if (header->source_size != source.byte_size() || header->alignment != alignment)
+                    header = nullptr;
+            }
+            if (header != nullptr)
+            {
+                records.append({ false, hit.value(), origin, first_line });
+            } else
+            {
+                misses++;
+                Vector<Object> objects;
+                Vector<Error> region_errors;
+                Lexer lexer(source);
+                parse_statements(lexer, objects, region_errors, [] {});
+                BytecodeEmitter piece(true);
+                piece.start_at(alignment);
+                for (const auto &object : objects)
+                    piece.emit(object);
+                for (const auto &error : piece.errors())
+                    region_errors.append(error);
+                for (auto &error : region_errors)
+                {
+                    error.where.line += first_line - 1;
+                    errors.append(error);
+                }
+                
+                //regions with errors are never cached, but still laid out so the ones after them get checked
+                u64 offset = fresh.size();
+                if (!append_cached_region(fresh, source, source_hash, alignment, lexer.line() - 1, piece))
+                {
+                    errors.construct((LinePos){}, String("out of memory"));
+                    return errors;
+                }
+                records.append({ true, offset, origin, first_line });
+                header = (const CachedRegionHeader *) (fresh.data() + offset);
+            }
+            if (header->flags & region_end_is_relocatable)
+            {
+                address = header->end_address + address - alignment;
+            } else
+            {
+                address = header->end_address;
+                segment = payload_offset + header->end_segment;
+            }
+            payload_offset += header->bytes_size;
+            first_line += header->lines;
+        }
+        if (errors.size() != 0)
+            return errors;
+        
+        Vector<PlacedRegion> regions;
+        u64 definition_count = 0;
+        for (const auto &record : records)
+        {
+            const u8 *base = (record.is_fresh ? fresh.data() : old_cache.data()) + record.offset;
+            regions.append(PlacedRegion::at(base, record.origin, record.first_line));
+            definition_count += regions[regions.size() - 1].header->definition_count;
+        }
+        
+        TagIndex tags(definition_count);
+        PlacedSymbols symbols;
+        ByteBuffer payload(payload_offset);
+        u64 base_address = 0;
+        for (const auto &region : regions)
+        {
+            for (u32 i = 0; i < region.header->definition_count; i++)
+            {
+                const auto &definition = region.definitions[i];
+                if (!tags.insert(region, definition))
+                    errors.append(redefinition_error(region.name(definition.name_offset, definition.name_size),
+                                                     region.position(definition.line, definition.pos)));
+                symbols.tags.append({ region.name(definition.name_offset, definition.name_size), region.place(definition) });
+            }
+            for (u32 i = 0; i < region.header->instruction_count; i++)
+            {
+                const auto &instruction = region.instructions[i];
+                symbols.lines.append(region.origin.place(instruction.placement, instruction.relocatable));
+                symbols.positions.append(region.position(instruction.line, instruction.pos));
+            }
+            for (u32 i = 0; i < region.header->section_count; i++)
+            {
+                const auto &section = region.sections[i];
+                symbols.sections.append({ region.origin.place(section.placement, section.relocatable), (SectionType) section.type });
+            }
+            payload.append(region.bytes, region.header->bytes_size);
+            if (region.header->flags & region_has_base_address)
+                base_address = region.header->base_address;
+        }
+        
+        Vector<LinkFixup> fixups;
+        for (const auto &region : regions)
+        {
+            for (u32 i = 0; i < region.header->fixup_count; i++)
+            {
+                const auto &cached_fixup = region.fixups[i];
+                TagFixup fixup { region.position(cached_fixup.line, cached_fixup.pos),
+                                 region.origin.place(cached_fixup.placement, cached_fixup.relocatable), cached_fixup.instruction,
+                                 region.name(cached_fixup.name_offset, cached_fixup.name_size), (bool) cached_fixup.tag_is_absolute,
+                                 (bool) cached_fixup.relocatable };
+                auto target = cached_fixup.local_tag != no_local_tag ? region.place(region.definitions[cached_fixup.local_tag])
+                                                                     : tags.get(fixup.tag);
+                if (target.has_value())
+                    fixups.append({ fixup, target.value() });
+                else
+                    errors.append(undefined_tag_error(fixup.tag, fixup.position));
+            }
+        }
         
+        auto entry_point = tags.get("start"_sv);
+        if (!entry_point.has_value())
+            errors.construct((LinePos){}, String("program doesn't contain entry point 'start'"));
+        if (payload.failed())
+            errors.construct((LinePos){}, String("out of memory"));
         if (errors.size() != 0)
             return errors;
-        else
+        auto image = link(payload.span(), fixups, entry_point.value(), base_address, symbols, m_tags, m_lines, m_sections,
+                          errors);
+        if (errors.size() != 0)
+            return errors;
+        
+        //the cache only keeps the regions of this version of the source, so it never grows past it
+        if (misses != 0 || records.size() != cached_regions)
         {
-            return make_nvm_format(base_addr, maybe_entry_point.value(), bytecode.span());
+            Vector<Span<u8>> parts;
+            for (const auto &region : regions)
+                parts.append(Span<u8>((u8 *) region.header, region.header->record_size));
+            write_object_cache(cache_path, parts);
         }
+        return image;
     }
-}
\ No newline at end of file
+}
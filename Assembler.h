@@ -12,6 +12,21 @@
 
 namespace nvm
 {
+    //what Assembler::optimize did, by rule
+    struct PeepholeStatistics
+    {
+        //instructions removed because their result was known to be in their destination already
+        u64 folded_constants;
+        //instructions whose result was known to be constant and were turned into a move of it, not removed
+        u64 rewritten_constants;
+        u64 dead_writes;
+        u64 redundant_moves;
+        u64 fused_jumps;
+        //set when the program computes code addresses the optimizer can't follow, or loads or stores at a fixed address
+        //inside itself, and was left as it was
+        bool skipped;
+    };
+    
     class Assembler
     {
     private:
@@ -26,13 +41,49 @@ namespace nvm
         
         ResultOrError<Vector<Token>, Vector<Error>> tokenize();
         ResultOrError<Vector<Object>, Vector<Error>> parse(const Vector<Token>& tokens);
+        //optional peephole pass over the output of parse(), to run before generate_bytecode()
+        PeepholeStatistics optimize(Vector<Object> &objects);
         ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> generate_bytecode(const Vector<Object> &objects);
+        //tokenize, parse and generate_bytecode fused into a single streaming pass; large sources are split across threads
+        ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> assemble(u32 threads = 1);
+        
+        /*
+         * Like assemble(), but keeps an object cache in the file at cache_path: regions of the source that didn't change
+         * since the cache was written are taken from it instead of being assembled again. The cache is created if it
+         * doesn't exist and rewritten whenever it is out of date; failing to write it isn't an error.
+         */
+        ResultOrError<RefPtr<Vector<u8>>, Vector<Error>> assemble_incremental(const StringView &cache_path);
+        
+        //every tag of the program last assembled, by any of the above, sorted by address
+        const Vector<ResolvedTag>& tags() const
+        {
+            return m_tags;
+        }
+        
+        //where every instruction of the program last assembled came from, sorted by address
+        const Vector<ResolvedLine>& lines() const
+        {
+            return m_lines;
+        }
+        
+        //the .text, .rodata and .data directives of the program last assembled, sorted by address. each one says what
+        //the bytes from its address up to the next one are, for writing sectioned images
+        const Vector<ResolvedSection>& sections() const
+        {
+            return m_sections;
+        }
+        
+        //sources are only split into chunks of at least this many bytes
+        static constexpr u64 min_chunk_size = 256 * 1024;
     
     private:
         explicit Assembler(Vector<u8>&&data);
         
         Vector<u8> m_data;
         StringView m_source;
+        Vector<ResolvedTag> m_tags;
+        Vector<ResolvedLine> m_lines;
+        Vector<ResolvedSection> m_sections;
     };
     
 }
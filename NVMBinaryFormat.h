@@ -4,58 +4,424 @@
 #include "Vector.h"
 #include "ResultOrError.h"
 #include "StringView.h"
+#include "NVMMemory.h"
+#include "NVMChecksum.h"
+#include "NVMData.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 namespace nvm
 {
-    struct NVMBinaryFormatData
+    constexpr u32 nvm_magic = 0x63026302;
+    constexpr u32 nvm_sectioned_magic = 0x63026303;
+
+    struct NVMBinaryHeader
     {
         u32 magic;
         u32 crc32;
         u64 load_offset;
         u64 entry_point;
-        RefPtr<Vector<u8>> rom;
     };
-    
-    
-    ResultOrError<NVMBinaryFormatData, StringView> try_read(const Span<u8>& data)
+    static_assert(sizeof(NVMBinaryHeader) == 24, "the header layout is part of the file format");
+
+    //the checksum covers everything after the crc32 field: the rest of the header and the payload
+    inline u32 nvm_checksum(const NVMBinaryHeader& header, const Span<u8>& payload)
+    {
+        u32 crc = crc32c((const u8*) &header.load_offset, sizeof(header.load_offset) + sizeof(header.entry_point));
+        return crc32c(payload, crc);
+    }
+
+    constexpr u32 section_read = 1;
+    constexpr u32 section_write = 2;
+    constexpr u32 section_execute = 4;
+
+    struct NVMSectionedHeader
     {
-        if (data.size() < sizeof(NVMBinaryFormatData))
+        u32 magic;
+        //covers the rest of this header and the section table; every section carries its own checksum
+        u32 crc32;
+        u64 entry_point;
+        u32 section_count;
+        u32 reserved;
+    };
+    static_assert(sizeof(NVMSectionedHeader) == 24, "the header layout is part of the file format");
+
+    struct NVMSectionHeader
+    {
+        SectionType type;
+        u32 flags;
+        u64 address;
+        u64 size;
+        u64 file_offset;
+        u64 file_size;
+        u32 crc32;
+        u32 reserved;
+    };
+    static_assert(sizeof(NVMSectionHeader) == 48, "the section table layout is part of the file format");
+
+    struct NVMSection
+    {
+        SectionType type;
+        u32 flags;
+        u64 address;
+        //size in memory; whatever contents doesn't cover reads as zero
+        u64 size;
+        //where contents start in the image, so loaders can map them instead of copying
+        u64 file_offset;
+        //view into the buffer that was parsed; section contents are never copied
+        Span<u8> contents;
+        //sections of sectioned images are only checked against their checksum when they are loaded (see
+        //verify_sections and NVMImageFile::open). the payload of a flat image is checked along with its header
+        u32 crc32;
+        bool checked;
+    };
+
+    struct NVMBinaryFormatData
+    {
+        u32 magic;
+        u64 entry_point;
+        //flat images show up as a single writable text section
+        Vector<NVMSection> sections;
+    };
+
+    inline ResultOrError<NVMBinaryFormatData, StringView> try_read_sectioned(const Span<u8>& data)
+    {
+        NVMSectionedHeader header;
+        __builtin_memcpy(&header, data.data(), sizeof(NVMSectionedHeader));
+        u64 table_size = (u64) header.section_count * sizeof(NVMSectionHeader);
+        if (data.size() - sizeof(NVMSectionedHeader) < table_size)
+            return "section table doesn't fit in the specified buffer"_sv;
+        u64 checked = sizeof(NVMSectionedHeader) - sizeof(u32) * 2 + table_size;
+        if (crc32c(data.data() + sizeof(u32) * 2, checked) != header.crc32)
+            return "bad checksum"_sv;
+
+        NVMBinaryFormatData image { header.magic, header.entry_point, Vector<NVMSection>() };
+        for (u32 i = 0; i < header.section_count; i++)
+        {
+            NVMSectionHeader section;
+            __builtin_memcpy(&section, data.data() + sizeof(NVMSectionedHeader) + i * sizeof(NVMSectionHeader), sizeof(NVMSectionHeader));
+            if (section.type > SectionType::Bss)
+                return "unknown section type"_sv;
+            if (section.file_size > section.size || (section.type == SectionType::Bss && section.file_size != 0))
+                return "section has more file bytes than its size"_sv;
+            if (section.file_offset > data.size() || section.file_size > data.size() - section.file_offset)
+                return "section contents don't fit in the specified buffer"_sv;
+            auto contents = data.slice(section.file_offset, section.file_size);
+            image.sections.append({ section.type, section.flags, section.address, section.size, section.file_offset, contents,
+                section.crc32, false });
+        }
+        return image;
+    }
+
+    inline ResultOrError<NVMBinaryFormatData, StringView> try_read(const Span<u8>& data)
+    {
+        if (data.size() < sizeof(NVMBinaryHeader))
             return "specified buffer isn't long enough for correct parsing"_sv;
-        
-        auto magic = data.as<u32>()[0];
-        if (magic != 0x63026302)
+
+        u32 magic;
+        __builtin_memcpy(&magic, data.data(), sizeof(u32));
+        if (magic == nvm_sectioned_magic)
+            return try_read_sectioned(data);
+        if (magic != nvm_magic)
             return "bad magic"_sv;
-        auto crc32 = data.as<u32>()[1];
-        auto load_offset = data.as<u64>().slice(1)[0];
-        auto entry_point = data.as<u64>().slice(1)[1];
-        
-        RefPtr<Vector<u8>> rom(new Vector<u8>());
-        for (auto byte : data.slice(sizeof(u32)*2+sizeof(u64)*2))
-            rom->append(byte);
-        
-        //TODO: implement crc32 check
-        return NVMBinaryFormatData { magic, crc32, load_offset, entry_point, move(rom) };
-    }
-    
-    RefPtr<Vector<u8>> make_nvm_format(u64 load_offset, u64 entry_point, const Span<u8>& data)
-    {
-        RefPtr<Vector<u8>> buf(new Vector<u8>(24+data.size()));
-        //insert magic
-        buf->append(0x02);
-        buf->append(0x63);
-        buf->append(0x02);
-        buf->append(0x63);
-        //insert crc32
-        buf->append(0);
-        buf->append(0);
-        buf->append(0);
-        buf->append(0);
-        //insert load offset
-        for (int i = 0; i < sizeof(u64); i++)
-            buf->append((load_offset & (0xFF << i*8)) >> i*8);
-        //insert entry point
-        for (int i = 0; i < sizeof(u64); i++)
-            buf->append((entry_point & (0xFF << i*8)) >> i*8);
+
+        NVMBinaryHeader header;
+        __builtin_memcpy(&header, data.data(), sizeof(NVMBinaryHeader));
+        auto payload = data.slice(sizeof(NVMBinaryHeader));
+        if (nvm_checksum(header, payload) != header.crc32)
+            return "bad checksum"_sv;
+        NVMBinaryFormatData image { header.magic, header.entry_point, Vector<NVMSection>() };
+        image.sections.append({ SectionType::Text, section_read | section_write | section_execute, header.load_offset,
+            payload.size(), sizeof(NVMBinaryHeader), payload, header.crc32, true });
+        return image;
+    }
+
+    //for loaders that copy the sections, and read them whole anyway
+    inline bool verify_sections(const NVMBinaryFormatData& image)
+    {
+        for (const auto& section : image.sections)
+        {
+            if (!section.checked && crc32c(section.contents) != section.crc32)
+                return false;
+        }
+        return true;
+    }
+
+    //only whole pages are protected, so a section sharing a page with a writable one leaves that page writable
+    inline bool protect_section(NVMMemory& memory, const NVMSection& section)
+    {
+        if (section.flags & section_write)
+            return true;
+        u64 first = (section.address + NVMMemory::page_mask) & ~NVMMemory::page_mask;
+        u64 last = (section.address + section.size) & ~NVMMemory::page_mask;
+        return first >= last || memory.protect(first, last - first, false);
+    }
+
+    /*
+     * Copies the sections of a parsed image into memory, which must not have been written yet: bss sections and the
+     * zero filled tails of the others need no work at all, since untouched memory already reads as zero.
+     * Checksums are left to the caller, which only has to check an image once however many guests it loads (see
+     * verify_sections). false if a read only section couldn't be protected.
+     */
+    inline bool load_sections(NVMMemory& memory, const NVMBinaryFormatData& image)
+    {
+        for (const auto& section : image.sections)
+            memory.load_image(section.address, section.contents);
+        for (const auto& section : image.sections)
+        {
+            if (!protect_section(memory, section))
+                return false;
+        }
+        return true;
+    }
+
+    //builds an image in place: the payload goes after sizeof(NVMBinaryHeader) reserved bytes, then this fills in the header
+    inline void finish_nvm_format(Vector<u8>& image, u64 load_offset, u64 entry_point)
+    {
+        NVMBinaryHeader header { nvm_magic, 0, load_offset, entry_point };
+        header.crc32 = nvm_checksum(header, image.span().slice(sizeof(NVMBinaryHeader)));
+        __builtin_memcpy(image.data(), &header, sizeof(NVMBinaryHeader));
+    }
+
+    //writev may write less than asked, in which case the rest is written from where it stopped. parts is consumed
+    inline bool writev_all(int fd, iovec* parts, int count)
+    {
+        int first = 0;
+        while (first < count)
+        {
+            ssize_t written = writev(fd, parts + first, count - first);
+            if (written <= 0)
+                return false;
+            while (first < count && (u64) written >= parts[first].iov_len)
+                written -= parts[first++].iov_len;
+            if (first < count)
+            {
+                parts[first].iov_base = (u8*) parts[first].iov_base + written;
+                parts[first].iov_len -= written;
+            }
+        }
+        return true;
+    }
+
+    //writes the image straight from the payload buffer, without assembling it in memory first
+    inline bool write_nvm_file(const char* path, u64 load_offset, u64 entry_point, const Span<u8>& data)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        NVMBinaryHeader header { nvm_magic, 0, load_offset, entry_point };
+        header.crc32 = nvm_checksum(header, data);
+        iovec parts[2] { { &header, sizeof(NVMBinaryHeader) }, { data.data(), data.size() } };
+        bool ok = writev_all(fd, parts, 2);
+        close(fd);
+        return ok;
+    }
+
+    /*
+     * Lays out a sectioned image. The file offset of every section is congruent with its load address modulo the
+     * page size, which costs at most a page of padding per section but lets NVMImageFile map the contents instead of
+     * copying them. The file_offset of the sections passed in is ignored.
+     */
+    inline RefPtr<Vector<u8>> make_nvm_sectioned_format(u64 entry_point, const Vector<NVMSection>& sections)
+    {
+        Vector<NVMSectionHeader> table;
+        u64 cursor = sizeof(NVMSectionedHeader) + sections.size() * sizeof(NVMSectionHeader);
+        for (const auto& section : sections)
+        {
+            u64 offset = section.contents.size() == 0 ? 0 : cursor + ((section.address - cursor) & NVMMemory::page_mask);
+            table.append({ section.type, section.flags, section.address, section.size, offset, section.contents.size(),
+                crc32c(section.contents), 0 });
+            if (section.contents.size() != 0)
+                cursor = offset + section.contents.size();
+        }
+
+        NVMSectionedHeader header { nvm_sectioned_magic, 0, entry_point, (u32) sections.size(), 0 };
+        u32 crc = crc32c((const u8*) &header.entry_point, sizeof(NVMSectionedHeader) - sizeof(u32) * 2);
+        header.crc32 = crc32c((const u8*) table.data(), table.size() * sizeof(NVMSectionHeader), crc);
+
+        RefPtr<Vector<u8>> buf(new Vector<u8>(cursor));
+        for (auto byte : Span<u8>((u8*) &header, sizeof(NVMSectionedHeader)))
+            buf->append(byte);
+        for (auto byte : Span<u8>((u8*) table.data(), table.size() * sizeof(NVMSectionHeader)))
+            buf->append(byte);
+        for (u64 i = 0; i < sections.size(); i++)
+        {
+            if (table[i].file_size == 0)
+                continue;
+            while (buf->size() < table[i].file_offset)
+                buf->append(0);
+            for (auto byte : sections[i].contents)
+                buf->append(byte);
+        }
         return buf;
     }
-}
\ No newline at end of file
+
+    /*
+     * Splits the payload of a flat image the assembler produced into sections with the flags what they hold needs. The
+     * .text, .rodata and .data directives (see Assembler::sections) say what the bytes after them are. Bytes before the
+     * first one are text where lines put an instruction, along with the alignment padding between two of them, and data
+     * anywhere else. Pages of zeroes are left out of every section, since untouched memory reads as zero anyway.
+     * Sections view into the payload.
+     */
+    inline Vector<NVMSection> split_flat_payload(u64 load_offset, const Span<u8>& payload, const Vector<ResolvedLine>& lines,
+                                                 const Vector<ResolvedSection>& marks)
+    {
+        auto offset_of = [&](u64 address) -> u64
+        {
+            if (address < load_offset)
+                return 0;
+            return address - load_offset < payload.size() ? address - load_offset : payload.size();
+        };
+        Vector<u8> types(payload.size());
+        for (u64 i = 0; i < payload.size(); i++)
+            types.append((u8) SectionType::Data);
+        u64 unmarked = marks.size() != 0 ? offset_of(marks[0].address) : payload.size();
+        u64 previous_end = ~0ul;
+        for (const auto& line : lines)
+        {
+            u64 at = offset_of(line.address);
+            if (at >= unmarked)
+                break;
+            u64 from = previous_end <= at && at - previous_end < 4 ? previous_end : at;
+            u64 to = at + line.size < unmarked ? at + line.size : unmarked;
+            __builtin_memset(types.data() + from, (u8) SectionType::Text, to - from);
+            previous_end = to;
+        }
+        for (u64 i = 0; i < marks.size(); i++)
+        {
+            u64 from = offset_of(marks[i].address);
+            u64 to = i + 1 < marks.size() ? offset_of(marks[i + 1].address) : payload.size();
+            __builtin_memset(types.data() + from, (u8) marks[i].type, to - from);
+        }
+
+        Vector<NVMSection> sections;
+        auto append_section = [&](u64 begin, u64 end)
+        {
+            if (begin >= end)
+                return;
+            auto type = (SectionType) types[begin];
+            u32 flags = type == SectionType::Text ? section_read | section_execute
+                        : type == SectionType::Rodata ? section_read : section_read | section_write;
+            sections.append({ type, flags, load_offset + begin, end - begin, 0, payload.slice(begin, end - begin),
+                crc32c(payload.slice(begin, end - begin)), true });
+        };
+        for (u64 run = 0; run < payload.size();)
+        {
+            u64 run_end = run + 1;
+            while (run_end < payload.size() && types[run_end] == types[run])
+                run_end++;
+            u64 begin = run;
+            //offsets of the guest pages the run covers whole
+            u64 page = ((load_offset + run + NVMMemory::page_mask) & ~NVMMemory::page_mask) - load_offset;
+            for (; page + NVMMemory::page_size <= run_end; page += NVMMemory::page_size)
+            {
+                bool zero = true;
+                for (u64 i = page; i < page + NVMMemory::page_size && zero; i++)
+                    zero = payload[i] == 0;
+                if (!zero)
+                    continue;
+                append_section(begin, page);
+                begin = page + NVMMemory::page_size;
+            }
+            append_section(begin, run_end);
+            run = run_end;
+        }
+        return sections;
+    }
+
+    inline bool write_nvm_sectioned_file(const char* path, u64 entry_point, const Vector<NVMSection>& sections)
+    {
+        auto image = make_nvm_sectioned_format(entry_point, sections);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        iovec parts[1] { { image->data(), image->size() } };
+        bool ok = writev_all(fd, parts, 1);
+        close(fd);
+        return ok;
+    }
+
+    /*
+     * An image file mapped read only. Parsing only reads the headers, and load_into hands the sections to
+     * NVMMemory::map_file: pages are mapped copy-on-write and only read from the file when the guest first touches
+     * them, as long as the section is page aligned with its load address. Otherwise map_file copies it once, straight
+     * from the file. Bss sections cost nothing at all.
+     * Section checksums are checked once, when the image is opened, so however many guests it is loaded into none of
+     * them reads it again.
+     */
+    class NVMImageFile
+    {
+    public:
+        static ResultOrError<RefPtr<NVMImageFile>, StringView> open(const char* path)
+        {
+            int fd = ::open(path, O_RDONLY);
+            if (fd < 0)
+                return "couldn't open image file"_sv;
+            struct stat st;
+            if (fstat(fd, &st) != 0 || (u64) st.st_size < sizeof(NVMBinaryHeader))
+            {
+                close(fd);
+                return "image file is too small to hold a header"_sv;
+            }
+            void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED)
+            {
+                close(fd);
+                return "couldn't map image file"_sv;
+            }
+            RefPtr<NVMImageFile> file(new NVMImageFile(fd, (u8*) mapping, st.st_size));
+            auto data_or_error = try_read(Span<u8>((u8*) mapping, st.st_size));
+            if (data_or_error.has_error())
+                return data_or_error.error();
+            file->m_data = data_or_error.result();
+            if (!verify_sections(file->m_data))
+                return "bad section checksum"_sv;
+            return file;
+        }
+
+        NVMImageFile(const NVMImageFile&) = delete;
+        NVMImageFile& operator=(const NVMImageFile&) = delete;
+
+        ~NVMImageFile()
+        {
+            if (m_mapping != nullptr)
+                munmap(m_mapping, m_size);
+            if (m_fd >= 0)
+                close(m_fd);
+        }
+
+        const NVMBinaryFormatData& data() const
+        {
+            return m_data;
+        }
+
+        //memory must not have been written yet, see load_sections. false if a section couldn't be mapped or protected
+        bool load_into(NVMMemory& memory) const
+        {
+            for (const auto& section : m_data.sections)
+            {
+                if (!memory.map_file(section.address, m_fd, section.file_offset, section.contents.size()))
+                    return false;
+            }
+            for (const auto& section : m_data.sections)
+            {
+                if (!protect_section(memory, section))
+                    return false;
+            }
+            return true;
+        }
+
+    private:
+        NVMImageFile(int fd, u8* mapping, u64 size) : m_fd(fd), m_mapping(mapping), m_size(size), m_data()
+        {
+        }
+
+        int m_fd { -1 };
+        u8* m_mapping { nullptr };
+        u64 m_size { 0 };
+        NVMBinaryFormatData m_data;
+    };
+}
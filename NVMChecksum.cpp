@@ -0,0 +1,208 @@
+#include "NVMChecksum.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+namespace nvm
+{
+    //reflected form of the Castagnoli polynomial 0x1EDC6F41
+    constexpr u32 crc32c_polynomial = 0x82F63B78;
+
+    struct SliceTables
+    {
+        u32 table[16][256];
+    };
+
+    constexpr SliceTables make_slice_tables()
+    {
+        SliceTables tables {};
+        for (u32 i = 0; i < 256; i++)
+        {
+            u32 crc = i;
+            for (u32 bit = 0; bit < 8; bit++)
+                crc = (crc >> 1) ^ (crc & 1 ? crc32c_polynomial : 0);
+            tables.table[0][i] = crc;
+        }
+        //table[n][i] is the crc of byte i followed by n zero bytes
+        for (u32 n = 1; n < 16; n++)
+        {
+            for (u32 i = 0; i < 256; i++)
+            {
+                u32 previous = tables.table[n - 1][i];
+                tables.table[n][i] = (previous >> 8) ^ tables.table[0][previous & 0xFF];
+            }
+        }
+        return tables;
+    }
+
+    constexpr SliceTables slice_tables = make_slice_tables();
+
+    //the helpers below work on the raw crc register, without the initial and final inversion
+    static u32 crc32c_slice_by_16(u32 crc, const u8* data, u64 size)
+    {
+        const auto& t = slice_tables.table;
+        while (size >= 16)
+        {
+            u32 low;
+            __builtin_memcpy(&low, data, sizeof(u32));
+            low ^= crc;
+            crc = t[15][low & 0xFF] ^ t[14][(low >> 8) & 0xFF] ^ t[13][(low >> 16) & 0xFF] ^ t[12][low >> 24]
+                ^ t[11][data[4]] ^ t[10][data[5]] ^ t[9][data[6]] ^ t[8][data[7]]
+                ^ t[7][data[8]] ^ t[6][data[9]] ^ t[5][data[10]] ^ t[4][data[11]]
+                ^ t[3][data[12]] ^ t[2][data[13]] ^ t[1][data[14]] ^ t[0][data[15]];
+            data += 16;
+            size -= 16;
+        }
+        while (size != 0)
+        {
+            crc = (crc >> 8) ^ t[0][(crc ^ *data) & 0xFF];
+            data++;
+            size--;
+        }
+        return crc;
+    }
+
+#if defined(__x86_64__)
+    //each of the three streams covers this many bytes per round
+    constexpr u64 stream_size = 8192;
+
+    /*
+     * Advancing the crc register over n zero bytes is linear over GF(2), so it is fully described by its effect on
+     * the 32 single bit registers. These tables apply that operator one register byte at a time.
+     */
+    struct ShiftTables
+    {
+        u32 table[4][256];
+    };
+
+    static u32 apply_operator(const u32* columns, u32 vector)
+    {
+        u32 result = 0;
+        for (u32 i = 0; vector != 0; i++, vector >>= 1)
+        {
+            if (vector & 1)
+                result ^= columns[i];
+        }
+        return result;
+    }
+
+    static ShiftTables make_shift_tables(u64 zero_bytes)
+    {
+        //operator for a single zero bit, then squared up to one zero byte and on to the requested length
+        u32 step[32];
+        step[0] = crc32c_polynomial;
+        for (u32 i = 1; i < 32; i++)
+            step[i] = 1u << (i - 1);
+
+        u32 result[32];
+        for (u32 i = 0; i < 32; i++)
+            result[i] = 1u << i;
+
+        u64 zero_bits = zero_bytes * 8;
+        while (zero_bits != 0)
+        {
+            u32 next[32];
+            if (zero_bits & 1)
+            {
+                for (u32 i = 0; i < 32; i++)
+                    next[i] = apply_operator(step, result[i]);
+                for (u32 i = 0; i < 32; i++)
+                    result[i] = next[i];
+            }
+            for (u32 i = 0; i < 32; i++)
+                next[i] = apply_operator(step, step[i]);
+            for (u32 i = 0; i < 32; i++)
+                step[i] = next[i];
+            zero_bits >>= 1;
+        }
+
+        ShiftTables tables;
+        for (u32 byte = 0; byte < 4; byte++)
+        {
+            for (u32 value = 0; value < 256; value++)
+                tables.table[byte][value] = apply_operator(result + byte * 8, value);
+        }
+        return tables;
+    }
+
+    static u32 shift(const ShiftTables& tables, u32 crc)
+    {
+        return tables.table[0][crc & 0xFF] ^ tables.table[1][(crc >> 8) & 0xFF] ^ tables.table[2][(crc >> 16) & 0xFF]
+            ^ tables.table[3][crc >> 24];
+    }
+
+    __attribute__((target("sse4.2"))) static u32 crc32c_sse42_serial(u32 crc, const u8* data, u64 size)
+    {
+        u64 crc64 = crc;
+        while (size >= 8)
+        {
+            u64 word;
+            __builtin_memcpy(&word, data, sizeof(u64));
+            crc64 = _mm_crc32_u64(crc64, word);
+            data += 8;
+            size -= 8;
+        }
+        crc = (u32) crc64;
+        while (size != 0)
+        {
+            crc = _mm_crc32_u8(crc, *data);
+            data++;
+            size--;
+        }
+        return crc;
+    }
+
+    /*
+     * The crc32 instruction has a latency of three cycles but can issue every cycle, so a single dependency chain
+     * wastes two thirds of it. Three streams run over adjacent blocks and are merged by shifting the earlier ones
+     * past the bytes that follow them.
+     */
+    __attribute__((target("sse4.2"))) static u32 crc32c_sse42(u32 crc, const u8* data, u64 size)
+    {
+        static const ShiftTables one_stream = make_shift_tables(stream_size);
+        static const ShiftTables two_streams = make_shift_tables(stream_size * 2);
+
+        while (size >= stream_size * 3)
+        {
+            u64 a = crc;
+            u64 b = 0;
+            u64 c = 0;
+            const u8* end = data + stream_size;
+            while (data != end)
+            {
+                u64 word_a;
+                u64 word_b;
+                u64 word_c;
+                __builtin_memcpy(&word_a, data, sizeof(u64));
+                __builtin_memcpy(&word_b, data + stream_size, sizeof(u64));
+                __builtin_memcpy(&word_c, data + stream_size * 2, sizeof(u64));
+                a = _mm_crc32_u64(a, word_a);
+                b = _mm_crc32_u64(b, word_b);
+                c = _mm_crc32_u64(c, word_c);
+                data += 8;
+            }
+            crc = shift(two_streams, (u32) a) ^ shift(one_stream, (u32) b) ^ (u32) c;
+            data += stream_size * 2;
+            size -= stream_size * 3;
+        }
+        return crc32c_sse42_serial(crc, data, size);
+    }
+#endif
+
+    using CrcImplementation = u32 (*)(u32, const u8*, u64);
+
+    static CrcImplementation select_implementation()
+    {
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2"))
+            return crc32c_sse42;
+#endif
+        return crc32c_slice_by_16;
+    }
+
+    u32 crc32c(const u8* data, u64 size, u32 crc)
+    {
+        static const CrcImplementation implementation = select_implementation();
+        return ~implementation(~crc, data, size);
+    }
+}
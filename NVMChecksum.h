@@ -0,0 +1,19 @@
+#pragma once
+#include <Types.h>
+#include <Span.h>
+
+namespace nvm
+{
+    /*
+     * CRC-32C (Castagnoli), the variant the SSE4.2 crc32 instruction computes. Hosts with SSE4.2 run three
+     * interleaved instruction streams, which keeps up with memory bandwidth; everything else falls back to
+     * slice-by-16 tables. The implementation is picked once, at the first call.
+     * crc is the checksum of the data that precedes this buffer, so large inputs can be checksummed in pieces.
+     */
+    u32 crc32c(const u8* data, u64 size, u32 crc = 0);
+
+    inline u32 crc32c(const Span<u8>& data, u32 crc = 0)
+    {
+        return crc32c(data.data(), data.size(), crc);
+    }
+}
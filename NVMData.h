@@ -34,7 +34,19 @@ namespace nvm
         i16,
         i32,
         i64,
-        string
+        string,
+        //.text, .rodata and .data take no value; the SectionType of what follows them is kept as one
+        section
+    };
+    
+    //what a section of an image holds (see NVMBinaryFormat), and what .text, .rodata and .data say the bytes after them are
+    enum class SectionType : u32
+    {
+        Text,
+        Rodata,
+        Data,
+        //zero filled, takes no bytes in the file
+        Bss
     };
     
     enum class Instruction
@@ -81,18 +93,38 @@ namespace nvm
     struct Error
     {
         LinePos where;
-        String* what;
+        String what;
     };
     
+    //a tag of an assembled program and the address it ended up at (see Assembler::tags)
     struct ResolvedTag
     {
         u64 address;
+        String name;
+    };
+    
+    //an instruction of an assembled program and the source position it came from (see Assembler::lines)
+    struct ResolvedLine
+    {
+        u64 address;
+        //4 or 8, once jumps were widened
+        u32 size;
+        LinePos position;
+    };
+    
+    //where a .text, .rodata or .data directive of an assembled program ended up; it covers everything up to the next
+    //one (see Assembler::sections)
+    struct ResolvedSection
+    {
+        u64 address;
+        SectionType type;
     };
     
     struct DirectiveData
     {
         Directive directive;
-        Variant<String, u64> value;
+        //.string contents point into the assembler's source buffer, like token data
+        Variant<StringView, u64> value;
     };
     
     struct InstructionData
@@ -100,21 +132,25 @@ namespace nvm
         Instruction instruction;
         Register op1;
         Register op2;
-        Pair<int, Variant<Register, String, u64>> op3;
+        Pair<int, Variant<Register, StringView, u64>> op3;
         u64 misc;
     };
     
+    //the payload lives inline, so parsing allocates nothing per object
     struct Object
     {
         ObjectType type;
-        void* data;
+        Variant<InstructionData, DirectiveData, StringView> data;
+        //start of the statement, for errors found after parsing
+        LinePos position {};
     };
     
     struct Token
     {
         LinePos position_in_source;
         TokenType type;
-        String* data;
+        //points into the assembler's source buffer, so it is only valid as long as the assembler is
+        StringView data;
     };
     
     struct InstructionParser
@@ -134,13 +170,13 @@ namespace nvm
         ResultOrError<Object, Error>(*parse)(Vector<const Token>::BidIt&, const Vector<const Token>::BidIt&, bool& more);
     };
     
-    constexpr Array<Pair<StringView, Instruction>, 15> instruction_literals { { { "add", Instruction::Add }, { "sub", Instruction::Add }, { "mul", Instruction::Mul }, { "div", Instruction::Div }, { "neg", Instruction::Neg }, { "not", Instruction::Not }, { "shl", Instruction::Shl }, { "shr", Instruction::Shr }, { "sra", Instruction::Sra }, { "and", Instruction::And }, { "or", Instruction::Or }, { "xor", Instruction::Xor }, { "load", Instruction::Load }, {"store", Instruction::Store }, {"jmp", Instruction::Jmp } } };
+    constexpr Array<Pair<StringView, Instruction>, 16> instruction_literals { { { "add", Instruction::Add }, { "sub", Instruction::Sub }, { "mul", Instruction::Mul }, { "div", Instruction::Div }, { "neg", Instruction::Neg }, { "not", Instruction::Not }, { "shl", Instruction::Shl }, { "shr", Instruction::Shr }, { "sra", Instruction::Sra }, { "and", Instruction::And }, { "or", Instruction::Or }, { "xor", Instruction::Xor }, { "load", Instruction::Load }, {"store", Instruction::Store }, {"int", Instruction::Int }, {"jmp", Instruction::Jmp } } };
     
-    constexpr Array<Pair<StringView, Directive>, 6> assembler_directives { { { ".addr", Directive::addr }, { ".i8", Directive::i8 }, { ".i16", Directive::i16 }, { ".i32", Directive::i32 }, { ".i64", Directive::i64 }, { ".string", Directive::string } } };
+    constexpr Array<Pair<StringView, Directive>, 9> assembler_directives { { { ".addr", Directive::addr }, { ".i8", Directive::i8 }, { ".i16", Directive::i16 }, { ".i32", Directive::i32 }, { ".i64", Directive::i64 }, { ".string", Directive::string }, { ".text", Directive::section }, { ".rodata", Directive::section }, { ".data", Directive::section } } };
     
     constexpr Array<Pair<StringView, Register>, 11> register_literals { { { "r0", Register::r0 }, { "r1", Register::r1 }, { "r2", Register::r2 }, { "r3", Register::r3 }, { "r4", Register::r4 }, { "r5", Register::r5 }, { "r6", Register::r6 }, { "r7", Register::r7 }, { "r8", Register::r8 }, { "sp", Register::sp }, { "ip", Register::ip } } };
     
-    constexpr Array<StringView, 7> other_keyword_literals { { "to", "in", "if", "==", "!=", ">", "<" } };
+    constexpr Array<StringView, 8> other_keyword_literals { { "to", "in", "if", "unsigned", "==", "!=", ">", "<" } };
     
     constexpr u8 get_instruction_opcode(Instruction i)
     {
@@ -152,6 +188,22 @@ namespace nvm
         return (u8)r;
     }
     
+    //load/store keep their access width in the otherwise unused second register field, as log2 of the byte count
+    constexpr u8 get_width_id(u64 bits)
+    {
+        switch (bits)
+        {
+            case 8:
+                return 0;
+            case 16:
+                return 1;
+            case 32:
+                return 2;
+            default:
+                return 3;
+        }
+    }
+    
     constexpr bool is_logicarithmetic(Instruction i)
     {
         switch (i)
@@ -0,0 +1,149 @@
+#include "NVMDebugTable.h"
+#include "NVMChecksum.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace nvm
+{
+    NVMDebugTable::NVMDebugTable() : m_lines(), m_tags(), m_names()
+    {
+    }
+
+    NVMDebugTable::NVMDebugTable(const Vector<ResolvedTag>& tags, const Vector<ResolvedLine>& lines) :
+            m_lines(lines.size()), m_tags(tags.size()), m_names()
+    {
+        for (const auto& line : lines)
+            m_lines.append({ line.address, line.size, (u32) line.position.line, (u32) line.position.pos, 0 });
+        for (const auto& tag : tags)
+        {
+            const char* name = tag.name.null_terminated_characters();
+            u32 size = (u32) __builtin_strlen(name);
+            m_tags.append({ tag.address, (u32) m_names.size(), size });
+            for (u32 i = 0; i <= size; i++)
+                m_names.append(name[i]);
+        }
+    }
+
+    ResultOrError<NVMDebugTable, StringView> NVMDebugTable::load(const char* path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return "couldn't open debug table"_sv;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (u64) st.st_size < sizeof(NVMDebugTableHeader))
+        {
+            close(fd);
+            return "debug table is too small to hold a header"_sv;
+        }
+        u64 size = st.st_size;
+        auto contents = (u8*) malloc(size);
+        bool read_all = pread(fd, contents, size, 0) == (ssize_t) size;
+        close(fd);
+
+        NVMDebugTableHeader header;
+        __builtin_memcpy(&header, contents, sizeof(NVMDebugTableHeader));
+        u64 available = size - sizeof(NVMDebugTableHeader);
+        StringView problem = ""_sv;
+        if (!read_all)
+            problem = "couldn't read debug table"_sv;
+        else if (header.magic != nvm_debug_table_magic)
+            problem = "bad magic"_sv;
+        else if (header.line_count > available / sizeof(DebugLine)
+                 || header.tag_count > (available - header.line_count * sizeof(DebugLine)) / sizeof(DebugTag)
+                 || header.names_size != available - header.line_count * sizeof(DebugLine) - header.tag_count * sizeof(DebugTag))
+            problem = "tables don't fit in the debug table"_sv;
+        else if (crc32c(contents + sizeof(u32) * 2, size - sizeof(u32) * 2) != header.crc32)
+            problem = "bad checksum"_sv;
+        if (problem.byte_size() != 0)
+        {
+            free(contents);
+            return problem;
+        }
+
+        NVMDebugTable table;
+        auto lines = contents + sizeof(NVMDebugTableHeader);
+        auto tags = lines + header.line_count * sizeof(DebugLine);
+        auto names = (const char*) (tags + header.tag_count * sizeof(DebugTag));
+        for (u64 i = 0; i < header.line_count; i++)
+        {
+            DebugLine line;
+            __builtin_memcpy(&line, lines + i * sizeof(DebugLine), sizeof(DebugLine));
+            table.m_lines.append(line);
+        }
+        for (u64 i = 0; i < header.tag_count; i++)
+        {
+            DebugTag tag;
+            __builtin_memcpy(&tag, tags + i * sizeof(DebugTag), sizeof(DebugTag));
+            //names have to end in the 0 tag_name relies on
+            if ((u64) tag.name_offset + tag.name_size >= header.names_size || names[tag.name_offset + tag.name_size] != 0)
+            {
+                free(contents);
+                return "tag name doesn't fit in the debug table"_sv;
+            }
+            table.m_tags.append(tag);
+        }
+        for (u64 i = 0; i < header.names_size; i++)
+            table.m_names.append(names[i]);
+        free(contents);
+        return table;
+    }
+
+    bool NVMDebugTable::save(const char* path) const
+    {
+        NVMDebugTableHeader header { nvm_debug_table_magic, 0, m_lines.size(), m_tags.size(), m_names.size() };
+        u32 crc = crc32c((const u8*) &header.line_count, sizeof(NVMDebugTableHeader) - sizeof(u32) * 2);
+        crc = crc32c((const u8*) m_lines.data(), m_lines.size() * sizeof(DebugLine), crc);
+        crc = crc32c((const u8*) m_tags.data(), m_tags.size() * sizeof(DebugTag), crc);
+        header.crc32 = crc32c((const u8*) m_names.data(), m_names.size(), crc);
+
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        iovec parts[4] {
+            { &header, sizeof(NVMDebugTableHeader) },
+            { (void*) m_lines.data(), m_lines.size() * sizeof(DebugLine) },
+            { (void*) m_tags.data(), m_tags.size() * sizeof(DebugTag) },
+            { (void*) m_names.data(), m_names.size() }
+        };
+        ssize_t expected = sizeof(NVMDebugTableHeader) + m_lines.size() * sizeof(DebugLine) + m_tags.size() * sizeof(DebugTag)
+                           + m_names.size();
+        bool ok = writev(fd, parts, 4) == expected;
+        close(fd);
+        return ok;
+    }
+
+    const DebugLine* NVMDebugTable::line_at(u64 address) const
+    {
+        u64 low = 0;
+        u64 high = m_lines.size();
+        while (low < high)
+        {
+            u64 middle = (low + high) / 2;
+            if (m_lines[middle].address <= address)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if (low == 0 || address - m_lines[low - 1].address >= m_lines[low - 1].size)
+            return nullptr;
+        return &m_lines[low - 1];
+    }
+
+    u64 NVMDebugTable::tag_at(u64 address) const
+    {
+        u64 low = 0;
+        u64 high = m_tags.size();
+        while (low < high)
+        {
+            u64 middle = (low + high) / 2;
+            if (m_tags[middle].address <= address)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low != 0 ? low - 1 : m_tags.size();
+    }
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <Types.h>
+#include <Vector.h>
+#include <ResultOrError.h>
+#include <StringView.h>
+#include "NVMData.h"
+
+namespace nvm
+{
+    constexpr u32 nvm_debug_table_magic = 0x63026305;
+
+    struct NVMDebugTableHeader
+    {
+        u32 magic;
+        //covers everything after this field
+        u32 crc32;
+        u64 line_count;
+        u64 tag_count;
+        u64 names_size;
+    };
+    static_assert(sizeof(NVMDebugTableHeader) == 32, "the header layout is part of the debug table format");
+
+    //the instruction at [address, address + size) came from line:pos of the source
+    struct DebugLine
+    {
+        u64 address;
+        u32 size;
+        u32 line;
+        u32 pos;
+        u32 reserved;
+    };
+    static_assert(sizeof(DebugLine) == 24, "the line table layout is part of the debug table format");
+
+    struct DebugTag
+    {
+        u64 address;
+        //into the names, which hold every name followed by a 0
+        u32 name_offset;
+        u32 name_size;
+    };
+    static_assert(sizeof(DebugTag) == 16, "the tag table layout is part of the debug table format");
+
+    /*
+     * Maps guest addresses back to the program source: the line and column every instruction came from, and the tag
+     * every address follows. It is built from what the assembler resolved (see Assembler::tags and Assembler::lines)
+     * and kept in a file of its own next to the image, so images stay as they are and nothing reads it unless asked
+     * to name an address. Both tables are sorted by address, so a lookup is a binary search.
+     * The file is the header, the line table, the tag table and the names.
+     */
+    class NVMDebugTable
+    {
+    public:
+        NVMDebugTable();
+        //tags and lines have to be sorted by address, as the assembler leaves them
+        NVMDebugTable(const Vector<ResolvedTag>& tags, const Vector<ResolvedLine>& lines);
+
+        static ResultOrError<NVMDebugTable, StringView> load(const char* path);
+        bool save(const char* path) const;
+
+        //the instruction covering address, or null if it isn't part of one
+        const DebugLine* line_at(u64 address) const;
+        //the last tag at or below address, or tag_count() if there is none
+        u64 tag_at(u64 address) const;
+
+        const char* tag_name(u64 tag) const
+        {
+            return m_names.data() + m_tags[tag].name_offset;
+        }
+
+        u64 tag_address(u64 tag) const
+        {
+            return m_tags[tag].address;
+        }
+
+        u64 tag_count() const
+        {
+            return m_tags.size();
+        }
+
+        u64 line_count() const
+        {
+            return m_lines.size();
+        }
+
+    private:
+        Vector<DebugLine> m_lines;
+        Vector<DebugTag> m_tags;
+        Vector<char> m_names;
+    };
+}
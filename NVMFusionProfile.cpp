@@ -0,0 +1,235 @@
+#include "NVMFusionProfile.h"
+#include <File.h>
+#include <StringBuilder.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace nvm
+{
+#define MICRO_OP_NAME(name) #name,
+    static constexpr const char* micro_op_names[] { ENUMERATE_MICRO_OPS(MICRO_OP_NAME) };
+#undef MICRO_OP_NAME
+
+    static_assert(sizeof(micro_op_names) / sizeof(micro_op_names[0]) == NVMFusionProfile::kinds);
+
+    //control transfers that never fall through to the next slot, and markers that aren't guest instructions
+    static bool can_be_fused(u64 kind)
+    {
+        auto micro_op = (MicroOpKind)kind;
+        return micro_op != MicroOpKind::Decode && micro_op != MicroOpKind::LeaveChunk &&
+               micro_op != MicroOpKind::EnterNative && micro_op != MicroOpKind::InvalidInstruction &&
+               micro_op != MicroOpKind::JmpR && micro_op != MicroOpKind::JmpI;
+    }
+
+    NVMFusionProfile::NVMFusionProfile()
+    {
+        for (u64 i = 0; i < kinds * kinds; i++)
+            m_pairs.append(0);
+        for (u64 i = 0; i < kinds * kinds * kinds; i++)
+            m_triples.append(0);
+    }
+
+    //skips to the next whitespace separated word and returns its kind, or kinds if it doesn't name one
+    static u64 parse_kind(const char*& cursor)
+    {
+        while (*cursor == ' ')
+            cursor++;
+        const char* end = cursor;
+        while (*end != ' ' && *end != '\n' && *end != 0)
+            end++;
+        u64 length = end - cursor;
+        for (u64 kind = 0; kind < NVMFusionProfile::kinds; kind++)
+        {
+            if (strlen(micro_op_names[kind]) == length && memcmp(micro_op_names[kind], cursor, length) == 0)
+            {
+                cursor = end;
+                return kind;
+            }
+        }
+        cursor = end;
+        return NVMFusionProfile::kinds;
+    }
+
+    /*
+     * one count per line:
+     *   dispatches <count>
+     *   pair <micro-op> <micro-op> <count>
+     *   triple <micro-op> <micro-op> <micro-op> <count>
+     * micro-ops are named as in ENUMERATE_MICRO_OPS. lines naming micro-ops this build doesn't have are skipped, so
+     * profiles outlive changes to the micro-op set
+     */
+    bool NVMFusionProfile::merge_from(const char* path)
+    {
+        StringView path_view(path, strlen(path));
+        if (!File::exists(path_view))
+            return true;
+        auto file_or_error = File::read_all(path_view);
+        if (file_or_error.has_error())
+            return false;
+        auto& text = file_or_error.result();
+        text.append(0);
+
+        const char* cursor = (const char*)text.data();
+        while (*cursor != 0)
+        {
+            if (strncmp(cursor, "dispatches ", 11) == 0)
+            {
+                m_dispatches += strtoull(cursor + 11, nullptr, 10);
+            }
+            else if (strncmp(cursor, "pair ", 5) == 0)
+            {
+                cursor += 5;
+                u64 first = parse_kind(cursor);
+                u64 second = parse_kind(cursor);
+                u64 count = strtoull(cursor, nullptr, 10);
+                if (first < kinds && second < kinds)
+                    m_pairs[first * kinds + second] += count;
+            }
+            else if (strncmp(cursor, "triple ", 7) == 0)
+            {
+                cursor += 7;
+                u64 first = parse_kind(cursor);
+                u64 second = parse_kind(cursor);
+                u64 third = parse_kind(cursor);
+                u64 count = strtoull(cursor, nullptr, 10);
+                if (first < kinds && second < kinds && third < kinds)
+                    m_triples[(first * kinds + second) * kinds + third] += count;
+            }
+            else
+            {
+                return false;
+            }
+            while (*cursor != '\n' && *cursor != 0)
+                cursor++;
+            if (*cursor == '\n')
+                cursor++;
+        }
+        return true;
+    }
+
+    //written next to path and renamed over it, so an interrupted run never leaves half a profile behind
+    static bool write_atomically(const char* path, const Vector<u8>& contents)
+    {
+        String temporary = StringBuilder().append(StringView(path, strlen(path))).append(".tmp").to_string();
+        int fd = open(temporary.null_terminated_characters(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size();
+        close(fd);
+        if (ok)
+            ok = rename(temporary.null_terminated_characters(), path) == 0;
+        else
+            unlink(temporary.null_terminated_characters());
+        return ok;
+    }
+
+    static void append_line(Vector<u8>& contents, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    static void append_line(Vector<u8>& contents, const char* format, ...)
+    {
+        char line[256];
+        va_list arguments;
+        va_start(arguments, format);
+        int length = vsnprintf(line, sizeof(line), format, arguments);
+        va_end(arguments);
+        for (int i = 0; i < length && i < (int)sizeof(line) - 1; i++)
+            contents.append(line[i]);
+    }
+
+    bool NVMFusionProfile::save(const char* path) const
+    {
+        Vector<u8> contents;
+        append_line(contents, "dispatches %lu\n", m_dispatches);
+        for (u64 first = 0; first < kinds; first++)
+        {
+            for (u64 second = 0; second < kinds; second++)
+            {
+                u64 count = m_pairs[first * kinds + second];
+                if (count != 0)
+                    append_line(contents, "pair %s %s %lu\n", micro_op_names[first], micro_op_names[second], count);
+                for (u64 third = 0; third < kinds; third++)
+                {
+                    count = m_triples[(first * kinds + second) * kinds + third];
+                    if (count != 0)
+                        append_line(contents, "triple %s %s %s %lu\n", micro_op_names[first], micro_op_names[second],
+                                    micro_op_names[third], count);
+                }
+            }
+        }
+        return write_atomically(path, contents);
+    }
+
+    /*
+     * a superinstruction of n micro-ops saves n - 1 dispatches every time it runs, which is what candidates are ranked
+     * by. triples whose pairs also make the table are still worth having: the triple is picked over the pair wherever
+     * both match, and the pair covers the places where the third micro-op differs
+     */
+    bool NVMFusionProfile::write_fusion_table(const char* path) const
+    {
+        struct Candidate
+        {
+            u64 ops[3];
+            u64 length;
+            u64 saved;
+        };
+        //kept sorted by the dispatches they save, most first
+        Candidate candidates[max_superinstructions];
+        u64 count = 0;
+        auto consider = [&](const Candidate& candidate)
+        {
+            if (candidate.saved == 0 || candidate.saved * 100 < m_dispatches * min_share)
+                return;
+            u64 position = count;
+            while (position > 0 && candidates[position - 1].saved < candidate.saved)
+                position--;
+            if (position >= max_superinstructions)
+                return;
+            if (count < max_superinstructions)
+                count++;
+            for (u64 i = count - 1; i > position; i--)
+                candidates[i] = candidates[i - 1];
+            candidates[position] = candidate;
+        };
+        for (u64 first = 0; first < kinds; first++)
+        {
+            if (!can_be_fused(first))
+                continue;
+            for (u64 second = 0; second < kinds; second++)
+            {
+                if (!can_be_fused(second))
+                    continue;
+                consider({ { first, second, 0 }, 2, m_pairs[first * kinds + second] });
+                for (u64 third = 0; third < kinds; third++)
+                {
+                    if (can_be_fused(third))
+                        consider({ { first, second, third }, 3, m_triples[(first * kinds + second) * kinds + third] * 2 });
+                }
+            }
+        }
+
+        Vector<u8> contents;
+        append_line(contents, "#pragma once\n");
+        append_line(contents, "//generated by nvm --profile, see NVMFusionProfile; regenerate it instead of editing it\n");
+        append_line(contents, "//the profile and its workloads are in sample_assembly/profile. from the top of the tree, regenerate it with\n");
+        append_line(contents, "//  rm -f sample_assembly/profile/fusion.profile; for workload in sample_assembly/profile/*.asm; do\n");
+        append_line(contents, "//  nvm $workload --profile sample_assembly/profile/fusion.profile NVMSuperinstructions.h; done\n");
+        append_line(contents, "//from a profile of %lu dispatches\n", m_dispatches);
+        append_line(contents, "#define ENUMERATE_SUPERINSTRUCTIONS(PAIR, TRIPLE)");
+        for (u64 i = 0; i < count; i++)
+        {
+            const auto& candidate = candidates[i];
+            if (candidate.length == 2)
+                append_line(contents, " \\\n    PAIR(%s, %s)", micro_op_names[candidate.ops[0]],
+                            micro_op_names[candidate.ops[1]]);
+            else
+                append_line(contents, " \\\n    TRIPLE(%s, %s, %s)", micro_op_names[candidate.ops[0]],
+                            micro_op_names[candidate.ops[1]], micro_op_names[candidate.ops[2]]);
+        }
+        append_line(contents, "\n");
+        return write_atomically(path, contents);
+    }
+}
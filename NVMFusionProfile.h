@@ -0,0 +1,49 @@
+#pragma once
+#include <Types.h>
+#include <Vector.h>
+#include "NVMInstructionCache.h"
+
+namespace nvm
+{
+    /*
+     * Counts of the micro-op pairs and triples the interpreter runs back to back, gathered by
+     * NVMVirtualMachine::run_profiled. Profiles are kept in a text file that every profiled run adds its counts to,
+     * and the superinstruction table (NVMSuperinstructions.h) is generated from it: the sequences that save the most
+     * dispatches get fused, as long as each saves at least min_share of them.
+     * The table in the tree comes from sample_assembly/profile/fusion.profile, a profile of the workloads next to it.
+     */
+    class NVMFusionProfile
+    {
+    public:
+        static constexpr u64 kinds = base_micro_op_count;
+        static constexpr u32 max_superinstructions = 32;
+        //in hundredths of the profiled dispatches
+        static constexpr u64 min_share = 1;
+
+        NVMFusionProfile();
+
+        //previous is MicroOpKind::Count when current wasn't reached by falling through from another micro-op
+        void record(MicroOpKind previous, MicroOpKind current, MicroOpKind next)
+        {
+            m_dispatches++;
+            m_pairs[(u64)current * kinds + (u64)next]++;
+            if (previous != MicroOpKind::Count)
+                m_triples[((u64)previous * kinds + (u64)current) * kinds + (u64)next]++;
+        }
+
+        u64 dispatches() const
+        {
+            return m_dispatches;
+        }
+
+        //adds the counts in the file at path, if there is one
+        bool merge_from(const char* path);
+        bool save(const char* path) const;
+        bool write_fusion_table(const char* path) const;
+
+    private:
+        Vector<u64> m_pairs;
+        Vector<u64> m_triples;
+        u64 m_dispatches { 0 };
+    };
+}
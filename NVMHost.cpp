@@ -0,0 +1,311 @@
+#include "NVMHost.h"
+#include "NVMBinaryFormat.h"
+#include "NVMSharedCode.h"
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace nvm
+{
+    /*
+     * A worker's guests, as a Chase-Lev work-stealing deque of guest numbers (Le, Pop, Cohen, Zappa Nardelli, "Correct
+     * and Efficient Work-Stealing for Weak Memory Models"). Only the owner pushes, at the bottom; guests are taken from
+     * the top with a compare and swap, by thieves and by the owner alike, so that the owner's guests take turns
+     * instead of the last one put back running again. Nothing takes a lock.
+     * The array grows by doubling. A thief may still be reading the old one, so old arrays are only freed along with
+     * the queue. Queues sit on cache lines of their own.
+     */
+    class alignas(64) NVMHost::RunQueue
+    {
+    public:
+        RunQueue()
+        {
+            m_array = new_array(64);
+            m_retired.append(m_array);
+        }
+
+        ~RunQueue()
+        {
+            for (auto array : m_retired)
+                free(array);
+        }
+
+        //owner only. returns how many guests the queue holds, counting the new one
+        u64 push(u32 guest)
+        {
+            u64 bottom = __atomic_load_n(&m_bottom, __ATOMIC_RELAXED);
+            u64 top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+            Array* array = __atomic_load_n(&m_array, __ATOMIC_RELAXED);
+            if (bottom - top > array->mask)
+                array = grow(array, top, bottom);
+            __atomic_store_n(&array->guests[bottom & array->mask], guest, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            __atomic_store_n(&m_bottom, bottom + 1, __ATOMIC_RELAXED);
+            return bottom + 1 - top;
+        }
+
+        //any thread. only gives up when the queue is empty, not when another taker got there first
+        bool take(u32& guest)
+        {
+            while (true)
+            {
+                u64 top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                u64 bottom = __atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE);
+                if ((i64)(bottom - top) <= 0)
+                    return false;
+                Array* array = __atomic_load_n(&m_array, __ATOMIC_ACQUIRE);
+                u32 taken = __atomic_load_n(&array->guests[top & array->mask], __ATOMIC_RELAXED);
+                if (__atomic_compare_exchange_n(&m_top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                {
+                    guest = taken;
+                    return true;
+                }
+            }
+        }
+
+        bool empty() const
+        {
+            u64 top = __atomic_load_n(&m_top, __ATOMIC_ACQUIRE);
+            return (i64)(__atomic_load_n(&m_bottom, __ATOMIC_ACQUIRE) - top) <= 0;
+        }
+
+    private:
+        struct Array
+        {
+            u64 mask;
+            //right after the header, in the same allocation
+            u32* guests;
+        };
+
+        static Array* new_array(u64 capacity)
+        {
+            auto array = (Array*) malloc(sizeof(Array) + capacity * sizeof(u32));
+            array->mask = capacity - 1;
+            array->guests = (u32*)(array + 1);
+            return array;
+        }
+
+        //indices keep counting up across arrays, so the guests keep theirs and only move to the new slots for them
+        Array* grow(Array* array, u64 top, u64 bottom)
+        {
+            Array* grown = new_array((array->mask + 1) * 2);
+            for (u64 i = top; i != bottom; i++)
+                grown->guests[i & grown->mask] = array->guests[i & array->mask];
+            m_retired.append(grown);
+            __atomic_store_n(&m_array, grown, __ATOMIC_RELEASE);
+            return grown;
+        }
+
+        u64 m_top { 0 };
+        u64 m_bottom { 0 };
+        Array* m_array { nullptr };
+        //every array the queue had, the current one included
+        Vector<Array*> m_retired;
+    };
+
+    static void futex_wait(u32* word, u32 expected)
+    {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+    }
+
+    static void futex_wake(u32* word, u32 count)
+    {
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+    }
+
+    NVMHost::NVMHost(u32 workers, u32 capacity, u64 slice, u64 guest_memory) :
+            m_workers(workers != 0 ? workers : 1), m_capacity(capacity), m_slice(slice),
+            m_guest_memory((guest_memory + NVMMemory::page_mask) & ~NVMMemory::page_mask)
+    {
+        if (m_guest_memory != 0 && m_capacity != 0)
+        {
+            //only reserves address space, like NVMMemory does for a flat region of its own
+            void* arena = mmap(nullptr, m_guest_memory * m_capacity, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (arena != MAP_FAILED)
+                m_arena = (u8*) arena;
+        }
+        m_vms = (NVMVirtualMachine**) calloc(m_capacity, sizeof(NVMVirtualMachine*));
+        m_results = (GuestResult*) calloc(m_capacity, sizeof(GuestResult));
+        m_queues = new RunQueue[m_workers];
+    }
+
+    NVMHost::~NVMHost()
+    {
+        for (u32 i = 0; i < m_guests; i++)
+            delete m_vms[i];
+        for (const auto& shared : m_shared_code)
+            delete shared.code;
+        free(m_vms);
+        free(m_results);
+        delete[] m_queues;
+        if (m_arena != nullptr)
+            munmap(m_arena, m_guest_memory * m_capacity);
+    }
+
+    bool NVMHost::spawn(const NVMBinaryFormatData& image)
+    {
+        if (m_guests == m_capacity || (m_arena == nullptr && m_guest_memory != 0))
+            return false;
+        u32 guest = m_guests;
+        auto vm = new NVMVirtualMachine(image.entry_point, m_arena + guest * m_guest_memory, m_guest_memory);
+        if (!load_sections(vm->memory(), image))
+        {
+            delete vm;
+            return false;
+        }
+        vm->share_code(shared_code(&image));
+        m_guests++;
+        m_vms[guest] = vm;
+        m_unfinished++;
+        m_queues[guest % m_workers].push(guest);
+        return true;
+    }
+
+    bool NVMHost::spawn(NVMVirtualMachine& origin)
+    {
+        if (m_guests == m_capacity || !origin.paused())
+            return false;
+        auto vm = origin.fork();
+        if (vm == nullptr)
+            return false;
+        vm->share_code(shared_code(&origin));
+        u32 guest = m_guests++;
+        m_vms[guest] = vm;
+        m_unfinished++;
+        m_queues[guest % m_workers].push(guest);
+        return true;
+    }
+
+    //guests are told apart by what they were spawned from; there are hardly ever more than a couple of those
+    NVMSharedCode& NVMHost::shared_code(const void* origin)
+    {
+        for (const auto& shared : m_shared_code)
+        {
+            if (shared.origin == origin)
+                return *shared.code;
+        }
+        m_shared_code.append({ origin, new NVMSharedCode() });
+        return *m_shared_code[m_shared_code.size() - 1].code;
+    }
+
+    void NVMHost::run()
+    {
+        struct Worker
+        {
+            NVMHost* host;
+            u32 index;
+        };
+        Vector<Worker> workers;
+        for (u32 i = 0; i < m_workers; i++)
+            workers.append({ this, i });
+        Vector<pthread_t> threads;
+        for (u32 i = 1; i < m_workers; i++)
+        {
+            //a worker that couldn't be started leaves its queue to the others, which steal everything in it, so the
+            //guests still all run, on fewer threads
+            pthread_t thread;
+            if (pthread_create(&thread, nullptr, [](void* worker) -> void*
+            {
+                ((Worker*) worker)->host->work(((Worker*) worker)->index);
+                return nullptr;
+            }, &workers[i]) == 0)
+                threads.append(thread);
+        }
+        work(0);
+        for (auto thread : threads)
+            pthread_join(thread, nullptr);
+        for (const auto& shared : m_shared_code)
+            m_statistics.shared_pages += shared.code->pages();
+    }
+
+    void NVMHost::work(u32 worker)
+    {
+        HostStatistics statistics {};
+        auto& queue = m_queues[worker];
+        while (__atomic_load_n(&m_unfinished, __ATOMIC_ACQUIRE) != 0)
+        {
+            u32 guest;
+            if (!queue.take(guest))
+            {
+                //the last guests are still running elsewhere, and may yet be put back where they can be stolen
+                if (!steal(worker, guest))
+                {
+                    park();
+                    continue;
+                }
+                statistics.steals++;
+            }
+
+            auto vm = m_vms[guest];
+            ExitCode exit_code = vm->run_slice(m_slice);
+            statistics.slices++;
+            if (!vm->paused())
+                finish(guest, exit_code);
+            else if (queue.push(guest) > 1)
+                wake(1);
+        }
+        __atomic_add_fetch(&m_statistics.slices, statistics.slices, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&m_statistics.steals, statistics.steals, __ATOMIC_RELAXED);
+    }
+
+    //the other queues are tried in turn, starting with the next one, so that thieves spread out
+    bool NVMHost::steal(u32 worker, u32& guest)
+    {
+        for (u32 i = 1; i < m_workers; i++)
+        {
+            if (m_queues[(worker + i) % m_workers].take(guest))
+                return true;
+        }
+        return false;
+    }
+
+    /*
+     * Idle workers sleep on a futex until a queue gets a guest more than its owner is about to run, or the last guest
+     * finishes. A worker counts itself as sleeping before it looks at the queues one last time, and whoever puts a
+     * guest back looks at that count only after the guest is in, so one of the two always sees the other: either the
+     * sleeper finds the guest, or it gets woken. The epoch changes with every wake, so one that comes between the last
+     * look and the wait makes the wait return right away.
+     */
+    void NVMHost::park()
+    {
+        u32 epoch = __atomic_load_n(&m_epoch, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&m_sleepers, 1, __ATOMIC_SEQ_CST);
+        bool idle = __atomic_load_n(&m_unfinished, __ATOMIC_SEQ_CST) != 0;
+        for (u32 i = 0; idle && i < m_workers; i++)
+            idle = m_queues[i].empty();
+        if (idle)
+            futex_wait(&m_epoch, epoch);
+        __atomic_sub_fetch(&m_sleepers, 1, __ATOMIC_RELAXED);
+    }
+
+    void NVMHost::wake(u32 workers)
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&m_sleepers, __ATOMIC_RELAXED) == 0)
+            return;
+        __atomic_add_fetch(&m_epoch, 1, __ATOMIC_RELEASE);
+        futex_wake(&m_epoch, workers);
+    }
+
+    //the guest's flat region is mapped over with fresh anonymous memory, which releases its pages even if something
+    //else was mapped there (see NVMMemory::fork_into)
+    void NVMHost::finish(u32 guest, ExitCode exit_code)
+    {
+        auto vm = m_vms[guest];
+        m_results[guest] = { exit_code, vm->trap(), vm->trap_address() };
+        __atomic_add_fetch(&m_statistics.decoded_pages, vm->code_cache().decoded_pages(), __ATOMIC_RELAXED);
+        delete vm;
+        m_vms[guest] = nullptr;
+        if (m_arena != nullptr)
+            mmap(m_arena + guest * m_guest_memory, m_guest_memory, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        //every worker that is asleep would otherwise wait for a guest that never comes
+        if (__atomic_sub_fetch(&m_unfinished, 1, __ATOMIC_SEQ_CST) == 0)
+            wake(m_workers);
+    }
+}
@@ -0,0 +1,122 @@
+#pragma once
+#include <Types.h>
+#include "NVMVirtualMachine.h"
+
+namespace nvm
+{
+    struct NVMBinaryFormatData;
+    class NVMSharedCode;
+
+    struct GuestResult
+    {
+        ExitCode exit_code;
+        Trap trap;
+        u64 trap_address;
+    };
+
+    struct HostStatistics
+    {
+        u64 slices;
+        //guests a worker took from another one's queue
+        u64 steals;
+        //code pages guests decoded for themselves alone; every one of them cost NVMInstructionCache::chunk_bytes
+        u64 decoded_pages;
+        //code pages decoded once for every guest spawned from the same image or origin (see NVMSharedCode)
+        u64 shared_pages;
+    };
+
+    /*
+     * Runs many guests at once as cooperative tasks on a fixed set of worker threads. Every guest runs for a slice of
+     * instructions at a time (see NVMVirtualMachine::run_slice), and goes back to the end of its worker's queue if it
+     * didn't finish. Workers with nothing left to run steal guests from the others, so load evens out across cores
+     * without any central queue, and sleep when there is nothing to steal either.
+     * Guests are interpreted, and their flat regions are slices of one mapping reserved up front and only backed as
+     * they are touched, so a guest costs its VM, the pages it touched and the code it decoded. A finished guest hands
+     * all of that back right away.
+     * Guests spawned from the same image, or forked from the same origin, share their decoded code through an
+     * NVMSharedCode, so each page of code they run costs NVMInstructionCache::chunk_bytes (1026 slots of 40 bytes)
+     * once rather than once per guest. A guest that writes to its code decodes that page for itself.
+     * statistics() counts both kinds of pages, and --host prints them along with peak memory.
+     * Guests can also be forked from a template that was run up to where they all start (see
+     * NVMVirtualMachine::fork). Those share every page of the template until they write it, and get a flat region of
+     * their own instead of a slice of the mapping.
+     */
+    class NVMHost
+    {
+    public:
+        static constexpr u64 default_slice = 10000;
+        static constexpr u64 default_guest_memory = 1ul << 20;
+
+        //guest_memory is the flat region of every guest; addresses past it still work, through NVMMemory's page table
+        NVMHost(u32 workers, u32 capacity, u64 slice = default_slice, u64 guest_memory = default_guest_memory);
+        ~NVMHost();
+        NVMHost(const NVMHost&) = delete;
+        NVMHost& operator=(const NVMHost&) = delete;
+
+        //adds a guest starting from image, which run() runs along with the others. guests are numbered in the order
+        //they were spawned. fails once capacity guests were spawned, if their memory couldn't be reserved, or if image
+        //couldn't be loaded into it
+        bool spawn(const NVMBinaryFormatData& image);
+        //adds a guest forked from origin, which has to be paused, and is left as it was. fails once capacity guests
+        //were spawned, or if origin's memory couldn't be shared
+        bool spawn(NVMVirtualMachine& origin);
+        //runs every guest to the end, on the calling thread and workers - 1 others
+        void run();
+
+        u32 guests() const
+        {
+            return m_guests;
+        }
+
+        u32 workers() const
+        {
+            return m_workers;
+        }
+
+        //only meaningful once run() returned
+        const GuestResult& result(u32 guest) const
+        {
+            return m_results[guest];
+        }
+
+        HostStatistics statistics() const
+        {
+            return m_statistics;
+        }
+
+    private:
+        class RunQueue;
+
+        struct SharedCode
+        {
+            //the image or the guest that guests were spawned from
+            const void* origin;
+            NVMSharedCode* code;
+        };
+
+        NVMSharedCode& shared_code(const void* origin);
+        void work(u32 worker);
+        bool steal(u32 worker, u32& guest);
+        void park();
+        //wakes up to workers sleeping in park()
+        void wake(u32 workers);
+        void finish(u32 guest, ExitCode exit_code);
+
+        u32 m_workers;
+        u32 m_capacity;
+        u64 m_slice;
+        u64 m_guest_memory;
+        u8* m_arena { nullptr };
+        u32 m_guests { 0 };
+        NVMVirtualMachine** m_vms { nullptr };
+        GuestResult* m_results { nullptr };
+        RunQueue* m_queues { nullptr };
+        //guests that haven't finished yet; workers stop once it gets to 0
+        u32 m_unfinished { 0 };
+        //the futex idle workers wait on, and how many of them do
+        u32 m_epoch { 0 };
+        u32 m_sleepers { 0 };
+        Vector<SharedCode> m_shared_code;
+        HostStatistics m_statistics {};
+    };
+}
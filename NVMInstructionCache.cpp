@@ -0,0 +1,376 @@
+#include "NVMInstructionCache.h"
+#include "NVMMemory.h"
+#include "NVMData.h"
+#include "NVMJit.h"
+#include "NVMSharedCode.h"
+#include <stdlib.h>
+
+namespace nvm
+{
+    //register/immediate pairs are laid out next to each other in ENUMERATE_MICRO_OPS
+    constexpr MicroOpKind select_form(MicroOpKind register_form, bool uses_register)
+    {
+        return (MicroOpKind)((u8)register_form + (uses_register ? 0 : 1));
+    }
+
+    struct Superinstruction
+    {
+        MicroOpKind ops[NVMInstructionCache::max_fused_ops];
+        u64 length;
+        MicroOpKind kind;
+    };
+
+#define PAIR_ENTRY(a, b) { { MicroOpKind::a, MicroOpKind::b, MicroOpKind::Count }, 2, MicroOpKind::a##_##b },
+#define TRIPLE_ENTRY(a, b, c) { { MicroOpKind::a, MicroOpKind::b, MicroOpKind::c }, 3, MicroOpKind::a##_##b##_##c },
+    //ends with an empty entry, so that it is never empty itself
+    constexpr Superinstruction superinstructions[] { ENUMERATE_SUPERINSTRUCTIONS(PAIR_ENTRY, TRIPLE_ENTRY) { {}, 0, MicroOpKind::Count } };
+#undef TRIPLE_ENTRY
+#undef PAIR_ENTRY
+
+    static_assert(NVMInstructionCache::chunk_bytes == (NVMMemory::page_size / sizeof(u32) + NVMInstructionCache::sentinel_slots) * sizeof(MicroOp),
+                  "chunks are a page of slots");
+
+    NVMInstructionCache::NVMInstructionCache(NVMMemory& memory) : m_memory(memory), m_chunks(), m_arrays()
+    {
+    }
+
+    NVMInstructionCache::~NVMInstructionCache()
+    {
+        for (const auto& chunk : m_arrays)
+        {
+            if (!chunk.shared)
+                free(chunk.ops);
+        }
+    }
+
+    //every run loop sets its table when it starts; decoded slots only have to go when it is a different one.
+    //borrowed chunks were decoded with the old table, so they are given up for undecoded ones of this cache's own
+    void NVMInstructionCache::set_handlers(void* const* handlers)
+    {
+        if (__builtin_memcmp(m_handlers, handlers, sizeof(m_handlers)) == 0)
+            return;
+        for (u8 i = 0; i < (u8)MicroOpKind::Count; i++)
+            m_handlers[i] = handlers[i];
+        for (auto& chunk : m_arrays)
+        {
+            if (chunk.shared)
+                chunk = { new_chunk(), false };
+            else
+                reset(chunk.ops);
+        }
+        m_borrowed = 0;
+    }
+
+    void NVMInstructionCache::attach_jit(NVMJit* jit)
+    {
+        m_jit = jit;
+        for (auto& chunk : m_arrays)
+        {
+            if (chunk.shared)
+                own(chunk);
+        }
+    }
+
+    void NVMInstructionCache::reset(MicroOp* ops)
+    {
+        u64 slots = NVMMemory::page_size / sizeof(u32);
+        for (u64 i = 0; i < slots; i++)
+        {
+            ops[i].handler = m_handlers[(u8)MicroOpKind::Decode];
+            ops[i].kind = MicroOpKind::Decode;
+            ops[i].heat = 0;
+        }
+        for (u64 i = slots; i < slots + sentinel_slots; i++)
+        {
+            ops[i].handler = m_handlers[(u8)MicroOpKind::LeaveChunk];
+            ops[i].kind = MicroOpKind::LeaveChunk;
+        }
+    }
+
+    MicroOp* NVMInstructionCache::ops_for(u64 address)
+    {
+        constexpr u64 chunk_size = NVMMemory::page_size;
+        u64 base = address - address % chunk_size;
+        auto maybe_index = m_chunks.get(base);
+        if (maybe_index.has_value())
+            return m_arrays[maybe_index.value()].ops;
+
+        Chunk chunk { nullptr, false };
+        if (m_shared != nullptr && m_jit == nullptr && m_fusion)
+            chunk = borrow(base);
+        if (chunk.ops == nullptr)
+            chunk.ops = new_chunk();
+        m_borrowed += chunk.shared;
+        m_chunks.insert(base, m_arrays.size());
+        m_arrays.append(chunk);
+        if (base < m_low)
+            m_low = base;
+        if (base + chunk_size > m_high)
+            m_high = base + chunk_size;
+        m_memory.watch_code(this, m_low, m_high);
+        return chunk.ops;
+    }
+
+    MicroOp* NVMInstructionCache::new_chunk()
+    {
+        auto ops = (MicroOp*) calloc(NVMMemory::page_size / sizeof(u32) + sentinel_slots, sizeof(MicroOp));
+        reset(ops);
+        return ops;
+    }
+
+    //a chunk that is going to be shared is decoded in full up front, since nobody may write its slots afterwards.
+    //the page is read before that, so a guest that already wrote to it doesn't get code decoded from another one's
+    NVMInstructionCache::Chunk NVMInstructionCache::borrow(u64 base)
+    {
+        constexpr u64 slots = NVMMemory::page_size / sizeof(u32);
+        u8 contents[NVMSharedCode::contents_size];
+        m_memory.read_bytes(base, contents, sizeof(contents));
+        const MicroOp* shared = m_shared->find(base, contents, m_handlers);
+        if (shared != nullptr)
+            return { (MicroOp*) shared, true };
+
+        MicroOp* ops = new_chunk();
+        for (u64 slot = 0; slot < slots; slot++)
+            decode(ops + slot, base + slot * sizeof(u32), ops, base);
+        shared = m_shared->publish(base, contents, m_handlers, ops);
+        if (shared == nullptr)
+            return { ops, false };
+        if (shared != ops)
+            free(ops);
+        return { (MicroOp*) shared, true };
+    }
+
+    //jumps within the chunk point into the array they were decoded in, so they are moved over to the copy. the
+    //interpreter may be running the borrowed chunk, and is told to look up the copy
+    void NVMInstructionCache::own(Chunk& chunk)
+    {
+        auto ops = (MicroOp*) malloc(chunk_bytes);
+        __builtin_memcpy(ops, chunk.ops, chunk_bytes);
+        for (u64 i = 0; i < chunk_bytes / sizeof(MicroOp); i++)
+        {
+            if (ops[i].target_op != nullptr)
+                ops[i].target_op = ops + (ops[i].target_op - chunk.ops);
+        }
+        chunk = { ops, false };
+        m_borrowed--;
+        m_memory.flag_code_moved();
+    }
+
+    void NVMInstructionCache::decode(MicroOp* op, u64 address, MicroOp* chunk_ops, u64 chunk_base)
+    {
+        //slots decoded ahead by fuse() keep the decode handler until they run, so they get their own chance to start one
+        if (op->kind == MicroOpKind::Decode)
+            decode_one(op, address, chunk_ops, chunk_base);
+        else
+            op->handler = m_handlers[(u8)op->kind];
+        if (m_fusion)
+            fuse(op, chunk_ops, chunk_base);
+    }
+
+    //superinstructions never reach past the end of the chunk, so the slots they run are always in the same array
+    void NVMInstructionCache::fuse(MicroOp* op, MicroOp* chunk_ops, u64 chunk_base)
+    {
+        constexpr u64 slots = NVMMemory::page_size / sizeof(u32);
+        MicroOp* sequence[max_fused_ops] { op };
+        u64 decoded = 1;
+        const Superinstruction* best = nullptr;
+        for (const auto* candidate = superinstructions; candidate->length != 0; candidate++)
+        {
+            if (candidate->ops[0] != op->kind || (best != nullptr && best->length >= candidate->length))
+                continue;
+            bool matches = true;
+            for (u64 i = 1; matches && i < candidate->length; i++)
+            {
+                if (i == decoded)
+                {
+                    u64 slot = (u64)(sequence[i - 1] - chunk_ops) + sequence[i - 1]->words;
+                    if (slot >= slots)
+                    {
+                        matches = false;
+                        break;
+                    }
+                    sequence[i] = chunk_ops + slot;
+                    if (sequence[i]->kind == MicroOpKind::Decode)
+                    {
+                        decode_one(sequence[i], chunk_base + slot * sizeof(u32), chunk_ops, chunk_base);
+                        sequence[i]->handler = m_handlers[(u8)MicroOpKind::Decode];
+                    }
+                    decoded++;
+                }
+                matches = sequence[i]->kind == candidate->ops[i];
+            }
+            if (matches)
+                best = candidate;
+        }
+        if (best != nullptr)
+            op->handler = m_handlers[(u8)best->kind];
+    }
+
+    void NVMInstructionCache::decode_one(MicroOp* op, u64 address, MicroOp* chunk_ops, u64 chunk_base)
+    {
+        u32 word = m_memory.read_32(address);
+        bool wide = (word & (1u << 31)) != 0;
+        bool uses_register = (word & (1u << 30)) != 0;
+        u64 imm = word & 0xFFF;
+        if (wide)
+            imm = (imm << 32) | m_memory.read_32(address + 4);
+
+        op->a = (word >> 20) & 0xF;
+        op->b = (word >> 16) & 0xF;
+        op->c = (word >> 12) & 0xF;
+        op->words = wide ? 2 : 1;
+        op->next_ip = address + op->words * sizeof(u32);
+        op->imm = imm;
+        op->target_op = nullptr;
+
+        MicroOpKind kind;
+        switch ((Instruction)((word >> 24) & 0x3F))
+        {
+            case Instruction::Add:
+                kind = select_form(MicroOpKind::AddR, uses_register);
+                break;
+            case Instruction::Sub:
+                kind = select_form(MicroOpKind::SubR, uses_register);
+                break;
+            case Instruction::Mul:
+                kind = select_form(MicroOpKind::MulR, uses_register);
+                break;
+            case Instruction::Div:
+                kind = select_form(MicroOpKind::DivR, uses_register);
+                break;
+            case Instruction::Neg:
+                kind = MicroOpKind::Neg;
+                break;
+            case Instruction::Not:
+                kind = MicroOpKind::Not;
+                break;
+            case Instruction::Shl:
+                kind = select_form(MicroOpKind::ShlR, uses_register);
+                break;
+            case Instruction::Shr:
+                kind = select_form(MicroOpKind::ShrR, uses_register);
+                break;
+            case Instruction::Sra:
+                kind = select_form(MicroOpKind::SraR, uses_register);
+                break;
+            case Instruction::And:
+                kind = select_form(MicroOpKind::AndR, uses_register);
+                break;
+            case Instruction::Or:
+                kind = select_form(MicroOpKind::OrR, uses_register);
+                break;
+            case Instruction::Xor:
+                kind = select_form(MicroOpKind::XorR, uses_register);
+                break;
+            case Instruction::Load:
+                kind = select_form((MicroOpKind)((u8)MicroOpKind::Load8R + (op->b & 3) * 2), uses_register);
+                break;
+            case Instruction::Store:
+                kind = select_form((MicroOpKind)((u8)MicroOpKind::Store8R + (op->b & 3) * 2), uses_register);
+                break;
+            case Instruction::Int:
+                kind = MicroOpKind::Int;
+                break;
+            case Instruction::Jmp:
+            case Instruction::Je:
+            case Instruction::Jne:
+            case Instruction::Jg:
+            case Instruction::Jgu:
+            case Instruction::Jl:
+            case Instruction::Jlu:
+            {
+                u8 index = ((word >> 24) & 0x3F) - get_instruction_opcode(Instruction::Jmp);
+                kind = select_form((MicroOpKind)((u8)MicroOpKind::JmpR + index * 2), uses_register);
+                if (!uses_register)
+                {
+                    //jump immediates are signed word offsets relative to the jump, 12 or 44 bits wide
+                    u8 shift = wide ? 20 : 52;
+                    u64 target = address + (u64)(((i64)(imm << shift) >> shift) * 4);
+                    op->imm = target;
+                    if (target - chunk_base < NVMMemory::page_size)
+                        op->target_op = chunk_ops + (target - chunk_base) / sizeof(u32);
+                }
+            }
+                break;
+            default:
+                kind = MicroOpKind::InvalidInstruction;
+                break;
+        }
+        op->kind = kind;
+        op->handler = m_handlers[(u8)kind];
+    }
+
+    MicroOp* NVMInstructionCache::chunk_for_write(u64 base)
+    {
+        auto maybe_index = m_chunks.get(base);
+        if (!maybe_index.has_value())
+            return nullptr;
+        auto& chunk = m_arrays[maybe_index.value()];
+        if (chunk.shared)
+            own(chunk);
+        return chunk.ops;
+    }
+
+    void NVMInstructionCache::invalidate(u64 address, u64 size)
+    {
+        constexpr u64 chunk_size = NVMMemory::page_size;
+        //a write to the second word of a wide instruction changes the instruction one slot back, and a write to any
+        //instruction of a superinstruction changes the slot it starts at
+        constexpr u64 reach = (max_fused_ops * 2 - 1) * sizeof(u32);
+        u64 first = (address & ~3ul) >= reach ? (address & ~3ul) - reach : 0;
+        u64 last = address + size - 1;
+        u64 base = first - first % chunk_size;
+        MicroOp* ops = chunk_for_write(base);
+        for (u64 word = first; word <= last; word += sizeof(u32))
+        {
+            if (word - base >= chunk_size)
+            {
+                base = word - word % chunk_size;
+                ops = chunk_for_write(base);
+            }
+            if (ops == nullptr)
+                continue;
+            auto& op = ops[(word - base) / sizeof(u32)];
+            op.handler = m_handlers[(u8)MicroOpKind::Decode];
+            op.kind = MicroOpKind::Decode;
+            op.heat = 0;
+        }
+        if (m_jit != nullptr)
+            m_jit->invalidate(address, size);
+    }
+
+    void NVMInstructionCache::drop_native()
+    {
+        if (m_jit != nullptr)
+            m_jit->flush();
+    }
+
+    const MicroOp* NVMInstructionCache::decoded(u64 address)
+    {
+        constexpr u64 chunk_size = NVMMemory::page_size;
+        u64 base = address - address % chunk_size;
+        MicroOp* ops = ops_for(address);
+        MicroOp* op = ops + (address - base) / sizeof(u32);
+        if (op->kind == MicroOpKind::Decode)
+        {
+            decode_one(op, address, ops, base);
+            op->handler = m_handlers[(u8)MicroOpKind::Decode];
+        }
+        return op;
+    }
+
+    void NVMInstructionCache::enter_native(u64 address)
+    {
+        MicroOp* op = ops_for(address) + address % NVMMemory::page_size / sizeof(u32);
+        op->handler = m_handlers[(u8)MicroOpKind::EnterNative];
+    }
+
+    //the slot is decoded again when it next runs, which gives it back its own or its superinstruction's handler
+    void NVMInstructionCache::leave_native(u64 address)
+    {
+        MicroOp* op = ops_for(address) + address % NVMMemory::page_size / sizeof(u32);
+        if (op->handler == m_handlers[(u8)MicroOpKind::EnterNative])
+            op->handler = m_handlers[(u8)MicroOpKind::Decode];
+        op->heat = 0;
+    }
+}
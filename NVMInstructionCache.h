@@ -0,0 +1,154 @@
+#pragma once
+#include <Types.h>
+#include <Hashmap.h>
+#include <Vector.h>
+#include "NVMSuperinstructions.h"
+
+namespace nvm
+{
+    class NVMJit;
+    
+    class NVMMemory;
+    
+    class NVMSharedCode;
+
+    //every handler the interpreter can jump to. register and immediate forms of the third operand are separate
+    //handlers, and load/store are split by width, so none of that is looked at while executing
+#define ENUMERATE_MICRO_OPS(O) \
+        O(AddR) O(AddI) O(SubR) O(SubI) O(MulR) O(MulI) O(DivR) O(DivI) O(Neg) O(Not) \
+        O(ShlR) O(ShlI) O(ShrR) O(ShrI) O(SraR) O(SraI) O(AndR) O(AndI) O(OrR) O(OrI) O(XorR) O(XorI) \
+        O(Load8R) O(Load8I) O(Load16R) O(Load16I) O(Load32R) O(Load32I) O(Load64R) O(Load64I) \
+        O(Store8R) O(Store8I) O(Store16R) O(Store16I) O(Store32R) O(Store32I) O(Store64R) O(Store64I) \
+        O(Int) \
+        O(JmpR) O(JmpI) O(JeR) O(JeI) O(JneR) O(JneI) O(JgR) O(JgI) O(JguR) O(JguI) O(JlR) O(JlI) O(JluR) O(JluI) \
+        O(InvalidInstruction) O(Decode) O(LeaveChunk) O(EnterNative)
+
+    //superinstructions run a sequence of micro-ops with a single dispatch, and are named after them
+    enum class MicroOpKind : u8
+    {
+#define MICRO_OP_ENUM_ENTRY(name) name,
+#define PAIR_ENUM_ENTRY(a, b) a##_##b,
+#define TRIPLE_ENUM_ENTRY(a, b, c) a##_##b##_##c,
+        ENUMERATE_MICRO_OPS(MICRO_OP_ENUM_ENTRY)
+        ENUMERATE_SUPERINSTRUCTIONS(PAIR_ENUM_ENTRY, TRIPLE_ENUM_ENTRY)
+#undef TRIPLE_ENUM_ENTRY
+#undef PAIR_ENUM_ENTRY
+#undef MICRO_OP_ENUM_ENTRY
+        Count
+    };
+
+#define COUNT_MICRO_OP(name) + 1
+    constexpr u64 base_micro_op_count = 0 ENUMERATE_MICRO_OPS(COUNT_MICRO_OP);
+#undef COUNT_MICRO_OP
+
+    struct MicroOp
+    {
+        //the handler of a superinstruction when this is the first micro-op of one, so it goes on to run the ones after it
+        void* handler;
+        //zero extended immediate, interrupt code, or absolute target address for immediate jumps
+        u64 imm;
+        //the value ip reads as while this instruction executes
+        u64 next_ip;
+        //immediate jumps whose target is in the same chunk jump straight to its slot
+        MicroOp* target_op;
+        //always one of ENUMERATE_MICRO_OPS, even when handler runs a superinstruction
+        MicroOpKind kind;
+        u8 a;
+        u8 b;
+        u8 c;
+        //size of the instruction in 32 bit words
+        u8 words;
+        //how many times a block was entered here, counted by the interpreter when it runs with a JIT
+        u16 heat;
+    };
+
+    /*
+     * Decode-once storage for guest code. Each memory page that code runs from gets a dense array with one micro-op
+     * per 32 bit word, filled in lazily the first time a slot executes. Two sentinel slots past the end hand control
+     * back to the interpreter when execution runs off the chunk.
+     * NVMMemory reports writes that land in decoded chunks, and the affected slots go back to being undecoded.
+     * When a slot is decoded, the ones that follow it in the chunk are decoded too if together they make up one of the
+     * superinstructions in NVMSuperinstructions.h, and the first slot gets the superinstruction's handler. The
+     * others keep their own, since they can still be jumped to.
+     * Slots where a block compiled by NVMJit starts get the EnterNative handler, and keep their kind so that they
+     * can still be interpreted.
+     * Guests that run the same image can borrow chunks from an NVMSharedCode instead of decoding their own, as long
+     * as they run without a JIT and with fusion on. Borrowed chunks are never written; the first write to one gives
+     * the guest a copy of its own, which the write then invalidates as usual.
+     */
+    class NVMInstructionCache
+    {
+    public:
+        explicit NVMInstructionCache(NVMMemory& memory);
+        ~NVMInstructionCache();
+        NVMInstructionCache(const NVMInstructionCache&) = delete;
+        NVMInstructionCache& operator=(const NVMInstructionCache&) = delete;
+
+        //the handler table is indexed by MicroOpKind and only known to the interpreter
+        void set_handlers(void* const* handlers);
+        MicroOp* ops_for(u64 address);
+        void decode(MicroOp* op, u64 address, MicroOp* chunk_ops, u64 chunk_base);
+        void invalidate(u64 address, u64 size);
+        //the decoded slot for address, for translating code ahead of running it. leaves it to be fused when it runs
+        const MicroOp* decoded(u64 address);
+        void enter_native(u64 address);
+        void leave_native(u64 address);
+
+        //native code compiled from decoded slots is dropped along with them. slots where native code starts are
+        //written, so borrowed chunks are copied first
+        void attach_jit(NVMJit* jit);
+        //chunks are borrowed from shared from then on, where it has them
+        void attach_shared(NVMSharedCode* shared)
+        {
+            m_shared = shared;
+        }
+        //drops all native code but keeps the decoded slots, for changes generated code has baked in
+        void drop_native();
+
+        //profiling needs every micro-op dispatched on its own; only affects slots decoded from then on
+        void set_fusion(bool enabled)
+        {
+            m_fusion = enabled;
+        }
+
+        //pages that have decoded micro-ops of this cache's own, each of which costs chunk_bytes
+        u64 decoded_pages() const
+        {
+            return m_arrays.size() - m_borrowed;
+        }
+
+        static constexpr u64 sentinel_slots = 2;
+        static constexpr u64 max_fused_ops = 3;
+        //one slot per 32 bit word of a page, plus the sentinels
+        static constexpr u64 chunk_bytes = (4096 / sizeof(u32) + sentinel_slots) * sizeof(MicroOp);
+
+    private:
+        struct Chunk
+        {
+            MicroOp* ops;
+            //borrowed from m_shared, and never written
+            bool shared;
+        };
+
+        MicroOp* new_chunk();
+        Chunk borrow(u64 base);
+        void own(Chunk& chunk);
+        //the chunk at base if there is one, copied first if it is borrowed
+        MicroOp* chunk_for_write(u64 base);
+        void reset(MicroOp* ops);
+        void decode_one(MicroOp* op, u64 address, MicroOp* chunk_ops, u64 chunk_base);
+        void fuse(MicroOp* op, MicroOp* chunk_ops, u64 chunk_base);
+
+        NVMMemory& m_memory;
+        //index into m_arrays
+        Hashmap<u64, u64> m_chunks;
+        Vector<Chunk> m_arrays;
+        u64 m_borrowed { 0 };
+        NVMSharedCode* m_shared { nullptr };
+        void* m_handlers[(u8)MicroOpKind::Count] { nullptr };
+        u64 m_low { ~0ul };
+        u64 m_high { 0 };
+        bool m_fusion { true };
+        NVMJit* m_jit { nullptr };
+    };
+}
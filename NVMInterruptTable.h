@@ -1,16 +1,109 @@
 #pragma once
 #include "Array.h"
 #include "NVMVirtualMachine.h"
+#include "NVMData.h"
+#include <stdio.h>
 
 namespace nvm
 {
+    enum class InterruptResult
+    {
+        Continue,
+        Halt
+    };
+
     namespace Interrupts
     {
-        void print_char(const NVMMemory& memory)
+        inline InterruptResult terminate(u64*, NVMMemory&)
+        {
+            return InterruptResult::Halt;
+        }
+
+        inline InterruptResult read_char(u64* registers, NVMMemory&)
+        {
+            int c = getchar();
+            registers[get_register_id(Register::r1)] = c == EOF ? 0 : (u64)c;
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult read_integer(u64* registers, NVMMemory&)
         {
-            __builtin_printf("%c", '?');
+            i64 value = 0;
+            if (scanf("%ld", &value) != 1)
+                value = 0;
+            registers[get_register_id(Register::r1)] = (u64)value;
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult read_string(u64* registers, NVMMemory& memory)
+        {
+            u64 address = registers[get_register_id(Register::r1)];
+            int c;
+            while ((c = getchar()) != EOF && c != '\n')
+                memory.write_8(address++, (u8)c);
+            memory.write_8(address, 0);
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult print_char(u64* registers, NVMMemory&)
+        {
+            putchar((int)(registers[get_register_id(Register::r1)] & 0xFF));
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult print_integer(u64* registers, NVMMemory&)
+        {
+            printf("%ld", (i64)registers[get_register_id(Register::r1)]);
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult print_string(u64* registers, NVMMemory& memory)
+        {
+            u64 address = registers[get_register_id(Register::r1)];
+            u8 c;
+            while ((c = memory.read_8(address++)) != 0)
+                putchar(c);
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult print_utf8_char(u64* registers, NVMMemory&)
+        {
+            u32 codepoint = registers[get_register_id(Register::r1)] & 0x1FFFFF;
+            if (codepoint < 0x80)
+                putchar(codepoint);
+            else if (codepoint < 0x800)
+            {
+                putchar(0xC0 | (codepoint >> 6));
+                putchar(0x80 | (codepoint & 0x3F));
+            }
+            else if (codepoint < 0x10000)
+            {
+                putchar(0xE0 | (codepoint >> 12));
+                putchar(0x80 | ((codepoint >> 6) & 0x3F));
+                putchar(0x80 | (codepoint & 0x3F));
+            }
+            else
+            {
+                putchar(0xF0 | (codepoint >> 18));
+                putchar(0x80 | ((codepoint >> 12) & 0x3F));
+                putchar(0x80 | ((codepoint >> 6) & 0x3F));
+                putchar(0x80 | (codepoint & 0x3F));
+            }
+            return InterruptResult::Continue;
+        }
+
+        inline InterruptResult print_newline(u64*, NVMMemory&)
+        {
+            putchar('\n');
+            return InterruptResult::Continue;
         }
     }
-    
-    constexpr Array<u64,
-}
\ No newline at end of file
+
+    struct InterruptHandler
+    {
+        u64 code;
+        InterruptResult(*handle)(u64* registers, NVMMemory& memory);
+    };
+
+    constexpr Array<InterruptHandler, 9> interrupt_table { { { 0xFF, Interrupts::terminate }, { 0x00, Interrupts::read_char }, { 0x01, Interrupts::read_integer }, { 0x02, Interrupts::read_string }, { 0x03, Interrupts::print_char }, { 0x04, Interrupts::print_integer }, { 0x05, Interrupts::print_string }, { 0x30, Interrupts::print_utf8_char }, { 0x32, Interrupts::print_newline } } };
+}
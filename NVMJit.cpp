@@ -0,0 +1,2049 @@
+#include "NVMJit.h"
+#include "NVMData.h"
+#include "NVMInterruptTable.h"
+#include "NVMTrace.h"
+#include <IterableUtil.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+namespace nvm
+{
+    //numbered as in their x86-64 encoding
+    enum class Host : u8
+    {
+        rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15
+    };
+
+    enum class Condition : u8
+    {
+        Below = 0x2,
+        AboveOrEqual = 0x3,
+        Equal = 0x4,
+        NotEqual = 0x5,
+        BelowOrEqual = 0x6,
+        Above = 0x7,
+        Less = 0xC,
+        GreaterOrEqual = 0xD,
+        LessOrEqual = 0xE,
+        Greater = 0xF
+    };
+
+    //conditions come in pairs that differ in the lowest bit
+    static constexpr Condition invert(Condition condition)
+    {
+        return (Condition)((u8)condition ^ 1);
+    }
+
+    //the opcode of the "op r/m64, r64" form; the "op r64, r/m64" form is two above it
+    enum class AluOp : u8
+    {
+        Add = 0x01,
+        Or = 0x09,
+        And = 0x21,
+        Sub = 0x29,
+        Xor = 0x31,
+        Cmp = 0x39
+    };
+
+    //the /digit of the "op r/m64, imm" form
+    static constexpr u8 immediate_extension(AluOp op)
+    {
+        switch (op)
+        {
+            case AluOp::Add:
+                return 0;
+            case AluOp::Or:
+                return 1;
+            case AluOp::And:
+                return 4;
+            case AluOp::Sub:
+                return 5;
+            case AluOp::Xor:
+                return 6;
+            default:
+                return 7;
+        }
+    }
+
+    /*
+     * register assignment inside a block:
+     *   rbx          the guest register file, for the whole block
+     *   r12-r15, rbp r1-r4, r5 (callee saved, so they survive calls out)
+     *   rsi, rdi, r8 r6-r8, and r9 holds sp; saved around calls out
+     *   r10          base of the flat region, rematerialized after calls out
+     *   rax rcx rdx  scratch, r11 scratch for constants
+     */
+    static constexpr u8 unmapped = 0xFF;
+    static constexpr u8 host_register_for[16] { unmapped, (u8)Host::r12, (u8)Host::r13, (u8)Host::r14, (u8)Host::r15,
+        (u8)Host::rbp, (u8)Host::rsi, (u8)Host::rdi, (u8)Host::r8, (u8)Host::r9, unmapped, unmapped, unmapped,
+        unmapped, unmapped, unmapped };
+    static constexpr Host callee_saved[] { Host::rbx, Host::rbp, Host::r12, Host::r13, Host::r14, Host::r15 };
+    static constexpr u8 ip_id = get_register_id(Register::ip);
+
+    static constexpr bool fits_i8(i64 value)
+    {
+        return value >= -128 && value <= 127;
+    }
+
+    static constexpr bool fits_i32(i64 value)
+    {
+        return value >= -2147483648l && value <= 2147483647l;
+    }
+
+    //a guest operand as native code sees it
+    struct Operand
+    {
+        enum class Kind
+        {
+            Register,
+            Immediate,
+            //a register file slot that has no host register, at [rbx + displacement]
+            Memory
+        };
+        Kind kind;
+        Host host;
+        u64 value;
+    };
+
+    /*
+     * x86-64 encoder for the handful of instructions blocks are made of. Code goes into one of two sections, so that
+     * slow paths can be written next to the fast path they belong to and still end up out of the way after the block.
+     * Jumps go to labels and are resolved when the sections are laid out.
+     */
+    class Emitter
+    {
+    public:
+        static constexpr u8 no_index = 0xFF;
+
+        enum class Section : u8
+        {
+            Hot,
+            Cold
+        };
+
+        u32 label()
+        {
+            m_labels.append({ Section::Hot, 0, false });
+            return m_labels.size() - 1;
+        }
+
+        void bind(u32 label)
+        {
+            m_labels[label] = { m_section, current().size(), true };
+        }
+
+        void switch_to(Section section)
+        {
+            m_section = section;
+        }
+
+        Section section() const
+        {
+            return m_section;
+        }
+
+        u64 size() const
+        {
+            return m_hot.size() + m_cold.size();
+        }
+
+        //copies both sections to destination, hot first, and resolves every jump
+        void finish(u8* destination)
+        {
+            memcpy(destination, m_hot.data(), m_hot.size());
+            //a block without slow paths has no cold section, and nothing to copy it from
+            if (m_cold.size() != 0)
+                memcpy(destination + m_hot.size(), m_cold.data(), m_cold.size());
+            for (const auto& fixup : m_fixups)
+            {
+                const auto& label = m_labels[fixup.label];
+                u64 target = label.offset + (label.section == Section::Cold ? m_hot.size() : 0);
+                u64 end = fixup.offset + sizeof(u32) + (fixup.section == Section::Cold ? m_hot.size() : 0);
+                i32 relative = (i32)(target - end);
+                memcpy(destination + end - sizeof(u32), &relative, sizeof(u32));
+            }
+        }
+
+        void mov(Host destination, Host source)
+        {
+            if (destination != source)
+                register_form(0x89, source, destination, true);
+        }
+
+        void mov(Host destination, u64 value)
+        {
+            u8 id = (u8)destination;
+            if (value == 0)
+            {
+                register_form(0x31, destination, destination, false);
+            }
+            else if (value <= 0xFFFFFFFF)
+            {
+                rex(false, 0, 0, id);
+                emit(0xB8 + (id & 7));
+                emit32(value);
+            }
+            else if (fits_i32((i64)value))
+            {
+                rex(true, 0, 0, id);
+                emit(0xC7);
+                emit(0xC0 | (id & 7));
+                emit32(value);
+            }
+            else
+            {
+                rex(true, 0, 0, id);
+                emit(0xB8 + (id & 7));
+                emit64(value);
+            }
+        }
+
+        //mov destination, [base + displacement]
+        void load(Host destination, Host base, i32 displacement)
+        {
+            memory_form(0x8B, (u8)destination, base, no_index, displacement, true);
+        }
+
+        //mov [base + displacement], source
+        void store(Host base, i32 displacement, Host source)
+        {
+            memory_form(0x89, (u8)source, base, no_index, displacement, true);
+        }
+
+        //mov qword [base + displacement], sign extended value, or mov dword when not wide
+        void store(Host base, i32 displacement, i32 value, bool wide = true)
+        {
+            memory_form(0xC7, 0, base, no_index, displacement, wide);
+            emit32((u32)value);
+        }
+
+        //zero extending load of 1 << width bytes from [base + index + displacement]
+        void load(u8 width, Host destination, Host base, u8 index, i32 displacement = 0)
+        {
+            switch (width)
+            {
+                case 0:
+                    rex(false, (u8)destination, index, (u8)base);
+                    emit(0x0F);
+                    emit(0xB6);
+                    break;
+                case 1:
+                    rex(false, (u8)destination, index, (u8)base);
+                    emit(0x0F);
+                    emit(0xB7);
+                    break;
+                case 2:
+                    rex(false, (u8)destination, index, (u8)base);
+                    emit(0x8B);
+                    break;
+                default:
+                    rex(true, (u8)destination, index, (u8)base);
+                    emit(0x8B);
+                    break;
+            }
+            modrm_memory((u8)destination, base, index, displacement);
+        }
+
+        //store of the low 1 << width bytes of source to [base + index]
+        void store(u8 width, Host base, u8 index, Host source)
+        {
+            if (width == 1)
+                emit(0x66);
+            //without a REX prefix, byte registers 4-7 would be ah, ch, dh and bh
+            if (width == 0 && (u8)source >= 4 && (u8)source < 8)
+                emit(0x40 | ((index >> 3) << 1) | ((u8)base >> 3));
+            else
+                rex(width == 3, (u8)source, index, (u8)base);
+            emit(width == 0 ? 0x88 : 0x89);
+            modrm_memory((u8)source, base, index, 0);
+        }
+
+        void alu(AluOp op, Host destination, Host source)
+        {
+            register_form((u8)op, source, destination, true);
+        }
+
+        void alu(AluOp op, Host destination, i32 value)
+        {
+            rex(true, 0, 0, (u8)destination);
+            emit(fits_i8(value) ? 0x83 : 0x81);
+            emit(0xC0 | immediate_extension(op) << 3 | ((u8)destination & 7));
+            if (fits_i8(value))
+                emit((u8)value);
+            else
+                emit32((u32)value);
+        }
+
+        //op destination, [base + index + displacement]
+        void alu(AluOp op, Host destination, Host base, u8 index, i32 displacement)
+        {
+            memory_form((u8)op + 2, (u8)destination, base, index, displacement, true);
+        }
+
+        //op qword [base + displacement], value
+        void alu_memory(AluOp op, Host base, i32 displacement, i32 value)
+        {
+            memory_form(fits_i8(value) ? 0x83 : 0x81, immediate_extension(op), base, no_index, displacement, true);
+            if (fits_i8(value))
+                emit((u8)value);
+            else
+                emit32((u32)value);
+        }
+
+        void imul(Host destination, Host source)
+        {
+            rex(true, (u8)destination, 0, (u8)source);
+            emit(0x0F);
+            emit(0xAF);
+            emit(0xC0 | ((u8)destination & 7) << 3 | ((u8)source & 7));
+        }
+
+        //imul destination, [base + index + displacement]
+        void imul(Host destination, Host base, u8 index, i32 displacement)
+        {
+            rex(true, (u8)destination, index, (u8)base);
+            emit(0x0F);
+            emit(0xAF);
+            modrm_memory((u8)destination, base, index, displacement);
+        }
+
+        void imul(Host destination, Host source, i32 value)
+        {
+            register_form(0x69, destination, source, true);
+            emit32((u32)value);
+        }
+
+        //the F7 group: 2 not, 3 neg, 7 idiv
+        void unary(u8 extension, Host operand)
+        {
+            rex(true, 0, 0, (u8)operand);
+            emit(0xF7);
+            emit(0xC0 | extension << 3 | ((u8)operand & 7));
+        }
+
+        //the shift group: 4 shl, 5 shr, 7 sar. by cl, which the host masks to 6 bits like the guest does
+        void shift(u8 extension, Host operand)
+        {
+            rex(true, 0, 0, (u8)operand);
+            emit(0xD3);
+            emit(0xC0 | extension << 3 | ((u8)operand & 7));
+        }
+
+        void shift(u8 extension, Host operand, u8 count)
+        {
+            rex(true, 0, 0, (u8)operand);
+            emit(0xC1);
+            emit(0xC0 | extension << 3 | ((u8)operand & 7));
+            emit(count);
+        }
+
+        void test(Host left, Host right)
+        {
+            register_form(0x85, right, left, true);
+        }
+
+        void cqo()
+        {
+            emit(0x48);
+            emit(0x99);
+        }
+
+        void push(Host operand)
+        {
+            rex(false, 0, 0, (u8)operand);
+            emit(0x50 + ((u8)operand & 7));
+        }
+
+        void pop(Host operand)
+        {
+            rex(false, 0, 0, (u8)operand);
+            emit(0x58 + ((u8)operand & 7));
+        }
+
+        void call(Host target)
+        {
+            rex(false, 0, 0, (u8)target);
+            emit(0xFF);
+            emit(0xD0 | ((u8)target & 7));
+        }
+
+        void ret()
+        {
+            emit(0xC3);
+        }
+
+        void jump(u32 label)
+        {
+            emit(0xE9);
+            fixup(label);
+        }
+
+        void jump(Condition condition, u32 label)
+        {
+            emit(0x0F);
+            emit(0x80 | (u8)condition);
+            fixup(label);
+        }
+
+    private:
+        struct Label
+        {
+            Section section;
+            u64 offset;
+            bool bound;
+        };
+
+        struct Fixup
+        {
+            Section section;
+            //of the rel32 field
+            u64 offset;
+            u32 label;
+        };
+
+        Vector<u8>& current()
+        {
+            return m_section == Section::Hot ? m_hot : m_cold;
+        }
+
+        void emit(u8 byte)
+        {
+            current().append(byte);
+        }
+
+        void emit32(u32 value)
+        {
+            for (u64 i = 0; i < sizeof(u32); i++)
+                emit((u8)(value >> (i * 8)));
+        }
+
+        void emit64(u64 value)
+        {
+            for (u64 i = 0; i < sizeof(u64); i++)
+                emit((u8)(value >> (i * 8)));
+        }
+
+        void fixup(u32 label)
+        {
+            m_fixups.append({ m_section, current().size(), label });
+            emit32(0);
+        }
+
+        void rex(bool wide, u8 reg, u8 index, u8 base)
+        {
+            if (index == no_index)
+                index = 0;
+            u8 prefix = 0x40 | (wide ? 8 : 0) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+            if (prefix != 0x40)
+                emit(prefix);
+        }
+
+        void register_form(u8 opcode, Host reg, Host rm, bool wide)
+        {
+            rex(wide, (u8)reg, 0, (u8)rm);
+            emit(opcode);
+            emit(0xC0 | ((u8)reg & 7) << 3 | ((u8)rm & 7));
+        }
+
+        void memory_form(u8 opcode, u8 reg, Host base, u8 index, i32 displacement, bool wide)
+        {
+            rex(wide, reg, index, (u8)base);
+            emit(opcode);
+            modrm_memory(reg, base, index, displacement);
+        }
+
+        //[base + index + displacement]. rsp and r12 as a base need a SIB byte, rbp and r13 a displacement
+        void modrm_memory(u8 reg, Host base, u8 index, i32 displacement)
+        {
+            u8 base_id = (u8)base;
+            bool sib = index != no_index || (base_id & 7) == 4;
+            u8 mod = displacement == 0 && (base_id & 7) != 5 ? 0 : fits_i8(displacement) ? 1 : 2;
+            emit(mod << 6 | (reg & 7) << 3 | (sib ? 4 : base_id & 7));
+            if (sib)
+                emit(((index == no_index ? 4 : index & 7) << 3) | (base_id & 7));
+            if (mod == 1)
+                emit((u8)displacement);
+            else if (mod == 2)
+                emit32((u32)displacement);
+        }
+
+        Vector<u8> m_hot;
+        Vector<u8> m_cold;
+        Vector<Label> m_labels;
+        Vector<Fixup> m_fixups;
+        Section m_section { Section::Hot };
+    };
+
+    //what a call out tells the block that made it
+    enum class CallOutcome : u64
+    {
+        Proceed,
+        //blocks died, possibly this one, so it leaves at the next instruction
+        Leave,
+        Halt,
+        Trap
+    };
+
+    static u64 native_load(NVMMemory* memory, u64 address, u64 width)
+    {
+        switch (width)
+        {
+            case 0:
+                return memory->read_8(address);
+            case 1:
+                return memory->read_16(address);
+            case 2:
+                return memory->read_32(address);
+            default:
+                return memory->read_64(address);
+        }
+    }
+
+    static u64 native_store(NVMJit* jit, u64 address, u64 value, u64 width)
+    {
+        return jit->store(address, value, width);
+    }
+
+    static u64 native_interrupt(NVMJit* jit, u64 code)
+    {
+        return jit->interrupt(code);
+    }
+
+    u64 NVMJit::store(u64 address, u64 value, u64 width)
+    {
+        u64 generation = m_generation;
+        switch (width)
+        {
+            case 0:
+                m_memory.write_8(address, value);
+                break;
+            case 1:
+                m_memory.write_16(address, value);
+                break;
+            case 2:
+                m_memory.write_32(address, value);
+                break;
+            default:
+                m_memory.write_64(address, value);
+                break;
+        }
+        if (m_memory.has_fault())
+        {
+            m_memory.clear_fault();
+            m_trap = Trap::ProtectionFault;
+            return (u64)CallOutcome::Trap;
+        }
+        return (u64)(generation != m_generation ? CallOutcome::Leave : CallOutcome::Proceed);
+    }
+
+    u64 NVMJit::interrupt(u64 code)
+    {
+        auto handler = find(interrupt_table, code, [](const InterruptHandler& h, const u64& c) -> bool
+            { return h.code == c; });
+        if (handler == interrupt_table.end())
+        {
+            m_trap = Trap::InvalidInterrupt;
+            return (u64)CallOutcome::Trap;
+        }
+        u64 generation = m_generation;
+        if (handler->handle(m_registers, m_memory) == InterruptResult::Halt)
+            return (u64)CallOutcome::Halt;
+        if (m_memory.has_fault())
+        {
+            m_memory.clear_fault();
+            m_trap = Trap::ProtectionFault;
+            return (u64)CallOutcome::Trap;
+        }
+        m_registers[0] = 0;
+        return (u64)(generation != m_generation ? CallOutcome::Leave : CallOutcome::Proceed);
+    }
+
+    //whether a jump (numbered Jmp, Je, Jne, Jg, Jgu, Jl, Jlu) with both operands known is taken
+    static bool holds(u8 jump, u64 a, u64 b)
+    {
+        switch (jump)
+        {
+            case 0:
+                return true;
+            case 1:
+                return a == b;
+            case 2:
+                return a != b;
+            case 3:
+                return (i64)a > (i64)b;
+            case 4:
+                return a > b;
+            case 5:
+                return (i64)a < (i64)b;
+            default:
+                return a < b;
+        }
+    }
+
+    //the condition that holds with the operands of a compare swapped
+    static Condition mirror(Condition condition)
+    {
+        switch (condition)
+        {
+            case Condition::Greater:
+                return Condition::Less;
+            case Condition::Less:
+                return Condition::Greater;
+            case Condition::Above:
+                return Condition::Below;
+            case Condition::Below:
+                return Condition::Above;
+            default:
+                return condition;
+        }
+    }
+
+    /*
+     * translates one block. every exit stores the mapped registers back through the shared epilogue, with ip set to
+     * where the interpreter continues and, in checked mode, the number of instructions that completed.
+     * the optimizing tier knows which registers hold constants at each point of the block, starting from none at its
+     * start. constants are still written to their registers as the block goes, so exits and calls out never have to
+     * materialize them
+     */
+    class BlockCompiler
+    {
+    public:
+        BlockCompiler(NVMJit& jit, NVMMemory& memory, Trap* trap, u64* native_steps, bool checked, ExecutionTier tier,
+                      u64* entries, u64 optimizing_threshold) :
+                m_jit(jit), m_memory(memory), m_fast_path(memory.fast_path_state()), m_trap(trap),
+                m_native_steps(native_steps), m_checked(checked), m_tier(tier), m_entries(entries),
+                m_optimizing_threshold(optimizing_threshold)
+        {
+        }
+
+        Emitter& compile(const Vector<MicroOp>& ops, u64 address)
+        {
+            prologue();
+            m_emitter.bind(m_body);
+            count_entry(address);
+
+            for (u64 i = 0; i < ops.size(); i++)
+                translate(ops[i], i, address, nullptr);
+            const auto& last = ops[ops.size() - 1];
+            if (!is_jump(last.kind))
+                exit(NativeExit::Continue, last.next_ip, ops.size());
+            epilogue();
+            return m_emitter;
+        }
+
+        /*
+         * a trace checks the addresses it hoisted, then runs its micro-ops in a loop, with every jump replaced by a
+         * guard that leaves for the interpreter if it doesn't go where the recorded run went. in checked mode it leaves
+         * after one iteration instead of looping, like blocks do
+         */
+        Emitter& compile_trace(const NVMTrace& trace)
+        {
+            prologue();
+            u32 deoptimize = m_emitter.label();
+            for (const auto& check : trace.hoisted_checks())
+            {
+                //checks [low, flat_size) in one compare, by moving low to 0 along with the offset
+                u64 offset = check.offset - check.low;
+                load(Host::rax, operand(check.base, trace.anchor()));
+                if (fits_i32((i64)offset))
+                {
+                    if (offset != 0)
+                        m_emitter.alu(AluOp::Add, Host::rax, (i32)offset);
+                }
+                else
+                {
+                    m_emitter.mov(Host::rcx, offset);
+                    m_emitter.alu(AluOp::Add, Host::rax, Host::rcx);
+                }
+                m_emitter.mov(Host::r11, m_fast_path.flat_size - check.low - (1ul << check.width) + 1);
+                m_emitter.alu(AluOp::Cmp, Host::rax, Host::r11);
+                m_emitter.jump(Condition::AboveOrEqual, deoptimize);
+            }
+            m_emitter.bind(m_body);
+            count_entry(trace.anchor());
+
+            const auto& ops = trace.ops();
+            for (u64 i = 0; i < ops.size(); i++)
+            {
+                if (is_jump(ops[i].op.kind))
+                    translate_guard(ops[i].op, i, ops[i].successor);
+                else
+                    translate(ops[i].op, i, trace.anchor(), &ops[i]);
+            }
+            if (m_checked)
+                exit(NativeExit::Continue, trace.anchor(), ops.size());
+            else
+                m_emitter.jump(m_body);
+
+            m_emitter.switch_to(Emitter::Section::Cold);
+            m_emitter.bind(deoptimize);
+            exit(NativeExit::Deoptimize, trace.anchor(), 0);
+            m_emitter.switch_to(Emitter::Section::Hot);
+            epilogue();
+            return m_emitter;
+        }
+
+    private:
+        void prologue()
+        {
+            m_epilogue = m_emitter.label();
+            m_body = m_emitter.label();
+            for (auto host : callee_saved)
+                m_emitter.push(host);
+            //six pushes and the return address leave the stack 8 bytes off the alignment calls need
+            m_emitter.alu(AluOp::Sub, Host::rsp, 8);
+            m_emitter.mov(Host::rbx, Host::rdi);
+            fill(false);
+            m_emitter.mov(Host::r10, (u64)m_fast_path.flat);
+        }
+
+        void epilogue()
+        {
+            m_emitter.bind(m_epilogue);
+            spill(false);
+            m_emitter.alu(AluOp::Add, Host::rsp, 8);
+            for (u64 i = sizeof(callee_saved) / sizeof(callee_saved[0]); i > 0; i--)
+                m_emitter.pop(callee_saved[i - 1]);
+            m_emitter.ret();
+        }
+
+        static bool is_jump(MicroOpKind kind)
+        {
+            return kind >= MicroOpKind::JmpR && kind <= MicroOpKind::JluI;
+        }
+
+        //traces are optimized the same way
+        bool optimizing() const
+        {
+            return m_tier >= ExecutionTier::Optimizing;
+        }
+
+        //baseline blocks leave to be optimized once they started often enough, before running anything
+        void count_entry(u64 address)
+        {
+            m_emitter.mov(Host::r11, (u64)m_entries);
+            m_emitter.alu_memory(AluOp::Add, Host::r11, 0, 1);
+            if (m_tier != ExecutionTier::Baseline)
+                return;
+            u32 tier_up = m_emitter.label();
+            m_emitter.alu_memory(AluOp::Cmp, Host::r11, 0, (i32)m_optimizing_threshold);
+            m_emitter.jump(Condition::Equal, tier_up);
+            m_emitter.switch_to(Emitter::Section::Cold);
+            m_emitter.bind(tier_up);
+            exit(NativeExit::TierUp, address, 0);
+            m_emitter.switch_to(Emitter::Section::Hot);
+        }
+
+        //guest registers to the register file. calls out only clobber the caller saved ones
+        void spill(bool caller_saved_only)
+        {
+            for (u8 id = 0; id < 16; id++)
+            {
+                u8 host = host_register_for[id];
+                if (host != unmapped && (!caller_saved_only || is_caller_saved(host)))
+                    m_emitter.store(Host::rbx, id * sizeof(u64), (Host)host);
+            }
+        }
+
+        void fill(bool caller_saved_only)
+        {
+            for (u8 id = 0; id < 16; id++)
+            {
+                u8 host = host_register_for[id];
+                if (host != unmapped && (!caller_saved_only || is_caller_saved(host)))
+                    m_emitter.load((Host)host, Host::rbx, id * sizeof(u64));
+            }
+        }
+
+        static bool is_caller_saved(u8 host)
+        {
+            for (auto saved : callee_saved)
+            {
+                if ((u8)saved == host)
+                    return false;
+            }
+            return true;
+        }
+
+        Operand operand(u8 id, u64 next_ip)
+        {
+            if (id == 0)
+                return { Operand::Kind::Immediate, Host::rax, 0 };
+            if (id == ip_id)
+                return { Operand::Kind::Immediate, Host::rax, next_ip };
+            if (m_known[id])
+                return { Operand::Kind::Immediate, Host::rax, m_constants[id] };
+            if (host_register_for[id] != unmapped)
+                return { Operand::Kind::Register, (Host)host_register_for[id], 0 };
+            return { Operand::Kind::Memory, Host::rax, id * sizeof(u64) };
+        }
+
+        Operand immediate(u64 value)
+        {
+            return { Operand::Kind::Immediate, Host::rax, value };
+        }
+
+        void load(Host destination, const Operand& source)
+        {
+            switch (source.kind)
+            {
+                case Operand::Kind::Register:
+                    m_emitter.mov(destination, source.host);
+                    break;
+                case Operand::Kind::Immediate:
+                    m_emitter.mov(destination, source.value);
+                    break;
+                case Operand::Kind::Memory:
+                    m_emitter.load(destination, Host::rbx, source.value);
+                    break;
+            }
+        }
+
+        //r0 and ip drop whatever is written to them
+        void write_result(u8 id, Host source)
+        {
+            if (id == 0 || id == ip_id)
+                return;
+            m_known[id] = false;
+            if (host_register_for[id] != unmapped)
+                m_emitter.mov((Host)host_register_for[id], source);
+            else
+                m_emitter.store(Host::rbx, id * sizeof(u64), source);
+        }
+
+        //where the optimizing tier computes a result: straight in its host register if it has one
+        Host result_register(u8 id)
+        {
+            if (id == 0 || id == ip_id || host_register_for[id] == unmapped)
+                return Host::rax;
+            return (Host)host_register_for[id];
+        }
+
+        void finish_result(u8 id, Host result)
+        {
+            if (result == Host::rax)
+                write_result(id, Host::rax);
+            else
+                m_known[id] = false;
+        }
+
+        void set_constant(u8 id, u64 value)
+        {
+            if (id == 0 || id == ip_id)
+                return;
+            if (host_register_for[id] != unmapped)
+            {
+                m_emitter.mov((Host)host_register_for[id], value);
+            }
+            else if (fits_i32((i64)value))
+            {
+                m_emitter.store(Host::rbx, id * sizeof(u64), (i32)value);
+            }
+            else
+            {
+                m_emitter.mov(Host::rax, value);
+                m_emitter.store(Host::rbx, id * sizeof(u64), Host::rax);
+            }
+            m_known[id] = true;
+            m_constants[id] = value;
+        }
+
+        void forget_all()
+        {
+            for (u8 id = 0; id < 16; id++)
+                m_known[id] = false;
+        }
+
+        static bool is_register(const Operand& operand, Host host)
+        {
+            return operand.kind == Operand::Kind::Register && operand.host == host;
+        }
+
+        void alu(AluOp op, Host destination, const Operand& source)
+        {
+            switch (source.kind)
+            {
+                case Operand::Kind::Register:
+                    m_emitter.alu(op, destination, source.host);
+                    break;
+                case Operand::Kind::Immediate:
+                    if (fits_i32((i64)source.value))
+                    {
+                        m_emitter.alu(op, destination, (i32)source.value);
+                    }
+                    else
+                    {
+                        m_emitter.mov(Host::rcx, source.value);
+                        m_emitter.alu(op, destination, Host::rcx);
+                    }
+                    break;
+                case Operand::Kind::Memory:
+                    m_emitter.alu(op, destination, Host::rbx, Emitter::no_index, source.value);
+                    break;
+            }
+        }
+
+        void multiply(Host destination, const Operand& source)
+        {
+            switch (source.kind)
+            {
+                case Operand::Kind::Register:
+                    m_emitter.imul(destination, source.host);
+                    break;
+                case Operand::Kind::Immediate:
+                    if (fits_i32((i64)source.value))
+                    {
+                        m_emitter.imul(destination, destination, (i32)source.value);
+                    }
+                    else
+                    {
+                        m_emitter.mov(Host::rcx, source.value);
+                        m_emitter.imul(destination, Host::rcx);
+                    }
+                    break;
+                case Operand::Kind::Memory:
+                    m_emitter.imul(destination, Host::rbx, Emitter::no_index, source.value);
+                    break;
+            }
+        }
+
+        /*
+         * the optimizing tier's two operand arithmetic: folded if both operands are known, otherwise computed into
+         * the result's own host register, with commutative operands swapped so that neither a known left operand nor
+         * a right operand living in that register gets in the way. operations with no effect are left out
+         */
+        void translate_arithmetic(const MicroOp& op, AluOp alu_op, bool multiply_op, Operand left, Operand right)
+        {
+            if (left.kind == Operand::Kind::Immediate && right.kind == Operand::Kind::Immediate)
+            {
+                set_constant(op.a, fold(op.kind, left.value, right.value));
+                return;
+            }
+            bool commutative = multiply_op || alu_op != AluOp::Sub;
+            Host result = result_register(op.a);
+            if (commutative && (left.kind == Operand::Kind::Immediate || (is_register(right, result) && !is_register(left, result))))
+            {
+                Operand swapped = left;
+                left = right;
+                right = swapped;
+            }
+            else if (is_register(right, result) && !is_register(left, result))
+            {
+                result = Host::rax;
+            }
+            bool identity = right.kind == Operand::Kind::Immediate &&
+                            (multiply_op ? right.value == 1 : right.value == (alu_op == AluOp::And ? ~0ul : 0));
+            if (multiply_op && !identity && left.kind == Operand::Kind::Register && right.kind == Operand::Kind::Immediate &&
+                fits_i32((i64)right.value))
+            {
+                m_emitter.imul(result, left.host, (i32)right.value);
+            }
+            else
+            {
+                load(result, left);
+                if (!identity && multiply_op)
+                    multiply(result, right);
+                else if (!identity)
+                    alu(alu_op, result, right);
+            }
+            finish_result(op.a, result);
+        }
+
+        void store_ip(u64 ip)
+        {
+            if (fits_i32((i64)ip))
+            {
+                m_emitter.store(Host::rbx, ip_id * sizeof(u64), (i32)ip);
+            }
+            else
+            {
+                m_emitter.mov(Host::rax, ip);
+                m_emitter.store(Host::rbx, ip_id * sizeof(u64), Host::rax);
+            }
+        }
+
+        void exit(NativeExit reason, u64 ip, u64 steps)
+        {
+            store_ip(ip);
+            exit(reason, steps);
+        }
+
+        //with ip already stored
+        void exit(NativeExit reason, u64 steps)
+        {
+            if (m_checked)
+            {
+                m_emitter.mov(Host::rcx, (u64)m_native_steps);
+                m_emitter.store(Host::rcx, 0, (i32)steps);
+            }
+            m_emitter.mov(Host::rax, (u64)reason);
+            m_emitter.jump(m_epilogue);
+        }
+
+        void trap(Trap reason, u64 address, u64 steps)
+        {
+            static_assert(sizeof(Trap) == sizeof(u32));
+            m_emitter.mov(Host::rcx, (u64)m_trap);
+            m_emitter.store(Host::rcx, 0, (i32)reason, false);
+            exit(NativeExit::Trap, address, steps);
+        }
+
+        //calls target with its arguments already in place, which the caller can only do after spilling, since rsi and
+        //rdi hold guest registers. reloads what was spilled: the caller saved registers, or all of them
+        void call_out(void* target, bool spilled_all)
+        {
+            m_emitter.mov(Host::rax, (u64)target);
+            m_emitter.call(Host::rax);
+            fill(!spilled_all);
+            m_emitter.mov(Host::r10, (u64)m_fast_path.flat);
+        }
+
+        //after a call out returning a CallOutcome, with the instruction at address done unless it trapped
+        void check_outcome(u64 address, u64 next_ip, u64 index)
+        {
+            auto section = m_emitter.section();
+            u32 leave = m_emitter.label();
+            m_emitter.test(Host::rax, Host::rax);
+            m_emitter.jump(Condition::NotEqual, leave);
+
+            m_emitter.switch_to(Emitter::Section::Cold);
+            m_emitter.bind(leave);
+            u32 halt = m_emitter.label();
+            u32 trapped = m_emitter.label();
+            m_emitter.alu(AluOp::Cmp, Host::rax, (i32)CallOutcome::Halt);
+            m_emitter.jump(Condition::Equal, halt);
+            m_emitter.jump(Condition::Greater, trapped);
+            exit(NativeExit::Continue, next_ip, index + 1);
+            m_emitter.bind(halt);
+            exit(NativeExit::Halt, next_ip, index + 1);
+            m_emitter.bind(trapped);
+            exit(NativeExit::Trap, address, index);
+            m_emitter.switch_to(section);
+        }
+
+        //whether an access of bytes at a known address is always in the flat region at or above low, and reachable by
+        //a displacement
+        bool in_flat_region(const Operand& address, u64 bytes, u64 low = 0)
+        {
+            return optimizing() && address.kind == Operand::Kind::Immediate && address.value <= 0x7FFFFFFF &&
+                   address.value >= low && address.value + bytes <= m_fast_path.flat_size;
+        }
+
+        //rax holds the guest address; on the way out it holds the zero extended value
+        void emit_load(u8 width)
+        {
+            u64 bytes = 1ul << width;
+            u32 slow = m_emitter.label();
+            u32 resume = m_emitter.label();
+            if (m_fast_path.flat_size >= bytes)
+            {
+                m_emitter.mov(Host::r11, m_fast_path.flat_size - bytes + 1);
+                m_emitter.alu(AluOp::Cmp, Host::rax, Host::r11);
+                m_emitter.jump(Condition::AboveOrEqual, slow);
+                m_emitter.load(width, Host::rax, Host::r10, (u8)Host::rax);
+            }
+            else
+            {
+                m_emitter.jump(slow);
+            }
+            m_emitter.bind(resume);
+
+            m_emitter.switch_to(Emitter::Section::Cold);
+            m_emitter.bind(slow);
+            u32 call = m_emitter.label();
+            tlb_lookup(m_fast_path.read_tlb, bytes, call);
+            m_emitter.load(width, Host::rax, Host::r10, (u8)Host::rcx);
+            m_emitter.mov(Host::r10, (u64)m_fast_path.flat);
+            m_emitter.jump(resume);
+            m_emitter.bind(call);
+            spill(true);
+            m_emitter.mov(Host::rdi, (u64)&m_memory);
+            m_emitter.mov(Host::rsi, Host::rax);
+            m_emitter.mov(Host::rdx, (u64)width);
+            call_out((void*)native_load, false);
+            m_emitter.jump(resume);
+            m_emitter.switch_to(Emitter::Section::Hot);
+        }
+
+        //rax holds the guest address and rdx the value. addresses known to be in the flat region only need the check
+        //for code
+        void emit_store(u8 width, u64 address, u64 next_ip, u64 index, bool flat)
+        {
+            u64 bytes = 1ul << width;
+            u32 slow = m_emitter.label();
+            u32 call = m_emitter.label();
+            u32 resume = m_emitter.label();
+            //stores that may hit code go through NVMMemory, which tells the instruction cache and the JIT
+            m_emitter.mov(Host::r11, (u64)m_fast_path.code_watch);
+            m_emitter.mov(Host::rcx, Host::rax);
+            m_emitter.alu(AluOp::Sub, Host::rcx, Host::r11, Emitter::no_index, offsetof(NVMMemory::CodeWatch, low));
+            m_emitter.alu(AluOp::Cmp, Host::rcx, Host::r11, Emitter::no_index, offsetof(NVMMemory::CodeWatch, span));
+            m_emitter.jump(Condition::Below, call);
+            if (flat)
+            {
+                m_emitter.store(width, Host::r10, (u8)Host::rax, Host::rdx);
+            }
+            else if (m_fast_path.flat_size - m_fast_path.flat_write_low >= bytes)
+            {
+                //the flat region below flat_write_low may be read only, and is left to NVMMemory
+                Host offset = Host::rax;
+                if (m_fast_path.flat_write_low != 0)
+                {
+                    offset = Host::rcx;
+                    m_emitter.mov(Host::rcx, Host::rax);
+                    m_emitter.mov(Host::r11, m_fast_path.flat_write_low);
+                    m_emitter.alu(AluOp::Sub, Host::rcx, Host::r11);
+                }
+                m_emitter.mov(Host::r11, m_fast_path.flat_size - m_fast_path.flat_write_low - bytes + 1);
+                m_emitter.alu(AluOp::Cmp, offset, Host::r11);
+                m_emitter.jump(Condition::AboveOrEqual, slow);
+                m_emitter.store(width, Host::r10, (u8)Host::rax, Host::rdx);
+            }
+            else
+            {
+                m_emitter.jump(slow);
+            }
+            m_emitter.bind(resume);
+
+            m_emitter.switch_to(Emitter::Section::Cold);
+            if (!flat)
+            {
+                m_emitter.bind(slow);
+                tlb_lookup(m_fast_path.write_tlb, bytes, call);
+                m_emitter.store(width, Host::r10, (u8)Host::rcx, Host::rdx);
+                m_emitter.mov(Host::r10, (u64)m_fast_path.flat);
+                m_emitter.jump(resume);
+            }
+            m_emitter.bind(call);
+            spill(true);
+            m_emitter.mov(Host::rsi, Host::rax);
+            m_emitter.mov(Host::rdi, (u64)&m_jit);
+            m_emitter.mov(Host::rcx, (u64)width);
+            call_out((void*)native_store, false);
+            check_outcome(address, next_ip, index);
+            m_emitter.jump(resume);
+            m_emitter.switch_to(Emitter::Section::Hot);
+        }
+
+        //looks the page of rax up in a TLB half; leaves the host page in r10 and the offset in rcx, or jumps to miss
+        //with rax untouched. r10 is the flat base again after either way out of the caller's slow path
+        void tlb_lookup(const NVMMemory::TlbEntry* tlb, u64 bytes, u32 miss)
+        {
+            //bits 12 to 47 of the address
+            m_emitter.mov(Host::rcx, Host::rax);
+            m_emitter.shift(4, Host::rcx, 64 - NVMMemory::address_bits);
+            m_emitter.shift(5, Host::rcx, 64 - NVMMemory::address_bits + NVMMemory::page_bits);
+            m_emitter.mov(Host::r11, Host::rcx);
+            m_emitter.alu(AluOp::And, Host::r11, (i32)NVMMemory::tlb_mask);
+            m_emitter.shift(4, Host::r11, 4);
+            m_emitter.mov(Host::r10, (u64)tlb);
+            m_emitter.alu(AluOp::Cmp, Host::rcx, Host::r10, (u8)Host::r11, offsetof(NVMMemory::TlbEntry, page_number));
+            m_emitter.jump(Condition::NotEqual, miss);
+            m_emitter.alu(AluOp::Add, Host::r10, Host::r11);
+            m_emitter.load(Host::r10, Host::r10, offsetof(NVMMemory::TlbEntry, page));
+            m_emitter.mov(Host::rcx, Host::rax);
+            m_emitter.alu(AluOp::And, Host::rcx, (i32)NVMMemory::page_mask);
+            m_emitter.alu(AluOp::Cmp, Host::rcx, (i32)(NVMMemory::page_size - bytes));
+            m_emitter.jump(Condition::Above, miss);
+        }
+
+        //traced is what the trace compiler found out about the micro-op, or null in a block
+        void translate(const MicroOp& op, u64 index, u64 block_address, const TraceOp* traced)
+        {
+            TraceAccess access = traced != nullptr ? traced->access : TraceAccess::Checked;
+            u64 address = op.next_ip - op.words * sizeof(u32);
+            bool uses_register = ((u8)op.kind - (u8)MicroOpKind::AddR) % 2 == 0;
+            Operand left = operand(op.b, op.next_ip);
+            Operand right = uses_register ? operand(op.c, op.next_ip) : immediate(op.imm);
+            switch (op.kind)
+            {
+                case MicroOpKind::AddR:
+                case MicroOpKind::AddI:
+                case MicroOpKind::SubR:
+                case MicroOpKind::SubI:
+                case MicroOpKind::AndR:
+                case MicroOpKind::AndI:
+                case MicroOpKind::OrR:
+                case MicroOpKind::OrI:
+                case MicroOpKind::XorR:
+                case MicroOpKind::XorI:
+                {
+                    AluOp alu_op = op.kind <= MicroOpKind::AddI ? AluOp::Add : op.kind <= MicroOpKind::SubI ? AluOp::Sub
+                        : op.kind <= MicroOpKind::AndI ? AluOp::And : op.kind <= MicroOpKind::OrI ? AluOp::Or : AluOp::Xor;
+                    if (optimizing())
+                    {
+                        translate_arithmetic(op, alu_op, false, left, right);
+                        break;
+                    }
+                    load(Host::rax, left);
+                    alu(alu_op, Host::rax, right);
+                    write_result(op.a, Host::rax);
+                    break;
+                }
+                case MicroOpKind::MulR:
+                case MicroOpKind::MulI:
+                    if (optimizing())
+                    {
+                        translate_arithmetic(op, AluOp::Add, true, left, right);
+                        break;
+                    }
+                    load(Host::rax, left);
+                    multiply(Host::rax, right);
+                    write_result(op.a, Host::rax);
+                    break;
+                case MicroOpKind::DivR:
+                case MicroOpKind::DivI:
+                {
+                    bool known_divisor = right.kind == Operand::Kind::Immediate;
+                    if (optimizing() && known_divisor && right.value != 0 && left.kind == Operand::Kind::Immediate)
+                    {
+                        set_constant(op.a, fold(op.kind, left.value, right.value));
+                        break;
+                    }
+                    u32 by_zero = m_emitter.label();
+                    u32 negate = m_emitter.label();
+                    u32 resume = m_emitter.label();
+                    load(Host::rcx, right);
+                    if (!known_divisor || right.value == 0)
+                    {
+                        m_emitter.test(Host::rcx, Host::rcx);
+                        m_emitter.jump(Condition::Equal, by_zero);
+                    }
+                    load(Host::rax, left);
+                    if (known_divisor && right.value == (u64)-1)
+                    {
+                        m_emitter.unary(3, Host::rax);
+                    }
+                    else
+                    {
+                        if (!known_divisor)
+                        {
+                            m_emitter.alu(AluOp::Cmp, Host::rcx, -1);
+                            m_emitter.jump(Condition::Equal, negate);
+                        }
+                        m_emitter.cqo();
+                        m_emitter.unary(7, Host::rcx);
+                    }
+                    m_emitter.bind(resume);
+                    write_result(op.a, Host::rax);
+
+                    m_emitter.switch_to(Emitter::Section::Cold);
+                    m_emitter.bind(negate);
+                    //INT64_MIN / -1 traps on the host, so negation is done by hand
+                    m_emitter.unary(3, Host::rax);
+                    m_emitter.jump(resume);
+                    m_emitter.bind(by_zero);
+                    trap(Trap::DivisionByZero, address, index);
+                    m_emitter.switch_to(Emitter::Section::Hot);
+                    break;
+                }
+                case MicroOpKind::Neg:
+                case MicroOpKind::Not:
+                {
+                    if (optimizing() && left.kind == Operand::Kind::Immediate)
+                    {
+                        set_constant(op.a, fold(op.kind, left.value, 0));
+                        break;
+                    }
+                    Host result = optimizing() ? result_register(op.a) : Host::rax;
+                    load(result, left);
+                    m_emitter.unary(op.kind == MicroOpKind::Neg ? 3 : 2, result);
+                    finish_result(op.a, result);
+                    break;
+                }
+                case MicroOpKind::ShlR:
+                case MicroOpKind::ShlI:
+                case MicroOpKind::ShrR:
+                case MicroOpKind::ShrI:
+                case MicroOpKind::SraR:
+                case MicroOpKind::SraI:
+                {
+                    if (optimizing() && left.kind == Operand::Kind::Immediate && right.kind == Operand::Kind::Immediate)
+                    {
+                        set_constant(op.a, fold(op.kind, left.value, right.value));
+                        break;
+                    }
+                    u8 extension = op.kind <= MicroOpKind::ShlI ? 4 : op.kind <= MicroOpKind::ShrI ? 5 : 7;
+                    Host result = optimizing() ? result_register(op.a) : Host::rax;
+                    if (right.kind == Operand::Kind::Immediate)
+                    {
+                        load(result, left);
+                        if (!optimizing() || (right.value & 63) != 0)
+                            m_emitter.shift(extension, result, right.value & 63);
+                    }
+                    else
+                    {
+                        load(Host::rcx, right);
+                        load(result, left);
+                        m_emitter.shift(extension, result);
+                    }
+                    finish_result(op.a, result);
+                    break;
+                }
+                case MicroOpKind::Load8R:
+                case MicroOpKind::Load8I:
+                case MicroOpKind::Load16R:
+                case MicroOpKind::Load16I:
+                case MicroOpKind::Load32R:
+                case MicroOpKind::Load32I:
+                case MicroOpKind::Load64R:
+                case MicroOpKind::Load64I:
+                {
+                    u8 width = ((u8)op.kind - (u8)MicroOpKind::Load8R) / 2;
+                    if (access == TraceAccess::Known)
+                    {
+                        set_constant(op.a, traced->value);
+                        break;
+                    }
+                    if (access == TraceAccess::Forwarded)
+                    {
+                        Host result = result_register(op.a);
+                        load(result, operand(traced->source, op.next_ip));
+                        finish_result(op.a, result);
+                        break;
+                    }
+                    if (access == TraceAccess::Hoisted && right.kind != Operand::Kind::Immediate)
+                    {
+                        Host index_register = right.kind == Operand::Kind::Register ? right.host : Host::rax;
+                        load(index_register, right);
+                        Host result = result_register(op.a);
+                        m_emitter.load(width, result, Host::r10, (u8)index_register);
+                        finish_result(op.a, result);
+                        break;
+                    }
+                    if (in_flat_region(right, 1ul << width))
+                    {
+                        Host result = result_register(op.a);
+                        m_emitter.load(width, result, Host::r10, Emitter::no_index, (i32)right.value);
+                        finish_result(op.a, result);
+                        break;
+                    }
+                    load(Host::rax, right);
+                    emit_load(width);
+                    write_result(op.a, Host::rax);
+                    break;
+                }
+                case MicroOpKind::Store8R:
+                case MicroOpKind::Store8I:
+                case MicroOpKind::Store16R:
+                case MicroOpKind::Store16I:
+                case MicroOpKind::Store32R:
+                case MicroOpKind::Store32I:
+                case MicroOpKind::Store64R:
+                case MicroOpKind::Store64I:
+                {
+                    u8 width = ((u8)op.kind - (u8)MicroOpKind::Store8R) / 2;
+                    if (access == TraceAccess::Dead)
+                        break;
+                    load(Host::rax, right);
+                    load(Host::rdx, operand(op.a, op.next_ip));
+                    emit_store(width, address, op.next_ip, index,
+                               access == TraceAccess::Hoisted ||
+                               in_flat_region(right, 1ul << width, m_fast_path.flat_write_low));
+                    break;
+                }
+                case MicroOpKind::Int:
+                    //the interrupt table works on the register file, and ip reads as it would in the interpreter
+                    spill(false);
+                    store_ip(op.next_ip);
+                    m_emitter.mov(Host::rdi, (u64)&m_jit);
+                    m_emitter.mov(Host::rsi, op.imm);
+                    call_out((void*)native_interrupt, true);
+                    check_outcome(address, op.next_ip, index);
+                    //interrupt handlers write registers
+                    forget_all();
+                    break;
+                default:
+                    translate_jump(op, index, block_address);
+                    break;
+            }
+        }
+
+        //compares the operands of a conditional jump (numbered as in holds()), and returns the condition the jump is
+        //taken on
+        Condition compare(u8 jump, Operand a, Operand b)
+        {
+            //Jmp, Je, Jne, Jg, Jgu, Jl, Jlu
+            constexpr Condition conditions[] { Condition::Equal, Condition::Equal, Condition::NotEqual,
+                Condition::Greater, Condition::Above, Condition::Less, Condition::Below };
+            Condition condition = conditions[jump];
+            if (!optimizing())
+            {
+                load(Host::rax, a);
+                alu(AluOp::Cmp, Host::rax, b);
+                return condition;
+            }
+            if (a.kind == Operand::Kind::Immediate)
+            {
+                Operand swapped = a;
+                a = b;
+                b = swapped;
+                condition = mirror(condition);
+            }
+            Host compared = a.kind == Operand::Kind::Register ? a.host : Host::rax;
+            load(compared, a);
+            if (b.kind == Operand::Kind::Immediate && b.value == 0)
+                m_emitter.test(compared, compared);
+            else
+                alu(AluOp::Cmp, compared, b);
+            return condition;
+        }
+
+        void translate_jump(const MicroOp& op, u64 index, u64 block_address)
+        {
+            u8 jump = ((u8)op.kind - (u8)MicroOpKind::JmpR) / 2;
+            bool uses_register = ((u8)op.kind - (u8)MicroOpKind::JmpR) % 2 == 0;
+            Operand a = operand(op.a, op.next_ip);
+            Operand b = operand(op.b, op.next_ip);
+            bool always = jump == 0 || (jump == 1 && op.a == op.b);
+            if (a.kind == Operand::Kind::Immediate && b.kind == Operand::Kind::Immediate && optimizing())
+            {
+                if (!holds(jump, a.value, b.value))
+                {
+                    exit(NativeExit::Continue, op.next_ip, index + 1);
+                    return;
+                }
+                always = true;
+            }
+            u32 taken = m_emitter.label();
+            if (!always)
+            {
+                m_emitter.jump(compare(jump, a, b), taken);
+                exit(NativeExit::Continue, op.next_ip, index + 1);
+                m_emitter.switch_to(Emitter::Section::Cold);
+            }
+
+            m_emitter.bind(taken);
+            if (uses_register)
+            {
+                load(Host::rax, operand(op.c, op.next_ip));
+                m_emitter.store(Host::rbx, ip_id * sizeof(u64), Host::rax);
+                exit(NativeExit::Continue, index + 1);
+            }
+            else if (op.imm == block_address && !m_checked)
+            {
+                m_emitter.jump(m_body);
+            }
+            else
+            {
+                exit(NativeExit::Continue, op.imm, index + 1);
+            }
+            m_emitter.switch_to(Emitter::Section::Hot);
+        }
+
+        //a jump inside a trace, which goes on to successor. going anywhere else is a side exit to the interpreter,
+        //which continues where the jump went with every register already in place
+        void translate_guard(const MicroOp& op, u64 index, u64 successor)
+        {
+            u8 jump = ((u8)op.kind - (u8)MicroOpKind::JmpR) / 2;
+            bool uses_register = ((u8)op.kind - (u8)MicroOpKind::JmpR) % 2 == 0;
+            bool always = jump == 0 || (jump == 1 && op.a == op.b);
+            //a register jump to the next instruction is taken to have fallen through
+            bool taken = always || (uses_register ? successor != op.next_ip : successor == op.imm);
+            if (!always)
+            {
+                Operand a = operand(op.a, op.next_ip);
+                Operand b = operand(op.b, op.next_ip);
+                u32 side_exit = m_emitter.label();
+                if (a.kind != Operand::Kind::Immediate || b.kind != Operand::Kind::Immediate)
+                    m_emitter.jump(taken ? invert(compare(jump, a, b)) : compare(jump, a, b), side_exit);
+                else if (holds(jump, a.value, b.value) != taken)
+                    m_emitter.jump(side_exit);
+
+                m_emitter.switch_to(Emitter::Section::Cold);
+                m_emitter.bind(side_exit);
+                if (taken)
+                {
+                    exit(NativeExit::Continue, op.next_ip, index + 1);
+                }
+                else if (uses_register)
+                {
+                    load(Host::rax, operand(op.c, op.next_ip));
+                    m_emitter.store(Host::rbx, ip_id * sizeof(u64), Host::rax);
+                    exit(NativeExit::Continue, index + 1);
+                }
+                else
+                {
+                    exit(NativeExit::Continue, op.imm, index + 1);
+                }
+                m_emitter.switch_to(Emitter::Section::Hot);
+            }
+            if (!taken || !uses_register)
+                return;
+
+            Operand target = operand(op.c, op.next_ip);
+            u32 elsewhere = m_emitter.label();
+            if (target.kind == Operand::Kind::Immediate)
+            {
+                if (target.value != successor)
+                    m_emitter.jump(elsewhere);
+            }
+            else
+            {
+                load(Host::rax, target);
+                alu(AluOp::Cmp, Host::rax, immediate(successor));
+                m_emitter.jump(Condition::NotEqual, elsewhere);
+            }
+            m_emitter.switch_to(Emitter::Section::Cold);
+            m_emitter.bind(elsewhere);
+            load(Host::rax, target);
+            m_emitter.store(Host::rbx, ip_id * sizeof(u64), Host::rax);
+            exit(NativeExit::Continue, index + 1);
+            m_emitter.switch_to(Emitter::Section::Hot);
+        }
+
+        Emitter m_emitter;
+        NVMJit& m_jit;
+        NVMMemory& m_memory;
+        NVMMemory::FastPathState m_fast_path;
+        Trap* m_trap;
+        u64* m_native_steps;
+        bool m_checked;
+        ExecutionTier m_tier;
+        u64* m_entries;
+        u64 m_optimizing_threshold;
+        u32 m_epilogue { 0 };
+        u32 m_body { 0 };
+        //optimizing tier: the registers known to hold m_constants at the instruction being translated
+        bool m_known[16] {};
+        u64 m_constants[16] {};
+    };
+
+    NVMJit::NVMJit(u64* registers, NVMMemory& memory, NVMInstructionCache& code_cache, bool checked,
+                   u16 baseline_threshold, u64 optimizing_threshold) :
+            m_registers(registers), m_memory(memory), m_code_cache(code_cache), m_checked(checked)
+    {
+        if (baseline_threshold == 0)
+            baseline_threshold = checked ? checked_baseline_threshold : default_baseline_threshold;
+        if (optimizing_threshold == 0)
+            optimizing_threshold = checked ? checked_optimizing_threshold : default_optimizing_threshold;
+        m_baseline_threshold = baseline_threshold < max_baseline_threshold ? baseline_threshold : max_baseline_threshold;
+        //blocks compare their count against it as a 32 bit immediate
+        m_optimizing_threshold = optimizing_threshold < 0x7FFFFFFF ? optimizing_threshold : 0x7FFFFFFF;
+        m_trace_threshold = checked ? checked_trace_threshold : default_trace_threshold;
+
+        void* code = mmap(nullptr, code_buffer_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (code != MAP_FAILED)
+            m_code = (u8*)code;
+        m_code_cache.attach_jit(this);
+    }
+
+    NVMJit::~NVMJit()
+    {
+        m_code_cache.attach_jit(nullptr);
+        delete m_recording;
+        if (m_code != nullptr)
+            munmap(m_code, code_buffer_size);
+        for (auto block : m_all_blocks)
+            delete block;
+        free(m_live);
+    }
+
+    static u64 now_nanoseconds()
+    {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time.tv_sec * 1000000000ul + time.tv_nsec;
+    }
+
+    //the pages the code goes to are made writable, and executable again once it is in. blocks sharing the first of them
+    //can't be running, since nothing is compiled while native code runs
+    static bool write_code(u8* code, Emitter& emitter)
+    {
+        auto first = (u8*)((u64)code & ~NVMMemory::page_mask);
+        auto end = (u8*)(((u64)code + emitter.size() + NVMMemory::page_mask) & ~NVMMemory::page_mask);
+        if (mprotect(first, end - first, PROT_READ | PROT_WRITE) != 0)
+            return false;
+        emitter.finish(code);
+        return mprotect(first, end - first, PROT_READ | PROT_EXEC) == 0;
+    }
+
+    u64 NVMJit::form_block(u64 address, Vector<MicroOp>& ops)
+    {
+        u64 next = address;
+        while (ops.size() < max_block_instructions)
+        {
+            MicroOp op = *m_code_cache.decoded(next);
+            //left to the interpreter, which traps on them, and in checked mode interrupts are too since their
+            //effects on the outside world can't be taken back
+            if (op.kind == MicroOpKind::InvalidInstruction || (m_checked && op.kind == MicroOpKind::Int))
+                break;
+            ops.append(op);
+            next = op.next_ip;
+            if (op.kind >= MicroOpKind::JmpR && op.kind <= MicroOpKind::JluI)
+                break;
+        }
+        return next;
+    }
+
+    bool NVMJit::compile(u64 address, ExecutionTier tier)
+    {
+        if (m_code == nullptr)
+            return false;
+        auto existing = m_blocks.get(address);
+        if (existing.has_value() && existing.value()->live && existing.value()->tier >= tier)
+        {
+            m_code_cache.enter_native(address);
+            return true;
+        }
+
+        u64 start = now_nanoseconds();
+        Vector<MicroOp> ops;
+        u64 next = form_block(address, ops);
+        if (ops.size() == 0)
+            return false;
+
+        //generated code counts its entries in the block, so it has to exist first
+        NativeBlock* block;
+        if (existing.has_value())
+        {
+            block = existing.value();
+            retire(block);
+        }
+        else
+        {
+            block = new NativeBlock {};
+            m_blocks.insert(address, block);
+            m_all_blocks.append(block);
+        }
+
+        BlockCompiler compiler(*this, m_memory, &m_trap, &m_native_steps, m_checked, tier, &block->entries,
+                               m_optimizing_threshold);
+        auto& emitter = compiler.compile(ops, address);
+        if (emitter.size() > code_buffer_size)
+            return false;
+        //the code just generated counts into block, which goes with the rest, so it is generated again
+        if (m_code_used + emitter.size() > code_buffer_size || m_dead_code > max_dead_code)
+        {
+            flush();
+            return compile(address, tier);
+        }
+        u8* code = m_code + m_code_used;
+        //a page left writable would take the blocks already on it down with it
+        if (!write_code(code, emitter))
+        {
+            flush();
+            return false;
+        }
+        m_code_used += emitter.size();
+
+        bool was_live = block->live;
+        if (was_live)
+            discard_code(block);
+        *block = { address, address, next, ops.size(), (NativeExit(*)(u64*))code, emitter.size(), tier, 0, true,
+                   nullptr, 0 };
+        if (!was_live)
+            add_live(block);
+        if (address < m_low)
+            m_low = address;
+        if (next > m_high)
+            m_high = next;
+        auto& statistics = m_statistics[(u8)tier];
+        statistics.compiled_blocks++;
+        statistics.compile_nanoseconds += now_nanoseconds() - start;
+        m_code_cache.enter_native(address);
+        return true;
+    }
+
+    bool NVMJit::compile_trace(NVMTrace& trace)
+    {
+        if (m_code == nullptr)
+            return false;
+        u64 start = now_nanoseconds();
+        auto fast_path = m_memory.fast_path_state();
+        trace.optimize(fast_path.flat_size, fast_path.flat_write_low, m_registers);
+        auto record = m_free_traces;
+        if (record != nullptr)
+        {
+            m_free_traces = record->trace;
+        }
+        else
+        {
+            record = new NativeBlock {};
+            m_all_blocks.append(record);
+        }
+        BlockCompiler compiler(*this, m_memory, &m_trap, &m_native_steps, m_checked, ExecutionTier::Trace,
+                               &record->entries, 0);
+        auto& emitter = compiler.compile_trace(trace);
+        //making room would kill the blocks it was recorded from; the next block compiled makes it instead
+        if (m_code_used + emitter.size() > code_buffer_size)
+        {
+            record->trace = m_free_traces;
+            m_free_traces = record;
+            return false;
+        }
+        u8* code = m_code + m_code_used;
+        if (!write_code(code, emitter))
+        {
+            flush();
+            return false;
+        }
+        m_code_used += emitter.size();
+
+        *record = { trace.anchor(), trace.low(), trace.high(), trace.ops().size(), (NativeExit(*)(u64*))code,
+                    emitter.size(), ExecutionTier::Trace, 0, true, nullptr, 0 };
+        add_live(record);
+        m_blocks.get(trace.anchor()).value()->trace = record;
+        if (trace.low() < m_low)
+            m_low = trace.low();
+        if (trace.high() > m_high)
+            m_high = trace.high();
+        auto& statistics = m_statistics[(u8)ExecutionTier::Trace];
+        statistics.compiled_blocks++;
+        statistics.compile_nanoseconds += now_nanoseconds() - start;
+        return true;
+    }
+
+    void NVMJit::start_trace(NativeBlock* anchor)
+    {
+        anchor->trace_attempts++;
+        Vector<MicroOp> ops;
+        form_block(anchor->address, ops);
+        const auto& last = ops[ops.size() - 1];
+        bool immediate_jump = last.kind >= MicroOpKind::JmpR && last.kind <= MicroOpKind::JluI &&
+                              ((u8)last.kind - (u8)MicroOpKind::JmpR) % 2 == 1;
+        //a block that loops on itself is its own recording
+        if (immediate_jump && last.imm == anchor->address)
+        {
+            NVMTrace trace(anchor->address);
+            if (trace.append(ops, anchor->address))
+                compile_trace(trace);
+            return;
+        }
+        m_recording = new NVMTrace(anchor->address);
+        m_recording_next = anchor->address;
+        m_recording_generation = m_generation;
+    }
+
+    void NVMJit::stop_recording()
+    {
+        delete m_recording;
+        m_recording = nullptr;
+    }
+
+    //a block asking to be optimized has not run anything yet, so the optimized one starts over from the same state.
+    //the baseline code it replaces counts as dead until the next flush, and so does the code of traces that can't run
+    NativeExit NVMJit::run(u64 address)
+    {
+        NativeBlock* block = m_blocks.get(address).value();
+        if (m_recording != nullptr)
+        {
+            if (address != m_recording_next || m_generation != m_recording_generation || block->trace != nullptr)
+            {
+                stop_recording();
+            }
+            else if (address == m_recording->anchor() && m_recording->ops().size() != 0)
+            {
+                compile_trace(*m_recording);
+                stop_recording();
+            }
+        }
+        else if (block->tier == ExecutionTier::Optimizing && block->trace == nullptr &&
+                 block->entries >= m_trace_threshold && block->trace_attempts < max_trace_attempts)
+        {
+            start_trace(block);
+        }
+
+        //writing a new block out can fail in a way that drops every block, this one included, and frees them
+        auto current = m_blocks.get(address);
+        if (!current.has_value() || !current.value()->live)
+        {
+            m_registers[ip_id] = address;
+            return NativeExit::Continue;
+        }
+        block = current.value();
+        if (block->trace != nullptr)
+        {
+            NativeExit exit = block->trace->entry(m_registers);
+            if (exit != NativeExit::Deoptimize)
+                return exit;
+            //what it hoisted no longer holds, so it goes, and the anchor may record another one
+            kill(block->trace);
+        }
+        NativeExit exit = block->entry(m_registers);
+        if (exit == NativeExit::TierUp)
+        {
+            compile(address, ExecutionTier::Optimizing);
+            current = m_blocks.get(address);
+            if (!current.has_value() || !current.value()->live)
+            {
+                m_registers[ip_id] = address;
+                return NativeExit::Continue;
+            }
+            exit = current.value()->entry(m_registers);
+        }
+        if (m_recording != nullptr)
+        {
+            Vector<MicroOp> ops;
+            form_block(address, ops);
+            u64 next = m_registers[ip_id];
+            //the interpreter runs whatever has no block there, which the recording wouldn't see
+            auto successor = m_blocks.get(next);
+            if (exit != NativeExit::Continue || m_generation != m_recording_generation || !successor.has_value() ||
+                !successor.value()->live || !m_recording->append(ops, next))
+                stop_recording();
+            else
+                m_recording_next = next;
+        }
+        return exit;
+    }
+
+    void NVMJit::retire(NativeBlock* block)
+    {
+        m_statistics[(u8)block->tier].instructions += block->entries * block->instructions;
+        block->entries = 0;
+    }
+
+    //dead blocks had what they ran added when they died
+    TierStatistics NVMJit::statistics(ExecutionTier tier) const
+    {
+        TierStatistics statistics = m_statistics[(u8)tier];
+        for (u64 i = 0; i < m_live_count; i++)
+        {
+            if (m_live[i]->tier == tier)
+                statistics.instructions += m_live[i]->entries * m_live[i]->instructions;
+        }
+        return statistics;
+    }
+
+    u64 NVMJit::first_live_from(u64 start) const
+    {
+        u64 low = 0;
+        u64 high = m_live_count;
+        while (low < high)
+        {
+            u64 middle = (low + high) / 2;
+            if (m_live[middle]->start < start)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low;
+    }
+
+    void NVMJit::add_live(NativeBlock* block)
+    {
+        if (m_live_count == m_live_capacity)
+        {
+            m_live_capacity = m_live_capacity != 0 ? m_live_capacity * 2 : 64;
+            m_live = (NativeBlock**) realloc(m_live, m_live_capacity * sizeof(NativeBlock*));
+        }
+        u64 at = first_live_from(block->start);
+        __builtin_memmove(m_live + at + 1, m_live + at, (m_live_count - at) * sizeof(NativeBlock*));
+        m_live[at] = block;
+        m_live_count++;
+        if (block->end - block->start > m_longest)
+            m_longest = block->end - block->start;
+    }
+
+    //blocks can start at the same address as a trace, so the one to remove is looked for among those
+    void NVMJit::remove_live(NativeBlock* block)
+    {
+        u64 at = first_live_from(block->start);
+        while (m_live[at] != block)
+            at++;
+        __builtin_memmove(m_live + at, m_live + at + 1, (m_live_count - at - 1) * sizeof(NativeBlock*));
+        m_live_count--;
+    }
+
+    //a trace only leaves its anchor. the anchor takes its trace with it
+    void NVMJit::kill(NativeBlock* block)
+    {
+        retire(block);
+        block->live = false;
+        remove_live(block);
+        discard_code(block);
+        m_generation++;
+        if (block->tier == ExecutionTier::Trace)
+        {
+            NativeBlock* anchor = m_blocks.get(block->address).value();
+            if (anchor->trace == block)
+                anchor->trace = nullptr;
+            //nothing enters it again, and the code it was compiled to only counts into it until it leaves, so the
+            //next trace compiled can have it
+            block->trace = m_free_traces;
+            m_free_traces = block;
+            return;
+        }
+        m_code_cache.leave_native(block->address);
+        if (block->trace != nullptr)
+            kill(block->trace);
+    }
+
+    //nothing runs code that died, or was replaced, once it left, so the last code written can be written over
+    void NVMJit::discard_code(NativeBlock* block)
+    {
+        if ((u8*)block->entry + block->code_size == m_code + m_code_used)
+            m_code_used -= block->code_size;
+        else
+            m_dead_code += block->code_size;
+    }
+
+    //the code buffer is reused from the start, so every block goes at once, and is freed. native code that called out
+    //into whatever flushed leaves as soon as it gets back, without touching its block again, and everything else only
+    //holds on to blocks by address
+    void NVMJit::flush()
+    {
+        for (auto block : m_all_blocks)
+        {
+            if (block->live)
+                kill(block);
+        }
+        for (auto block : m_all_blocks)
+            delete block;
+        m_all_blocks.clear();
+        m_blocks = Hashmap<u64, NativeBlock*>();
+        m_free_traces = nullptr;
+        m_longest = 0;
+        m_code_used = 0;
+        m_dead_code = 0;
+        m_low = ~0ul;
+        m_high = 0;
+    }
+
+    //killing a block moves the ones after it in m_live, so the ones to kill are gathered first
+    void NVMJit::invalidate(u64 address, u64 size)
+    {
+        if (address >= m_high || address + size <= m_low)
+            return;
+        Vector<NativeBlock*> overlapping;
+        for (u64 i = first_live_from(address > m_longest ? address - m_longest : 0);
+             i < m_live_count && m_live[i]->start < address + size; i++)
+        {
+            if (address < m_live[i]->end)
+                overlapping.append(m_live[i]);
+        }
+        for (auto block : overlapping)
+        {
+            if (block->live)
+                kill(block);
+        }
+    }
+
+    static void undo(NVMMemory& memory, const Vector<NVMMemory::JournalEntry>& writes)
+    {
+        for (u64 i = writes.size(); i > 0; i--)
+            memory.write_bytes(writes[i - 1].address, (const u8*)&writes[i - 1].old_value, writes[i - 1].size);
+        //undoing a store that faulted faults again
+        memory.clear_fault();
+    }
+
+    u64 NVMJit::begin_check(u64 address)
+    {
+        u64 before[16];
+        memcpy(before, m_registers, sizeof(before));
+        m_native_writes.clear();
+        m_native_steps = 0;
+        m_trap = Trap::None;
+        m_memory.set_journal(&m_native_writes);
+        m_native_exit = run(address);
+        m_memory.set_journal(nullptr);
+        m_native_trap = m_trap;
+        memcpy(m_native_registers, m_registers, sizeof(m_native_registers));
+
+        //the journal holds what was there before. what native code left there is kept in its place once memory is
+        //put back, which is what end_check compares against
+        Vector<u64> left;
+        for (const auto& write : m_native_writes)
+        {
+            u64 value = 0;
+            m_memory.read_bytes(write.address, (u8*)&value, write.size);
+            left.append(value);
+        }
+        undo(m_memory, m_native_writes);
+        for (u64 i = 0; i < left.size(); i++)
+            m_native_writes[i].old_value = left[i];
+        memcpy(m_registers, before, sizeof(before));
+
+        m_check_address = address;
+        m_interpreter_writes.clear();
+        m_memory.set_journal(&m_interpreter_writes);
+        return m_native_exit == NativeExit::Trap ? NVMTrace::max_instructions : m_native_steps;
+    }
+
+    static void print_register(u8 id)
+    {
+        if (id <= ip_id)
+            printf("%.*s", (int)register_literals[id].get<StringView>().byte_size(),
+                register_literals[id].get<StringView>().non_null_terminated_buffer());
+        else
+            printf("register slot %u", id);
+    }
+
+    void NVMJit::end_check(u64 ip, Trap trap)
+    {
+        m_memory.set_journal(nullptr);
+        m_checked_blocks++;
+        bool mismatch = false;
+        auto report = [&]()
+        {
+            if (!mismatch)
+                printf("\nJIT check failed for the block at 0x%lx:\n", m_check_address);
+            mismatch = true;
+        };
+
+        bool native_trapped = m_native_exit == NativeExit::Trap;
+        if (native_trapped != (trap != Trap::None) || (native_trapped && m_native_trap != trap))
+        {
+            report();
+            printf("  trap: native %d, interpreter %d\n", native_trapped ? (int)m_native_trap : 0, (int)trap);
+        }
+        for (u8 id = 1; id < 16; id++)
+        {
+            u64 interpreted = id == ip_id ? ip : m_registers[id];
+            if (m_native_registers[id] != interpreted)
+            {
+                report();
+                printf("  ");
+                print_register(id);
+                printf(": native 0x%lx, interpreter 0x%lx\n", m_native_registers[id], interpreted);
+            }
+        }
+
+        //memory either side wrote must now hold what native code left there. where only the interpreter wrote,
+        //native code left what was there before the block, which is the first thing the interpreter replaced
+        Hashmap<u64, u8> expected;
+        auto expect = [&](const Vector<NVMMemory::JournalEntry>& writes)
+        {
+            for (const auto& write : writes)
+            {
+                for (u64 byte = 0; byte < write.size; byte++)
+                {
+                    if (!expected.contains(write.address + byte))
+                        expected.insert(write.address + byte, (u8)(write.old_value >> (byte * 8)));
+                }
+            }
+        };
+        expect(m_native_writes);
+        expect(m_interpreter_writes);
+        auto compare = [&](const Vector<NVMMemory::JournalEntry>& writes)
+        {
+            for (const auto& write : writes)
+            {
+                for (u64 byte = 0; byte < write.size; byte++)
+                {
+                    u8 native = expected.get(write.address + byte).value();
+                    u8 interpreted = m_memory.read_8(write.address + byte);
+                    if (native != interpreted)
+                    {
+                        report();
+                        printf("  memory 0x%lx: native 0x%x, interpreter 0x%x\n", write.address + byte, native, interpreted);
+                    }
+                }
+            }
+        };
+        compare(m_native_writes);
+        compare(m_interpreter_writes);
+
+        if (mismatch)
+        {
+            m_mismatches++;
+            auto block = m_blocks.get(m_check_address);
+            if (block.has_value() && block.value()->live)
+                kill(block.value());
+        }
+    }
+}
@@ -0,0 +1,239 @@
+#pragma once
+#include <Types.h>
+#include <Hashmap.h>
+#include <Vector.h>
+#include "NVMMemory.h"
+#include "NVMInstructionCache.h"
+#include "NVMTrace.h"
+#include "NVMVirtualMachine.h"
+
+namespace nvm
+{
+    //how native code hands control back to the interpreter
+    enum class NativeExit : u64
+    {
+        //continue at the address in ip
+        Continue,
+        //int 0xFF ran, r1 holds the exit code
+        Halt,
+        //ip holds the address of the instruction that trapped, and NVMJit::trap() the reason
+        Trap,
+        //a baseline block got hot enough to be optimized, and left before running anything. never returned by run()
+        TierUp,
+        //a trace found an address it hoisted the check of outside the flat region, and left before running anything.
+        //never returned by run()
+        Deoptimize
+    };
+
+    enum class ExecutionTier : u8
+    {
+        Interpreter,
+        Baseline,
+        Optimizing,
+        Trace,
+        Count
+    };
+
+    struct TierStatistics
+    {
+        //native tiers count whole blocks, so a block left early by a trap or halt counts as if it ran to the end
+        u64 instructions;
+        u64 compiled_blocks;
+        u64 compile_nanoseconds;
+    };
+
+    //a compiled block, or a trace, which is entered at the address of the block it is anchored at
+    struct NativeBlock
+    {
+        u64 address;
+        //the guest code it was compiled from, which for a trace may start below its anchor
+        u64 start;
+        u64 end;
+        u64 instructions;
+        NativeExit (*entry)(u64* registers);
+        //bytes of the code buffer it takes, which nothing uses once it dies
+        u64 code_size;
+        ExecutionTier tier;
+        //bumped by the block itself every time it starts, whether from the interpreter or by looping back. traces
+        //count iterations
+        u64 entries;
+        //dead blocks have no code; their slot is compiled again once it gets hot again
+        bool live;
+        //blocks: the live trace anchored here, which runs instead, and how many times one was recorded from here.
+        //dead traces: the next dead trace compile_trace can reuse
+        NativeBlock* trace;
+        u8 trace_attempts;
+    };
+
+    /*
+     * Baseline template JIT. Basic blocks are translated one micro-op at a time, from the same decoded slots the
+     * interpreter runs, into x86-64 code in an executable buffer owned by the JIT. A block ends at its first jump,
+     * before an invalid instruction, or after max_block_instructions. The buffer is never writable and executable at
+     * once: the pages a block is written to are only writable while it is copied in.
+     * Inside a block r1-r8 and sp live in host registers, r0 and ip are constants, and the rest of the register file
+     * stays in memory. Loads and stores check for the flat region and then the TLB inline, and only call into
+     * NVMMemory when both miss or the store may hit code. int calls out to the interrupt table. A block that jumps back
+     * to its own start loops without leaving native code; every other exit goes back to the interpreter, which
+     * enters the next block from the slot it starts at (see MicroOpKind::EnterNative).
+     * Writes to code a block was compiled from kill the block, and a block whose own store killed blocks leaves right
+     * after that store.
+     * Blocks are first compiled by the baseline tier, which translates every micro-op on its own. A baseline block
+     * counts how often it starts, and the one that gets to the optimizing threshold is compiled again by the
+     * optimizing tier, which tracks the registers holding known constants through the block to fold them away,
+     * computes straight into the host register a result goes to, and skips the bounds check of flat region accesses
+     * whose address is known.
+     * Optimized blocks that keep running anchor a trace (see NVMTrace): the next time one starts, the blocks the run
+     * goes through are recorded until it comes back to the anchor, and then compiled into one loop guarded to follow
+     * the same path. The anchor runs the trace from then on. A trace whose recording strays into the interpreter,
+     * ends the program or kills blocks is dropped, and an anchor gives up after max_trace_attempts of them. Blocks that
+     * loop on themselves need no recording. Traces die with any block they were recorded from, and deoptimize when an
+     * address they hoisted the check of is no longer in the flat region: the trace is dropped and the anchor runs.
+     * In checked mode every block runs twice, natively and then in the interpreter, and their registers, traps and
+     * the memory either of them wrote are compared afterwards. The interpreter's results are the ones kept.
+     */
+    class NVMJit
+    {
+    public:
+        //entries into a block before the baseline tier compiles it, and runs of the baseline block before the
+        //optimizing tier does. checked mode compiles on first entry and optimizes on the second run, so that both
+        //tiers get checked
+        static constexpr u16 default_baseline_threshold = 32;
+        static constexpr u64 default_optimizing_threshold = 1000;
+        static constexpr u16 checked_baseline_threshold = 1;
+        static constexpr u64 checked_optimizing_threshold = 2;
+        //heat is 16 bits wide, and a backward jump may add up to this much to it at once
+        static constexpr u16 max_baseline_threshold = 0xFF00;
+        //the target of a backward jump is probably a loop, and is counted as this many entries
+        static constexpr u16 backward_jump_weight = 8;
+        //runs of an optimized block before a trace is recorded from it
+        static constexpr u64 default_trace_threshold = 100;
+        static constexpr u64 checked_trace_threshold = 2;
+        static constexpr u8 max_trace_attempts = 4;
+        static constexpr u64 max_block_instructions = 64;
+        static constexpr u64 code_buffer_size = 64ul << 20;
+        //the buffer starts over once this much of it holds code that died or was replaced
+        static constexpr u64 max_dead_code = code_buffer_size / 2;
+
+        //thresholds of 0 pick the defaults for the mode
+        NVMJit(u64* registers, NVMMemory& memory, NVMInstructionCache& code_cache, bool checked,
+               u16 baseline_threshold = 0, u64 optimizing_threshold = 0);
+        ~NVMJit();
+        NVMJit(const NVMJit&) = delete;
+        NVMJit& operator=(const NVMJit&) = delete;
+
+        u16 threshold() const
+        {
+            return m_baseline_threshold;
+        }
+
+        bool checked() const
+        {
+            return m_checked;
+        }
+
+        //compiles the block starting at address, and points its slot at it. fails if nothing there can be translated.
+        //a live block is only compiled again for a higher tier
+        bool compile(u64 address, ExecutionTier tier = ExecutionTier::Baseline);
+        //runs the live block starting at address, or the trace anchored there, optimizing the block first if it asks
+        //to be, and recording it into a trace if one is being recorded
+        NativeExit run(u64 address);
+        void invalidate(u64 address, u64 size);
+        //drops every block and starts over with an empty code buffer
+        void flush();
+
+        Trap trap() const
+        {
+            return m_trap;
+        }
+
+        //checked mode: runs the block at address natively and takes its effects back, then starts recording the
+        //interpreter's. returns how many instructions the interpreter has to run to get where native code left off
+        u64 begin_check(u64 address);
+        //compares the two runs once the interpreter got there, ip being where it is about to continue
+        void end_check(u64 ip, Trap trap);
+
+        //interpreted instructions are counted by the interpreter, which hands them over when it stops
+        void count_interpreted(u64 instructions)
+        {
+            m_statistics[(u8)ExecutionTier::Interpreter].instructions += instructions;
+        }
+
+        TierStatistics statistics(ExecutionTier tier) const;
+
+        u64 checked_blocks() const
+        {
+            return m_checked_blocks;
+        }
+
+        u64 mismatches() const
+        {
+            return m_mismatches;
+        }
+
+        //called from generated code
+        u64 store(u64 address, u64 value, u64 width);
+        u64 interrupt(u64 code);
+
+    private:
+        //the micro-ops a block at address is made of, and where it ends
+        u64 form_block(u64 address, Vector<MicroOp>& ops);
+        bool compile_trace(NVMTrace& trace);
+        void start_trace(NativeBlock* anchor);
+        void stop_recording();
+        void kill(NativeBlock* block);
+        //gives the code of a block that is going away back to the buffer if it was the last one written, and counts
+        //it as dead otherwise
+        void discard_code(NativeBlock* block);
+        //adds what the block ran so far to its tier, before it goes away or changes tier
+        void retire(NativeBlock* block);
+        //keeps m_live in order as blocks come and go
+        void add_live(NativeBlock* block);
+        void remove_live(NativeBlock* block);
+        //position in m_live of the first block starting at or past start
+        u64 first_live_from(u64 start) const;
+
+        u64* m_registers;
+        NVMMemory& m_memory;
+        NVMInstructionCache& m_code_cache;
+        bool m_checked;
+        u16 m_baseline_threshold;
+        u64 m_optimizing_threshold;
+        u64 m_trace_threshold;
+        u8* m_code { nullptr };
+        u64 m_code_used { 0 };
+        u64 m_dead_code { 0 };
+        Hashmap<u64, NativeBlock*> m_blocks;
+        //every block and trace since the last flush, dead or alive; flush() frees them all
+        Vector<NativeBlock*> m_all_blocks;
+        //dead traces, linked through their trace field
+        NativeBlock* m_free_traces { nullptr };
+        //the live ones, sorted by the start of the guest code they cover. no live block covers more than m_longest
+        //bytes, so the ones a write overlaps all start less than that far below it
+        NativeBlock** m_live { nullptr };
+        u64 m_live_count { 0 };
+        u64 m_live_capacity { 0 };
+        u64 m_longest { 0 };
+        //guest code covered by live blocks, so writes elsewhere are rejected without looking at any
+        u64 m_low { ~0ul };
+        u64 m_high { 0 };
+        //bumped whenever a block dies, so generated code can tell if a call out killed any
+        u64 m_generation { 0 };
+        Trap m_trap { Trap::None };
+        TierStatistics m_statistics[(u8)ExecutionTier::Count] {};
+        //the trace being recorded, if any, where its run has to go next, and the generation it started in
+        NVMTrace* m_recording { nullptr };
+        u64 m_recording_next { 0 };
+        u64 m_recording_generation { 0 };
+
+        //checked mode
+        u64 m_native_steps { 0 };
+        u64 m_check_address { 0 };
+        NativeExit m_native_exit { NativeExit::Continue };
+        Trap m_native_trap { Trap::None };
+        u64 m_native_registers[16] { 0 };
+        Vector<NVMMemory::JournalEntry> m_native_writes;
+        Vector<NVMMemory::JournalEntry> m_interpreter_writes;
+        u64 m_checked_blocks { 0 };
+        u64 m_mismatches { 0 };
+    };
+}
@@ -0,0 +1,602 @@
+#include "NVMMemory.h"
+#include "NVMInstructionCache.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace nvm
+{
+    NVMMemory::NVMMemory(u64 flat_size) : m_file_mappings()
+    {
+        flat_size = (flat_size + page_mask) & ~page_mask;
+        if (flat_size != 0)
+        {
+            //only reserves address space; the kernel backs pages with zeroes the first time they are touched
+            void* flat = mmap(nullptr, flat_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (flat != MAP_FAILED)
+            {
+                m_flat = (u8*) flat;
+                m_flat_size = flat_size;
+            }
+        }
+        flush_tlb();
+    }
+
+    NVMMemory::NVMMemory(u8* flat, u64 flat_size) : m_flat(flat), m_flat_size(flat_size & ~page_mask), m_owns_flat(false), m_file_mappings()
+    {
+        flush_tlb();
+    }
+
+    NVMMemory::~NVMMemory()
+    {
+        if (m_flat != nullptr && m_owns_flat)
+            munmap(m_flat, m_flat_size);
+        release_image();
+        for (auto index : m_tables)
+        {
+            PageEntry* table = m_directory[index];
+            for (u64 j = 0; j < table_entries; j++)
+            {
+                if (table[j] != 0)
+                    release(&table[j]);
+            }
+            free(table);
+        }
+        free(m_directory);
+        free(m_scratch);
+        for (const auto& mapping : m_file_mappings)
+            munmap(mapping.base, mapping.size);
+    }
+
+    u8* NVMMemory::zero_page()
+    {
+        alignas(page_size) static u8 zeroes[page_size] {};
+        return zeroes;
+    }
+
+    //every memory has one of its own, since guests on other threads fault into theirs at the same time (see NVMHost)
+    u8* NVMMemory::scratch_page()
+    {
+        if (m_scratch == nullptr)
+            m_scratch = (u8*) aligned_alloc(page_size, page_size);
+        return m_scratch;
+    }
+
+    NVMMemory::PageEntry* NVMMemory::entry_for(u64 page_number, bool create)
+    {
+        if (m_directory == nullptr)
+        {
+            if (!create)
+                return nullptr;
+            m_directory = (PageEntry**) calloc(table_entries, sizeof(PageEntry*));
+        }
+        PageEntry*& table = m_directory[(page_number >> table_bits) & table_mask];
+        if (table == nullptr)
+        {
+            if (!create)
+                return nullptr;
+            table = (PageEntry*) calloc(table_entries * 2, sizeof(PageEntry));
+            m_tables.append((page_number >> table_bits) & table_mask);
+        }
+        return &table[page_number & table_mask];
+    }
+
+    //drops this memory's hold on the page of a non-empty entry, freeing it if nobody else holds it
+    void NVMMemory::release(PageEntry* entry)
+    {
+        u8* page = (u8*)(*entry & ~page_flags_mask);
+        if (*entry & page_shared)
+        {
+            auto references = (u32*) entry[table_entries];
+            if (__atomic_sub_fetch(references, 1, __ATOMIC_ACQ_REL) == 0)
+            {
+                free(page);
+                free(references);
+            }
+            entry[table_entries] = 0;
+        }
+        else if ((*entry & page_borrowed) == 0)
+        {
+            free(page);
+        }
+        *entry = 0;
+    }
+
+    //the first write to a shared page. the copy is taken before letting go, since whoever ends up last writes in place
+    void NVMMemory::unshare(PageEntry* entry)
+    {
+        auto references = (u32*) entry[table_entries];
+        u8* page = (u8*)(*entry & ~page_flags_mask);
+        if (__atomic_load_n(references, __ATOMIC_ACQUIRE) != 1)
+        {
+            u8* copy = (u8*) aligned_alloc(page_size, page_size);
+            __builtin_memcpy(copy, page, page_size);
+            if (__atomic_sub_fetch(references, 1, __ATOMIC_ACQ_REL) != 0)
+            {
+                *entry = (PageEntry) copy | (*entry & page_read_only);
+                entry[table_entries] = 0;
+                return;
+            }
+            //everyone else let go in the meantime
+            free(page);
+            page = copy;
+        }
+        free(references);
+        *entry = (PageEntry) page | (*entry & page_read_only);
+        entry[table_entries] = 0;
+    }
+
+    u8* NVMMemory::fill_read_tlb(u64 page_number)
+    {
+        m_tlb_statistics.read_misses++;
+        PageEntry* entry = entry_for(page_number, false);
+        u8* page = entry != nullptr && *entry != 0 ? (u8*)(*entry & ~page_flags_mask) : zero_page();
+        m_read_tlb[page_number & tlb_mask] = { page_number, page };
+        return page;
+    }
+
+    u8* NVMMemory::fill_write_tlb(u64 page_number)
+    {
+        m_tlb_statistics.write_misses++;
+        PageEntry* entry = entry_for(page_number, true);
+        if (*entry == 0)
+        {
+            u8* page = (u8*) aligned_alloc(page_size, page_size);
+            __builtin_memset(page, 0, page_size);
+            *entry = (PageEntry) page;
+            //the read half may still be pointing at the zero page
+            m_read_tlb[page_number & tlb_mask] = { page_number, page };
+        }
+        if (*entry & page_read_only) [[unlikely]]
+        {
+            if (!has_fault())
+            {
+                m_events |= fault_event;
+                m_fault_address = page_number << page_bits;
+            }
+            return scratch_page();
+        }
+        if (*entry & page_shared) [[unlikely]]
+        {
+            unshare(entry);
+            m_read_tlb[page_number & tlb_mask] = { page_number, (u8*)(*entry & ~page_flags_mask) };
+        }
+        u8* page = (u8*)(*entry & ~page_flags_mask);
+        m_write_tlb[page_number & tlb_mask] = { page_number, page };
+        return page;
+    }
+
+    u8* NVMMemory::flat_page_for_write(u64 address)
+    {
+        if (flat_read_only(address))
+        {
+            if (!has_fault())
+            {
+                m_events |= fault_event;
+                m_fault_address = address & ~page_mask;
+            }
+            return scratch_page();
+        }
+        return m_flat + (address & ~page_mask);
+    }
+
+    void NVMMemory::flush_tlb()
+    {
+        for (u64 i = 0; i < tlb_entries; i++)
+        {
+            //no page number is ever all ones after masking, so this never matches
+            m_read_tlb[i] = { ~0ul, nullptr };
+            m_write_tlb[i] = { ~0ul, nullptr };
+        }
+    }
+
+    void NVMMemory::flush_tlb_page(u64 page_number)
+    {
+        if (m_read_tlb[page_number & tlb_mask].page_number == page_number)
+            m_read_tlb[page_number & tlb_mask] = { ~0ul, nullptr };
+        if (m_write_tlb[page_number & tlb_mask].page_number == page_number)
+            m_write_tlb[page_number & tlb_mask] = { ~0ul, nullptr };
+    }
+
+    bool NVMMemory::is_file_backed(const u8* page) const
+    {
+        u64 low = 0;
+        u64 high = m_flat_file_mappings.size();
+        while (low < high)
+        {
+            u64 middle = (low + high) / 2;
+            if (m_flat_file_mappings[middle].base <= page)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low != 0 && page < m_flat_file_mappings[low - 1].base + m_flat_file_mappings[low - 1].size;
+    }
+
+    void NVMMemory::unmap(u64 address, u64 size)
+    {
+        if (size == 0)
+            return;
+        address &= address_mask;
+        u64 first = address >> page_bits;
+        u64 last = (address + size - 1) >> page_bits;
+        for (u64 page_number = first; page_number <= last; page_number++)
+        {
+            u64 page_address = page_number << page_bits;
+            if (page_address < m_flat_size)
+            {
+                //private anonymous memory reads back as zeroes after this, but a private mapping of a file (the image,
+                //or whatever map_file put there) reads back as the file, so those pages get fresh anonymous memory
+                //mapped over them instead
+                u8* page = m_flat + page_address;
+                if (m_image == nullptr && !is_file_backed(page))
+                    madvise(page, page_size, MADV_DONTNEED);
+                else if (mmap(page, page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+                    __builtin_memset(page, 0, page_size);
+                m_image_current = false;
+                continue;
+            }
+            PageEntry* entry = entry_for(page_number & page_number_mask, false);
+            if (entry == nullptr || *entry == 0)
+                continue;
+            release(entry);
+            flush_tlb_page(page_number & page_number_mask);
+        }
+        if (m_code_cache != nullptr)
+            m_code_cache->invalidate(address, size);
+    }
+
+    bool NVMMemory::protect(u64 address, u64 size, bool writable)
+    {
+        if (size == 0)
+            return true;
+        address &= address_mask;
+        u64 first = address >> page_bits;
+        u64 last = (address + size - 1) >> page_bits;
+        u64 flat_pages = m_flat_size >> page_bits;
+        if (first < flat_pages)
+        {
+            if (m_flat_read_only.size() == 0 && !writable)
+            {
+                for (u64 i = 0; i < (flat_pages + 63) / 64; i++)
+                    m_flat_read_only.append(0);
+            }
+            for (u64 page_number = first; page_number <= last && page_number < flat_pages && m_flat_read_only.size() != 0; page_number++)
+            {
+                u64 bit = 1ul << (page_number % 64);
+                m_flat_read_only[page_number / 64] = writable ? m_flat_read_only[page_number / 64] & ~bit : m_flat_read_only[page_number / 64] | bit;
+            }
+            u64 write_low = 0;
+            for (u64 i = m_flat_read_only.size(); i > 0 && write_low == 0; i--)
+            {
+                if (m_flat_read_only[i - 1] != 0)
+                    write_low = ((i - 1) * 64 + 64 - __builtin_clzl(m_flat_read_only[i - 1])) << page_bits;
+            }
+            //blocks compiled so far store below the new limit without looking at it
+            if (write_low > m_flat_write_low && m_code_cache != nullptr)
+                m_code_cache->drop_native();
+            m_flat_write_low = write_low;
+            first = flat_pages;
+        }
+        for (u64 page_number = first; page_number <= last; page_number++)
+        {
+            PageEntry* entry = entry_for(page_number & page_number_mask, false);
+            if (entry == nullptr || *entry == 0)
+                continue;
+            *entry = writable ? *entry & ~page_read_only : *entry | page_read_only;
+            flush_tlb_page(page_number & page_number_mask);
+        }
+        return true;
+    }
+
+    void NVMMemory::read_bytes(u64 address, u8* destination, u64 size)
+    {
+        while (size != 0)
+        {
+            u64 offset = address & page_mask;
+            u64 count = page_size - offset < size ? page_size - offset : size;
+            __builtin_memcpy(destination, page_for_read(address) + offset, count);
+            address += count;
+            destination += count;
+            size -= count;
+        }
+    }
+
+    void NVMMemory::write_bytes(u64 address, const u8* source, u64 size)
+    {
+        if (size == 0)
+            return;
+        address &= address_mask;
+        if (address < m_flat_size)
+            m_image_current = false;
+        if (address + size > m_code_watch.low && address < m_code_watch.low + m_code_watch.span)
+            notify_code_write(address, size);
+        while (size != 0)
+        {
+            u64 offset = address & page_mask;
+            u64 count = page_size - offset < size ? page_size - offset : size;
+            __builtin_memcpy(page_for_write(address) + offset, source, count);
+            address += count;
+            source += count;
+            size -= count;
+        }
+    }
+
+    bool NVMMemory::map_file(u64 address, int fd, u64 file_offset, u64 size)
+    {
+        if (size == 0)
+            return true;
+        u64 head = ((address + page_mask) & ~page_mask) - address;
+        if (head > size)
+            head = size;
+        u64 middle = (size - head) & ~page_mask;
+        u64 tail = size - head - middle;
+        if ((address & page_mask) != (file_offset & page_mask))
+        {
+            head = size;
+            middle = 0;
+            tail = 0;
+        }
+
+        auto copy = [&](u64 at, u64 from, u64 count) -> bool
+        {
+            u8 buffer[page_size];
+            while (count != 0)
+            {
+                u64 chunk = count < page_size ? count : page_size;
+                ssize_t got = pread(fd, buffer, chunk, from);
+                if (got <= 0)
+                    return false;
+                write_bytes(at, buffer, got);
+                at += got;
+                from += got;
+                count -= got;
+            }
+            return true;
+        };
+
+        if (!copy(address, file_offset, head))
+            return false;
+
+        u64 page_address = address + head;
+        u64 page_offset = file_offset + head;
+        //the part that falls in the flat region replaces its anonymous backing in place
+        if (middle != 0 && page_address < m_flat_size)
+        {
+            u64 flat_part = m_flat_size - page_address < middle ? m_flat_size - page_address : middle;
+            void* mapped = mmap(m_flat + page_address, flat_part, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, page_offset);
+            if (mapped == MAP_FAILED)
+                return false;
+            m_flat_file_mappings.append({ (u8*) mapped, flat_part });
+            for (u64 i = m_flat_file_mappings.size() - 1; i > 0 && m_flat_file_mappings[i - 1].base > m_flat_file_mappings[i].base; i--)
+            {
+                auto swapped = m_flat_file_mappings[i];
+                m_flat_file_mappings[i] = m_flat_file_mappings[i - 1];
+                m_flat_file_mappings[i - 1] = swapped;
+            }
+            m_image_current = false;
+            page_address += flat_part;
+            page_offset += flat_part;
+            middle -= flat_part;
+        }
+        if (middle != 0)
+        {
+            void* mapped = mmap(nullptr, middle, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, page_offset);
+            if (mapped == MAP_FAILED)
+                return false;
+            m_file_mappings.append({ (u8*) mapped, middle });
+            for (u64 i = 0; i < middle; i += page_size)
+            {
+                u64 page_number = ((page_address + i) >> page_bits) & page_number_mask;
+                PageEntry* entry = entry_for(page_number, true);
+                if (*entry != 0)
+                    release(entry);
+                *entry = (PageEntry)((u8*) mapped + i) | page_borrowed;
+                flush_tlb_page(page_number);
+            }
+            page_address += middle;
+            page_offset += middle;
+        }
+        if (address + head < page_address)
+            notify_code_write(address + head, page_address - address - head);
+
+        return copy(page_address, page_offset, tail);
+    }
+
+    bool NVMMemory::is_zero(const u8* page)
+    {
+        for (u64 i = 0; i < NVMMemory::page_size; i += sizeof(u64))
+        {
+            u64 word;
+            __builtin_memcpy(&word, page + i, sizeof(u64));
+            if (word != 0)
+                return false;
+        }
+        return true;
+    }
+
+    void NVMMemory::release_image()
+    {
+        if (m_image != nullptr && __atomic_sub_fetch(&m_image->references, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            close(m_image->fd);
+            delete m_image;
+        }
+        m_image = nullptr;
+    }
+
+    /*
+     * Only pages that may hold something are looked at: the ones the image has data in, the ones /proc/self/pagemap
+     * shows were written since it was mapped, and those of files mapped over the region. Mappings are sorted by base,
+     * so they are walked along with the region.
+     */
+    bool NVMMemory::visit_flat_pages(PageVisitor visit, void* context) const
+    {
+        //pagemap entries: present, swapped, and mapping a file page rather than an anonymous one
+        constexpr u64 pagemap_present = 1ul << 63;
+        constexpr u64 pagemap_swapped = 1ul << 62;
+        constexpr u64 pagemap_file = 1ul << 61;
+        constexpr u64 batch = 8192;
+
+        if (m_flat_size == 0)
+            return true;
+        int pagemap = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        if (pagemap < 0)
+            return false;
+        auto entries = (u64*) malloc(batch * sizeof(u64));
+        bool completed = true;
+        //the data range of the image at or after the page being looked at
+        u64 data = 0;
+        u64 data_end = 0;
+        u64 mapping = 0;
+        u64 pages = m_flat_size >> page_bits;
+        for (u64 first = 0; first < pages && completed; first += batch)
+        {
+            u64 count = pages - first < batch ? pages - first : batch;
+            u64 offset = (((u64) m_flat >> page_bits) + first) * sizeof(u64);
+            if (pread(pagemap, entries, count * sizeof(u64), offset) != (ssize_t)(count * sizeof(u64)))
+            {
+                completed = false;
+                break;
+            }
+            for (u64 i = 0; i < count && completed; i++)
+            {
+                u64 at = (first + i) << page_bits;
+                bool candidate = (entries[i] & pagemap_swapped) || ((entries[i] & pagemap_present) && !(entries[i] & pagemap_file));
+                if (!candidate && m_image != nullptr)
+                {
+                    if (at >= data_end)
+                    {
+                        off_t next = lseek(m_image->fd, at, SEEK_DATA);
+                        data = next < 0 ? ~0ul : (u64) next;
+                        off_t hole = next < 0 ? -1 : lseek(m_image->fd, next, SEEK_HOLE);
+                        data_end = hole < 0 ? ~0ul : (u64) hole;
+                    }
+                    candidate = at >= data;
+                }
+                while (mapping < m_flat_file_mappings.size() && m_flat_file_mappings[mapping].base + m_flat_file_mappings[mapping].size <= m_flat + at)
+                    mapping++;
+                candidate = candidate || (mapping < m_flat_file_mappings.size() && m_flat_file_mappings[mapping].base <= m_flat + at);
+                bool read_only = flat_read_only(at);
+                if ((candidate && !is_zero(m_flat + at)) || read_only)
+                    completed = visit(context, at, m_flat + at, !read_only);
+            }
+        }
+        free(entries);
+        close(pagemap);
+        return completed;
+    }
+
+    bool NVMMemory::for_each_page(PageVisitor visit, void* context) const
+    {
+        if (!visit_flat_pages(visit, context))
+            return false;
+        for (auto index : m_tables)
+        {
+            const PageEntry* table = m_directory[index];
+            for (u64 j = 0; j < table_entries; j++)
+            {
+                auto page = (const u8*)(table[j] & ~page_flags_mask);
+                if (table[j] != 0 && ((table[j] & page_read_only) || !is_zero(page)) && !visit(context, ((index << table_bits) | j) << page_bits, page, !(table[j] & page_read_only)))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Writes what the flat region holds to a new image and maps that over the region, which hands back every page the
+     * region had to itself. All-zero pages are left as holes.
+     */
+    bool NVMMemory::take_image()
+    {
+        int fd = memfd_create("nvm-flat", MFD_CLOEXEC);
+        if (fd < 0)
+            return false;
+        bool written = ftruncate(fd, m_flat_size) == 0 && visit_flat_pages([](void* context, u64 address, const u8* page, bool) -> bool
+        {
+            return pwrite(*(int*) context, page, page_size, address) == (ssize_t) page_size;
+        }, &fd);
+
+        if (!written || mmap(m_flat, m_flat_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0) == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        release_image();
+        m_image = new FlatImage { fd, 1 };
+        m_image_current = true;
+        m_flat_file_mappings.clear();
+        return true;
+    }
+
+    bool NVMMemory::fork_into(NVMMemory& child)
+    {
+        if (m_flat_size != 0)
+        {
+            if (!m_image_current && !take_image())
+                return false;
+            void* flat = mmap(nullptr, m_flat_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, m_image->fd, 0);
+            if (flat == MAP_FAILED)
+                return false;
+            __atomic_add_fetch(&m_image->references, 1, __ATOMIC_RELAXED);
+            child.m_flat = (u8*) flat;
+            child.m_flat_size = m_flat_size;
+            child.m_owns_flat = true;
+            child.m_image = m_image;
+            child.m_image_current = true;
+            for (auto bits : m_flat_read_only)
+                child.m_flat_read_only.append(bits);
+            child.m_flat_write_low = m_flat_write_low;
+        }
+
+        for (auto index : m_tables)
+        {
+            PageEntry* table = m_directory[index];
+            for (u64 j = 0; j < table_entries; j++)
+            {
+                if (table[j] == 0)
+                    continue;
+                PageEntry* copy = child.entry_for((index << table_bits) | j, true);
+                if (table[j] & page_borrowed)
+                {
+                    u8* page = (u8*) aligned_alloc(page_size, page_size);
+                    __builtin_memcpy(page, (u8*)(table[j] & ~page_flags_mask), page_size);
+                    *copy = (PageEntry) page | (table[j] & page_read_only);
+                    continue;
+                }
+                if ((table[j] & page_shared) == 0)
+                {
+                    auto references = (u32*) malloc(sizeof(u32));
+                    *references = 1;
+                    table[j] |= page_shared;
+                    table[j + table_entries] = (PageEntry) references;
+                }
+                __atomic_add_fetch((u32*) table[j + table_entries], 1, __ATOMIC_RELAXED);
+                *copy = table[j];
+                copy[table_entries] = table[j + table_entries];
+            }
+        }
+        //the write half may hold pages that are shared now
+        flush_tlb();
+        return true;
+    }
+
+    void NVMMemory::notify_code_write(u64 address, u64 size)
+    {
+        if (m_journal != nullptr)
+        {
+            for (u64 offset = 0; offset < size; offset += sizeof(u64))
+            {
+                JournalEntry entry { address + offset, size - offset < sizeof(u64) ? size - offset : sizeof(u64), 0 };
+                read_bytes(entry.address, (u8*)&entry.old_value, entry.size);
+                m_journal->append(entry);
+            }
+            if (address + size <= m_watched.low || address >= m_watched.low + m_watched.span)
+                return;
+        }
+        if (m_code_cache != nullptr)
+            m_code_cache->invalidate(address, size);
+    }
+}
@@ -0,0 +1,388 @@
+#pragma once
+#include <Types.h>
+#include <Span.h>
+#include <Vector.h>
+
+namespace nvm
+{
+    class NVMInstructionCache;
+    
+    /*
+     * Guest memory. Addresses below the flat size live in one contiguous host mapping and translate with a compare
+     * and an add. Everything else goes through a two level radix table over fixed size pages, so a translation is a
+     * shift, a mask and two loads. Guest addresses are 48 bits wide; the upper bits are ignored, on the flat path as much
+     * as on the table one, so an address 2^48 past another is the same byte.
+     * Reads of pages that were never written see a shared zero page and don't allocate anything.
+     * A small direct mapped TLB, split in read and write halves, sits in front of the table walk. The write half only
+     * ever holds pages that may be written, so the store fast path needs no protection check.
+     * Read only pages of the flat region are kept in a bitmap. Only writes below the end of the last of them look at
+     * it, so a region with none still translates writes with a compare and an add.
+     * The table is only allocated once something outside the flat region is written, so a guest that stays inside it
+     * costs little more than the flat pages it touched.
+     * Forked memories share their pages copy-on-write. Table pages are shared outright, with a reference count, and
+     * copied by the first write of any memory but the last one holding them. The flat region is shared through an
+     * image of it in an anonymous file, which both memories map privately, so the kernel does the copying. Taking the
+     * image costs a pass over the region, so it is kept for the next fork until mark_changed() says it is stale.
+     */
+    class NVMMemory
+    {
+    public:
+        static constexpr u64 page_bits = 12;
+        static constexpr u64 page_size = 1ul << page_bits;
+        static constexpr u64 page_mask = page_size - 1;
+        static constexpr u64 address_bits = 48;
+        static constexpr u64 address_mask = (1ul << address_bits) - 1;
+        static constexpr u64 table_bits = (address_bits - page_bits) / 2;
+        static constexpr u64 table_entries = 1ul << table_bits;
+        static constexpr u64 table_mask = table_entries - 1;
+        
+        static constexpr u64 page_number_mask = (1ul << (address_bits - page_bits)) - 1;
+        static constexpr u64 tlb_bits = 6;
+        static constexpr u64 tlb_entries = 1ul << tlb_bits;
+        static constexpr u64 tlb_mask = tlb_entries - 1;
+        
+        //page table entries are host page pointers with flags in the low bits, which page alignment leaves free
+        using PageEntry = u64;
+        static constexpr PageEntry page_read_only = 1;
+        //the page lives inside a file mapping owned by NVMMemory as a whole, so it is never freed on its own
+        static constexpr PageEntry page_borrowed = 2;
+        //the page is held by more than one memory, and has to be copied before it is written (see fork_into)
+        static constexpr PageEntry page_shared = 4;
+        static constexpr PageEntry page_flags_mask = page_mask;
+        
+        struct TlbStatistics
+        {
+            //hits are only counted when built with NVM_TLB_STATISTICS, misses always are
+            u64 read_hits;
+            u64 read_misses;
+            u64 write_hits;
+            u64 write_misses;
+        };
+        
+        explicit NVMMemory(u64 flat_size = 0);
+        //runs on a flat region the caller reserved and keeps owning, e.g. a slice of one mapping shared by many guests
+        //(see NVMHost). it has to be page aligned and read as zeroes
+        NVMMemory(u8* flat, u64 flat_size);
+        ~NVMMemory();
+        NVMMemory(const NVMMemory&) = delete;
+        NVMMemory& operator=(const NVMMemory&) = delete;
+        
+        //writes to addresses in [low, low + span) take the slow path that reports them to the instruction cache
+        struct CodeWatch
+        {
+            u64 low;
+            u64 span;
+        };
+        
+        struct TlbEntry
+        {
+            u64 page_number;
+            u8* page;
+        };
+        
+        //what the inlined fast paths of generated code read (see NVMJit). the pointers stay valid as long as the memory
+        struct FastPathState
+        {
+            u8* flat;
+            u64 flat_size;
+            //stores to the flat region below this may hit a read only page, and have to go through NVMMemory
+            u64 flat_write_low;
+            const CodeWatch* code_watch;
+            const TlbEntry* read_tlb;
+            const TlbEntry* write_tlb;
+        };
+        
+        struct JournalEntry
+        {
+            u64 address;
+            u64 size;
+            //the bytes the write replaced, little endian
+            u64 old_value;
+        };
+        
+        //writes that land in [low, high) are reported to the instruction cache so decoded code never goes stale
+        void watch_code(NVMInstructionCache* cache, u64 low, u64 high)
+        {
+            m_code_cache = cache;
+            //widened so that a write starting just below low but spilling into it is caught too
+            m_watched.low = low >= sizeof(u64) ? low - sizeof(u64) : 0;
+            m_watched.span = high - m_watched.low;
+            if (m_journal == nullptr)
+                m_code_watch = m_watched;
+        }
+        
+        //while a journal is set, every write is appended to it before it happens. it works by watching all of memory,
+        //so the stores of both the interpreter and generated code come through the slow path
+        void set_journal(Vector<JournalEntry>* journal)
+        {
+            m_journal = journal;
+            m_code_watch = journal != nullptr ? CodeWatch { 0, ~0ul } : m_watched;
+        }
+        
+        u64 flat_size() const
+        {
+            return m_flat_size;
+        }
+        
+        FastPathState fast_path_state() const
+        {
+            return { m_flat, m_flat_size, m_flat_write_low, &m_code_watch, m_read_tlb, m_write_tlb };
+        }
+        
+        //host pointer to the start of the page holding address. never allocates; unbacked pages read as zero
+        u8* page_for_read(u64 address)
+        {
+            address &= address_mask;
+            if (address < m_flat_size)
+                return m_flat + (address & ~page_mask);
+            u64 page_number = address >> page_bits;
+            auto& entry = m_read_tlb[page_number & tlb_mask];
+            if (entry.page_number == page_number) [[likely]]
+            {
+#ifdef NVM_TLB_STATISTICS
+                m_tlb_statistics.read_hits++;
+#endif
+                return entry.page;
+            }
+            return fill_read_tlb(page_number);
+        }
+        
+        //host pointer to the start of the page holding address, backing it with fresh zeroed memory if needed.
+        //writes to read only pages record a fault and are redirected to a scratch page
+        u8* page_for_write(u64 address)
+        {
+            address &= address_mask;
+            if (address < m_flat_size)
+            {
+                if (address < m_flat_write_low) [[unlikely]]
+                    return flat_page_for_write(address);
+                return m_flat + (address & ~page_mask);
+            }
+            u64 page_number = address >> page_bits;
+            auto& entry = m_write_tlb[page_number & tlb_mask];
+            if (entry.page_number == page_number) [[likely]]
+            {
+#ifdef NVM_TLB_STATISTICS
+                m_tlb_statistics.write_hits++;
+#endif
+                return entry.page;
+            }
+            return fill_write_tlb(page_number);
+        }
+        
+        //drops the backing of every page overlapping [address, address+size); they read as zero afterwards
+        void unmap(u64 address, u64 size);
+        //changes the protection of every backed page overlapping [address, address+size), and of every page of the flat
+        //region in it. native code is dropped when flat pages become read only, since it writes the region directly
+        bool protect(u64 address, u64 size, bool writable);
+        void flush_tlb();
+        
+        const TlbStatistics& tlb_statistics() const
+        {
+            return m_tlb_statistics;
+        }
+        
+        //a fault, or code the interpreter may be running having moved; one test covers both on its store path
+        bool has_event() const
+        {
+            return m_events != 0;
+        }
+        
+        bool has_fault() const
+        {
+            return (m_events & fault_event) != 0;
+        }
+        
+        u64 fault_address() const
+        {
+            return m_fault_address;
+        }
+        
+        void clear_fault()
+        {
+            m_events &= ~fault_event;
+        }
+        
+        //set by NVMInstructionCache when a write gave the guest a copy of its own of a chunk it borrowed from
+        //NVMSharedCode, so that the interpreter stops running the old one
+        void flag_code_moved()
+        {
+            m_events |= code_moved_event;
+        }
+        
+        void clear_events()
+        {
+            m_events = 0;
+        }
+        
+        //guest memory is little endian, like every host this runs on. an access that fits in one page is a single
+        //memcpy; only accesses straddling a page boundary take the byte-wise path
+        template<typename T>
+        T read(u64 address)
+        {
+            u64 offset = address & page_mask;
+            if (offset <= page_size - sizeof(T)) [[likely]]
+            {
+                T value;
+                __builtin_memcpy(&value, page_for_read(address) + offset, sizeof(T));
+                return value;
+            }
+            T value;
+            read_bytes(address, (u8*) &value, sizeof(T));
+            return value;
+        }
+        
+        template<typename T>
+        void write(u64 address, T value)
+        {
+            u64 offset = address & page_mask;
+            if (offset <= page_size - sizeof(T)) [[likely]]
+            {
+                if ((address & address_mask) - m_code_watch.low < m_code_watch.span) [[unlikely]]
+                    notify_code_write(address & address_mask, sizeof(T));
+                __builtin_memcpy(page_for_write(address) + offset, &value, sizeof(T));
+                return;
+            }
+            write_bytes(address, (const u8*) &value, sizeof(T));
+        }
+        
+        u64 read_8(u64 address)
+        {
+            return read<u8>(address);
+        }
+        
+        u64 read_16(u64 address)
+        {
+            return read<u16>(address);
+        }
+        
+        u64 read_32(u64 address)
+        {
+            return read<u32>(address);
+        }
+        
+        u64 read_64(u64 address)
+        {
+            return read<u64>(address);
+        }
+        
+        void write_8(u64 address, u8 value)
+        {
+            write<u8>(address, value);
+        }
+        
+        void write_16(u64 address, u16 value)
+        {
+            write<u16>(address, value);
+        }
+        
+        void write_32(u64 address, u32 value)
+        {
+            write<u32>(address, value);
+        }
+        
+        void write_64(u64 address, u64 value)
+        {
+            write<u64>(address, value);
+        }
+        
+        //copy an arbitrary range in or out of guest memory, one page at a time
+        void read_bytes(u64 address, u8* destination, u64 size);
+        void write_bytes(u64 address, const u8* source, u64 size);
+        
+        void load_image(u64 address, const Span<u8>& image)
+        {
+            write_bytes(address, image.data(), image.size());
+        }
+        
+        //maps size bytes of fd starting at file_offset to address. whole pages are mapped privately, so the file
+        //is never written and guest stores copy the page on first write; the unaligned head and tail are copied.
+        //if address and file_offset don't share their alignment inside a page everything is copied
+        bool map_file(u64 address, int fd, u64 file_offset, u64 size);
+        
+        //makes child, which must be fresh and have no flat region of its own, a copy of this memory that shares its
+        //pages until either one writes them. pages of file mappings are copied instead, since they go away with this
+        //memory. false if the flat region couldn't be shared
+        bool fork_into(NVMMemory& child);
+        
+        //the interpreter and native code write the flat region directly, so whoever runs a guest calls this before
+        //doing so. writes through write_bytes, map_file and unmap call it themselves
+        void mark_changed()
+        {
+            m_image_current = false;
+        }
+        
+        //called with every page that may hold something other than zeroes and the host copy of its contents, the flat
+        //region first and in order, then the rest in no particular order. read only pages are visited even if they are
+        //all zeroes. stops at the first call returning false. false if it stopped or the flat region couldn't be read
+        using PageVisitor = bool (*)(void* context, u64 address, const u8* page, bool writable);
+        bool for_each_page(PageVisitor visit, void* context) const;
+        
+    private:
+        struct FileMapping
+        {
+            u8* base;
+            u64 size;
+        };
+        
+        //an anonymous file holding the contents of a flat region, shared by every memory that maps it
+        struct FlatImage
+        {
+            int fd;
+            u32 references;
+        };
+        
+        static u8* zero_page();
+        u8* scratch_page();
+        static bool is_zero(const u8* page);
+        //the table an entry lives in is twice as long as it has entries; the second half holds the reference count
+        //of every shared page in the first
+        PageEntry* entry_for(u64 page_number, bool create);
+        void release(PageEntry* entry);
+        void unshare(PageEntry* entry);
+        bool visit_flat_pages(PageVisitor visit, void* context) const;
+        //whether a page of the flat region lies in one of the flat file mappings
+        bool is_file_backed(const u8* page) const;
+        bool take_image();
+        void release_image();
+        u8* fill_read_tlb(u64 page_number);
+        u8* fill_write_tlb(u64 page_number);
+        u8* flat_page_for_write(u64 address);
+        bool flat_read_only(u64 address) const
+        {
+            u64 page_number = address >> page_bits;
+            return page_number / 64 < m_flat_read_only.size() && ((m_flat_read_only[page_number / 64] >> (page_number % 64)) & 1);
+        }
+        void flush_tlb_page(u64 page_number);
+        void notify_code_write(u64 address, u64 size);
+        
+        u8* m_flat { nullptr };
+        u64 m_flat_size { 0 };
+        bool m_owns_flat { true };
+        PageEntry** m_directory { nullptr };
+        //indices of the tables allocated in the directory
+        Vector<u64> m_tables;
+        Vector<FileMapping> m_file_mappings;
+        //parts of the flat region map_file mapped a file over, sorted by base
+        Vector<FileMapping> m_flat_file_mappings;
+        //one bit per page of the flat region, set for read only ones. empty until something there is protected
+        Vector<u64> m_flat_read_only;
+        //the end of the last read only page of the flat region, 0 if it has none
+        u64 m_flat_write_low { 0 };
+        FlatImage* m_image { nullptr };
+        bool m_image_current { false };
+        TlbEntry m_read_tlb[tlb_entries];
+        TlbEntry m_write_tlb[tlb_entries];
+        TlbStatistics m_tlb_statistics {};
+        static constexpr u8 fault_event = 1;
+        static constexpr u8 code_moved_event = 2;
+        u8 m_events { 0 };
+        u64 m_fault_address { 0 };
+        NVMInstructionCache* m_code_cache { nullptr };
+        CodeWatch m_code_watch { 0, 0 };
+        CodeWatch m_watched { 0, 0 };
+        Vector<JournalEntry>* m_journal { nullptr };
+        //where writes to read only pages go, allocated by the first one
+        u8* m_scratch { nullptr };
+    };
+}
@@ -0,0 +1,128 @@
+#include "NVMSampleProfile.h"
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+namespace nvm
+{
+    NVMSampleProfile::NVMSampleProfile(u64 interval) : m_interval(interval != 0 ? interval : default_interval)
+    {
+        grow();
+    }
+
+    NVMSampleProfile::~NVMSampleProfile()
+    {
+        free(m_table);
+    }
+
+    //instructions are 4 byte aligned, so the low bits carry nothing
+    static u64 slot_for(u64 address, u64 capacity)
+    {
+        return ((address >> 2) * 0x9E3779B97F4A7C15ul >> 32) & (capacity - 1);
+    }
+
+    void NVMSampleProfile::record(u64 address)
+    {
+        m_samples++;
+        u64 slot = slot_for(address, m_capacity);
+        while (m_table[slot].count != 0 && m_table[slot].address != address)
+            slot = (slot + 1) & (m_capacity - 1);
+        if (m_table[slot].count == 0)
+        {
+            m_table[slot].address = address;
+            if (++m_used * 2 > m_capacity)
+            {
+                m_table[slot].count = 1;
+                grow();
+                return;
+            }
+        }
+        m_table[slot].count++;
+    }
+
+    void NVMSampleProfile::grow()
+    {
+        u64 capacity = m_capacity != 0 ? m_capacity * 2 : 1024;
+        auto table = (AddressSamples*) calloc(capacity, sizeof(AddressSamples));
+        for (u64 i = 0; i < m_capacity; i++)
+        {
+            if (m_table[i].count == 0)
+                continue;
+            u64 slot = slot_for(m_table[i].address, capacity);
+            while (table[slot].count != 0)
+                slot = (slot + 1) & (capacity - 1);
+            table[slot] = m_table[i];
+        }
+        free(m_table);
+        m_table = table;
+        m_capacity = capacity;
+    }
+
+    Vector<AddressSamples> NVMSampleProfile::by_address() const
+    {
+        Vector<AddressSamples> samples(m_used);
+        for (u64 i = 0; i < m_capacity; i++)
+        {
+            if (m_table[i].count != 0)
+                samples.append(m_table[i]);
+        }
+        heap_sort(samples.data(), samples.size(), [](const AddressSamples& a, const AddressSamples& b) { return a.address < b.address; });
+        return samples;
+    }
+
+    Vector<TagSamples> NVMSampleProfile::by_tag(const NVMDebugTable& symbols) const
+    {
+        Vector<u64> counts(symbols.tag_count() + 1);
+        for (u64 i = 0; i <= symbols.tag_count(); i++)
+            counts.append(0);
+        for (u64 i = 0; i < m_capacity; i++)
+        {
+            if (m_table[i].count != 0)
+                counts[symbols.tag_at(m_table[i].address)] += m_table[i].count;
+        }
+        Vector<TagSamples> samples;
+        for (u64 i = 0; i <= symbols.tag_count(); i++)
+        {
+            if (counts[i] != 0)
+                samples.append({ i, counts[i] });
+        }
+        heap_sort(samples.data(), samples.size(), [](const TagSamples& a, const TagSamples& b) { return a.count > b.count; });
+        return samples;
+    }
+
+    static void append_line(Vector<u8>& contents, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+    static void append_line(Vector<u8>& contents, const char* format, ...)
+    {
+        char line[512];
+        va_list arguments;
+        va_start(arguments, format);
+        int length = vsnprintf(line, sizeof(line), format, arguments);
+        va_end(arguments);
+        for (int i = 0; i < length && i < (int)sizeof(line) - 1; i++)
+            contents.append(line[i]);
+    }
+
+    bool NVMSampleProfile::write_folded(const char* path, const NVMDebugTable& symbols) const
+    {
+        Vector<u8> contents;
+        for (const auto& sample : by_address())
+        {
+            u64 tag = symbols.tag_at(sample.address);
+            const char* name = tag == symbols.tag_count() ? "[untagged]" : symbols.tag_name(tag);
+            auto line = symbols.line_at(sample.address);
+            if (line != nullptr)
+                append_line(contents, "%s;line %u %lu\n", name, line->line, sample.count);
+            else
+                append_line(contents, "%s;0x%lx %lu\n", name, sample.address, sample.count);
+        }
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        bool ok = write(fd, contents.data(), contents.size()) == (ssize_t)contents.size();
+        close(fd);
+        return ok;
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <Types.h>
+#include <Vector.h>
+#include "NVMDebugTable.h"
+
+namespace nvm
+{
+    struct AddressSamples
+    {
+        u64 address;
+        u64 count;
+    };
+
+    struct TagSamples
+    {
+        //index of the tag of the debug table the samples were attributed to, or the tag count for samples below the
+        //first tag
+        u64 tag;
+        u64 count;
+    };
+
+    /*
+     * Where a guest spends its time, by sampling: NVMVirtualMachine::run_sampled records the address of every
+     * interval-th instruction it runs. Samples are counted per address in an open addressing table, and only
+     * attributed to tags and source lines when they are read out, through the program's debug table (see
+     * NVMDebugTable): an address belongs to the last tag at or below it.
+     */
+    class NVMSampleProfile
+    {
+    public:
+        //prime, so that the samples don't fall in step with a loop and keep hitting the same instructions of it
+        static constexpr u64 default_interval = 997;
+
+        explicit NVMSampleProfile(u64 interval = default_interval);
+        ~NVMSampleProfile();
+        NVMSampleProfile(const NVMSampleProfile&) = delete;
+        NVMSampleProfile& operator=(const NVMSampleProfile&) = delete;
+
+        void record(u64 address);
+
+        u64 interval() const
+        {
+            return m_interval;
+        }
+
+        u64 samples() const
+        {
+            return m_samples;
+        }
+
+        //sorted by address
+        Vector<AddressSamples> by_address() const;
+        //sorted by count, most first; tags without samples are left out
+        Vector<TagSamples> by_tag(const NVMDebugTable& symbols) const;
+        //one line per sampled address in the folded stack format flamegraph.pl takes, its source line, or the
+        //address itself if it has none, under its tag: "loop;line 12 57". flamegraph.pl adds up lines that match
+        bool write_folded(const char* path, const NVMDebugTable& symbols) const;
+
+    private:
+        void grow();
+
+        u64 m_interval;
+        u64 m_samples { 0 };
+        //a power of two long, kept at most half full. slots with a count of 0 are free
+        AddressSamples* m_table { nullptr };
+        u64 m_capacity { 0 };
+        u64 m_used { 0 };
+    };
+}
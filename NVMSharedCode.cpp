@@ -0,0 +1,66 @@
+#include "NVMSharedCode.h"
+#include <stdlib.h>
+
+namespace nvm
+{
+    NVMSharedCode::NVMSharedCode() : m_pages(), m_all()
+    {
+        pthread_mutex_init(&m_lock, nullptr);
+    }
+
+    NVMSharedCode::~NVMSharedCode()
+    {
+        for (auto page : m_all)
+        {
+            free(page->ops);
+            free(page);
+        }
+        pthread_mutex_destroy(&m_lock);
+    }
+
+    //pages are never changed once published, so their contents are compared outside the lock
+    const MicroOp* NVMSharedCode::find(u64 base, const u8* contents, void* const* handlers)
+    {
+        Page* page = nullptr;
+        pthread_mutex_lock(&m_lock);
+        if (__builtin_memcmp(m_handlers, handlers, sizeof(m_handlers)) == 0)
+        {
+            auto maybe_page = m_pages.get(base);
+            if (maybe_page.has_value())
+                page = maybe_page.value();
+        }
+        pthread_mutex_unlock(&m_lock);
+        if (page == nullptr || __builtin_memcmp(page->contents, contents, contents_size) != 0)
+            return nullptr;
+        return page->ops;
+    }
+
+    //the first chunk published sets the handler table every other one has to have been decoded with
+    const MicroOp* NVMSharedCode::publish(u64 base, const u8* contents, void* const* handlers, MicroOp* ops)
+    {
+        pthread_mutex_lock(&m_lock);
+        if (m_all.size() == 0)
+            __builtin_memcpy(m_handlers, handlers, sizeof(m_handlers));
+        const MicroOp* shared = nullptr;
+        if (__builtin_memcmp(m_handlers, handlers, sizeof(m_handlers)) == 0)
+        {
+            auto maybe_page = m_pages.get(base);
+            if (maybe_page.has_value())
+            {
+                if (__builtin_memcmp(maybe_page.value()->contents, contents, contents_size) == 0)
+                    shared = maybe_page.value()->ops;
+            }
+            else
+            {
+                auto page = (Page*) malloc(sizeof(Page));
+                page->ops = ops;
+                __builtin_memcpy(page->contents, contents, contents_size);
+                m_pages.insert(base, page);
+                m_all.append(page);
+                shared = ops;
+            }
+        }
+        pthread_mutex_unlock(&m_lock);
+        return shared;
+    }
+}
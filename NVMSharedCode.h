@@ -0,0 +1,59 @@
+#pragma once
+#include <Types.h>
+#include <Hashmap.h>
+#include <Vector.h>
+#include <pthread.h>
+#include "NVMInstructionCache.h"
+#include "NVMMemory.h"
+
+namespace nvm
+{
+    /*
+     * Decoded code shared by guests that run the same image, so that a page of code is decoded into
+     * NVMInstructionCache::chunk_bytes once instead of once per guest. A chunk is published fully decoded and fused by
+     * the first guest that runs the page, and never written again: guests that run it later only borrow it, after
+     * checking that their own copy of the page still reads the same as the one it was decoded from. A guest that
+     * writes to a page it borrowed gets a private copy of the chunk first (see NVMInstructionCache::invalidate), so
+     * the others never see the change.
+     * Chunks only hold for the handler table they were decoded with, which is the one of whatever run loop the first
+     * guest ran; guests running another one decode their own.
+     * Lookups take a lock, but a guest only looks a page up the first time it runs it, and keeps the chunk from then on.
+     */
+    class NVMSharedCode
+    {
+    public:
+        //the page, and the word after it, which a wide instruction in the page's last slot reads
+        static constexpr u64 contents_size = NVMMemory::page_size + sizeof(u32);
+
+        NVMSharedCode();
+        ~NVMSharedCode();
+        NVMSharedCode(const NVMSharedCode&) = delete;
+        NVMSharedCode& operator=(const NVMSharedCode&) = delete;
+
+        //the chunk decoded for base from contents with handlers, or null if there is none, or the page was decoded
+        //from different contents or with another table
+        const MicroOp* find(u64 base, const u8* contents, void* const* handlers);
+        //offers ops, decoded for base from contents with handlers, to the other guests. returns the chunk they share
+        //from then on, which is only ops if nobody published one first; null if the page can't be shared with the
+        //caller. ops belongs to the shared code from then on if it was returned, and stays the caller's otherwise
+        const MicroOp* publish(u64 base, const u8* contents, void* const* handlers, MicroOp* ops);
+
+        //pages that were decoded once for everyone, each of which cost chunk_bytes
+        u64 pages() const
+        {
+            return m_all.size();
+        }
+
+    private:
+        struct Page
+        {
+            MicroOp* ops;
+            u8 contents[contents_size];
+        };
+
+        pthread_mutex_t m_lock;
+        Hashmap<u64, Page*> m_pages;
+        Vector<Page*> m_all;
+        void* m_handlers[(u8)MicroOpKind::Count] { nullptr };
+    };
+}
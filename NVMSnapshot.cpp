@@ -0,0 +1,211 @@
+#include "NVMSnapshot.h"
+#include "NVMBinaryFormat.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace nvm
+{
+    /*
+     * Pages are gathered into batches of iovecs and written with one pwritev per batch; pages that are adjacent in
+     * the host, like those of the flat region, share an iovec. That keeps the writes large and the copies at zero, so
+     * saving goes about as fast as the disk takes it.
+     */
+    class SnapshotWriter
+    {
+    public:
+        static constexpr u32 batch = 1024;
+
+        explicit SnapshotWriter(int fd) : m_fd(fd), m_runs()
+        {
+        }
+
+        bool add(u64 address, const u8* page, bool writable)
+        {
+            u32 flags = writable ? section_read | section_write : section_read;
+            auto last = m_runs.size() != 0 ? &m_runs[m_runs.size() - 1] : nullptr;
+            if (last != nullptr && last->address + last->size == address && last->flags == flags)
+                last->size += NVMMemory::page_size;
+            else
+                m_runs.append({ address, NVMMemory::page_size, m_cursor, flags, 0 });
+            m_cursor += NVMMemory::page_size;
+
+            if (m_count != 0 && (const u8*) m_iovecs[m_count - 1].iov_base + m_iovecs[m_count - 1].iov_len == page)
+            {
+                m_iovecs[m_count - 1].iov_len += NVMMemory::page_size;
+                return true;
+            }
+            if (m_count == batch && !flush())
+                return false;
+            m_iovecs[m_count++] = { (void*) page, NVMMemory::page_size };
+            return true;
+        }
+
+        //pwritev may write less than asked, in which case the rest of the batch is written from where it stopped
+        bool flush()
+        {
+            u32 first = 0;
+            while (first < m_count)
+            {
+                ssize_t written = pwritev(m_fd, m_iovecs + first, (int)(m_count - first), m_written);
+                if (written <= 0)
+                    return false;
+                m_written += written;
+                while (first < m_count && (u64) written >= m_iovecs[first].iov_len)
+                    written -= m_iovecs[first++].iov_len;
+                if (first < m_count)
+                {
+                    m_iovecs[first].iov_base = (u8*) m_iovecs[first].iov_base + written;
+                    m_iovecs[first].iov_len -= written;
+                }
+            }
+            m_count = 0;
+            return true;
+        }
+
+        const Vector<NVMSnapshotRun>& runs() const
+        {
+            return m_runs;
+        }
+
+        //where the pages end, which is where the run table goes
+        u64 cursor() const
+        {
+            return m_cursor;
+        }
+
+    private:
+        int m_fd;
+        Vector<NVMSnapshotRun> m_runs;
+        u64 m_cursor { NVMMemory::page_size };
+        u64 m_written { NVMMemory::page_size };
+        iovec m_iovecs[batch];
+        u32 m_count { 0 };
+    };
+
+    static bool write_all(int fd, const void* data, u64 size, u64 offset)
+    {
+        while (size != 0)
+        {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if (written <= 0)
+                return false;
+            data = (const u8*) data + written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool save_snapshot(const NVMVirtualMachine& vm, const char* path)
+    {
+        char temporary[PATH_MAX];
+        if ((u64) snprintf(temporary, sizeof(temporary), "%s.partial", path) >= sizeof(temporary))
+            return false;
+        int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+
+        SnapshotWriter writer(fd);
+        const auto& memory = vm.memory();
+        bool written = memory.for_each_page([](void* context, u64 address, const u8* page, bool writable) -> bool
+        {
+            return ((SnapshotWriter*) context)->add(address, page, writable);
+        }, &writer) && writer.flush();
+
+        NVMSnapshotHeader header { nvm_snapshot_magic, 0, memory.flat_size(), { 0 }, writer.runs().size(), writer.cursor() };
+        for (u8 i = 0; i < 16; i++)
+            header.registers[i] = vm.register_value(i);
+        u64 table_size = header.run_count * sizeof(NVMSnapshotRun);
+        u32 crc = crc32c((const u8*) &header.flat_size, sizeof(NVMSnapshotHeader) - sizeof(u32) * 2);
+        header.crc32 = crc32c((const u8*) writer.runs().data(), table_size, crc);
+        written = written && write_all(fd, writer.runs().data(), table_size, header.table_offset)
+                  && write_all(fd, &header, sizeof(NVMSnapshotHeader), 0);
+
+        //the rename only happens once the contents are on disk, so a crash leaves either snapshot whole
+        written = fdatasync(fd) == 0 && written;
+        close(fd);
+        if (!written || rename(temporary, path) != 0)
+        {
+            unlink(temporary);
+            return false;
+        }
+        return true;
+    }
+
+    ResultOrError<NVMVirtualMachine*, StringView> restore_snapshot(const char* path)
+    {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return "couldn't open snapshot file"_sv;
+        struct stat st;
+        NVMSnapshotHeader header;
+        if (fstat(fd, &st) != 0 || pread(fd, &header, sizeof(NVMSnapshotHeader), 0) != sizeof(NVMSnapshotHeader))
+        {
+            close(fd);
+            return "snapshot file is too small to hold a header"_sv;
+        }
+        u64 file_size = st.st_size;
+        if (header.magic != nvm_snapshot_magic)
+        {
+            close(fd);
+            return "bad magic"_sv;
+        }
+        if (header.table_offset > file_size || header.run_count > (file_size - header.table_offset) / sizeof(NVMSnapshotRun))
+        {
+            close(fd);
+            return "run table doesn't fit in the snapshot file"_sv;
+        }
+
+        Vector<NVMSnapshotRun> runs(header.run_count);
+        for (u64 i = 0; i < header.run_count; i++)
+            runs.append({});
+        u64 table_size = header.run_count * sizeof(NVMSnapshotRun);
+        u32 crc = crc32c((const u8*) &header.flat_size, sizeof(NVMSnapshotHeader) - sizeof(u32) * 2);
+        if (pread(fd, runs.data(), table_size, header.table_offset) != (ssize_t) table_size
+            || crc32c((const u8*) runs.data(), table_size, crc) != header.crc32)
+        {
+            close(fd);
+            return "bad checksum"_sv;
+        }
+        for (const auto& run : runs)
+        {
+            if (((run.address | run.size | run.file_offset) & NVMMemory::page_mask) != 0 || run.file_offset > file_size
+                || run.size > file_size - run.file_offset)
+            {
+                close(fd);
+                return "run doesn't fit in the snapshot file"_sv;
+            }
+        }
+
+        auto vm = new NVMVirtualMachine(0, header.flat_size);
+        auto& memory = vm->memory();
+        bool mapped = true;
+        for (const auto& run : runs)
+            mapped = mapped && memory.map_file(run.address, fd, run.file_offset, run.size);
+        bool protected_runs = mapped;
+        for (const auto& run : runs)
+        {
+            if ((run.flags & section_write) == 0)
+                protected_runs = protected_runs && memory.protect(run.address, run.size, false);
+        }
+        //the mappings keep the file alive on their own
+        close(fd);
+        if (!mapped)
+        {
+            delete vm;
+            return "couldn't map snapshot pages"_sv;
+        }
+        if (!protected_runs)
+        {
+            delete vm;
+            return "couldn't protect snapshot pages"_sv;
+        }
+        for (u8 i = 0; i < 16; i++)
+            vm->set_register_value(i, header.registers[i]);
+        return vm;
+    }
+}
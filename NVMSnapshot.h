@@ -0,0 +1,46 @@
+#pragma once
+#include <Types.h>
+#include <ResultOrError.h>
+#include <StringView.h>
+#include "NVMVirtualMachine.h"
+
+namespace nvm
+{
+    constexpr u32 nvm_snapshot_magic = 0x63026304;
+
+    /*
+     * A snapshot file is this header, padded to a page, then the contents of every guest page that may hold something
+     * other than zeroes, then a table of the runs they form. Pages are stored at page aligned offsets, so restoring
+     * maps them instead of reading them, and all-zero pages aren't stored at all.
+     */
+    struct NVMSnapshotHeader
+    {
+        u32 magic;
+        //covers the rest of this header and the run table; the pages are only ever read by the guest
+        u32 crc32;
+        u64 flat_size;
+        u64 registers[16];
+        u64 run_count;
+        u64 table_offset;
+    };
+    static_assert(sizeof(NVMSnapshotHeader) == 160, "the header layout is part of the snapshot format");
+
+    //consecutive guest pages with the same protection, stored back to back
+    struct NVMSnapshotRun
+    {
+        u64 address;
+        u64 size;
+        u64 file_offset;
+        //section_write if the pages are writable (see NVMBinaryFormat.h)
+        u32 flags;
+        u32 reserved;
+    };
+    static_assert(sizeof(NVMSnapshotRun) == 32, "the run table layout is part of the snapshot format");
+
+    //writes the registers and memory of a guest that isn't running, e.g. one paused by run_slice, to path. the file is
+    //written next to it and renamed over it once it is on disk, so path always holds a whole snapshot
+    bool save_snapshot(const NVMVirtualMachine& vm, const char* path);
+    //a new guest in the state a snapshot was taken in. pages are mapped copy-on-write and only read from the file
+    //when the guest touches them, so this costs little more than reading the run table
+    ResultOrError<NVMVirtualMachine*, StringView> restore_snapshot(const char* path);
+}
@@ -0,0 +1,31 @@
+#pragma once
+//generated by nvm --profile, see NVMFusionProfile; regenerate it instead of editing it
+//the profile and its workloads are in sample_assembly/profile. from the top of the tree, regenerate it with
+//  rm -f sample_assembly/profile/fusion.profile; for workload in sample_assembly/profile/*.asm; do
+//  nvm $workload --profile sample_assembly/profile/fusion.profile NVMSuperinstructions.h; done
+//from a profile of 140305304 dispatches
+#define ENUMERATE_SUPERINSTRUCTIONS(PAIR, TRIPLE) \
+    PAIR(SubI, JneI) \
+    TRIPLE(MulR, SubI, JneI) \
+    TRIPLE(DivR, SubI, JneI) \
+    TRIPLE(AddR, AddI, XorR) \
+    TRIPLE(AddI, XorR, SubI) \
+    PAIR(MulR, SubI) \
+    PAIR(DivR, SubI) \
+    TRIPLE(XorR, SubI, JneI) \
+    PAIR(AddR, AddI) \
+    PAIR(AddI, XorR) \
+    PAIR(XorR, SubI) \
+    TRIPLE(AddR, AddI, JneI) \
+    TRIPLE(Load64R, AddR, AddI) \
+    PAIR(AddI, JneI) \
+    PAIR(Load64R, AddR) \
+    TRIPLE(AddI, AddI, MulR) \
+    TRIPLE(AddI, MulR, SubI) \
+    TRIPLE(AddI, DivR, SubI) \
+    TRIPLE(SubI, OrR, SubI) \
+    TRIPLE(SubI, JneI, AddI) \
+    TRIPLE(SubI, JneI, SubI) \
+    TRIPLE(OrR, SubI, JneI) \
+    TRIPLE(JneI, AddI, DivR) \
+    TRIPLE(JneI, SubI, OrR)
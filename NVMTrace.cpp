@@ -0,0 +1,340 @@
+#include "NVMTrace.h"
+#include "NVMData.h"
+#include "NVMMemory.h"
+
+namespace nvm
+{
+    static constexpr u8 ip_id = get_register_id(Register::ip);
+
+    u64 fold(MicroOpKind kind, u64 lhs, u64 rhs)
+    {
+        switch (kind)
+        {
+            case MicroOpKind::AddR:
+            case MicroOpKind::AddI:
+                return lhs + rhs;
+            case MicroOpKind::SubR:
+            case MicroOpKind::SubI:
+                return lhs - rhs;
+            case MicroOpKind::MulR:
+            case MicroOpKind::MulI:
+                return lhs * rhs;
+            case MicroOpKind::DivR:
+            case MicroOpKind::DivI:
+                return rhs == (u64)-1 ? -lhs : (u64)((i64)lhs / (i64)rhs);
+            case MicroOpKind::Neg:
+                return -lhs;
+            case MicroOpKind::Not:
+                return ~lhs;
+            case MicroOpKind::ShlR:
+            case MicroOpKind::ShlI:
+                return lhs << (rhs & 63);
+            case MicroOpKind::ShrR:
+            case MicroOpKind::ShrI:
+                return lhs >> (rhs & 63);
+            case MicroOpKind::SraR:
+            case MicroOpKind::SraI:
+                return (u64)((i64)lhs >> (rhs & 63));
+            case MicroOpKind::AndR:
+            case MicroOpKind::AndI:
+                return lhs & rhs;
+            case MicroOpKind::OrR:
+            case MicroOpKind::OrI:
+                return lhs | rhs;
+            default:
+                return lhs ^ rhs;
+        }
+    }
+
+    static bool is_load(MicroOpKind kind)
+    {
+        return kind >= MicroOpKind::Load8R && kind <= MicroOpKind::Load64I;
+    }
+
+    static bool is_store(MicroOpKind kind)
+    {
+        return kind >= MicroOpKind::Store8R && kind <= MicroOpKind::Store64I;
+    }
+
+    static bool is_jump(MicroOpKind kind)
+    {
+        return kind >= MicroOpKind::JmpR && kind <= MicroOpKind::JluI;
+    }
+
+    //log2 of the bytes a load or store accesses
+    static u8 access_width(MicroOpKind kind)
+    {
+        return ((u8)kind - (u8)(is_load(kind) ? MicroOpKind::Load8R : MicroOpKind::Store8R)) / 2;
+    }
+
+    NVMTrace::NVMTrace(u64 anchor) : m_anchor(anchor), m_low(anchor), m_ops(), m_hoisted_checks()
+    {
+    }
+
+    bool NVMTrace::append(const Vector<MicroOp>& ops, u64 successor)
+    {
+        if (ops.size() == 0 || m_ops.size() + ops.size() > max_instructions)
+            return false;
+        const auto& last = ops[ops.size() - 1];
+        bool immediate_jump = is_jump(last.kind) && ((u8)last.kind - (u8)MicroOpKind::JmpR) % 2 == 1;
+        if (!is_jump(last.kind) && last.next_ip != successor)
+            return false;
+        if (last.kind == MicroOpKind::JmpI && last.imm != successor)
+            return false;
+        if (immediate_jump && last.imm != successor && last.next_ip != successor)
+            return false;
+
+        for (const auto& op : ops)
+        {
+            m_ops.append({ op, op.next_ip, TraceAccess::Checked, 0, 0 });
+            u64 address = op.next_ip - op.words * sizeof(u32);
+            if (address < m_low)
+                m_low = address;
+            if (op.next_ip > m_high)
+                m_high = op.next_ip;
+        }
+        m_ops[m_ops.size() - 1].successor = successor;
+        return true;
+    }
+
+    //a value of the SSA form. the first 16 are what the registers held at the anchor
+    struct TraceValue
+    {
+        bool constant;
+        u64 value;
+        //known to be what the register base held at the anchor, plus offset
+        bool affine;
+        u8 base;
+        u64 offset;
+    };
+
+    //a value memory is known to hold, because it was loaded from or stored there
+    struct KnownMemory
+    {
+        u32 address;
+        u8 width;
+        u32 value;
+    };
+
+    void NVMTrace::optimize(u64 flat_size, u64 flat_write_low, const u64* registers)
+    {
+        Vector<TraceValue> values;
+        auto define = [&](const TraceValue& value) -> u32
+        {
+            values.append(value);
+            return values.size() - 1;
+        };
+        auto constant = [&](u64 value) -> u32
+        {
+            return define({ true, value, false, 0, 0 });
+        };
+        auto same = [&](u32 a, u32 b) -> bool
+        {
+            return a == b || (values[a].constant && values[b].constant && values[a].value == values[b].value);
+        };
+        //whether two accesses never touch the same byte, as far as the guest address space goes
+        auto disjoint = [&](u32 a, u64 a_bytes, u32 b, u64 b_bytes) -> bool
+        {
+            const auto& x = values[a];
+            const auto& y = values[b];
+            u64 distance;
+            if (x.constant && y.constant)
+                distance = y.value - x.value;
+            else if (x.affine && y.affine && x.base == y.base)
+                distance = y.offset - x.offset;
+            else
+                return false;
+            distance &= (1ul << NVMMemory::address_bits) - 1;
+            return distance >= a_bytes && distance <= (1ul << NVMMemory::address_bits) - b_bytes;
+        };
+
+        u32 current[16];
+        for (u8 id = 0; id < 16; id++)
+            current[id] = define({ false, 0, true, id, 0 });
+        current[0] = constant(0);
+        //registers given a value other than the one they had at the anchor, somewhere in the trace
+        bool written[16] {};
+        bool interrupts = false;
+        auto read = [&](u8 id, u64 next_ip) -> u32
+        {
+            return id == ip_id ? constant(next_ip) : current[id];
+        };
+        auto write = [&](u8 id, u32 value)
+        {
+            if (id == 0 || id == ip_id)
+                return;
+            if (value != id)
+                written[id] = true;
+            current[id] = value;
+        };
+
+        //arithmetic, with identities giving back the operand they leave alone
+        auto compute = [&](MicroOpKind kind, u32 left, u32 right) -> u32
+        {
+            TraceValue lhs = values[left];
+            TraceValue rhs = values[right];
+            bool unary = kind == MicroOpKind::Neg || kind == MicroOpKind::Not;
+            bool division = kind == MicroOpKind::DivR || kind == MicroOpKind::DivI;
+            if (lhs.constant && (unary || (rhs.constant && !(division && rhs.value == 0))))
+                return constant(fold(kind, lhs.value, rhs.value));
+            if (unary)
+                return define({ false, 0, false, 0, 0 });
+
+            bool add = kind == MicroOpKind::AddR || kind == MicroOpKind::AddI;
+            bool sub = kind == MicroOpKind::SubR || kind == MicroOpKind::SubI;
+            bool mul = kind == MicroOpKind::MulR || kind == MicroOpKind::MulI;
+            bool bitwise_and = kind == MicroOpKind::AndR || kind == MicroOpKind::AndI;
+            bool commutative = add || mul || bitwise_and || kind == MicroOpKind::OrR || kind == MicroOpKind::OrI ||
+                               kind == MicroOpKind::XorR || kind == MicroOpKind::XorI;
+            auto identity = [&](u64 value) -> bool
+            {
+                if (mul || division)
+                    return value == 1;
+                if (bitwise_and)
+                    return value == ~0ul;
+                return (value & (kind >= MicroOpKind::ShlR && kind <= MicroOpKind::SraI ? 63 : ~0ul)) == 0;
+            };
+            if (rhs.constant && identity(rhs.value))
+                return left;
+            if (lhs.constant && commutative && identity(lhs.value))
+                return right;
+            if (lhs.affine && rhs.constant && (add || sub))
+                return define({ false, 0, true, lhs.base, add ? lhs.offset + rhs.value : lhs.offset - rhs.value });
+            if (rhs.affine && lhs.constant && add)
+                return define({ false, 0, true, rhs.base, rhs.offset + lhs.value });
+            return define({ false, 0, false, 0, 0 });
+        };
+
+        Vector<KnownMemory> memory;
+        //the address of every load and store
+        Vector<u32> addresses;
+        for (u64 i = 0; i < m_ops.size(); i++)
+        {
+            auto& traced = m_ops[i];
+            const auto& op = traced.op;
+            bool uses_register = ((u8)op.kind - (u8)MicroOpKind::AddR) % 2 == 0;
+            addresses.append(0);
+            if (op.kind <= MicroOpKind::XorI)
+            {
+                u32 left = read(op.b, op.next_ip);
+                write(op.a, compute(op.kind, left, uses_register ? read(op.c, op.next_ip) : constant(op.imm)));
+            }
+            else if (is_load(op.kind))
+            {
+                u8 width = access_width(op.kind);
+                u32 address = uses_register ? read(op.c, op.next_ip) : constant(op.imm);
+                addresses[i] = address;
+                bool known = false;
+                u32 loaded = 0;
+                for (const auto& entry : memory)
+                {
+                    if (entry.width == width && same(entry.address, address))
+                    {
+                        known = true;
+                        loaded = entry.value;
+                        break;
+                    }
+                }
+                if (!known)
+                {
+                    loaded = define({ false, 0, false, 0, 0 });
+                    memory.append({ address, width, loaded });
+                }
+                else if (values[loaded].constant)
+                {
+                    traced.access = TraceAccess::Known;
+                    traced.value = values[loaded].value;
+                }
+                else
+                {
+                    //otherwise it is loaded again, which still gives the same value
+                    for (u8 id = 1; id < 16; id++)
+                    {
+                        if (id != ip_id && current[id] == loaded)
+                        {
+                            traced.access = TraceAccess::Forwarded;
+                            traced.source = id;
+                            break;
+                        }
+                    }
+                }
+                write(op.a, loaded);
+            }
+            else if (is_store(op.kind))
+            {
+                u8 width = access_width(op.kind);
+                u32 address = uses_register ? read(op.c, op.next_ip) : constant(op.imm);
+                addresses[i] = address;
+                Vector<KnownMemory> kept;
+                for (const auto& entry : memory)
+                {
+                    if (disjoint(entry.address, 1ul << entry.width, address, 1ul << width))
+                        kept.append(entry);
+                }
+                memory.clear();
+                for (const auto& entry : kept)
+                    memory.append(entry);
+                //narrower loads than 8 bytes see a truncated value, which is not one the store had
+                if (width == 3)
+                    memory.append({ address, width, read(op.a, op.next_ip) });
+            }
+            else if (op.kind == MicroOpKind::Int)
+            {
+                memory.clear();
+                for (u8 id = 1; id < 16; id++)
+                    write(id, define({ false, 0, false, 0, 0 }));
+                interrupts = true;
+            }
+        }
+
+        //a failed check before the loop keeps the whole trace from running, so only addresses that are in the flat
+        //region right now are worth it
+        for (u64 i = 0; i < m_ops.size() && !interrupts; i++)
+        {
+            auto& traced = m_ops[i];
+            if ((!is_load(traced.op.kind) && !is_store(traced.op.kind)) || traced.access != TraceAccess::Checked)
+                continue;
+            const auto& address = values[addresses[i]];
+            u8 width = access_width(traced.op.kind);
+            if (!address.affine || written[address.base])
+                continue;
+            u64 at = registers[address.base] + address.offset;
+            u64 low = is_store(traced.op.kind) ? flat_write_low : 0;
+            if (at < low || at >= flat_size || flat_size - at < (1ul << width))
+                continue;
+            traced.access = TraceAccess::Hoisted;
+            bool checked = false;
+            for (const auto& check : m_hoisted_checks)
+                checked = checked || (check.base == address.base && check.offset == address.offset && check.width == width &&
+                                      check.low == low);
+            if (!checked)
+                m_hoisted_checks.append({ address.base, address.offset, width, low });
+        }
+
+        //stores to the flat region above flat_write_low never fault, so one that is overwritten before memory is read,
+        //anything else is stored, or the trace may be left can go
+        u64 pending = ~0ul;
+        for (u64 i = 0; i < m_ops.size(); i++)
+        {
+            auto& traced = m_ops[i];
+            MicroOpKind kind = traced.op.kind;
+            if (is_store(kind))
+            {
+                const auto& address = values[addresses[i]];
+                u64 bytes = 1ul << access_width(kind);
+                bool flat = traced.access == TraceAccess::Hoisted ||
+                            (address.constant && address.value >= flat_write_low && address.value < flat_size &&
+                             flat_size - address.value >= bytes);
+                if (pending != ~0ul && access_width(m_ops[pending].op.kind) == access_width(kind) &&
+                    same(addresses[pending], addresses[i]))
+                    m_ops[pending].access = TraceAccess::Dead;
+                pending = flat ? i : ~0ul;
+            }
+            else if (is_load(kind) || is_jump(kind) || kind == MicroOpKind::Int || kind == MicroOpKind::DivR ||
+                     kind == MicroOpKind::DivI)
+            {
+                pending = ~0ul;
+            }
+        }
+    }
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <Types.h>
+#include <Vector.h>
+#include "NVMInstructionCache.h"
+
+namespace nvm
+{
+    //what the trace compiler does about a memory access, as NVMTrace::optimize() decided
+    enum class TraceAccess : u8
+    {
+        //checked inline, the way blocks do it
+        Checked,
+        //its address was checked before the loop, so it goes straight to the flat region
+        Hoisted,
+        //a load of a value a register already holds, which is moved from there
+        Forwarded,
+        //a load of a value known at compile time
+        Known,
+        //a store overwritten before anything could see it
+        Dead
+    };
+
+    struct TraceOp
+    {
+        MicroOp op;
+        //jumps: where the recorded run went on to, which is what the trace guards for
+        u64 successor;
+        TraceAccess access;
+        //forwarded loads: the register holding the value
+        u8 source;
+        //known loads: the value
+        u64 value;
+    };
+
+    //an address checked for the flat region before the loop: an invariant register plus an offset. stores check
+    //against the part of it above low, where no page is read only
+    struct HoistedCheck
+    {
+        u8 base;
+        u64 offset;
+        u8 width;
+        u64 low;
+    };
+
+    //what the interpreter and optimizing code compute for a micro-op whose operands are known. divisors are not 0
+    u64 fold(MicroOpKind kind, u64 lhs, u64 rhs);
+
+    /*
+     * A loop as one run went through it: the micro-ops of every block from the anchor until the run came back to it,
+     * with the direction each jump went. The trace compiler turns it into one straight line of native code, with a
+     * guard wherever the run could have gone elsewhere, that jumps back to its start.
+     * optimize() puts one iteration into SSA form. Every register starts out as its value at the anchor, r0 and
+     * immediates are constants, and every micro-op defines a new value, unless it folds to a constant or is an
+     * identity that just copies one. On top of that it
+     *   - forwards loads of a value that was loaded or stored at the same address earlier in the iteration, with no
+     *     store in between that might have overwritten it, from whichever register still holds the value
+     *   - drops stores to the flat region that are overwritten before anything else touches memory or leaves the trace
+     *   - hoists the bounds check of accesses whose address is an invariant register plus an offset, so that they go
+     *     straight to the flat region inside the loop. Only addresses in the flat region when the trace was compiled
+     *     are hoisted; the trace checks them all once before it starts, and runs none of itself if one fails
+     * Registers are invariant if nothing in the trace writes them. Interrupt handlers may write any register or memory,
+     * so an interrupt forgets everything known, and no check is hoisted out of a loop that has one.
+     */
+    class NVMTrace
+    {
+    public:
+        static constexpr u64 max_instructions = 256;
+
+        explicit NVMTrace(u64 anchor);
+
+        //adds the micro-ops of a block the run went through, and where it went next. false if the block can't have
+        //gone there, or the trace got too long
+        bool append(const Vector<MicroOp>& ops, u64 successor);
+        //registers are the values at the anchor when the trace is compiled, which decide what is worth hoisting.
+        //stores only count as flat at or above flat_write_low (see NVMMemory::FastPathState)
+        void optimize(u64 flat_size, u64 flat_write_low, const u64* registers);
+
+        u64 anchor() const
+        {
+            return m_anchor;
+        }
+
+        //guest code the trace was made from, which writes kill it for
+        u64 low() const
+        {
+            return m_low;
+        }
+
+        u64 high() const
+        {
+            return m_high;
+        }
+
+        const Vector<TraceOp>& ops() const
+        {
+            return m_ops;
+        }
+
+        const Vector<HoistedCheck>& hoisted_checks() const
+        {
+            return m_hoisted_checks;
+        }
+
+    private:
+        u64 m_anchor;
+        u64 m_low;
+        u64 m_high { 0 };
+        Vector<TraceOp> m_ops;
+        Vector<HoistedCheck> m_hoisted_checks;
+    };
+}
@@ -1,48 +1,589 @@
 #include "NVMVirtualMachine.h"
 #include "NVMData.h"
+#include "NVMInterruptTable.h"
+#include "NVMFusionProfile.h"
+#include "NVMJit.h"
+#include "NVMSampleProfile.h"
+#include <IterableUtil.h>
 
 namespace nvm
 {
-    NVMVirtualMachine::NVMVirtualMachine(const Span<u8>& bytecode) : m_memory(32*1024)
+    NVMVirtualMachine::NVMVirtualMachine(const Span<u8>& bytecode) : NVMVirtualMachine(bytecode, 0, 0)
     {
-        //this loads a raw blob of instructions starting in 0x0. for specific relocation loads, see formatted load (TODO)
-        u64 load_address = 0;
-        if (bytecode.size() %  8 == 0)
+    }
+
+    NVMVirtualMachine::NVMVirtualMachine(const Span<u8>& bytecode, u64 load_address, u64 entry_point) : m_memory(default_flat_memory_size), m_code_cache(m_memory)
+    {
+        m_registers[get_register_id(Register::ip)] = entry_point;
+        m_memory.load_image(load_address, bytecode);
+    }
+
+    NVMVirtualMachine::NVMVirtualMachine(u64 entry_point, u64 flat_memory_size) : m_memory(flat_memory_size), m_code_cache(m_memory)
+    {
+        m_registers[get_register_id(Register::ip)] = entry_point;
+    }
+
+    NVMVirtualMachine::NVMVirtualMachine(u64 entry_point, u8* flat_memory, u64 flat_memory_size) : m_memory(flat_memory, flat_memory_size), m_code_cache(m_memory)
+    {
+        m_registers[get_register_id(Register::ip)] = entry_point;
+    }
+
+    NVMVirtualMachine::~NVMVirtualMachine()
+    {
+        delete m_jit;
+    }
+
+    NVMVirtualMachine* NVMVirtualMachine::fork()
+    {
+        auto child = new NVMVirtualMachine(0, nullptr, 0);
+        if (!m_memory.fork_into(child->m_memory))
         {
-            for (auto w : bytecode.as<u64>())
-            {
-                m_memory.write_64(load_address, w);
-                load_address += 8;
-            }
+            delete child;
+            return nullptr;
         }
-        else if (bytecode.size() % 4 == 0)
+        __builtin_memcpy(child->m_registers, m_registers, sizeof(m_registers));
+        child->m_trap = m_trap;
+        child->m_trap_address = m_trap_address;
+        child->m_paused = m_paused;
+        return child;
+    }
+
+    //the micro-ops that can rewrite code
+    static constexpr bool writes_memory(MicroOpKind kind)
+    {
+        return (kind >= MicroOpKind::Store8R && kind <= MicroOpKind::Store64I) || kind == MicroOpKind::Int;
+    }
+
+    //the micro-ops that stand for a guest instruction, as opposed to markers the interpreter runs between them
+    static constexpr bool is_instruction(MicroOpKind kind)
+    {
+        return kind <= MicroOpKind::InvalidInstruction;
+    }
+
+    ExitCode NVMVirtualMachine::run()
+    {
+        return run_loop<DispatchMode::Interpret>(nullptr);
+    }
+
+    ExitCode NVMVirtualMachine::run_profiled(NVMFusionProfile& profile)
+    {
+        m_code_cache.set_fusion(false);
+        return run_loop<DispatchMode::Profile>(&profile);
+    }
+
+    //checked runs count instructions against native blocks one handler at a time, so nothing is fused
+    ExitCode NVMVirtualMachine::run_jit(bool checked, u16 baseline_threshold, u64 optimizing_threshold)
+    {
+        if (m_jit == nullptr)
+            m_jit = new NVMJit(m_registers, m_memory, m_code_cache, checked, baseline_threshold, optimizing_threshold);
+        if (checked)
         {
-            for (auto w : bytecode.as<u32>())
-            {
-                m_memory.write_32(load_address, w);
-                load_address += 4;
-            }
+            m_code_cache.set_fusion(false);
+            return run_loop<DispatchMode::Differential>(nullptr);
         }
-        else if (bytecode.size() % 2 == 0)
-        {
-            for (auto w : bytecode.as<u16>())
+        return run_loop<DispatchMode::Native>(nullptr);
+    }
+
+    //superinstructions run to their end, so a slice may take a couple of instructions more than asked for
+    ExitCode NVMVirtualMachine::run_slice(u64 instructions)
+    {
+        m_paused = false;
+        return run_loop<DispatchMode::Sliced>(nullptr, instructions);
+    }
+
+    //every instruction has a handler of its own, so each sample lands on the address of the instruction it counted
+    ExitCode NVMVirtualMachine::run_sampled(NVMSampleProfile& profile)
+    {
+        m_code_cache.set_fusion(false);
+        return run_loop<DispatchMode::Sampled>(nullptr, profile.interval(), &profile);
+    }
+
+    /*
+     * Direct threaded interpreter over pre-decoded micro-ops. Every handler ends by stepping to the next micro-op and
+     * jumping straight to its handler, so there is no central switch and the host branch predictor gets one indirect
+     * jump per handler to learn from.
+     * Slots are decoded the first time they execute (see NVMInstructionCache), so the steady state does no bit
+     * twiddling at all: operand forms, access widths and immediate jump targets were all resolved at decode time.
+     * The work of every micro-op is spelled out once, as the body macros below. Handlers run one body and dispatch;
+     * superinstruction handlers run the body of each micro-op in their sequence, stepping from one slot to the next in
+     * between, and dispatch once at the end. A body leaves the handler early only to take a jump, trap or halt.
+     * When profiling, every dispatch that falls through to the next slot is recorded along with the two micro-ops
+     * before it, and nothing is fused.
+     * With a JIT, every slot a block can start at counts how often it is entered: the targets of jumps, the slots
+     * after conditional jumps, and wherever resolve lands, with backward jumps counting for more since their targets
+     * are likely loops. Once one gets hot its block is compiled, and from then on its EnterNative handler runs the
+     * block and continues wherever it left off. Interpreted instructions are counted too, for the JIT's statistics. In differential mode the handler
+     * instead runs the block and takes its effects back, then interprets the same instructions and has the JIT compare
+     * the two once the interpreter got as far as the block did.
+     * Sliced runs count down the instructions left in their slice, and once it runs out return right before the next
+     * instruction, with ip pointing at it. Sampled runs count down the same way, to the next sample.
+     */
+    template<NVMVirtualMachine::DispatchMode mode>
+    ExitCode NVMVirtualMachine::run_loop(NVMFusionProfile* profile, u64 slice, NVMSampleProfile* samples)
+    {
+        void* handlers[(u8)MicroOpKind::Count];
+#define REGISTER_HANDLER(name) handlers[(u8)MicroOpKind::name] = &&name;
+#define REGISTER_PAIR(a, b) handlers[(u8)MicroOpKind::a##_##b] = &&a##_##b;
+#define REGISTER_TRIPLE(a, b, c) handlers[(u8)MicroOpKind::a##_##b##_##c] = &&a##_##b##_##c;
+        ENUMERATE_MICRO_OPS(REGISTER_HANDLER)
+        ENUMERATE_SUPERINSTRUCTIONS(REGISTER_PAIR, REGISTER_TRIPLE)
+#undef REGISTER_TRIPLE
+#undef REGISTER_PAIR
+#undef REGISTER_HANDLER
+        m_code_cache.set_handlers(handlers);
+        //the loop and native code write the flat region directly
+        m_memory.mark_changed();
+
+        constexpr u8 ip_id = get_register_id(Register::ip);
+        u64* const registers = m_registers;
+        constexpr u64 chunk_size = NVMMemory::page_size;
+        u64 ip = registers[ip_id];
+        u64 code_base = 0;
+        MicroOp* ops = nullptr;
+        MicroOp* op = nullptr;
+        //the slot the last fall through went to, and the micro-op it came from; only used when profiling
+        MicroOp* fell_into = nullptr;
+        MicroOpKind fell_from = MicroOpKind::Count;
+        constexpr bool counts_entries = mode == DispatchMode::Native || mode == DispatchMode::Differential;
+        const u16 threshold = m_jit != nullptr ? m_jit->threshold() : 0;
+        //differential mode: whether a native run is being compared, and how many instructions are left until then
+        bool checking = false;
+        u64 check_steps = 0;
+        //handed to the JIT whenever the loop returns
+        u64 interpreted = 0;
+
+#define DISPATCH()                                                  \
+        do                                                          \
+        {                                                           \
+            registers[ip_id] = op->next_ip;                         \
+            goto *op->handler;                                      \
+        } while (0)
+
+//moves on to the next slot of a superinstruction. if the micro-op just run was a store or interrupt, it may have
+//rewritten that slot, which then has to be decoded again and is dispatched to instead
+#define STEP(previous, expected)                                    \
+        do                                                          \
+        {                                                           \
+            op += op->words;                                        \
+            registers[ip_id] = op->next_ip;                         \
+            if constexpr (counts_entries)                           \
+                interpreted++;                                      \
+            if constexpr (mode == DispatchMode::Sliced)             \
+                slice -= slice != 0;                                \
+            if constexpr (writes_memory(MicroOpKind::previous))     \
+            {                                                       \
+                if (op->kind != MicroOpKind::expected) [[unlikely]] \
+                    goto *op->handler;                              \
+            }                                                       \
+        } while (0)
+
+#define NEXT()                                                      \
+        do                                                          \
+        {                                                           \
+            if constexpr (mode == DispatchMode::Profile)            \
+                record_fall_through(profile, op, ops, code_base, fell_into, fell_from); \
+            op += op->words;                                        \
+            DISPATCH();                                             \
+        } while (0)
+
+//r0 is hardwired to zero, so whatever a handler wrote to it is discarded here
+#define RESULT(value)                                               \
+        do                                                          \
+        {                                                           \
+            registers[op->a] = (value);                             \
+            registers[0] = 0;                                       \
+        } while (0)
+
+#define CONTINUE_AT(address)                                        \
+        do                                                          \
+        {                                                           \
+            ip = (address);                                         \
+            goto resolve;                                           \
+        } while (0)
+
+#define RETURN(code)                                                \
+        do                                                          \
+        {                                                           \
+            if constexpr (counts_entries)                           \
+                m_jit->count_interpreted(interpreted);              \
+            return (code);                                          \
+        } while (0)
+
+#define TRAP(reason, address)                                       \
+        do                                                          \
+        {                                                           \
+            m_trap = reason;                                        \
+            m_trap_address = (address);                             \
+            registers[ip_id] = m_trap_address;                      \
+            if constexpr (mode == DispatchMode::Differential)       \
+            {                                                       \
+                if (checking)                                       \
+                    m_jit->end_check(m_trap_address, m_trap);       \
+            }                                                       \
+            RETURN((ExitCode)-1);                                   \
+        } while (0)
+
+//compiles the block starting at entry once it was entered threshold times, an entry counting weight times. heat
+//saturates there, so a block that couldn't be compiled isn't tried again until something resets it
+#define COUNT_ENTRY(entry, address, weight)                         \
+        do                                                          \
+        {                                                           \
+            if constexpr (counts_entries)                           \
+            {                                                       \
+                if ((entry)->heat < threshold)                      \
+                {                                                   \
+                    (entry)->heat += (weight);                      \
+                    if ((entry)->heat >= threshold) [[unlikely]]    \
+                        m_jit->compile(address);                    \
+                }                                                   \
+            }                                                       \
+        } while (0)
+
+//counts interpreted instructions, and in differential mode the comparison happens right before the first instruction
+//native code didn't run. sliced runs pause here, and sampled runs take their samples
+#define COUNT_STEP(name)                                            \
+        do                                                          \
+        {                                                           \
+            if constexpr (counts_entries && is_instruction(MicroOpKind::name)) \
+                interpreted++;                                      \
+            if constexpr (mode == DispatchMode::Sampled && is_instruction(MicroOpKind::name)) \
+            {                                                       \
+                if (--slice == 0) [[unlikely]]                      \
+                {                                                   \
+                    samples->record(op->next_ip - op->words * sizeof(u32)); \
+                    slice = samples->interval();                    \
+                }                                                   \
+            }                                                       \
+            if constexpr (mode == DispatchMode::Sliced && is_instruction(MicroOpKind::name)) \
+            {                                                       \
+                if (slice == 0) [[unlikely]]                        \
+                {                                                   \
+                    registers[ip_id] = op->next_ip - op->words * sizeof(u32); \
+                    m_paused = true;                                \
+                    return 0;                                       \
+                }                                                   \
+                slice--;                                            \
+            }                                                       \
+            if constexpr (mode == DispatchMode::Differential && is_instruction(MicroOpKind::name)) \
+            {                                                       \
+                if (checking)                                       \
+                {                                                   \
+                    if (check_steps == 0)                           \
+                    {                                               \
+                        m_jit->end_check(op->next_ip - op->words * sizeof(u32), Trap::None); \
+                        checking = false;                           \
+                    }                                               \
+                    else                                            \
+                    {                                               \
+                        check_steps--;                              \
+                    }                                               \
+                }                                                   \
+            }                                                       \
+        } while (0)
+
+#define ALU_BODY_R(expression)                                      \
+        {                                                           \
+            u64 lhs = registers[op->b];                             \
+            u64 rhs = registers[op->c];                             \
+            RESULT(expression);                                     \
+        }
+
+#define ALU_BODY_I(expression)                                      \
+        {                                                           \
+            u64 lhs = registers[op->b];                             \
+            u64 rhs = op->imm;                                      \
+            RESULT(expression);                                     \
+        }
+
+#define DIV_BODY(divisor_value)                                     \
+        {                                                           \
+            u64 divisor = (divisor_value);                          \
+            if (divisor == 0) [[unlikely]]                          \
+                TRAP(Trap::DivisionByZero, op->next_ip - op->words * sizeof(u32)); \
+            /* INT64_MIN / -1 traps on the host, so negation is done by hand */ \
+            RESULT(divisor == (u64)-1 ? -registers[op->b] : (u64)((i64)registers[op->b] / (i64)divisor)); \
+        }
+
+//stores to read only pages are dropped by NVMMemory and surface here as a trap. a store to a chunk borrowed from
+//NVMSharedCode moves the guest to a copy of its own, which the next instruction is looked up in again
+#define CHECK_FAULT()                                               \
+        do                                                          \
+        {                                                           \
+            if (m_memory.has_event()) [[unlikely]]                  \
+            {                                                       \
+                bool fault = m_memory.has_fault();                  \
+                m_memory.clear_events();                            \
+                if (fault)                                          \
+                    TRAP(Trap::ProtectionFault, op->next_ip - op->words * sizeof(u32)); \
+                ops = nullptr;                                      \
+                CONTINUE_AT(op->next_ip);                           \
+            }                                                       \
+        } while (0)
+
+#define STORE_BODY(write, address)                                  \
+        {                                                           \
+            m_memory.write(address, registers[op->a]);              \
+            CHECK_FAULT();                                          \
+        }
+
+#define JUMP_BODY_R(condition)                                      \
+        {                                                           \
+            if (condition)                                          \
+                CONTINUE_AT(registers[op->c]);                      \
+            COUNT_ENTRY(op + op->words, op->next_ip, 1);            \
+        }
+
+#define JUMP_BODY_I(condition)                                      \
+        {                                                           \
+            if (condition)                                          \
+            {                                                       \
+                if (op->target_op != nullptr)                       \
+                {                                                   \
+                    COUNT_ENTRY(op->target_op, op->imm, op->imm < op->next_ip ? NVMJit::backward_jump_weight : 1); \
+                    op = op->target_op;                             \
+                    DISPATCH();                                     \
+                }                                                   \
+                CONTINUE_AT(op->imm);                               \
+            }                                                       \
+            COUNT_ENTRY(op + op->words, op->next_ip, 1);            \
+        }
+
+#define BODY_AddR ALU_BODY_R(lhs + rhs)
+#define BODY_AddI ALU_BODY_I(lhs + rhs)
+#define BODY_SubR ALU_BODY_R(lhs - rhs)
+#define BODY_SubI ALU_BODY_I(lhs - rhs)
+#define BODY_MulR ALU_BODY_R(lhs * rhs)
+#define BODY_MulI ALU_BODY_I(lhs * rhs)
+#define BODY_DivR DIV_BODY(registers[op->c])
+#define BODY_DivI DIV_BODY(op->imm)
+#define BODY_Neg RESULT(-registers[op->b]);
+#define BODY_Not RESULT(~registers[op->b]);
+#define BODY_ShlR ALU_BODY_R(lhs << (rhs & 63))
+#define BODY_ShlI ALU_BODY_I(lhs << (rhs & 63))
+#define BODY_ShrR ALU_BODY_R(lhs >> (rhs & 63))
+#define BODY_ShrI ALU_BODY_I(lhs >> (rhs & 63))
+#define BODY_SraR ALU_BODY_R((u64)((i64)lhs >> (rhs & 63)))
+#define BODY_SraI ALU_BODY_I((u64)((i64)lhs >> (rhs & 63)))
+#define BODY_AndR ALU_BODY_R(lhs & rhs)
+#define BODY_AndI ALU_BODY_I(lhs & rhs)
+#define BODY_OrR ALU_BODY_R(lhs | rhs)
+#define BODY_OrI ALU_BODY_I(lhs | rhs)
+#define BODY_XorR ALU_BODY_R(lhs ^ rhs)
+#define BODY_XorI ALU_BODY_I(lhs ^ rhs)
+#define BODY_Load8R RESULT(m_memory.read_8(registers[op->c]));
+#define BODY_Load8I RESULT(m_memory.read_8(op->imm));
+#define BODY_Load16R RESULT(m_memory.read_16(registers[op->c]));
+#define BODY_Load16I RESULT(m_memory.read_16(op->imm));
+#define BODY_Load32R RESULT(m_memory.read_32(registers[op->c]));
+#define BODY_Load32I RESULT(m_memory.read_32(op->imm));
+#define BODY_Load64R RESULT(m_memory.read_64(registers[op->c]));
+#define BODY_Load64I RESULT(m_memory.read_64(op->imm));
+#define BODY_Store8R STORE_BODY(write_8, registers[op->c])
+#define BODY_Store8I STORE_BODY(write_8, op->imm)
+#define BODY_Store16R STORE_BODY(write_16, registers[op->c])
+#define BODY_Store16I STORE_BODY(write_16, op->imm)
+#define BODY_Store32R STORE_BODY(write_32, registers[op->c])
+#define BODY_Store32I STORE_BODY(write_32, op->imm)
+#define BODY_Store64R STORE_BODY(write_64, registers[op->c])
+#define BODY_Store64I STORE_BODY(write_64, op->imm)
+#define BODY_Int                                                    \
+        {                                                           \
+            auto handler = find(interrupt_table, op->imm, [](const InterruptHandler& h, const u64& code) -> bool \
+                { return h.code == code; });                        \
+            if (handler == interrupt_table.end()) [[unlikely]]      \
+                TRAP(Trap::InvalidInterrupt, op->next_ip - op->words * sizeof(u32)); \
+            if (handler->handle(registers, m_memory) == InterruptResult::Halt) \
+                RETURN(registers[get_register_id(Register::r1)]);   \
+            registers[0] = 0;                                       \
+            CHECK_FAULT();                                          \
+        }
+#define BODY_JmpR JUMP_BODY_R(true)
+#define BODY_JmpI JUMP_BODY_I(true)
+#define BODY_JeR JUMP_BODY_R(registers[op->a] == registers[op->b])
+#define BODY_JeI JUMP_BODY_I(registers[op->a] == registers[op->b])
+#define BODY_JneR JUMP_BODY_R(registers[op->a] != registers[op->b])
+#define BODY_JneI JUMP_BODY_I(registers[op->a] != registers[op->b])
+#define BODY_JgR JUMP_BODY_R((i64)registers[op->a] > (i64)registers[op->b])
+#define BODY_JgI JUMP_BODY_I((i64)registers[op->a] > (i64)registers[op->b])
+#define BODY_JguR JUMP_BODY_R(registers[op->a] > registers[op->b])
+#define BODY_JguI JUMP_BODY_I(registers[op->a] > registers[op->b])
+#define BODY_JlR JUMP_BODY_R((i64)registers[op->a] < (i64)registers[op->b])
+#define BODY_JlI JUMP_BODY_I((i64)registers[op->a] < (i64)registers[op->b])
+#define BODY_JluR JUMP_BODY_R(registers[op->a] < registers[op->b])
+#define BODY_JluI JUMP_BODY_I(registers[op->a] < registers[op->b])
+#define BODY_InvalidInstruction TRAP(Trap::InvalidInstruction, op->next_ip - op->words * sizeof(u32));
+#define BODY_Decode                                                 \
+        {                                                           \
+            m_code_cache.decode(op, code_base + (u64)(op - ops) * sizeof(u32), ops, code_base); \
+            DISPATCH();                                             \
+        }
+#define BODY_LeaveChunk CONTINUE_AT(code_base + (u64)(op - ops) * sizeof(u32));
+//the slot keeps its kind, so outside of native mode it is interpreted as usual
+#define BODY_EnterNative                                            \
+        {                                                           \
+            u64 address = code_base + (u64)(op - ops) * sizeof(u32); \
+            if constexpr (mode == DispatchMode::Native)             \
+            {                                                       \
+                switch (m_jit->run(address))                        \
+                {                                                   \
+                    case NativeExit::Continue:                      \
+                        CONTINUE_AT(registers[ip_id]);              \
+                    case NativeExit::Halt:                          \
+                        RETURN(registers[get_register_id(Register::r1)]); \
+                    case NativeExit::Trap:                          \
+                        TRAP(m_jit->trap(), registers[ip_id]);      \
+                    case NativeExit::TierUp:                        \
+                    case NativeExit::Deoptimize:                    \
+                        __builtin_unreachable();                    \
+                }                                                   \
+            }                                                       \
+            /* blocks starting inside the one being checked are just interpreted */ \
+            if constexpr (mode == DispatchMode::Differential)       \
+            {                                                       \
+                if (!checking || check_steps == 0)                  \
+                {                                                   \
+                    if (checking)                                   \
+                        m_jit->end_check(address, Trap::None);      \
+                    check_steps = m_jit->begin_check(address);      \
+                    checking = true;                                \
+                }                                                   \
+            }                                                       \
+            goto *handlers[(u8)op->kind];                           \
+        }
+
+        //finds the slot for ip, switching chunks if needed. taken on entry, register jumps and far immediate jumps
+        resolve:
+            if constexpr (mode == DispatchMode::Differential)
             {
-                m_memory.write_16(load_address, w);
-                load_address += 2;
+                if (checking && check_steps == 0)
+                {
+                    m_jit->end_check(ip, Trap::None);
+                    checking = false;
+                }
             }
-        }
-        else
-        {
-            for (auto w : bytecode)
+            if (ip & 3) [[unlikely]]
+                TRAP(Trap::MisalignedInstruction, ip);
+            if (ops == nullptr || ip - code_base >= chunk_size)
             {
-                m_memory.write_32(load_address++, w);
+                ops = m_code_cache.ops_for(ip);
+                code_base = ip - ip % chunk_size;
             }
-        }
+            op = ops + (ip - code_base) / sizeof(u32);
+            COUNT_ENTRY(op, ip, 1);
+            DISPATCH();
+
+#define HANDLER(name)                                               \
+        name:                                                       \
+            COUNT_STEP(name);                                       \
+            BODY_##name                                             \
+            NEXT();
+#define PAIR_HANDLER(a, b)                                          \
+        a##_##b:                                                    \
+            COUNT_STEP(a);                                          \
+            BODY_##a                                                \
+            STEP(a, b);                                             \
+            BODY_##b                                                \
+            NEXT();
+#define TRIPLE_HANDLER(a, b, c)                                     \
+        a##_##b##_##c:                                              \
+            COUNT_STEP(a);                                          \
+            BODY_##a                                                \
+            STEP(a, b);                                             \
+            BODY_##b                                                \
+            STEP(b, c);                                             \
+            BODY_##c                                                \
+            NEXT();
+
+        ENUMERATE_MICRO_OPS(HANDLER)
+        ENUMERATE_SUPERINSTRUCTIONS(PAIR_HANDLER, TRIPLE_HANDLER)
+
+#undef TRIPLE_HANDLER
+#undef PAIR_HANDLER
+#undef HANDLER
+#undef BODY_EnterNative
+#undef BODY_LeaveChunk
+#undef BODY_Decode
+#undef BODY_InvalidInstruction
+#undef BODY_JluI
+#undef BODY_JluR
+#undef BODY_JlI
+#undef BODY_JlR
+#undef BODY_JguI
+#undef BODY_JguR
+#undef BODY_JgI
+#undef BODY_JgR
+#undef BODY_JneI
+#undef BODY_JneR
+#undef BODY_JeI
+#undef BODY_JeR
+#undef BODY_JmpI
+#undef BODY_JmpR
+#undef BODY_Int
+#undef BODY_Store64I
+#undef BODY_Store64R
+#undef BODY_Store32I
+#undef BODY_Store32R
+#undef BODY_Store16I
+#undef BODY_Store16R
+#undef BODY_Store8I
+#undef BODY_Store8R
+#undef BODY_Load64I
+#undef BODY_Load64R
+#undef BODY_Load32I
+#undef BODY_Load32R
+#undef BODY_Load16I
+#undef BODY_Load16R
+#undef BODY_Load8I
+#undef BODY_Load8R
+#undef BODY_XorI
+#undef BODY_XorR
+#undef BODY_OrI
+#undef BODY_OrR
+#undef BODY_AndI
+#undef BODY_AndR
+#undef BODY_SraI
+#undef BODY_SraR
+#undef BODY_ShrI
+#undef BODY_ShrR
+#undef BODY_ShlI
+#undef BODY_ShlR
+#undef BODY_Not
+#undef BODY_Neg
+#undef BODY_DivI
+#undef BODY_DivR
+#undef BODY_MulI
+#undef BODY_MulR
+#undef BODY_SubI
+#undef BODY_SubR
+#undef BODY_AddI
+#undef BODY_AddR
+#undef JUMP_BODY_I
+#undef JUMP_BODY_R
+#undef STORE_BODY
+#undef CHECK_FAULT
+#undef DIV_BODY
+#undef ALU_BODY_I
+#undef ALU_BODY_R
+#undef COUNT_STEP
+#undef COUNT_ENTRY
+#undef RETURN
+#undef TRAP
+#undef CONTINUE_AT
+#undef RESULT
+#undef NEXT
+#undef STEP
+#undef DISPATCH
     }
-    
-    ExitCode NVMVirtualMachine::run()
+
+    //the slot fallen into is decoded right away, as it would be by its handler, so that its micro-op is known
+    void NVMVirtualMachine::record_fall_through(NVMFusionProfile* profile, MicroOp* op, MicroOp* ops, u64 code_base,
+                                                MicroOp*& fell_into, MicroOpKind& fell_from)
     {
-        
-        return 0;
+        MicroOp* next = op + op->words;
+        if (next->kind == MicroOpKind::Decode)
+            m_code_cache.decode(next, code_base + (u64)(next - ops) * sizeof(u32), ops, code_base);
+        profile->record(op == fell_into ? fell_from : MicroOpKind::Count, op->kind, next->kind);
+        fell_into = next;
+        fell_from = op->kind;
     }
-}
\ No newline at end of file
+}
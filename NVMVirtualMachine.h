@@ -1,207 +1,137 @@
 #pragma once
 #include <Span.h>
 #include <Vector.h>
-#include <Hashmap.h>
+#include "NVMMemory.h"
+#include "NVMInstructionCache.h"
 
 namespace nvm
 {
-    class NVMMemory
+    class NVMFusionProfile;
+    class NVMJit;
+    class NVMSampleProfile;
+    class NVMSharedCode;
+    
+    using ExitCode = u64;
+    
+    enum class Trap
+    {
+        None,
+        InvalidInstruction,
+        InvalidInterrupt,
+        DivisionByZero,
+        MisalignedInstruction,
+        ProtectionFault
+    };
+    
+    class NVMVirtualMachine
     {
     public:
-        explicit NVMMemory(u64 chunk_size) : m_chunk_size(chunk_size), m_chunks()
+        //guests whose addresses stay below this run entirely on NVMMemory's flat fast path
+        static constexpr u64 default_flat_memory_size = 1ul << 32;
+        
+        explicit NVMVirtualMachine(const Span<u8>& bytecode);
+        NVMVirtualMachine(const Span<u8>& bytecode, u64 load_address, u64 entry_point);
+        //starts with empty memory, for loaders that fill it through memory() (e.g. NVMMemory::map_file)
+        explicit NVMVirtualMachine(u64 entry_point, u64 flat_memory_size = default_flat_memory_size);
+        //like the above, on a flat region the caller owns (see NVMMemory)
+        NVMVirtualMachine(u64 entry_point, u8* flat_memory, u64 flat_memory_size);
+        ~NVMVirtualMachine();
+        ExitCode run();
+        //runs without superinstructions, counting the micro-op sequences that would be worth fusing into profile
+        ExitCode run_profiled(NVMFusionProfile& profile);
+        //runs hot blocks as native code (see NVMJit). checked runs every block both ways and compares the results
+        //thresholds of 0 pick the JIT's defaults
+        ExitCode run_jit(bool checked, u16 baseline_threshold = 0, u64 optimizing_threshold = 0);
+        //runs about instructions guest instructions, then pauses before the next one. a paused guest picks up where
+        //it left off on the next call; otherwise the guest halted or trapped, and the exit code is final
+        ExitCode run_slice(u64 instructions);
+        //runs without superinstructions, recording the address of every profile.interval()-th instruction in profile.
+        //runs without it don't pay for any of this: sampling is a dispatch mode of its own
+        ExitCode run_sampled(NVMSampleProfile& profile);
+        
+        bool paused() const
         {
-            m_chunks.insert(0, (u8*) calloc(chunk_size, 1));
+            return m_paused;
         }
-    
-        u64 read_8(u64 address)
+        
+        //a copy of this guest, registers and run state and all, whose memory shares every page with this one's until either writes
+        //it (see NVMMemory::fork_into), so that guests can be spawned from a template that was run up to where they
+        //all start. the copy starts with no decoded code and no JIT. null if memory couldn't be shared
+        NVMVirtualMachine* fork();
+        
+        //borrows decoded code from shared wherever this guest's code reads the same as what it was decoded from, for
+        //guests that run the same program. shared has to outlive the guest
+        void share_code(NVMSharedCode& shared)
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                return 0; //skip fetching chunk. since newly used memory is blank, we can just return 0
-            }
-            else
-                return maybe_chunk.value()[address % m_chunk_size];
+            m_code_cache.attach_shared(&shared);
         }
         
-        u64 read_16(u64 address)
+        //the register file has 16 slots so that any 4 bit register field indexes it without a bounds check.
+        //slots past ip are never visible to the guest
+        u64 register_value(u8 register_id) const
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
-    
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 2)
-            {
-                return *reinterpret_cast<u16*>(chunk+(address%m_chunk_size));
-            }
-            else
-            {
-                return chunk[address%m_chunk_size] | (read_8(address+1) << 8);
-            }
+            return m_registers[register_id & 0xF];
         }
         
-        u64 read_32(u64 address)
+        //for loaders that restore a guest mid-run (see NVMSnapshot). r0 has to stay 0
+        void set_register_value(u8 register_id, u64 value)
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
-    
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 4)
-            {
-                return *reinterpret_cast<u32*>(chunk+(address%m_chunk_size));
-            }
-            else
-            {
-                if (m_chunk_size - (address % m_chunk_size) >= 2)
-                    return (*reinterpret_cast<u16*>(chunk + (address % m_chunk_size))) | (read_16(address+2) << 16);
-                else
-                    return chunk[address%m_chunk_size] | (read_8(address+1) << 8) | (read_16(address+2) << 16);
-            }
+            m_registers[register_id & 0xF] = value;
         }
         
-        u64 read_64(u64 address)
+        Trap trap() const
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
-    
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 8)
-            {
-                return *reinterpret_cast<u64*>(chunk+(address%m_chunk_size));
-            }
-            else
-            {
-                if (m_chunk_size - (address % m_chunk_size) >= 4)
-                    return (*reinterpret_cast<u32*>(chunk + (address % m_chunk_size))) | (read_32(address+2) << 32);
-                else if (m_chunk_size - (address % m_chunk_size) >= 2)
-                    return (*reinterpret_cast<u16*>(chunk + (address % m_chunk_size))) | (read_16(address+2) << 16) | (read_32(address+2) << 32);
-                else
-                    return chunk[address%m_chunk_size] | (read_8(address+1) << 8) | (read_16(address+2) << 16) | (read_32(address+4) << 32);
-            }
+            return m_trap;
         }
         
-        void write_8(u64 address, u8 value)
+        u64 trap_address() const
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                auto chunk = (u8*) calloc(m_chunk_size, 1);
-                m_chunks.insert(address - (address % m_chunk_size), chunk);
-                chunk[address % m_chunk_size] = value;
-            }
-            else
-                maybe_chunk.value()[address % m_chunk_size] = value;
+            return m_trap_address;
         }
         
-        void write_16(u64 address, u16 value)
+        const NVMMemory& memory() const
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
-    
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 2)
-            {
-                 *reinterpret_cast<u16*>(chunk+(address%m_chunk_size)) = value;
-            }
-            else
-            {
-                 chunk[address%m_chunk_size] = value & 0xFF;
-                 write_8(address+1, (value & 0xFF00) >> 8);
-            }
+            return m_memory;
         }
         
-        void write_32(u64 address, u32 value)
+        NVMMemory& memory()
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
-    
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 4)
-            {
-                *reinterpret_cast<u32*>(chunk+(address%m_chunk_size)) = value;
-            }
-            else if (m_chunk_size - (address % m_chunk_size) >= 2)
-            {
-                *reinterpret_cast<u16*>(chunk+(address%m_chunk_size)) = value & 0xFFFF;
-                write_16(address+2, (value & 0xFFFF0000) >> 16);
-            }
-            else
-            {
-                chunk[address % m_chunk_size] = value & 0xFF;
-                write_8(address+1, (value & 0xFF00) >> 8);
-                write_16(address+2, (value & 0xFFFF0000) >> 16);
-            }
+            return m_memory;
         }
-    
-        void write_64(u64 address, u64 value)
+        
+        const NVMInstructionCache& code_cache() const
         {
-            auto maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            if (!maybe_chunk.has_value())
-            {
-                m_chunks.insert(address - (address % m_chunk_size), (u8*) calloc(m_chunk_size, 1));
-                maybe_chunk = m_chunks.get(address - (address % m_chunk_size));
-            }
+            return m_code_cache;
+        }
         
-            auto chunk = maybe_chunk.value();
-            if (m_chunk_size - (address % m_chunk_size) >= 8)
-            {
-                *reinterpret_cast<u64*>(chunk+(address%m_chunk_size)) = value;
-            }
-            else if (m_chunk_size - (address % m_chunk_size) >= 4)
-            {
-                *reinterpret_cast<u32*>(chunk+(address%m_chunk_size)) = value & 0xFFFFFFFF;
-                write_32(address+4, (value & 0xFFFFFFFF00000000) >> 32);
-            }
-            else if (m_chunk_size - (address % m_chunk_size) >= 2)
-            {
-                *reinterpret_cast<u16*>(chunk+(address%m_chunk_size)) = value & 0xFFFF;
-                write_16(address+2, (value & 0xFFFF0000) >> 16);
-                write_32(address+4, (value & 0xFFFFFFFF00000000) >> 32);
-            }
-            else
-            {
-                chunk[address % m_chunk_size] = value & 0xFF;
-                write_8(address+1, (value & 0xFF00) >> 8);
-                write_16(address+2, (value & 0xFFFF0000) >> 16);
-                write_32(address+4, (value & 0xFFFFFFFF00000000) >> 32);
-            }
+        //null unless run_jit was called
+        const NVMJit* jit() const
+        {
+            return m_jit;
         }
         
     private:
-        u64 m_chunk_size;
-        Hashmap<u64, u8*> m_chunks;
-        u64 registers[11] { 0 };
-    };
-    
-    using ExitCode = u64;
-    class NVMVirtualMachine
-    {
-    public:
-        explicit NVMVirtualMachine(const Span<u8>& bytecode);
-        ExitCode run();
+        enum class DispatchMode
+        {
+            Interpret,
+            Profile,
+            Native,
+            Differential,
+            Sliced,
+            Sampled
+        };
+        
+        template<DispatchMode mode>
+        ExitCode run_loop(NVMFusionProfile* profile, u64 slice = 0, NVMSampleProfile* samples = nullptr);
+        void record_fall_through(NVMFusionProfile* profile, MicroOp* op, MicroOp* ops, u64 code_base,
+                                 MicroOp*& fell_into, MicroOpKind& fell_from);
         
-    private:
         NVMMemory m_memory;
+        NVMInstructionCache m_code_cache;
+        u64 m_registers[16] { 0 };
+        Trap m_trap { Trap::None };
+        u64 m_trap_address { 0 };
+        bool m_paused { false };
+        NVMJit* m_jit { nullptr };
     };
 }
@@ -4,27 +4,40 @@
 
 namespace nvm
 {
+    //both 1 based; pos counts utf8 codepoints
     struct LinePos
     {
         size_t line;
         size_t pos;
     };
     
-    inline LinePos get_line_and_pos(const StringView& text, const StringViewBidIt& what)
+    //in place, without allocating. less(a, b) tells whether a goes before b; equal items may end up in any order
+    template<typename T, typename Less>
+    void heap_sort(T* items, u64 count, const Less& less)
     {
-        size_t lines {0};
-        size_t codepoints_this_line {0};
-        auto begin = text.begin();
-        while (begin != what)
+        auto sift_down = [&](u64 root, u64 end)
         {
-            if (*begin++ == '\n')
+            while (2 * root + 1 < end)
             {
-                lines++;
-                codepoints_this_line = 0;
+                u64 child = 2 * root + 1;
+                if (child + 1 < end && less(items[child], items[child + 1]))
+                    child++;
+                if (!less(items[root], items[child]))
+                    return;
+                T swapped = move(items[root]);
+                items[root] = move(items[child]);
+                items[child] = move(swapped);
+                root = child;
             }
-            codepoints_this_line++;
+        };
+        for (u64 i = count / 2; i > 0; i--)
+            sift_down(i - 1, count);
+        for (u64 end = count; end > 1; end--)
+        {
+            T swapped = move(items[0]);
+            items[0] = move(items[end - 1]);
+            items[end - 1] = move(swapped);
+            sift_down(0, end - 1);
         }
-        
-        return {lines, codepoints_this_line};
     }
 }
\ No newline at end of file
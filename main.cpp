@@ -1,10 +1,22 @@
 #include "Assembler.h"
 #include "NVMBinaryFormat.h"
+#include "NVMDebugTable.h"
+#include "NVMFusionProfile.h"
+#include "NVMHost.h"
+#include "NVMJit.h"
+#include "NVMSampleProfile.h"
+#include "NVMSnapshot.h"
+#include "NVMVirtualMachine.h"
 #include <IterableUtil.h>
 #include <Preprocessor.h>
 #include <StringView.h>
 #include <Tuple.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
 
 #define VERSION STRINGIFY(0.1)
 
@@ -49,6 +61,10 @@
  *     E: Second register field
  *     F: Third register field
  *     G: Immediate field (12 bytes if <4096, otherwise 44 bits)
+ *     Instructions are 32 bit aligned; the assembler pads data that precedes them.
+ *     64 bit instructions are stored as two little endian 32 bit words, the one holding A-F and the top 12 bits of G first.
+ *     load/store store the access width in E as log2 of the byte count (0: 8 bits, 1: 16, 2: 32, 3: 64).
+ *     Jump immediates are signed offsets in 32 bit words relative to the jump. Load/store immediates are absolute addresses.
  *
  * The assembler accepts the following directives:
  *     .addr <address>
@@ -78,11 +94,64 @@
  *   The following table defines this format:
  *   AAAAAAAA|BBBBBBBB|CCCCCCCCCCCCCCCC|DDDDDDDDDDDDDDDD|X...
  *   A: magic signature (0x63026302)
- *   B: crc32 checksum of the file (excluding magic and this field)
+ *   B: crc32c (Castagnoli) checksum of the file (excluding magic and this field)
  *   C: binary load memory offset
  *   D: entry point address
  *   X: binary payload
  *
+ *   The sectioned format (magic 0x63026303) replaces the single payload with a table of sections:
+ *   AAAAAAAA|BBBBBBBB|CCCCCCCCCCCCCCCC|DDDDDDDD|EEEEEEEE|S...|X...
+ *   A: magic signature (0x63026303)
+ *   B: crc32c checksum of the header and section table (excluding magic and this field)
+ *   C: entry point address
+ *   D: section count
+ *   E: reserved
+ *   S: section table, 48 bytes per section:
+ *       type (u32: 0 text, 1 rodata, 2 data, 3 bss)
+ *       flags (u32: 1 read, 2 write, 4 execute)
+ *       load address (u64)
+ *       size in memory (u64)
+ *       file offset (u64)
+ *       size in file (u64; 0 for bss, bytes past it read as zero)
+ *       crc32c of the section contents (u32)
+ *       reserved (u32)
+ *   X: section contents. Each file offset is congruent with its load address modulo 4096 so it can be mapped.
+ *
+ *   Snapshots (magic 0x63026304) hold a guest paused mid-run:
+ *   AAAAAAAA|BBBBBBBB|CCCCCCCCCCCCCCCC|R...|DDDDDDDDDDDDDDDD|EEEEEEEEEEEEEEEE|X...|T...
+ *   A: magic signature (0x63026304)
+ *   B: crc32c checksum of the header and run table (excluding magic and this field)
+ *   C: flat memory size
+ *   R: the 16 register slots (u64 each)
+ *   D: run count
+ *   E: run table file offset
+ *   X: page contents, from offset 4096 on. All-zero pages are left out
+ *   T: run table, 32 bytes per run of consecutive pages:
+ *       guest address (u64)
+ *       size (u64)
+ *       file offset (u64)
+ *       flags (u32: 1 read, 2 write)
+ *       reserved (u32)
+ *
+ *   Debug tables (magic 0x63026305) are written by --symbols and read from <image>.dbg:
+ *   AAAAAAAA|BBBBBBBB|CCCCCCCCCCCCCCCC|DDDDDDDDDDDDDDDD|EEEEEEEEEEEEEEEE|L...|T...|N...
+ *   A: magic signature (0x63026305)
+ *   B: crc32c checksum of the rest of the file
+ *   C: line count
+ *   D: tag count
+ *   E: size of the names
+ *   L: line table, 24 bytes per instruction, sorted by address:
+ *       address (u64)
+ *       size (u32: 4 or 8)
+ *       source line (u32)
+ *       source column (u32)
+ *       reserved (u32)
+ *   T: tag table, 16 bytes per tag, sorted by address:
+ *       address (u64)
+ *       name offset (u32)
+ *       name size (u32, not counting the 0 that follows every name)
+ *   N: the names
+ *
  *
  */
 
@@ -93,7 +162,48 @@ void help()
         "This program is released under GPL3 license.\n"
         "Please check LICENSE.txt for a copy of the license.\n\n"
         "Usage:\n"
-        "    \e[1m nvm <assembly code file> \e[0m\n\n"
+        "    \e[1m nvm <assembly code file | nvm image> [--stream | --parallel | --incremental | --optimize] \e[0m\n"
+        "    \e[1m nvm <assembly code file | nvm image> [--jit | --jit-check] [baseline threshold] [optimizing threshold] \e[0m\n"
+        "    \e[1m nvm <assembly code file> --profile <profile file> [fusion table header] \e[0m\n"
+        "    \e[1m nvm <assembly code file | nvm image> --host [guests] [workers] [warm-up] \e[0m\n"
+        "    \e[1m nvm <assembly code file | nvm image> --checkpoint <snapshot file> [instructions] \e[0m\n"
+        "    \e[1m nvm <assembly code file | nvm image> --sample <folded stack file> [interval] \e[0m\n"
+        "    \e[1m nvm <assembly code file> --symbols <debug table file> \e[0m\n"
+        "    \e[1m nvm <assembly code file> -o <nvm image> [--sectioned] \e[0m\n\n"
+        "    --stream       assemble in a single pass, without printing tokens, objects and bytecode\n"
+        "    --parallel     like --stream, but large sources are assembled on every core\n"
+        "    --incremental  like --stream, but keeps an object cache next to the source and only\n"
+        "                   assembles again what changed since it was written\n"
+        "    --optimize     run the peephole optimizer between parsing and bytecode generation, and\n"
+        "                   print how many instructions each of its rules removed\n"
+        "    --profile      run without superinstructions, adding the micro-op sequences executed to the\n"
+        "                   profile file, and regenerate the fusion table from it if a header is given\n"
+        "                   (NVMSuperinstructions.h, picked up on the next build)\n"
+        "    --jit          like --stream, but blocks entered more often than the baseline threshold are\n"
+        "                   compiled to native code, and native blocks run more often than the optimizing\n"
+        "                   threshold are compiled again with optimizations, and hot loops are recorded\n"
+        "                   into traces. per tier instruction counts and compile times are printed at exit\n"
+        "    --jit-check    like --jit, but every block also runs in the interpreter, and any difference\n"
+        "                   between the two is reported\n"
+        "    --host         like --stream, but runs that many copies of the program side by side (1000\n"
+        "                   unless told otherwise), interleaved on a worker thread per core unless told\n"
+        "                   otherwise. prints how many exited and trapped, and how long it took. with a\n"
+        "                   warm-up, the program runs that many instructions once, and every copy is\n"
+        "                   forked from where it got to, sharing its memory until they write it\n"
+        "    --checkpoint   like --stream, but writes a snapshot of the guest every that many instructions\n"
+        "                   (100000000 unless told otherwise), and resumes from the snapshot instead of\n"
+        "                   starting over if there is one. the snapshot is removed once the program ends\n"
+        "    --sample       like --stream, but samples where the program is every that many instructions\n"
+        "                   (997 unless told otherwise), prints the tags that took the most samples, and\n"
+        "                   writes the samples as folded stacks (for flamegraph.pl) to the file given\n"
+        "    --symbols      assemble, and write the tags and source lines of every instruction to the file\n"
+        "                   given instead of running. images pick up <image>.dbg if there is one, and\n"
+        "                   name tags and lines in traps and samples with it, as assembly code always does\n"
+        "    -o             assemble, and write the program to the nvm image given instead of running, with\n"
+        "                   its debug table next to it as <image>.dbg. images run without assembling again.\n"
+        "                   sectioned images leave out the pages of zeroes in the program, and split it in\n"
+        "                   sections after its .text, .rodata and .data directives, so that code and\n"
+        "                   constants are read only\n\n"
         "\e[4mPress ctrl+c at any time to stop execution.\e[0m\n");
 }
 
@@ -110,6 +220,339 @@ const char* register_string(nvm::Register i)
         .non_null_terminated_buffer();
 }
 
+String tag_name(const nvm::InstructionData* data)
+{
+    const auto& tag = data->op3.get<1>().get<StringView>();
+    return String(tag.non_null_terminated_buffer(), tag.byte_size());
+}
+
+enum class JitMode
+{
+    Off,
+    On,
+    Checked
+};
+
+//thresholds of 0 leave the choice to the JIT
+struct JitOptions
+{
+    JitMode mode { JitMode::Off };
+    u16 baseline_threshold { 0 };
+    u64 optimizing_threshold { 0 };
+};
+
+JitMode jit_mode_for(const StringView& flag)
+{
+    if (flag == "--jit"_sv)
+        return JitMode::On;
+    if (flag == "--jit-check"_sv)
+        return JitMode::Checked;
+    return JitMode::Off;
+}
+
+//the thresholds follow the flag; false if one of them isn't a number
+bool parse_jit_options(const StringView& flag, int argc, char** argv, JitOptions& options)
+{
+    options.mode = jit_mode_for(flag);
+    u64 thresholds[2] { 0, 0 };
+    for (int i = 3; i < argc && i < 5 && options.mode != JitMode::Off; i++)
+    {
+        char* end;
+        thresholds[i - 3] = strtoull(argv[i], &end, 10);
+        if (*argv[i] == 0 || *end != 0)
+            return false;
+    }
+    options.baseline_threshold = thresholds[0] < nvm::NVMJit::max_baseline_threshold ? thresholds[0] : nvm::NVMJit::max_baseline_threshold;
+    options.optimizing_threshold = thresholds[1];
+    return true;
+}
+
+void print_tier(const char* name, const nvm::TierStatistics& statistics)
+{
+    printf("JIT %s: %lu instructions, %lu blocks compiled in %.3fms\n", name, statistics.instructions,
+           statistics.compiled_blocks, statistics.compile_nanoseconds / 1000000.0);
+}
+
+//names the tag and source line of address, when there is a debug table that covers it
+void print_trap(u64 address, const nvm::NVMDebugTable* symbols)
+{
+    printf("\nVM trapped at 0x%lx", address);
+    u64 tag = symbols != nullptr ? symbols->tag_at(address) : 0;
+    if (symbols != nullptr && tag != symbols->tag_count())
+        printf(" in %s+0x%lx", symbols->tag_name(tag), address - symbols->tag_address(tag));
+    auto line = symbols != nullptr ? symbols->line_at(address) : nullptr;
+    if (line != nullptr)
+        printf(" (line %u, column %u)", line->line, line->pos);
+    printf("\n");
+}
+
+int run_vm(nvm::NVMVirtualMachine& vm, nvm::NVMFusionProfile* profile = nullptr, const JitOptions& jit = {},
+           const nvm::NVMDebugTable* symbols = nullptr)
+{
+    nvm::ExitCode exit_code;
+    if (profile != nullptr)
+        exit_code = vm.run_profiled(*profile);
+    else if (jit.mode != JitMode::Off)
+        exit_code = vm.run_jit(jit.mode == JitMode::Checked, jit.baseline_threshold, jit.optimizing_threshold);
+    else
+        exit_code = vm.run();
+    if (vm.trap() != nvm::Trap::None)
+        print_trap(vm.trap_address(), symbols);
+    else
+        printf("\nProgram exited with code %lu\n", exit_code);
+    if (vm.jit() != nullptr)
+    {
+        printf("JIT interpreter: %lu instructions\n", vm.jit()->statistics(nvm::ExecutionTier::Interpreter).instructions);
+        print_tier("baseline", vm.jit()->statistics(nvm::ExecutionTier::Baseline));
+        print_tier("optimizing", vm.jit()->statistics(nvm::ExecutionTier::Optimizing));
+        print_tier("trace", vm.jit()->statistics(nvm::ExecutionTier::Trace));
+        if (jit.mode == JitMode::Checked)
+            printf("JIT checked %lu block runs, %lu mismatched\n", vm.jit()->checked_blocks(), vm.jit()->mismatches());
+    }
+    if (vm.trap() != nvm::Trap::None)
+        return -1;
+#ifdef NVM_TLB_STATISTICS
+    const auto& tlb = vm.memory().tlb_statistics();
+    printf("TLB reads: %lu hits %lu misses, writes: %lu hits %lu misses\n", tlb.read_hits, tlb.read_misses, tlb.write_hits, tlb.write_misses);
+#endif
+    return 0;
+}
+
+int run_image(const Span<u8>& bytecode, nvm::NVMFusionProfile* profile = nullptr, const JitOptions& jit = {},
+              const nvm::NVMDebugTable* symbols = nullptr)
+{
+    auto image_or_error = nvm::try_read(bytecode);
+    if (image_or_error.has_error())
+    {
+        error(image_or_error.error().non_null_terminated_buffer());
+        return -1;
+    }
+    auto& image = image_or_error.result();
+    nvm::NVMVirtualMachine vm(image.entry_point);
+    if (!nvm::load_sections(vm.memory(), image))
+    {
+        error("Couldn't load the specified image!\n");
+        return -1;
+    }
+    return run_vm(vm, profile, jit, symbols);
+}
+
+//the guest and worker counts and the warm-up follow the flag
+int run_host(const nvm::NVMBinaryFormatData& image, int argc, char** argv)
+{
+    u64 counts[3] { 1000, (u64)sysconf(_SC_NPROCESSORS_ONLN), 0 };
+    for (int i = 3; i < argc && i < 6; i++)
+    {
+        char* end;
+        counts[i - 3] = strtoull(argv[i], &end, 10);
+        if (*argv[i] == 0 || *end != 0 || counts[i - 3] == 0 || (i < 5 && counts[i - 3] > 0xFFFFFFFF))
+        {
+            error("Guest and worker counts and the warm-up have to be positive numbers!\n\n");
+            help();
+            return -1;
+        }
+    }
+    nvm::NVMHost host((u32)counts[1], (u32)counts[0]);
+    if (counts[2] != 0)
+    {
+        //the template gets a flat region as large as a guest's, which is what its copies map
+        nvm::NVMVirtualMachine origin(image.entry_point, nvm::NVMHost::default_guest_memory);
+        if (!nvm::load_sections(origin.memory(), image))
+        {
+            error("Couldn't load the specified image!\n");
+            return -1;
+        }
+        origin.run_slice(counts[2]);
+        if (!origin.paused())
+        {
+            error("The program ended during the warm-up!\n");
+            return -1;
+        }
+        for (u64 i = 0; i < counts[0]; i++)
+        {
+            if (!host.spawn(origin))
+            {
+                error("Couldn't share the memory of the warmed up program!\n");
+                return -1;
+            }
+        }
+    }
+    for (u64 i = host.guests(); i < counts[0]; i++)
+    {
+        if (!host.spawn(image))
+        {
+            error("Couldn't reserve memory for the guests!\n");
+            return -1;
+        }
+    }
+
+    timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    host.run();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    u32 trapped = 0;
+    for (u32 i = 0; i < host.guests(); i++)
+    {
+        if (host.result(i).trap != nvm::Trap::None)
+            trapped++;
+    }
+    auto statistics = host.statistics();
+    printf("\nHost ran %u guests on %u workers in %.3fms: %u exited, %u trapped, %lu slices, %lu stolen\n", host.guests(),
+           host.workers(), (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1000000.0,
+           host.guests() - trapped, trapped, statistics.slices, statistics.steals);
+    //ru_maxrss is in KiB
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    u64 decoded_pages = statistics.decoded_pages + statistics.shared_pages;
+    printf("Guests decoded %lu code pages (%lu shared, %lu KiB, %lu per guest); peak resident memory %ld KiB, %ld per guest\n",
+           decoded_pages, statistics.shared_pages, decoded_pages * nvm::NVMInstructionCache::chunk_bytes / 1024,
+           decoded_pages * nvm::NVMInstructionCache::chunk_bytes / 1024 / host.guests(), usage.ru_maxrss,
+           usage.ru_maxrss / host.guests());
+    return trapped != 0 ? -1 : 0;
+}
+
+//the snapshot file and interval follow the flag
+int run_checkpointed(const nvm::NVMBinaryFormatData& image, const nvm::NVMDebugTable& symbols, int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        error("--checkpoint needs a snapshot file!\n\n");
+        help();
+        return -1;
+    }
+    u64 interval = 100000000;
+    if (argc > 4)
+    {
+        char* end;
+        interval = strtoull(argv[4], &end, 10);
+        if (*argv[4] == 0 || *end != 0 || interval == 0)
+        {
+            error("The checkpoint interval has to be a positive number!\n\n");
+            help();
+            return -1;
+        }
+    }
+
+    nvm::NVMVirtualMachine* vm;
+    if (access(argv[3], F_OK) == 0)
+    {
+        auto vm_or_error = nvm::restore_snapshot(argv[3]);
+        if (vm_or_error.has_error())
+        {
+            error(vm_or_error.error().non_null_terminated_buffer());
+            return -1;
+        }
+        vm = vm_or_error.result();
+        printf("Resuming from %s\n", argv[3]);
+    }
+    else
+    {
+        vm = new nvm::NVMVirtualMachine(image.entry_point);
+        if (!nvm::load_sections(vm->memory(), image))
+        {
+            error("Couldn't load the specified image!\n");
+            delete vm;
+            return -1;
+        }
+    }
+
+    nvm::ExitCode exit_code = vm->run_slice(interval);
+    while (vm->paused())
+    {
+        if (!nvm::save_snapshot(*vm, argv[3]))
+        {
+            error("Couldn't write the snapshot!\n");
+            delete vm;
+            return -1;
+        }
+        exit_code = vm->run_slice(interval);
+    }
+    unlink(argv[3]);
+    bool trapped = vm->trap() != nvm::Trap::None;
+    if (trapped)
+        print_trap(vm->trap_address(), &symbols);
+    else
+        printf("\nProgram exited with code %lu\n", exit_code);
+    delete vm;
+    return trapped ? -1 : 0;
+}
+
+//the folded stack file and sampling interval follow the flag
+int run_sampled(const nvm::NVMBinaryFormatData& image, const nvm::NVMDebugTable& symbols, int argc, char** argv)
+{
+    if (argc < 4)
+    {
+        error("--sample needs a folded stack file!\n\n");
+        help();
+        return -1;
+    }
+    u64 interval = nvm::NVMSampleProfile::default_interval;
+    if (argc > 4)
+    {
+        char* end;
+        interval = strtoull(argv[4], &end, 10);
+        if (*argv[4] == 0 || *end != 0 || interval == 0)
+        {
+            error("The sampling interval has to be a positive number!\n\n");
+            help();
+            return -1;
+        }
+    }
+
+    nvm::NVMSampleProfile profile(interval);
+    nvm::NVMVirtualMachine vm(image.entry_point);
+    if (!nvm::load_sections(vm.memory(), image))
+    {
+        error("Couldn't load the specified image!\n");
+        return -1;
+    }
+    nvm::ExitCode exit_code = vm.run_sampled(profile);
+    if (vm.trap() != nvm::Trap::None)
+        print_trap(vm.trap_address(), &symbols);
+    else
+        printf("\nProgram exited with code %lu\n", exit_code);
+
+    printf("%lu samples, one every %lu instructions\n", profile.samples(), profile.interval());
+    auto by_tag = profile.by_tag(symbols);
+    for (u64 i = 0; i < by_tag.size() && i < 10; i++)
+    {
+        const char* name = by_tag[i].tag == symbols.tag_count() ? "[untagged]" : symbols.tag_name(by_tag[i].tag);
+        printf("%6.2f%% %s\n", by_tag[i].count * 100.0 / profile.samples(), name);
+    }
+    if (!profile.write_folded(argv[3], symbols))
+    {
+        error("Couldn't write the folded stack file!\n");
+        return -1;
+    }
+    return vm.trap() != nvm::Trap::None ? -1 : 0;
+}
+
+//the assembler only ever produces flat images, with the payload as their one section. a sectioned image splits it
+//again by what the assembler says is code, constants and data
+int write_image(const nvm::NVMBinaryFormatData& image, const nvm::Assembler& assembler, const nvm::NVMDebugTable& symbols,
+                const char* path, bool sectioned)
+{
+    const auto& payload = image.sections[0];
+    bool written = sectioned
+        ? nvm::write_nvm_sectioned_file(path, image.entry_point, nvm::split_flat_payload(payload.address, payload.contents,
+                                                                                         assembler.lines(), assembler.sections()))
+        : nvm::write_nvm_file(path, payload.address, image.entry_point, payload.contents);
+    if (!written)
+    {
+        error("Couldn't write the image!\n");
+        return -1;
+    }
+    char symbols_path[PATH_MAX];
+    snprintf(symbols_path, sizeof(symbols_path), "%s.dbg", path);
+    if (!symbols.save(symbols_path))
+    {
+        error("Couldn't write the debug table!\n");
+        return -1;
+    }
+    printf("Image with %lu bytes of code written to %s, debug table to %s\n", payload.contents.size(), path, symbols_path);
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
     Vector<i8> k;
@@ -120,6 +563,47 @@ int main(int argc, char** argv)
         return -1;
     }
     printf("\nNanoVM - v" VERSION " by ngc6302h\n");
+    StringView flag = argc > 2 ? StringView(argv[2], __builtin_strlen(argv[2])) : ""_sv;
+    JitOptions jit;
+    if (!parse_jit_options(flag, argc, argv, jit))
+    {
+        error("JIT thresholds have to be numbers!\n\n");
+        help();
+        return -1;
+    }
+
+    //prebuilt images skip the assembler and are mapped straight into guest memory
+    auto image_file_or_error = nvm::NVMImageFile::open(argv[1]);
+    //anything else but these means the file is an image, just not a sound one, such as one failing its checksums
+    if (image_file_or_error.has_error() && image_file_or_error.error() != "bad magic"_sv
+        && image_file_or_error.error() != "image file is too small to hold a header"_sv
+        && image_file_or_error.error() != "couldn't open image file"_sv)
+    {
+        error(image_file_or_error.error().non_null_terminated_buffer());
+        return -1;
+    }
+    if (image_file_or_error.has_result())
+    {
+        const auto& image_file = image_file_or_error.result();
+        //the debug table is optional; without one, addresses go unnamed
+        char symbols_path[PATH_MAX];
+        snprintf(symbols_path, sizeof(symbols_path), "%s.dbg", argv[1]);
+        auto symbols_or_error = nvm::NVMDebugTable::load(symbols_path);
+        nvm::NVMDebugTable symbols = symbols_or_error.has_result() ? symbols_or_error.result() : nvm::NVMDebugTable();
+        if (flag == "--host"_sv)
+            return run_host(image_file->data(), argc, argv);
+        if (flag == "--checkpoint"_sv)
+            return run_checkpointed(image_file->data(), symbols, argc, argv);
+        if (flag == "--sample"_sv)
+            return run_sampled(image_file->data(), symbols, argc, argv);
+        nvm::NVMVirtualMachine vm(image_file->data().entry_point);
+        if (!image_file->load_into(vm.memory()))
+        {
+            error("Couldn't load the specified image!\n");
+            return -1;
+        }
+        return run_vm(vm, nullptr, jit, &symbols);
+    }
 
     auto maybe_assembler = nvm::Assembler::create_from_file(argv[1]);
     if (!maybe_assembler.has_value())
@@ -128,18 +612,142 @@ int main(int argc, char** argv)
         return -1;
     }
     auto assembler = move(maybe_assembler.value());
+    if (flag == "--stream"_sv || flag == "--parallel"_sv || flag == "--incremental"_sv || jit.mode != JitMode::Off)
+    {
+        char cache_path[PATH_MAX];
+        snprintf(cache_path, sizeof(cache_path), "%s.objcache", argv[1]);
+        auto bytecode_or_error = flag == "--incremental"_sv
+            ? assembler.assemble_incremental(StringView(cache_path, __builtin_strlen(cache_path)))
+            : assembler.assemble(flag == "--parallel"_sv ? sysconf(_SC_NPROCESSORS_ONLN) : 1);
+        if (bytecode_or_error.has_error())
+        {
+            for (const auto& err : bytecode_or_error.error())
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
+            return -1;
+        }
+        nvm::NVMDebugTable symbols(assembler.tags(), assembler.lines());
+        return run_image(bytecode_or_error.result()->span(), nullptr, jit, &symbols);
+    }
+    if (flag == "--host"_sv || flag == "--checkpoint"_sv || flag == "--sample"_sv || flag == "--symbols"_sv || flag == "-o"_sv)
+    {
+        if ((flag == "--symbols"_sv || flag == "-o"_sv) && argc < 4)
+        {
+            error(flag == "-o"_sv ? "-o needs an image file!\n\n" : "--symbols needs a debug table file!\n\n");
+            help();
+            return -1;
+        }
+        auto bytecode_or_error = assembler.assemble(1);
+        if (bytecode_or_error.has_error())
+        {
+            for (const auto& err : bytecode_or_error.error())
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
+            return -1;
+        }
+        auto image_or_error = nvm::try_read(bytecode_or_error.result()->span());
+        if (image_or_error.has_error())
+        {
+            error(image_or_error.error().non_null_terminated_buffer());
+            return -1;
+        }
+        nvm::NVMDebugTable symbols(assembler.tags(), assembler.lines());
+        if (flag == "--symbols"_sv)
+        {
+            if (!symbols.save(argv[3]))
+            {
+                error("Couldn't write the debug table!\n");
+                return -1;
+            }
+            printf("Debug table with %lu instructions and %lu tags written to %s\n", symbols.line_count(), symbols.tag_count(), argv[3]);
+            return 0;
+        }
+        if (flag == "-o"_sv)
+            return write_image(image_or_error.result(), assembler, symbols, argv[3], argc > 4 && StringView(argv[4], __builtin_strlen(argv[4])) == "--sectioned"_sv);
+        if (flag == "--checkpoint"_sv)
+            return run_checkpointed(image_or_error.result(), symbols, argc, argv);
+        if (flag == "--sample"_sv)
+            return run_sampled(image_or_error.result(), symbols, argc, argv);
+        return run_host(image_or_error.result(), argc, argv);
+    }
+    if (flag == "--profile"_sv)
+    {
+        if (argc < 4)
+        {
+            error("--profile needs a profile file!\n\n");
+            help();
+            return -1;
+        }
+        auto bytecode_or_error = assembler.assemble(1);
+        if (bytecode_or_error.has_error())
+        {
+            for (const auto& err : bytecode_or_error.error())
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
+            return -1;
+        }
+        nvm::NVMFusionProfile profile;
+        if (!profile.merge_from(argv[3]))
+        {
+            error("Couldn't read the specified profile!\n");
+            return -1;
+        }
+        int result = run_image(bytecode_or_error.result()->span(), &profile);
+        if (!profile.save(argv[3]))
+        {
+            error("Couldn't write the specified profile!\n");
+            return -1;
+        }
+        printf("Profile now covers %lu dispatches\n", profile.dispatches());
+        if (argc > 4)
+        {
+            if (!profile.write_fusion_table(argv[4]))
+            {
+                error("Couldn't write the fusion table!\n");
+                return -1;
+            }
+            printf("Fusion table written to %s, rebuild to use it\n", argv[4]);
+        }
+        return result;
+    }
+    if (flag == "--optimize"_sv)
+    {
+        auto tokens_or_errors = assembler.tokenize();
+        auto objects_or_errors = tokens_or_errors.has_result() ? assembler.parse(tokens_or_errors.result()) : tokens_or_errors.error();
+        if (objects_or_errors.has_error())
+        {
+            for (const auto& err : objects_or_errors.error())
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
+            return -1;
+        }
+        auto& objects = objects_or_errors.result();
+        auto statistics = assembler.optimize(objects);
+        if (statistics.skipped)
+            printf("Peephole optimizer skipped: the program computes code addresses from registers, offsets or ip, or "
+                   "loads or stores at fixed addresses inside itself\n");
+        else
+            printf("Peephole optimizer removed: %lu folded constants (%lu more rewritten), %lu dead writes, %lu redundant moves, "
+                "%lu compares fused into jumps\n", statistics.folded_constants, statistics.rewritten_constants, statistics.dead_writes,
+                statistics.redundant_moves, statistics.fused_jumps);
+        auto bytecode_or_error = assembler.generate_bytecode(objects);
+        if (bytecode_or_error.has_error())
+        {
+            for (const auto& err : bytecode_or_error.error())
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
+            return -1;
+        }
+        nvm::NVMDebugTable symbols(assembler.tags(), assembler.lines());
+        return run_image(bytecode_or_error.result()->span(), nullptr, {}, &symbols);
+    }
     auto tokens_or_errors = assembler.tokenize();
     if (tokens_or_errors.has_result())
     {
         for (const auto& tok : tokens_or_errors.result())
         {
-            printf("At: L%zu P%zu Type: %s Value:%s\n", tok.position_in_source.line, tok.position_in_source.pos, tok.type == nvm::TokenType::NumericLiteral ? "NumericLiteral" : tok.type == nvm::TokenType::StringLiteral ? "StringLiteral"
+            printf("At: L%zu P%zu Type: %s Value:%.*s\n", tok.position_in_source.line, tok.position_in_source.pos, tok.type == nvm::TokenType::NumericLiteral ? "NumericLiteral" : tok.type == nvm::TokenType::StringLiteral ? "StringLiteral"
                     : tok.type == nvm::TokenType::RegisterKeyword                                                                                                                                                          ? "RegisterKeyword"
                     : tok.type == nvm::TokenType::InstructionKeyword                                                                                                                                                       ? "InstructionKeyword"
                     : tok.type == nvm::TokenType::AssemblerDirective                                                                                                                                                       ? "AssemblerDirective"
                     : tok.type == nvm::TokenType::TagDefinition                                                                                                                                                            ? "TagDefinition"
                                                                                                                                                                                                                            : "Tag",
-                tok.data->null_terminated_characters());
+                (int)tok.data.byte_size(), tok.data.non_null_terminated_buffer());
         }
 
         printf("\n\nObjects:\n");
@@ -151,7 +759,7 @@ int main(int argc, char** argv)
             {
                 if (obj.type == nvm::ObjectType::Instruction)
                 {
-                    const auto& data = reinterpret_cast<nvm::InstructionData*>(obj.data);
+                    const auto* data = &obj.data.get<nvm::InstructionData>();
                     switch (data->instruction)
                     {
                     case nvm::Instruction::Add:
@@ -190,7 +798,7 @@ int main(int argc, char** argv)
                             snprintf(buff, 10, "%zu", data->op3.get<1>().get<u64>());
                         }
                         printf("Instruction: load %lu from: %s to: %s\n",
-                            data->misc, data->op3.get<0>() == 0 ? register_string(data->op2) : data->op3.get<int>() == 1 ? data->op3.get<1>().get<String>().null_terminated_characters()
+                            data->misc, data->op3.get<0>() == 0 ? register_string(data->op2) : data->op3.get<int>() == 1 ? tag_name(data).null_terminated_characters()
                                                                                                                          : buff,
                             register_string(data->op1));
                     }
@@ -204,7 +812,7 @@ int main(int argc, char** argv)
                         }
                         printf("Instruction: store %lu what: %s in: %s\n", data->misc, register_string(data->op1),
                             data->op3.get<0>() == 0       ? register_string(data->op2)
-                                : data->op3.get<0>() == 1 ? data->op3.get<1>().get<String>().null_terminated_characters()
+                                : data->op3.get<0>() == 1 ? tag_name(data).null_terminated_characters()
                                                           : buff);
                     }
                     break;
@@ -241,7 +849,7 @@ int main(int argc, char** argv)
                             default: break;
                         }
                         printf("Instruction: jmp %s if %s %s %s\n", data->op3.get<0>() == 0 ? register_string(data->op3.get<1>().get<nvm::Register>()) :  data->op3.get<0>() == 1 ?
-                                data->op3.get<1>().get<String>().null_terminated_characters() : buff, register_string(data->op1), operator_literal ,register_string(data->op2));
+                                tag_name(data).null_terminated_characters() : buff, register_string(data->op1), operator_literal ,register_string(data->op2));
                     }
                     break;
                     case nvm::Instruction::Int:
@@ -257,25 +865,39 @@ int main(int argc, char** argv)
             if (bytecode_or_error.has_result())
             {
                 printf("Bytecode:\n");
-                for (size_t i = 0; i < bytecode_or_error.result().size(); i+=4)
+                const auto& bytes = *bytecode_or_error.result();
+                for (size_t i = 0; i + 3 < bytes.size(); i+=4)
                 {
-                    printf("%02x%02x%02x%02x\n", bytecode_or_error.result()[i+3], bytecode_or_error.result()[i+2], bytecode_or_error.result()[i+1], bytecode_or_error.result()[i]);
+                    printf("%02x%02x%02x%02x\n", bytes[i+3], bytes[i+2], bytes[i+1], bytes[i]);
                 }
                 
-                auto bytecode = bytecode_or_error.result().span().as<u32>(); //this only works for little endian machines!!!1
-                
+                auto image_or_error = nvm::try_read(bytecode_or_error.result()->span());
+                if (image_or_error.has_error())
+                {
+                    error(image_or_error.error().non_null_terminated_buffer());
+                    return -1;
+                }
+                auto& image = image_or_error.result();
+                nvm::NVMVirtualMachine vm(image.entry_point);
+                if (!nvm::load_sections(vm.memory(), image))
+                {
+                    error("Couldn't load the specified image!\n");
+                    return -1;
+                }
+                nvm::NVMDebugTable symbols(assembler.tags(), assembler.lines());
+                return run_vm(vm, nullptr, {}, &symbols);
             }
             else
             {
                 for(const auto& e : bytecode_or_error.error())
-                    printf("Error: %s", e.what->null_terminated_characters());
+                    printf("Error: %s", e.what.null_terminated_characters());
             }
         }
         else
         {
             for (const auto& err : objects_or_errors.error())
             {
-                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what->null_terminated_characters());
+                printf("At: L%zu P%zu What: %s\n", err.where.line, err.where.pos, err.what.null_terminated_characters());
             }
         }
     }
@@ -0,0 +1,21 @@
+#calculates 20! a million times, dividing it back down to 1 each time; exits with 0 if it always got back to 1
+start:
+add r7, r0, 1000000  #rounds left
+xor r1, r1, r1       #nonzero once a round went wrong
+again:
+add r2, r0, 1        #the product
+add r4, r0, 20       #the factor
+factor:
+mul r2, r2, r4       #multiply the factor in
+sub r4, r4, 1        #next factor
+jmp factor if r4 != r0
+add r4, r0, 20       #and back down
+unfactor:
+div r2, r2, r4       #divide the factor out
+sub r4, r4, 1        #next factor
+jmp unfactor if r4 != r0
+sub r2, r2, 1        #0 if it got back to 1
+or r1, r1, r2        #remember it if it didn't
+sub r7, r7, 1        #count the round
+jmp again if r7 != r0
+int 0xFF             #exit with 0 if every round got back to 1
@@ -0,0 +1,63 @@
+dispatches 140305304
+pair AddR AddI 14096000
+triple AddR AddI XorR 10000000
+triple AddR AddI JneI 4096000
+pair AddR Load64R 1000
+triple AddR Load64R AddR 1000
+pair AddR Store64R 1
+triple AddR Store64R AddI 1
+pair AddI AddR 1
+triple AddI AddR AddI 1
+pair AddI AddI 1004097
+triple AddI AddI MulR 1000000
+triple AddI AddI XorR 1
+triple AddI AddI JneI 4096
+pair AddI MulR 1000000
+triple AddI MulR SubI 1000000
+pair AddI DivR 1000000
+triple AddI DivR SubI 1000000
+pair AddI XorR 10000004
+triple AddI XorR AddR 1
+triple AddI XorR AddI 2
+triple AddI XorR SubI 10000000
+triple AddI XorR XorR 1
+pair AddI JeI 1000
+pair AddI JneI 4100096
+triple AddI JneI AddI 1001
+pair SubI OrR 1000000
+triple SubI OrR SubI 1000000
+pair SubI JneI 51001000
+triple SubI JneI AddI 1000000
+triple SubI JneI SubI 1000000
+triple SubI JneI AndI 1
+triple SubI JneI Int 2
+pair MulR SubI 20000000
+triple MulR SubI JneI 20000000
+pair DivR SubI 20000000
+triple DivR SubI JneI 20000000
+pair AndI Int 1
+pair OrR SubI 1000000
+triple OrR SubI JneI 1000000
+pair XorR AddR 1001
+triple XorR AddR Load64R 1000
+triple XorR AddR Store64R 1
+pair XorR AddI 2
+triple XorR AddI AddR 1
+triple XorR AddI AddI 1
+pair XorR SubI 10000000
+triple XorR SubI JneI 10000000
+pair XorR XorR 1
+triple XorR XorR AddR 1
+pair Load64R AddR 4096000
+triple Load64R AddR AddI 4096000
+pair Store64R AddI 4096
+triple Store64R AddI AddI 4096
+pair JneI AddI 1001001
+triple JneI AddI DivR 1000000
+triple JneI AddI XorR 1
+triple JneI AddI JeI 1000
+pair JneI SubI 1000000
+triple JneI SubI OrR 1000000
+pair JneI AndI 1
+triple JneI AndI Int 1
+pair JneI Int 2
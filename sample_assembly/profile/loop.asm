@@ -0,0 +1,13 @@
+#bounded loop: runs its body ten million times, mixing the counter into r1, and exits with the low byte of the mix
+start:
+add r4, r0, 10000000 #loop counter
+xor r1, r1, r1       #the mix
+add r2, r0, 1        #the step
+loop:
+add r1, r1, r2       #mix the step in
+add r2, r2, 3        #move the step on
+xor r1, r1, r2       #and mix it in again
+sub r4, r4, 1        #count down
+jmp loop if r4 != r0 #loop while r4 != 0
+and r1, r1, 255      #keep the exit code to a byte
+int 0xFF             #exit with it
@@ -0,0 +1,28 @@
+#fills an array with 0 to 4095 and adds it up a thousand times; exits with how many of the sums came out wrong
+start:
+add r6, r0, 0x100000 #the array
+add r8, r6, 32768    #and its end, 4096 numbers of 8 bytes on
+xor r3, r3, r3       #the number to store
+add r2, r0, r6       #where to store it
+fill:
+store 64 r3 in r2    #store it
+add r3, r3, 1        #next number
+add r2, r2, 8        #next slot
+jmp fill if r2 != r8 #until the end of the array
+add r7, r0, 1000     #passes left
+xor r1, r1, r1       #sums that came out wrong
+pass:
+xor r5, r5, r5       #the sum
+add r2, r0, r6       #from the start of the array
+sum:
+load 64 r2 to r3     #load a number
+add r5, r5, r3       #add it up
+add r2, r2, 8        #next slot
+jmp sum if r2 != r8  #until the end of the array
+add r3, r0, 8386560  #4095 * 4096 / 2
+jmp right if r5 == r3
+add r1, r1, 1        #count the wrong sum
+right:
+sub r7, r7, 1        #count the pass
+jmp pass if r7 != r0 #loop while there are passes left
+int 0xFF             #exit with the count of wrong sums
@@ -0,0 +1,146 @@
+/*
+ * Parallel assembly: a source long enough to be split into several chunks has to assemble to the same image on many
+ * threads as on one, byte for byte, with the same tags, lines and sections. The program jumps back and forth across
+ * chunk boundaries, far enough for some jumps to widen, loads from tags in other chunks, mixes code and data sections,
+ * and starts a segment of its own halfway through with .addr.
+ */
+#include "Assembler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace nvm;
+
+//blocks of the generated program, each some 130 bytes of source
+static constexpr u64 block_count = 12000;
+static constexpr u32 threads = 4;
+
+static bool write_source(FILE* file)
+{
+    fprintf(file, "start:\nxor r1, r1, r1\n");
+    for (u64 i = 0; i < block_count; i++)
+    {
+        if (i == block_count / 2)
+            fprintf(file, ".addr 0x%lx\n", 1ul << 24);
+        if (i % 64 == 0)
+            fprintf(file, ".text\n");
+        fprintf(file, "t%lu:\nadd r1, r1, %lu\n", i, i % 100);
+        //half the program away, which crosses chunks and is too far for a short jump; the neighbours are not
+        fprintf(file, "jmp t%lu if r1 == r0\n", (i + block_count / 2) % block_count);
+        fprintf(file, "jmp t%lu if r1 == r2\n", i + 1 < block_count ? i + 1 : 0);
+        fprintf(file, "load 64 d%lu to r2 #the data of the block %s\n", (i * 7) % block_count, i % 2 ? "after" : "before");
+        if (i % 64 == 63)
+            fprintf(file, ".data\n");
+        fprintf(file, "d%lu: .i64 %lu\n", i, i * 3);
+        if (i % 100 == 0)
+            fprintf(file, "s%lu: .string \"block %lu # not a comment: t%lu\"\n", i, i, i);
+    }
+    fprintf(file, ".text\nint 0xFF\n");
+    return fclose(file) == 0;
+}
+
+static bool same_tags(const Vector<ResolvedTag>& a, const Vector<ResolvedTag>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (u64 i = 0; i < a.size(); i++)
+    {
+        if (a[i].address != b[i].address)
+            return false;
+    }
+    return true;
+}
+
+static bool same_lines(const Vector<ResolvedLine>& a, const Vector<ResolvedLine>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (u64 i = 0; i < a.size(); i++)
+    {
+        if (a[i].address != b[i].address || a[i].size != b[i].size || a[i].position.line != b[i].position.line)
+            return false;
+    }
+    return true;
+}
+
+static bool same_sections(const Vector<ResolvedSection>& a, const Vector<ResolvedSection>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (u64 i = 0; i < a.size(); i++)
+    {
+        if (a[i].address != b[i].address || a[i].type != b[i].type)
+            return false;
+    }
+    return true;
+}
+
+int main()
+{
+    char path[] = "/tmp/nvm_parallel_XXXXXX";
+    int fd = mkstemp(path);
+    FILE* file = fd < 0 ? nullptr : fdopen(fd, "w");
+    if (file == nullptr || !write_source(file))
+    {
+        fprintf(stderr, "couldn't write the source\n");
+        return 1;
+    }
+    auto serial_assembler = Assembler::create_from_file(StringView(path, __builtin_strlen(path)));
+    auto parallel_assembler = Assembler::create_from_file(StringView(path, __builtin_strlen(path)));
+    unlink(path);
+    if (!serial_assembler.has_value() || !parallel_assembler.has_value())
+    {
+        fprintf(stderr, "couldn't read the source\n");
+        return 1;
+    }
+    auto& serial = serial_assembler.value();
+    auto& parallel = parallel_assembler.value();
+
+    auto serial_or_error = serial.assemble(1);
+    auto parallel_or_error = parallel.assemble(threads);
+    if (serial_or_error.has_error() || parallel_or_error.has_error())
+    {
+        const auto& errors = serial_or_error.has_error() ? serial_or_error.error() : parallel_or_error.error();
+        fprintf(stderr, "%s assembly failed at line %zu: %s\n", serial_or_error.has_error() ? "serial" : "parallel",
+                errors[0].where.line, errors[0].what.null_terminated_characters());
+        return 1;
+    }
+
+    const auto& serial_image = *serial_or_error.result();
+    const auto& parallel_image = *parallel_or_error.result();
+    bool ok = true;
+    if (serial_image.size() != parallel_image.size())
+    {
+        fprintf(stderr, "the parallel image is %lu bytes, the serial one %lu\n", parallel_image.size(),
+                serial_image.size());
+        ok = false;
+    }
+    else
+    {
+        for (u64 i = 0; i < serial_image.size(); i++)
+        {
+            if (serial_image[i] != parallel_image[i])
+            {
+                fprintf(stderr, "the images differ first at byte %lu\n", i);
+                ok = false;
+                break;
+            }
+        }
+    }
+    if (!same_tags(serial.tags(), parallel.tags()))
+    {
+        fprintf(stderr, "the tags differ\n");
+        ok = false;
+    }
+    if (!same_lines(serial.lines(), parallel.lines()))
+    {
+        fprintf(stderr, "the lines differ\n");
+        ok = false;
+    }
+    if (!same_sections(serial.sections(), parallel.sections()))
+    {
+        fprintf(stderr, "the sections differ\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
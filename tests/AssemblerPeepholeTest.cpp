@@ -0,0 +1,233 @@
+/*
+ * The peephole optimizer, one rule at a time: every program is written so that a single rule applies, and its optimized
+ * bytecode has to be exactly that of the program written the way the rule leaves it, with the rule counted as often as
+ * it applied. Both versions are run, and have to exit the same way.
+ * Programs that load or store at a fixed address inside themselves have to be left alone, since what they read would
+ * move, while fixed addresses outside of the program are no reason to.
+ */
+#include "Assembler.h"
+#include "NVMBinaryFormat.h"
+#include "NVMVirtualMachine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace nvm;
+
+struct Case
+{
+    const char* name;
+    const char* source;
+    //the source the way the rule rewrites it
+    const char* optimized;
+    PeepholeStatistics expected;
+};
+
+static const Case cases[] {
+    { "value numbering",
+      "start:\n"
+      "add r2, r0, 6\n"
+      "mul r1, r2, 7\n"
+      "mul r1, r1, 1\n"
+      "store 64 r2 in slot\n"
+      "int 0xFF\n"
+      "slot: .i64 0\n",
+      "start:\n"
+      "add r2, r0, 6\n"
+      "add r1, r0, 42\n"
+      "store 64 r2 in slot\n"
+      "int 0xFF\n"
+      "slot: .i64 0\n",
+      { 1, 1, 0, 0, 0, false } },
+    //r3 is written again on both paths before anything reads it
+    { "dead writes",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "load 64 slot to r3\n"
+      "jmp other if r2 == r0\n"
+      "load 64 slot to r3\n"
+      "jmp done if r0 == r0\n"
+      "other:\n"
+      "load 64 slot to r3\n"
+      "done:\n"
+      "add r1, r3, r2\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "jmp other if r2 == r0\n"
+      "load 64 slot to r3\n"
+      "jmp done if r0 == r0\n"
+      "other:\n"
+      "load 64 slot to r3\n"
+      "done:\n"
+      "add r1, r3, r2\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n",
+      { 0, 0, 1, 0, 0, false } },
+    { "redundant moves",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "add r2, r2, 0\n"
+      "add r3, r2, 0\n"
+      "or r3, r2, r0\n"
+      "add r1, r3, r3\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "add r3, r2, 0\n"
+      "add r1, r3, r3\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n",
+      { 0, 0, 0, 2, 0, false } },
+    { "compare and jump fusion",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "load 64 other to r3\n"
+      "sub r4, r2, r3\n"
+      "jmp equal if r4 == r0\n"
+      "add r1, r0, 1\n"
+      "int 0xFF\n"
+      "equal:\n"
+      "add r1, r0, 2\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n"
+      "other: .i64 7\n",
+      "start:\n"
+      "load 64 slot to r2\n"
+      "load 64 other to r3\n"
+      "jmp equal if r2 == r3\n"
+      "add r1, r0, 1\n"
+      "int 0xFF\n"
+      "equal:\n"
+      "add r1, r0, 2\n"
+      "int 0xFF\n"
+      "slot: .i64 7\n"
+      "other: .i64 7\n",
+      { 0, 0, 0, 0, 1, false } },
+    //the load reads the int, which removing the dead add would move from under it
+    { "fixed address inside the program",
+      "start:\n"
+      "load 64 8 to r1\n"
+      "add r2, r0, 1\n"
+      "int 0xFF\n",
+      "start:\n"
+      "load 64 8 to r1\n"
+      "add r2, r0, 1\n"
+      "int 0xFF\n",
+      { 0, 0, 0, 0, 0, true } },
+    { "fixed address outside the program",
+      "start:\n"
+      "load 64 0x10000 to r1\n"
+      "add r2, r0, 1\n"
+      "int 0xFF\n",
+      "start:\n"
+      "load 64 0x10000 to r1\n"
+      "int 0xFF\n",
+      { 0, 0, 1, 0, 0, false } },
+};
+
+//assembles source the way main does with --optimize, or without the optimizer
+static RefPtr<Vector<u8>> assemble(const char* source, bool optimize, PeepholeStatistics& statistics)
+{
+    char path[] = "/tmp/nvm_peephole_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return {};
+    u64 size = __builtin_strlen(source);
+    bool written = write(fd, source, size) == (ssize_t)size;
+    close(fd);
+    auto assembler = written ? Assembler::create_from_file(StringView(path, __builtin_strlen(path))) : Optional<Assembler>();
+    unlink(path);
+    if (!assembler.has_value())
+        return {};
+    auto tokens_or_errors = assembler.value().tokenize();
+    if (tokens_or_errors.has_error())
+        return {};
+    auto objects_or_errors = assembler.value().parse(tokens_or_errors.result());
+    if (objects_or_errors.has_error())
+        return {};
+    statistics = {};
+    if (optimize)
+        statistics = assembler.value().optimize(objects_or_errors.result());
+    auto image_or_error = assembler.value().generate_bytecode(objects_or_errors.result());
+    if (image_or_error.has_error())
+        return {};
+    return image_or_error.result();
+}
+
+//what the program exits with, and how
+static bool run(const Vector<u8>& image, ExitCode& exit_code, Trap& trap)
+{
+    auto image_or_error = try_read(image.span());
+    if (image_or_error.has_error())
+        return false;
+    NVMVirtualMachine vm(image_or_error.result().entry_point);
+    if (!load_sections(vm.memory(), image_or_error.result()))
+        return false;
+    exit_code = vm.run();
+    trap = vm.trap();
+    return true;
+}
+
+static bool same_statistics(const PeepholeStatistics& a, const PeepholeStatistics& b)
+{
+    return a.folded_constants == b.folded_constants && a.rewritten_constants == b.rewritten_constants &&
+           a.dead_writes == b.dead_writes && a.redundant_moves == b.redundant_moves && a.fused_jumps == b.fused_jumps &&
+           a.skipped == b.skipped;
+}
+
+static bool check(const Case& test)
+{
+    PeepholeStatistics statistics;
+    PeepholeStatistics unused;
+    auto original = assemble(test.source, false, unused);
+    auto optimized = assemble(test.source, true, statistics);
+    auto expected = assemble(test.optimized, false, unused);
+    if (!original || !optimized || !expected)
+    {
+        fprintf(stderr, "%s: didn't assemble\n", test.name);
+        return false;
+    }
+
+    bool ok = true;
+    if (!same_statistics(statistics, test.expected))
+    {
+        fprintf(stderr, "%s: counted %lu folded, %lu rewritten, %lu dead writes, %lu moves, %lu fused%s\n", test.name,
+                statistics.folded_constants, statistics.rewritten_constants, statistics.dead_writes,
+                statistics.redundant_moves, statistics.fused_jumps, statistics.skipped ? ", and skipped" : "");
+        ok = false;
+    }
+    if (optimized->size() != expected->size() ||
+        __builtin_memcmp(optimized->data(), expected->data(), optimized->size()) != 0)
+    {
+        fprintf(stderr, "%s: the optimized bytecode isn't the one expected\n", test.name);
+        ok = false;
+    }
+
+    ExitCode original_exit;
+    ExitCode optimized_exit;
+    Trap original_trap;
+    Trap optimized_trap;
+    if (!run(*original, original_exit, original_trap) || !run(*optimized, optimized_exit, optimized_trap))
+    {
+        fprintf(stderr, "%s: didn't load\n", test.name);
+        return false;
+    }
+    if (original_exit != optimized_exit || original_trap != optimized_trap)
+    {
+        fprintf(stderr, "%s: exited with %lu (trap %u) optimized, %lu (trap %u) as written\n", test.name, optimized_exit,
+                (u32)optimized_trap, original_exit, (u32)original_trap);
+        ok = false;
+    }
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    for (const auto& test : cases)
+        ok = check(test) && ok;
+    return ok ? 0 : 1;
+}
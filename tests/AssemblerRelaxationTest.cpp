@@ -0,0 +1,243 @@
+/*
+ * Jump relaxation in the assembler's linker: jumps to tags are emitted short, and only widened when their tag is too far
+ * away for 12 bits of words. A jump right at the limit in either direction has to stay short and one a word past it has
+ * to widen, and a widened jump that pushes others out of range has to widen them too, however long the chain. Every
+ * jump has to land on its tag, and the streaming assemble() has to link the same image as generate_bytecode().
+ */
+#include "Assembler.h"
+#include "NVMBinaryFormat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace nvm;
+
+//words a short jump reaches forward; it reaches one more backward
+static constexpr u64 short_reach = 2047;
+
+//what a jump has to turn into: the instruction it is, the one its tag is at, and whether it needs the wide form
+struct ExpectedJump
+{
+    u64 line;
+    u64 target_line;
+    bool wide;
+};
+
+//writes the source of a test program and counts its instructions along the way
+class Source
+{
+public:
+    Source()
+    {
+        __builtin_memcpy(m_path, "/tmp/nvm_relaxation_XXXXXX", sizeof("/tmp/nvm_relaxation_XXXXXX"));
+        int fd = mkstemp(m_path);
+        m_file = fd < 0 ? nullptr : fdopen(fd, "w");
+        if (m_file != nullptr)
+            fprintf(m_file, "start:\n");
+    }
+
+    ~Source()
+    {
+        if (m_file != nullptr)
+            fclose(m_file);
+        unlink(m_path);
+    }
+
+    bool opened() const
+    {
+        return m_file != nullptr;
+    }
+
+    //the instruction the next tag names
+    u64 tag(const char* name)
+    {
+        fprintf(m_file, "%s:\n", name);
+        return m_lines;
+    }
+
+    u64 jump(const char* tag)
+    {
+        fprintf(m_file, "jmp %s if r1 != r0\n", tag);
+        return m_lines++;
+    }
+
+    void pad(u64 count)
+    {
+        for (u64 i = 0; i < count; i++)
+            fprintf(m_file, "add r1, r1, 1\n");
+        m_lines += count;
+    }
+
+    const char* finish()
+    {
+        fprintf(m_file, "int 0xFF\n");
+        fclose(m_file);
+        m_file = nullptr;
+        return m_path;
+    }
+
+private:
+    char m_path[sizeof("/tmp/nvm_relaxation_XXXXXX")];
+    FILE* m_file;
+    u64 m_lines { 0 };
+};
+
+static i64 sign_extend(u64 value, u32 bits)
+{
+    return (i64)(value << (64 - bits)) >> (64 - bits);
+}
+
+static bool check(const char* name, const char* path, const ExpectedJump* jumps, u64 jump_count)
+{
+    auto streaming = Assembler::create_from_file(StringView(path, __builtin_strlen(path)));
+    auto staged = Assembler::create_from_file(StringView(path, __builtin_strlen(path)));
+    if (!streaming.has_value() || !staged.has_value())
+    {
+        fprintf(stderr, "%s: couldn't read the source\n", name);
+        return false;
+    }
+    auto image_or_error = streaming.value().assemble(1);
+    auto tokens_or_errors = staged.value().tokenize();
+    if (image_or_error.has_error() || tokens_or_errors.has_error())
+    {
+        fprintf(stderr, "%s: didn't assemble\n", name);
+        return false;
+    }
+    auto objects_or_errors = staged.value().parse(tokens_or_errors.result());
+    if (objects_or_errors.has_error())
+    {
+        fprintf(stderr, "%s: didn't parse\n", name);
+        return false;
+    }
+    auto staged_image_or_error = staged.value().generate_bytecode(objects_or_errors.result());
+    if (staged_image_or_error.has_error())
+    {
+        fprintf(stderr, "%s: didn't generate bytecode\n", name);
+        return false;
+    }
+
+    const auto& image = *image_or_error.result();
+    const auto& staged_image = *staged_image_or_error.result();
+    bool ok = true;
+    if (image.size() != staged_image.size() || __builtin_memcmp(image.data(), staged_image.data(), image.size()) != 0)
+    {
+        fprintf(stderr, "%s: assemble() and generate_bytecode() linked different images\n", name);
+        ok = false;
+    }
+
+    NVMBinaryHeader header;
+    __builtin_memcpy(&header, image.data(), sizeof(NVMBinaryHeader));
+    const auto& lines = streaming.value().lines();
+    auto word_at = [&](u64 address) -> u32
+    {
+        u32 word;
+        __builtin_memcpy(&word, image.data() + sizeof(NVMBinaryHeader) + address - header.load_offset, sizeof(u32));
+        return word;
+    };
+    u64 wide_jumps = 0;
+    for (u64 i = 0; i < jump_count; i++)
+    {
+        const auto& jump = jumps[i];
+        const auto& line = lines[jump.line];
+        u64 target = lines[jump.target_line].address;
+        u32 first = word_at(line.address);
+        bool wide = first & (1u << 31);
+        i64 words = wide ? sign_extend(((u64)first << 32 | word_at(line.address + 4)) & 0xFFFFFFFFFFF, 44)
+                         : sign_extend(first & 0xFFF, 12);
+        if (wide != jump.wide || line.size != (jump.wide ? 8u : 4u))
+        {
+            fprintf(stderr, "%s: jump %lu is %s, expected %s\n", name, i, wide ? "wide" : "short",
+                    jump.wide ? "wide" : "short");
+            ok = false;
+        }
+        if ((i64)line.address + words * 4 != (i64)target)
+        {
+            fprintf(stderr, "%s: jump %lu lands on 0x%lx, its tag is at 0x%lx\n", name, i, line.address + words * 4,
+                    target);
+            ok = false;
+        }
+        wide_jumps += jump.wide;
+    }
+    //the padding around the jumps is copied as it was, which is the same word every time; the last line is the int
+    u64 padding = 0;
+    for (u64 i = 0, next_jump = 0; i + 1 < lines.size(); i++)
+    {
+        if (next_jump < jump_count && jumps[next_jump].line == i)
+        {
+            next_jump++;
+            continue;
+        }
+        u32 word = word_at(lines[i].address);
+        if (padding == 0)
+            padding = word;
+        if (word != padding || lines[i].size != 4)
+        {
+            fprintf(stderr, "%s: the padding at 0x%lx reads 0x%x, expected 0x%lx\n", name, lines[i].address, word, padding);
+            ok = false;
+        }
+    }
+    if (image.size() != sizeof(NVMBinaryHeader) + 4 * lines.size() + 4 * wide_jumps)
+    {
+        fprintf(stderr, "%s: the image is %lu bytes, expected %lu\n", name, image.size(),
+                sizeof(NVMBinaryHeader) + 4 * lines.size() + 4 * wide_jumps);
+        ok = false;
+    }
+    return ok;
+}
+
+//a jump whose tag is padding words past it, forward
+static bool forward(const char* name, u64 padding, bool wide)
+{
+    Source source;
+    if (!source.opened())
+        return false;
+    ExpectedJump jump { source.jump("far"), 0, wide };
+    source.pad(padding - 1);
+    jump.target_line = source.tag("far");
+    return check(name, source.finish(), &jump, 1);
+}
+
+//a jump whose tag is padding words behind it
+static bool backward(const char* name, u64 padding, bool wide)
+{
+    Source source;
+    if (!source.opened())
+        return false;
+    u64 target = source.tag("back");
+    source.pad(padding);
+    ExpectedJump jump { source.jump("back"), target, wide };
+    return check(name, source.finish(), &jump, 1);
+}
+
+/*
+ * Three jumps in a row. The last one goes far back and has to widen, and the other two start out in range: the middle
+ * one is right at the limit until the last one widens, and the first one a word short of it until both others do. So
+ * relaxation only gets to the first one after widening the other two, one pass each.
+ */
+static bool chain()
+{
+    Source source;
+    if (!source.opened())
+        return false;
+    u64 back = source.tag("back");
+    source.pad(short_reach + 53);
+    ExpectedJump jumps[3];
+    jumps[0] = { source.jump("first"), 0, true };
+    jumps[1] = { source.jump("second"), 0, true };
+    jumps[2] = { source.jump("back"), back, true };
+    source.pad(short_reach - 4);
+    jumps[0].target_line = source.tag("first");
+    source.pad(2);
+    jumps[1].target_line = source.tag("second");
+    return check("chain", source.finish(), jumps, 3);
+}
+
+int main()
+{
+    bool ok = forward("forward at the limit", short_reach, false);
+    ok = forward("forward past the limit", short_reach + 1, true) && ok;
+    ok = backward("backward at the limit", short_reach + 1, false) && ok;
+    ok = backward("backward past the limit", short_reach + 2, true) && ok;
+    ok = chain() && ok;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copy-on-write isolation of forked guests: a parent and the child forked from it each write the same pages, in the
+ * flat region and in the page table, and each has to go on reading its own writes while pages neither wrote still
+ * read the same in both. The child also has to outlive its parent.
+ */
+#include "NVMVirtualMachine.h"
+#include <stdio.h>
+
+using namespace nvm;
+
+static constexpr u64 flat_size = 64 * NVMMemory::page_size;
+static constexpr u64 flat_page = 5 * NVMMemory::page_size;
+static constexpr u64 untouched_page = 9 * NVMMemory::page_size;
+static constexpr u64 table_page = 1ul << 36;
+static constexpr u64 untouched_table_page = table_page + NVMMemory::page_size;
+static constexpr u64 written_pages[] { flat_page, table_page };
+static constexpr u64 untouched_pages[] { untouched_page, untouched_table_page };
+
+static bool expect(const char* what, u64 got, u64 expected)
+{
+    if (got == expected)
+        return true;
+    fprintf(stderr, "%s read 0x%lx, expected 0x%lx\n", what, got, expected);
+    return false;
+}
+
+int main()
+{
+    auto parent = new NVMVirtualMachine(0, flat_size);
+    auto& memory = parent->memory();
+    for (u64 address : written_pages)
+        memory.write_64(address + 8, address ^ 0x6302);
+    for (u64 address : untouched_pages)
+        memory.write_64(address + 8, address ^ 0x6302);
+    parent->set_register_value(3, 0x1234);
+
+    auto child = parent->fork();
+    if (child == nullptr)
+    {
+        fprintf(stderr, "fork failed\n");
+        return 1;
+    }
+    bool ok = expect("child register", child->register_value(3), 0x1234);
+
+    for (u64 address : written_pages)
+    {
+        memory.write_64(address + 8, 0xAAAA);
+        child->memory().write_64(address + 8, 0xBBBB);
+        ok = expect("parent write", memory.read_64(address + 8), 0xAAAA) && ok;
+        ok = expect("child write", child->memory().read_64(address + 8), 0xBBBB) && ok;
+    }
+    for (u64 address : untouched_pages)
+    {
+        ok = expect("parent untouched page", memory.read_64(address + 8), address ^ 0x6302) && ok;
+        ok = expect("child untouched page", child->memory().read_64(address + 8), address ^ 0x6302) && ok;
+    }
+
+    //the child keeps the image and the shared table pages alive on its own
+    delete parent;
+    ok = expect("orphaned child write", child->memory().read_64(flat_page + 8), 0xBBBB) && ok;
+    ok = expect("orphaned child untouched page", child->memory().read_64(untouched_table_page + 8), untouched_table_page ^ 0x6302) && ok;
+    delete child;
+    return ok ? 0 : 1;
+}
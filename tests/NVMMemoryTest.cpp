@@ -0,0 +1,230 @@
+/*
+ * Differential test of the NVMMemory read/write layer: random reads and writes of every width, bulk copies and unmaps
+ * are replayed against a plain byte array, and every read has to agree with it. Accesses are drawn near page
+ * boundaries and near the end of the flat region more often than anywhere else, since that is where the fast paths
+ * hand over to the byte-wise path and the flat region to the page table. Pages of the flat region are made read only
+ * and writable again along the way; writes to read only ones have to fault and leave them as they were.
+ * Takes an optional seed and iteration count; exits non-zero on the first mismatch.
+ */
+#include "NVMMemory.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace nvm;
+
+static constexpr u64 flat_size = 16 * NVMMemory::page_size;
+//the reference covers the whole flat region and as much of the page table behind it
+static constexpr u64 window = 2 * flat_size;
+//a second window far away, which lands in a different table of the directory
+static constexpr u64 far_base = 1ul << 40;
+
+static u64 state;
+
+static u64 next_random()
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static u64 random_below(u64 bound)
+{
+    return next_random() % bound;
+}
+
+//an offset into a window, close to a page boundary or the flat boundary half the time
+static u64 random_offset(u64 size)
+{
+    switch (random_below(4))
+    {
+        case 0:
+            return (flat_size - 8 + random_below(16)) % window;
+        case 1:
+            return ((random_below(window >> NVMMemory::page_bits) << NVMMemory::page_bits) - 8 + random_below(16)) % window;
+        default:
+            return random_below(window - size + 1);
+    }
+}
+
+struct Reference
+{
+    u64 base;
+    u8* bytes;
+};
+
+static bool failed(const char* what, u64 address, u64 expected, u64 got, u64 iteration)
+{
+    fprintf(stderr, "iteration %lu: %s at 0x%lx read 0x%lx, expected 0x%lx\n", iteration, what, address, got, expected);
+    return false;
+}
+
+//applies a write to the reference, but for the bytes on read only pages of the flat region, and tells if there were any
+static bool reference_write(const Reference& reference, const bool* read_only, u64 offset, const u8* bytes, u64 size)
+{
+    bool faulted = false;
+    for (u64 i = 0; i < size; i++)
+    {
+        u64 page = (offset + i) >> NVMMemory::page_bits;
+        if (reference.base == 0 && offset + i < flat_size && read_only[page])
+            faulted = true;
+        else
+            reference.bytes[offset + i] = bytes[i];
+    }
+    return faulted;
+}
+
+static u64 reference_value(const u8* bytes, u64 size)
+{
+    u64 value = 0;
+    __builtin_memcpy(&value, bytes, size);
+    return value;
+}
+
+static bool run(u64 iterations)
+{
+    NVMMemory memory(flat_size);
+    Reference references[2] {
+        { 0, (u8*) calloc(window, 1) },
+        { far_base, (u8*) calloc(window, 1) }
+    };
+    u8 buffer[3 * NVMMemory::page_size];
+    bool read_only[flat_size / NVMMemory::page_size] {};
+    bool ok = true;
+
+    for (u64 iteration = 0; iteration < iterations && ok; iteration++)
+    {
+        auto& reference = references[random_below(2)];
+        u64 width = 1ul << random_below(4);
+        u64 size = 1 + random_below(sizeof(buffer));
+        switch (random_below(9))
+        {
+            case 0:
+            case 1:
+            {
+                u64 offset = random_offset(width);
+                if (offset + width > window)
+                    offset = window - width;
+                u64 value = next_random();
+                switch (width)
+                {
+                    case 1: memory.write_8(reference.base + offset, value); break;
+                    case 2: memory.write_16(reference.base + offset, value); break;
+                    case 4: memory.write_32(reference.base + offset, value); break;
+                    default: memory.write_64(reference.base + offset, value); break;
+                }
+                if (reference_write(reference, read_only, offset, (const u8*) &value, width) != memory.has_fault())
+                    ok = failed("write fault", reference.base + offset, !memory.has_fault(), memory.has_fault(), iteration);
+                memory.clear_fault();
+                break;
+            }
+            case 2:
+            case 3:
+            {
+                u64 offset = random_offset(width);
+                if (offset + width > window)
+                    offset = window - width;
+                u64 got = 0;
+                switch (width)
+                {
+                    case 1: got = memory.read_8(reference.base + offset); break;
+                    case 2: got = memory.read_16(reference.base + offset); break;
+                    case 4: got = memory.read_32(reference.base + offset); break;
+                    default: got = memory.read_64(reference.base + offset); break;
+                }
+                u64 expected = reference_value(reference.bytes + offset, width);
+                if (got != expected)
+                    ok = failed("read", reference.base + offset, expected, got, iteration);
+                break;
+            }
+            case 4:
+            {
+                u64 offset = random_offset(size);
+                if (offset + size > window)
+                    offset = window - size;
+                for (u64 i = 0; i < size; i++)
+                    buffer[i] = (u8) next_random();
+                memory.write_bytes(reference.base + offset, buffer, size);
+                if (reference_write(reference, read_only, offset, buffer, size) != memory.has_fault())
+                    ok = failed("write_bytes fault", reference.base + offset, !memory.has_fault(), memory.has_fault(), iteration);
+                memory.clear_fault();
+                break;
+            }
+            case 5:
+            case 6:
+            {
+                u64 offset = random_offset(size);
+                if (offset + size > window)
+                    offset = window - size;
+                memory.read_bytes(reference.base + offset, buffer, size);
+                for (u64 i = 0; i < size && ok; i++)
+                {
+                    if (buffer[i] != reference.bytes[offset + i])
+                        ok = failed("read_bytes", reference.base + offset + i, reference.bytes[offset + i], buffer[i], iteration);
+                }
+                break;
+            }
+            case 7:
+            {
+                //a few pages of the flat region at a time, so most of it stays writable
+                if (random_below(4) != 0)
+                    break;
+                u64 first = random_below(flat_size / NVMMemory::page_size);
+                u64 count = 1 + random_below(3);
+                if (first + count > flat_size / NVMMemory::page_size)
+                    count = flat_size / NVMMemory::page_size - first;
+                bool writable = random_below(2) == 0;
+                memory.protect(first << NVMMemory::page_bits, count << NVMMemory::page_bits, writable);
+                for (u64 page = first; page < first + count; page++)
+                    read_only[page] = !writable;
+                break;
+            }
+            default:
+            {
+                //unmap drops whole pages, so the reference clears every page the range touches
+                if (random_below(8) != 0)
+                    break;
+                u64 offset = random_offset(size);
+                if (offset + size > window)
+                    offset = window - size;
+                memory.unmap(reference.base + offset, size);
+                u64 first = offset & ~NVMMemory::page_mask;
+                u64 end = (offset + size + NVMMemory::page_mask) & ~NVMMemory::page_mask;
+                __builtin_memset(reference.bytes + first, 0, (end < window ? end : window) - first);
+                break;
+            }
+        }
+    }
+
+    //a last full comparison catches writes that landed somewhere no read happened to look
+    for (auto& reference : references)
+    {
+        for (u64 offset = 0; offset < window && ok; offset += sizeof(u64))
+        {
+            u64 got = memory.read_64(reference.base + offset);
+            u64 expected = reference_value(reference.bytes + offset, sizeof(u64));
+            if (got != expected)
+                ok = failed("final read", reference.base + offset, expected, got, iterations);
+            //the bits above the address width are ignored, in the flat region as much as in the table
+            u64 alias = reference.base + offset + (1ul << NVMMemory::address_bits);
+            got = memory.read_64(alias);
+            if (got != expected)
+                ok = failed("aliased read", alias, expected, got, iterations);
+        }
+        free(reference.bytes);
+    }
+    return ok;
+}
+
+int main(int argc, char** argv)
+{
+    u64 seed = argc > 1 ? strtoul(argv[1], nullptr, 0) : 0x6302;
+    u64 iterations = argc > 2 ? strtoul(argv[2], nullptr, 0) : 1000000;
+    state = seed != 0 ? seed : 1;
+    if (!run(iterations))
+    {
+        fprintf(stderr, "seed 0x%lx\n", seed);
+        return 1;
+    }
+    return 0;
+}